@@ -0,0 +1,29 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+// Summary statistics shared by the benchmarks, which report medians rather than means so that the odd slow repetition
+// (a page fault, another process) doesn't skew the headline number.
+
+#ifndef BENCH_STATS_H
+#define BENCH_STATS_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+inline double Median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  size_t n = values.size();
+  return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/** Median absolute deviation, as a fraction of the median. */
+inline double RelativeMad(const std::vector<double>& values) {
+  double median = Median(values);
+  std::vector<double> deviations;
+  for (double value : values)
+    deviations.push_back(std::abs(value - median));
+  return median > 0 ? Median(deviations) / median : 0;
+}
+
+#endif //BENCH_STATS_H
@@ -0,0 +1,320 @@
+//
+// Created by Cowpox on 8/16/24.
+//
+// Classfile parsing benchmark. Usage:
+//
+//   classfile_bench [--warmup N] [--repetitions N] [--decode] [--archive] [--sequences] <.class, .jar or directory>...
+//
+// Every classfile in the corpus is read into memory up front, so only parsing is timed. The corpus is parsed
+// --warmup times untimed, then --repetitions times timed; the median repetition is reported, along with the spread
+// across repetitions so that regressions can be told apart from noise.
+//
+// Method code is normally decoded lazily, on first invocation, so parsing alone doesn't decode it. --decode also
+// decodes every method after parsing, as if all of them were run, and reports that as a separate phase.
+//
+// --archive instead compares parsing and decoding the corpus with loading it from a class archive (see
+// class_archive.h), which is what an archive saves at startup. Loading includes computing each classfile's CRC-32, as
+// for a loose .class file; classes in a JAR take theirs from the central directory.
+//
+// --sequences times nothing, and instead counts the most frequent sequences of 2 to 4 decoded instructions in the
+// corpus, for choosing superinstructions (see superinstructions.cc).
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../src/class_archive.h"
+#include "../src/classfile.h"
+#include "../src/jar_file.h"
+#include "../src/utilities.h"
+#include "bench_stats.h"
+
+using namespace bjvm;
+
+struct CorpusClass {
+  std::string m_name;
+  std::vector<uint8_t> m_bytes;
+};
+
+static void AddToCorpus(const std::string& path, std::vector<CorpusClass>& corpus) {
+  if (HasSuffix(path, ".class")) {
+    corpus.push_back({ path, ReadFile(path) });
+  } else if (HasSuffix(path, ".jar")) {
+    JarFile jar { path };
+    std::vector<uint8_t> buffer;
+    for (const auto& [name, entry] : jar.Entries()) {
+      if (HasSuffix(name, ".class")) {
+        ByteSpan bytes = jar.Read(entry, buffer);
+        corpus.push_back({ path + "!" + name, { bytes.begin(), bytes.end() } });
+      }
+    }
+  } else {
+    for (const auto& file : ListDirectory(path, true)) {
+      if (HasSuffix(file, ".class") || HasSuffix(file, ".jar"))
+        AddToCorpus(file, corpus);
+    }
+  }
+}
+
+static void PrintSequences(const std::vector<CorpusClass>& corpus) {
+  constexpr size_t MIN_LENGTH = 2, MAX_LENGTH = 4, TOP = 15;
+  std::map<std::vector<classfile::InsnCode>, uint64_t> counts[MAX_LENGTH + 1];
+
+  for (const auto& klass : corpus) {
+    Arena arena;
+    ByteReader reader { klass.m_bytes };
+    auto cf = classfile::Classfile::parse(&reader, &arena);
+    for (const auto& method : cf.m_methods) {
+      const auto* code = method.GetCode();
+      if (!code)
+        continue;
+
+      std::vector<classfile::InsnCode> codes;
+      for (const auto& insn : code->m_code)
+        codes.push_back(insn.GetCode());
+      for (size_t length = MIN_LENGTH; length <= MAX_LENGTH; ++length) {
+        for (size_t i = 0; i + length <= codes.size(); ++i)
+          counts[length][{ codes.begin() + i, codes.begin() + i + length }]++;
+      }
+    }
+  }
+
+  for (size_t length = MIN_LENGTH; length <= MAX_LENGTH; ++length) {
+    std::vector<std::pair<uint64_t, std::vector<classfile::InsnCode>>> sorted;
+    for (const auto& [sequence, count] : counts[length])
+      sorted.emplace_back(count, sequence);
+    std::sort(sorted.begin(), sorted.end(), [] (const auto& a, const auto& b) { return a.first > b.first; });
+
+    std::printf("%s%zu instructions:\n", length == MIN_LENGTH ? "" : "\n", length);
+    for (size_t i = 0; i < std::min(sorted.size(), TOP); ++i) {
+      std::printf("%10llu ", static_cast<unsigned long long>(sorted[i].first));
+      for (auto insn_code : sorted[i].second)
+        std::printf(" %s", classfile::CodeName(insn_code));
+      std::printf("\n");
+    }
+  }
+}
+
+static void CompareWithArchive(const std::vector<CorpusClass>& corpus, int warmup, int repetitions) {
+  const std::string path = (std::filesystem::temp_directory_path() / "classfile_bench.archive").string();
+
+  {
+    Arena arena;
+    std::vector<classfile::Classfile> classes;
+    classes.reserve(corpus.size());
+    std::vector<ClassArchive::Entry> entries;
+    for (const auto& klass : corpus) {
+      ByteSpan bytes { klass.m_bytes.data(), klass.m_bytes.size() };
+      ByteReader reader { klass.m_bytes };
+      classes.push_back(classfile::Classfile::parse(&reader, &arena));
+      classes.back().m_digest = Sha256(bytes);
+      entries.push_back({ klass.m_name, &classes.back(), Crc32(bytes), static_cast<uint32_t>(bytes.size()) });
+    }
+    ClassArchive::Write(path, entries);
+  }
+
+  auto archive = ClassArchive::Open(path);
+  if (!archive) {
+    std::fprintf(stderr, "Could not open %s\n", path.c_str());
+    return;
+  }
+
+  // Both end with every method's code decoded, as the archive has it
+  const auto Parse = [&] {
+    Arena arena;
+    for (const auto& klass : corpus) {
+      ByteReader reader { klass.m_bytes };
+      auto cf = classfile::Classfile::parse(&reader, &arena);
+      for (const auto& method : cf.m_methods)
+        method.GetCode();
+    }
+  };
+  const auto Load = [&] {
+    Arena arena;
+    for (const auto& klass : corpus) {
+      ByteSpan bytes { klass.m_bytes.data(), klass.m_bytes.size() };
+      if (!archive->Load(klass.m_name, Crc32(bytes), static_cast<uint32_t>(bytes.size()), &arena))
+        throw std::runtime_error("Not in archive: " + klass.m_name);
+    }
+  };
+  const auto Time = [&] (const auto& pass) {
+    for (int i = 0; i < warmup; ++i)
+      pass();
+    std::vector<double> seconds;
+    for (int i = 0; i < repetitions; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      pass();
+      seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return seconds;
+  };
+
+  std::vector<double> parse_seconds = Time(Parse), load_seconds = Time(Load);
+  double parse_median = Median(parse_seconds), load_median = Median(load_seconds);
+  std::printf("Parse and decode: %.3f ms median, +/- %.1f%% (MAD)\n", parse_median * 1e3,
+              RelativeMad(parse_seconds) * 100);
+  std::printf("Load from archive: %.3f ms median, +/- %.1f%% (MAD), %.2f MB archive\n", load_median * 1e3,
+              RelativeMad(load_seconds) * 100, std::filesystem::file_size(path) / 1e6);
+  std::printf("Speedup: %.2fx over %d repetitions\n", parse_median / load_median, repetitions);
+
+  archive.reset();
+  std::filesystem::remove(path);
+}
+
+int main(int argc, char** argv) {
+  int warmup = 3, repetitions = 15;
+  bool decode = false, archive = false, sequences = false;
+  std::vector<std::string> paths;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--warmup") && i + 1 < argc) {
+      warmup = std::stoi(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--repetitions") && i + 1 < argc) {
+      repetitions = std::max(1, std::stoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--decode")) {
+      decode = true;
+    } else if (!std::strcmp(argv[i], "--archive")) {
+      archive = true;
+    } else if (!std::strcmp(argv[i], "--sequences")) {
+      sequences = true;
+    } else {
+      paths.emplace_back(argv[i]);
+    }
+  }
+
+  if (paths.empty()) {
+    std::fprintf(stderr, "Usage: %s [--warmup N] [--repetitions N] [--decode] [--archive] [--sequences] "
+                         "<.class, .jar or directory>...\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<CorpusClass> corpus;
+  for (const auto& path : paths)
+    AddToCorpus(path, corpus);
+
+  // Drop anything that doesn't parse, so that every repetition does the same work
+  size_t corpus_bytes = 0;
+  corpus.erase(std::remove_if(corpus.begin(), corpus.end(), [&] (const CorpusClass& klass) {
+    try {
+      Arena arena;
+      ByteReader reader { klass.m_bytes };
+      auto cf = classfile::Classfile::parse(&reader, &arena);
+      for (const auto& method : cf.m_methods)
+        method.GetCode();
+      corpus_bytes += klass.m_bytes.size();
+      return false;
+    } catch (std::exception& e) {
+      std::fprintf(stderr, "Skipping %s: %s\n", klass.m_name.c_str(), e.what());
+      return true;
+    }
+  }), corpus.end());
+
+  if (corpus.empty()) {
+    std::fprintf(stderr, "No parseable classfiles found\n");
+    return 1;
+  }
+
+  std::printf("Corpus: %zu classes, %.2f MB\n", corpus.size(), corpus_bytes / 1e6);
+
+  if (sequences) {
+    std::printf("\n");
+    PrintSequences(corpus);
+    return 0;
+  }
+
+  if (archive) {
+    std::printf("\n");
+    CompareWithArchive(corpus, warmup, repetitions);
+    return 0;
+  }
+
+  // Each pass parses into a fresh arena, as a class loader would, and releases it afterwards. Returns the number of
+  // bytes of metadata allocated, and adds the time spent decoding code (with --decode) to decode_seconds.
+  const auto ParseCorpus = [&] (classfile::ParseProfile* profile, double* decode_seconds = nullptr) {
+    Arena arena;
+    std::vector<classfile::Classfile> classes;
+    classes.reserve(corpus.size());
+    for (const auto& klass : corpus) {
+      ByteReader reader { klass.m_bytes };
+      classes.push_back(classfile::Classfile::parse(&reader, &arena, profile));
+    }
+
+    if (decode) {
+      auto start = std::chrono::steady_clock::now();
+      for (const auto& cf : classes) {
+        for (const auto& method : cf.m_methods)
+          method.GetCode();
+      }
+      if (decode_seconds)
+        *decode_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return arena.BytesAllocated();
+  };
+
+  for (int i = 0; i < warmup; ++i)
+    ParseCorpus(nullptr);
+
+  // Wall-clock seconds per repetition, unprofiled, so clock reads in the parser don't inflate the headline numbers
+  std::vector<double> seconds, decode_seconds;
+  size_t metadata_bytes = 0;
+  for (int i = 0; i < repetitions; ++i) {
+    double decode_time = 0;
+    auto start = std::chrono::steady_clock::now();
+    metadata_bytes = ParseCorpus(nullptr, &decode_time);
+    seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - decode_time);
+    decode_seconds.push_back(decode_time);
+  }
+
+  // Per-phase seconds, from separate profiled repetitions
+  struct Phase {
+    const char* m_name;
+    uint64_t classfile::ParseProfile::* m_counter;
+    std::vector<double> m_seconds {};
+  };
+
+  Phase phases[] = {
+    { "constant pool", &classfile::ParseProfile::m_constant_pool_ns },
+    { "fields", &classfile::ParseProfile::m_fields_ns },
+    { "methods", &classfile::ParseProfile::m_methods_ns },
+    { "code", &classfile::ParseProfile::m_code_ns },
+    { "attributes", &classfile::ParseProfile::m_attributes_ns },
+    { "total (profiled)", &classfile::ParseProfile::m_total_ns },
+  };
+
+  for (int i = 0; i < repetitions; ++i) {
+    classfile::ParseProfile profile;
+    ParseCorpus(&profile);
+    for (auto& phase : phases)
+      phase.m_seconds.push_back((profile.*phase.m_counter) / 1e9);
+  }
+
+  double median = Median(seconds);
+  std::printf("Parse: %.3f ms median, %.3f ms min, +/- %.1f%% (MAD) over %d repetitions\n", median * 1e3,
+              *std::min_element(seconds.begin(), seconds.end()) * 1e3, RelativeMad(seconds) * 100, repetitions);
+  std::printf("       %.1f MB/s, %.0f classes/s\n", corpus_bytes / 1e6 / median, corpus.size() / median);
+  std::printf("       %.2f MB of class metadata (excluding decoded code)\n", metadata_bytes / 1e6);
+  if (decode) {
+    double decode_median = Median(decode_seconds);
+    std::printf("Decode: %.3f ms median, +/- %.1f%% (MAD), %.1f MB/s\n", decode_median * 1e3,
+                RelativeMad(decode_seconds) * 100, corpus_bytes / 1e6 / decode_median);
+  }
+  std::printf("\n");
+
+  std::printf("%-18s %10s %8s %10s %8s\n", "phase", "ms", "share", "MB/s", "MAD");
+  double profiled_total = Median(phases[std::size(phases) - 1].m_seconds);
+  for (const auto& phase : phases) {
+    double phase_median = Median(phase.m_seconds);
+    std::printf("%-18s %10.3f %7.1f%% %10.1f %7.1f%%\n", phase.m_name, phase_median * 1e3,
+                profiled_total > 0 ? phase_median / profiled_total * 100 : 0,
+                phase_median > 0 ? corpus_bytes / 1e6 / phase_median : 0, RelativeMad(phase.m_seconds) * 100);
+  }
+
+  return 0;
+}
@@ -0,0 +1,448 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+// Interpreter dispatch benchmark. Usage:
+//
+//   interpreter_bench [--warmup N] [--repetitions N] [--iterations N] [--profile FILE] [kernel...]
+//
+// Each kernel is a static method looping --iterations times over a handful of instructions. They are assembled into a
+// classfile in memory, so no Java compiler or class library is needed, and run under every dispatch mode the build
+// supports, with and without top-of-stack caching. The median time per loop iteration is reported for each mode, along
+// with its speedup over the plain switch loop. Every run's result is checked against the same computation done in C++.
+//
+// The virtual call kernels call methods on receivers allocated here, which they read from static fields, and the
+// state of each of their call sites' inline caches is reported after the timings. --profile writes the interpreter's
+// profile of everything run (see WriteProfile) to a file as JSON.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../src/bytecode_interpreter.h"
+#include "../src/class_instance.h"
+#include "../src/classfile.h"
+#include "../src/heap_object.h"
+#include "../src/inline_cache.h"
+#include "../src/profile.h"
+#include "../test/class_builder.h"
+#include "bench_stats.h"
+
+using namespace bjvm;
+using namespace bjvm::test;
+
+namespace {
+
+constexpr char CLASS_NAME[] = "InterpreterBench";
+
+/** A static method taking the iteration count, and what it should return, as a Java int, for a given count. */
+struct Kernel {
+  const char* m_name;
+  const char* m_description;
+  std::function<void(ClassBuilder&, CodeBuilder&)> m_assemble;
+  std::function<int32_t(int32_t)> m_expected;
+};
+
+// Locals: 0 is the iteration count n, 1 the loop counter i, and the rest are the kernel's own. Every loop has the same
+// shape as javac's: a goto to the condition at the bottom.
+
+void Loop(CodeBuilder& code, const std::function<void(CodeBuilder&)>& body) {
+  code.Op(ICONST_0).Op(ISTORE, { 1 }).Branch(GOTO, "cond").Label("loop");
+  body(code);
+  code.Op(IINC, { 1, 1 }).Label("cond").Op(ILOAD, { 1 }).Op(ILOAD, { 0 }).Branch(IF_ICMPLT, "loop");
+}
+
+uint32_t Wrap(int64_t value) {
+  return static_cast<uint32_t>(value);
+}
+
+// The virtual call kernels' receivers: one instance each of Receiver0, which implements the interface Function, and
+// Receiver1 and on, which extend it. Receiver<k> is in the static field r<k>, and its apply(II)I returns (a ^ b) + k.
+constexpr int RECEIVERS = 5;
+
+std::string ReceiverClass(int k) {
+  return "Receiver" + std::to_string(k);
+}
+
+/**
+ * A kernel calling apply(s, i) on receivers[i % size] with invokevirtual (of Receiver0.apply), or invokeinterface (of
+ * Function.apply), so that its call site sees as many classes as there are receivers.
+ */
+Kernel VirtualKernel(const char* name, const char* description, std::vector<int> receivers, bool interface) {
+  auto assemble = [receivers, interface] (ClassBuilder& klass, CodeBuilder& code) {
+    uint16_t apply = interface ? klass.InterfaceMethodRef("Function", "apply", "(II)I")
+                               : klass.MethodRef(ReceiverClass(0), "apply", "(II)I");
+    auto get_receiver = [&] (CodeBuilder& body, int k) {
+      body.U16(GETSTATIC, klass.StaticField("r" + std::to_string(k), "LReceiver0;"));
+    };
+
+    code.Op(ICONST_0).Op(ISTORE, { 2 });
+    Loop(code, [&] (CodeBuilder& body) {
+      if (receivers.size() == 1) {
+        get_receiver(body, receivers[0]);
+      } else {
+        std::vector<std::string> labels;
+        for (size_t j = 0; j < receivers.size(); ++j)
+          labels.push_back("receiver" + std::to_string(j));
+        body.Op(ILOAD, { 1 }).Op(BIPUSH, { static_cast<uint8_t>(receivers.size()) }).Op(IREM)
+            .Tableswitch(0, labels, labels[0]);
+        for (size_t j = 0; j < receivers.size(); ++j) {
+          body.Label(labels[j]);
+          get_receiver(body, receivers[j]);
+          body.Branch(GOTO, "call");
+        }
+        body.Label("call");
+      }
+      body.Op(ILOAD, { 2 }).Op(ILOAD, { 1 });
+      if (interface)
+        body.InvokeInterface(apply, 3);
+      else
+        body.U16(INVOKEVIRTUAL, apply);
+      body.Op(ISTORE, { 2 });
+    });
+    code.Op(ILOAD, { 2 }).Op(IRETURN);
+  };
+
+  auto expected = [receivers] (int32_t n) {
+    uint32_t s = 0;
+    for (int32_t i = 0; i < n; ++i)
+      s = (s ^ i) + receivers[i % receivers.size()];
+    return static_cast<int32_t>(s);
+  };
+
+  return { name, description, assemble, expected };
+}
+
+const std::vector<Kernel> KERNELS = {
+  {
+    "sum", "s += i",
+    [] (ClassBuilder&, CodeBuilder& code) {
+      code.Op(ICONST_0).Op(ISTORE, { 2 });
+      Loop(code, [] (CodeBuilder& body) {
+        body.Op(ILOAD, { 2 }).Op(ILOAD, { 1 }).Op(IADD).Op(ISTORE, { 2 });
+      });
+      code.Op(ILOAD, { 2 }).Op(IRETURN);
+    },
+    [] (int32_t n) {
+      uint32_t s = 0;
+      for (int32_t i = 0; i < n; ++i)
+        s += i;
+      return static_cast<int32_t>(s);
+    }
+  },
+  {
+    "hash", "h = (h * 31 + i) ^ (h >>> 7); h += h << 3",
+    [] (ClassBuilder&, CodeBuilder& code) {
+      code.Op(ICONST_1).Op(ISTORE, { 2 });
+      Loop(code, [] (CodeBuilder& body) {
+        body.Op(ILOAD, { 2 }).Op(BIPUSH, { 31 }).Op(IMUL).Op(ILOAD, { 1 }).Op(IADD)
+            .Op(ILOAD, { 2 }).Op(BIPUSH, { 7 }).Op(IUSHR).Op(IXOR).Op(ISTORE, { 2 })
+            .Op(ILOAD, { 2 }).Op(ILOAD, { 2 }).Op(ICONST_3).Op(ISHL).Op(IADD).Op(ISTORE, { 2 });
+      });
+      code.Op(ILOAD, { 2 }).Op(IRETURN);
+    },
+    [] (int32_t n) {
+      uint32_t h = 1;
+      for (int32_t i = 0; i < n; ++i) {
+        h = (h * 31 + i) ^ (h >> 7);
+        h += h << 3;
+      }
+      return static_cast<int32_t>(h);
+    }
+  },
+  {
+    "long", "x = x * 6364136223846793005 + i; return (int) (x ^ x >>> 32)",
+    [] (ClassBuilder& klass, CodeBuilder& code) {
+      uint16_t multiplier = klass.Long(6364136223846793005);
+      code.Op(LCONST_1).Op(LSTORE, { 2 });
+      Loop(code, [&] (CodeBuilder& body) {
+        body.Op(LLOAD, { 2 }).U16(LDC2_W, multiplier).Op(LMUL).Op(ILOAD, { 1 }).Op(I2L).Op(LADD).Op(LSTORE, { 2 });
+      });
+      code.Op(LLOAD, { 2 }).Op(LLOAD, { 2 }).Op(BIPUSH, { 32 }).Op(LUSHR).Op(LXOR).Op(L2I).Op(IRETURN);
+    },
+    [] (int32_t n) {
+      uint64_t x = 1;
+      for (int32_t i = 0; i < n; ++i)
+        x = x * 6364136223846793005u + static_cast<int64_t>(i);
+      return static_cast<int32_t>(Wrap(static_cast<int64_t>(x ^ x >> 32)));
+    }
+  },
+  {
+    "double", "x = x * 0.5 + i; return (int) x",
+    [] (ClassBuilder& klass, CodeBuilder& code) {
+      uint16_t half = klass.Double(0.5);
+      code.Op(DCONST_0).Op(DSTORE, { 2 });
+      Loop(code, [&] (CodeBuilder& body) {
+        body.Op(DLOAD, { 2 }).U16(LDC2_W, half).Op(DMUL).Op(ILOAD, { 1 }).Op(I2D).Op(DADD).Op(DSTORE, { 2 });
+      });
+      code.Op(DLOAD, { 2 }).Op(D2I).Op(IRETURN);
+    },
+    [] (int32_t n) {
+      double x = 0;
+      for (int32_t i = 0; i < n; ++i)
+        x = x * 0.5 + i;
+      return static_cast<int32_t>(x);
+    }
+  },
+  {
+    "switch", "switch (i & 3) { case 0: s += 1; case 1: s ^= i; case 2: s -= i; default: s *= 3 } (with breaks)",
+    [] (ClassBuilder&, CodeBuilder& code) {
+      code.Op(ICONST_0).Op(ISTORE, { 2 });
+      Loop(code, [] (CodeBuilder& body) {
+        body.Op(ILOAD, { 1 }).Op(ICONST_3).Op(IAND).Tableswitch(0, { "case0", "case1", "case2" }, "default")
+            .Label("case0").Op(IINC, { 2, 1 }).Branch(GOTO, "break")
+            .Label("case1").Op(ILOAD, { 2 }).Op(ILOAD, { 1 }).Op(IXOR).Op(ISTORE, { 2 }).Branch(GOTO, "break")
+            .Label("case2").Op(ILOAD, { 2 }).Op(ILOAD, { 1 }).Op(ISUB).Op(ISTORE, { 2 }).Branch(GOTO, "break")
+            .Label("default").Op(ILOAD, { 2 }).Op(ICONST_3).Op(IMUL).Op(ISTORE, { 2 })
+            .Label("break");
+      });
+      code.Op(ILOAD, { 2 }).Op(IRETURN);
+    },
+    [] (int32_t n) {
+      uint32_t s = 0;
+      for (int32_t i = 0; i < n; ++i) {
+        switch (i & 3) {
+          case 0: s += 1; break;
+          case 1: s ^= i; break;
+          case 2: s -= i; break;
+          default: s *= 3; break;
+        }
+      }
+      return static_cast<int32_t>(s);
+    }
+  },
+  {
+    "poly", "s ^= ((i * 3 + 5) * i - 7) * i + 11",
+    [] (ClassBuilder&, CodeBuilder& code) {
+      code.Op(ICONST_0).Op(ISTORE, { 2 });
+      Loop(code, [] (CodeBuilder& body) {
+        body.Op(ILOAD, { 2 }).Op(ILOAD, { 1 }).Op(ICONST_3).Op(IMUL).Op(BIPUSH, { 5 }).Op(IADD)
+            .Op(ILOAD, { 1 }).Op(IMUL).Op(BIPUSH, { 7 }).Op(ISUB)
+            .Op(ILOAD, { 1 }).Op(IMUL).Op(BIPUSH, { 11 }).Op(IADD)
+            .Op(IXOR).Op(ISTORE, { 2 });
+      });
+      code.Op(ILOAD, { 2 }).Op(IRETURN);
+    },
+    [] (int32_t n) {
+      uint32_t s = 0;
+      for (int32_t i = 0; i < n; ++i) {
+        uint32_t x = i;
+        s ^= ((x * 3 + 5) * x - 7) * x + 11;
+      }
+      return static_cast<int32_t>(s);
+    }
+  },
+  {
+    "static", "S += i; L ^= S, where S is a static int and L a static long",
+    [] (ClassBuilder& klass, CodeBuilder& code) {
+      uint16_t s = klass.StaticField("S", "I"), l = klass.StaticField("L", "J");
+      code.Op(ICONST_0).U16(PUTSTATIC, s).Op(LCONST_1).U16(PUTSTATIC, l);
+      Loop(code, [&] (CodeBuilder& body) {
+        body.U16(GETSTATIC, s).Op(ILOAD, { 1 }).Op(IADD).U16(PUTSTATIC, s)
+            .U16(GETSTATIC, l).U16(GETSTATIC, s).Op(I2L).Op(LXOR).U16(PUTSTATIC, l);
+      });
+      code.U16(GETSTATIC, l).Op(L2I).Op(IRETURN);
+    },
+    [] (int32_t n) {
+      uint32_t s = 0;
+      uint64_t l = 1;
+      for (int32_t i = 0; i < n; ++i) {
+        s += i;
+        l ^= static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(s)));
+      }
+      return static_cast<int32_t>(Wrap(static_cast<int64_t>(l)));
+    }
+  },
+  {
+    "call", "s = add(s, i), where add is static",
+    [] (ClassBuilder& klass, CodeBuilder& code) {
+      uint16_t add = klass.MethodRef("add", "(II)I");
+      code.Op(ICONST_0).Op(ISTORE, { 2 });
+      Loop(code, [&] (CodeBuilder& body) {
+        body.Op(ILOAD, { 2 }).Op(ILOAD, { 1 }).U16(INVOKESTATIC, add).Op(ISTORE, { 2 });
+      });
+      code.Op(ILOAD, { 2 }).Op(IRETURN);
+    },
+    [] (int32_t n) {
+      uint32_t s = 0;
+      for (int32_t i = 0; i < n; ++i)
+        s += i;
+      return static_cast<int32_t>(s);
+    }
+  },
+  VirtualKernel("virtual", "s = r1.apply(s, i), where apply is virtual", { 1 }, false),
+  VirtualKernel("bimorphic", "s = (i % 2 == 0 ? r1 : r2).apply(s, i)", { 1, 2 }, false),
+  VirtualKernel("megamorph", "s = r[i % 5].apply(s, i), with five classes of receiver", { 0, 1, 2, 3, 4 }, false),
+  VirtualKernel("interface", "s = (i % 2 == 0 ? r1 : r2).apply(s, i), where apply is an interface method", { 1, 2 },
+                true),
+};
+
+struct Mode {
+  const char* m_name;
+  DispatchMode m_dispatch_mode;
+  StackCaching m_stack_caching;
+};
+
+// The first is the baseline for speedups
+const std::vector<Mode> MODES = {
+  { "switch", DispatchMode::Switch, StackCaching::None },
+  { "switch+tos", DispatchMode::Switch, StackCaching::TopOfStack },
+#if BJVM_THREADED_DISPATCH
+  { "threaded", DispatchMode::Threaded, StackCaching::None },
+  { "threaded+tos", DispatchMode::Threaded, StackCaching::TopOfStack },
+#endif
+};
+
+}
+
+int main(int argc, char** argv) {
+  int warmup = 3, repetitions = 15;
+  int32_t iterations = 1000000;
+  std::string profile_path;
+  std::vector<std::string> selected;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--warmup") && i + 1 < argc) {
+      warmup = std::stoi(argv[++i]);
+    } else if (!std::strcmp(argv[i], "--repetitions") && i + 1 < argc) {
+      repetitions = std::max(1, std::stoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--iterations") && i + 1 < argc) {
+      iterations = std::max(1, std::stoi(argv[++i]));
+    } else if (!std::strcmp(argv[i], "--profile") && i + 1 < argc) {
+      profile_path = argv[++i];
+    } else if (argv[i][0] == '-') {
+      std::fprintf(stderr, "Usage: %s [--warmup N] [--repetitions N] [--iterations N] [--profile FILE] [kernel...]\n",
+                   argv[0]);
+      return 1;
+    } else {
+      selected.emplace_back(argv[i]);
+    }
+  }
+
+  ClassBuilder builder { CLASS_NAME };
+  {
+    CodeBuilder add;
+    add.Op(ILOAD, { 0 }).Op(ILOAD, { 1 }).Op(IADD).Op(IRETURN);
+    builder.AddMethod("add", "(II)I", 2, add);
+  }
+  for (const auto& kernel : KERNELS) {
+    CodeBuilder code;
+    kernel.m_assemble(builder, code);
+    builder.AddMethod(kernel.m_name, "(I)I", 4, code);
+  }
+
+  // The interface the receivers' classes implement, then the classes, then the kernels which use them
+  LoadedClasses classes;
+  ClassBuilder function = ClassBuilder::Interface("Function");
+  function.AddAbstractMethod("apply", "(II)I");
+  classes.Add(function);
+  for (int k = 0; k < RECEIVERS; ++k) {
+    ClassBuilder receiver { ReceiverClass(k), k == 0 ? "java/lang/Object" : ReceiverClass(0) };
+    if (k == 0)
+      receiver.Implement("Function");
+    CodeBuilder apply;
+    apply.Op(ILOAD, { 1 }).Op(ILOAD, { 2 }).Op(IXOR).Op(BIPUSH, { static_cast<uint8_t>(k) }).Op(IADD).Op(IRETURN);
+    receiver.AddMethod("apply", "(II)I", 3, apply, ACC_PUBLIC);
+    classes.Add(receiver);
+  }
+  classes.Add(builder);
+  if (!classes.Link())
+    return 1;
+
+  ClassInstance& klass = *classes.Get(CLASS_NAME);
+  classfile::Classfile* cf = klass.GetClassfile();
+
+  std::vector<HeapObject> receivers;
+  for (int k = 0; k < RECEIVERS; ++k)
+    receivers.emplace_back(classes.Get(ReceiverClass(k)));
+  for (auto& field : cf->m_fields) {
+    const std::string& name = cf->m_cp.GetUtf8(field.m_name_index);
+    if (name[0] == 'r')
+      *klass.GetStaticSlot(&field) = reinterpret_cast<uintptr_t>(&receivers[std::stoi(name.substr(1))]);
+  }
+
+  auto is_selected = [&] (const Kernel& kernel) {
+    return selected.empty() || std::find(selected.begin(), selected.end(), kernel.m_name) != selected.end();
+  };
+
+  std::printf("%d iterations per run, median of %d runs\n\n", iterations, repetitions);
+  std::printf("%-10s", "");
+  for (const auto& mode : MODES)
+    std::printf(" | %-22s", mode.m_name);
+  std::printf("\n%-10s", "kernel");
+  for (size_t i = 0; i < MODES.size(); ++i)
+    std::printf(" | %8s %6s %6s", "ns/iter", "MAD", "speed");
+  std::printf("\n");
+
+  for (const auto& kernel : KERNELS) {
+    if (!is_selected(kernel))
+      continue;
+
+    const classfile::MethodInfo* method = klass.FindStaticMethod(kernel.m_name, "(I)I");
+    int32_t expected = kernel.m_expected(iterations);
+
+    std::printf("%-10s", kernel.m_name);
+    double baseline_median = 0;
+    for (const auto& mode : MODES) {
+      BytecodeInterpreter interpreter { nullptr, mode.m_dispatch_mode, mode.m_stack_caching };
+      FrameEntry argument = static_cast<uint32_t>(iterations);
+
+      std::vector<double> seconds;
+      for (int i = -warmup; i < repetitions; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        interpreter.PushFrame(method, &argument);
+        while (interpreter.step()) {}
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        auto result = static_cast<int32_t>(interpreter.GetReturnValue());
+        if (result != expected) {
+          std::fprintf(stderr, "\n%s returned %d under %s, expected %d\n", kernel.m_name, result, mode.m_name,
+                       expected);
+          return 1;
+        }
+        if (i >= 0)
+          seconds.push_back(elapsed);
+      }
+
+      double median = Median(seconds);
+      if (&mode == &MODES[0])
+        baseline_median = median;
+      std::printf(" | %8.2f %5.1f%% %5.2fx", median / iterations * 1e9, RelativeMad(seconds) * 100,
+                  baseline_median / median);
+    }
+    std::printf("\n");
+  }
+
+  // Accumulated over every run, in every mode
+  bool any_caches = false;
+  for (const auto& kernel : KERNELS) {
+    if (!is_selected(kernel))
+      continue;
+
+    for (const auto& insn : klass.FindStaticMethod(kernel.m_name, "(I)I")->GetExecutableCode()->m_code) {
+      if (insn.GetCode() != classfile::InsnCode::invokevirtual_quick
+          && insn.GetCode() != classfile::InsnCode::invokeinterface_quick)
+        continue;
+
+      if (!any_caches)
+        std::printf("\n%-10s | %-12s %12s %12s\n", "call site", "inline cache", "hits", "misses");
+      any_caches = true;
+
+      const InlineCache* cache = insn.GetInlineCache();
+      std::printf("%-10s | %-12s %12llu %12llu\n", kernel.m_name, StateName(cache->GetState()),
+                  static_cast<unsigned long long>(cache->GetHits()),
+                  static_cast<unsigned long long>(cache->GetMisses()));
+    }
+  }
+
+  if (!profile_path.empty()) {
+    std::ofstream out { profile_path };
+    WriteProfile(out, classes.All(), 20);
+  }
+
+  return 0;
+}
@@ -0,0 +1,162 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#ifndef ARCHIVE_IO_H
+#define ARCHIVE_IO_H
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "arena.h"
+#include "byte_reader.h"
+
+namespace bjvm {
+
+// Helpers for the VM's on-disk caches (ClassArchive, VerificationCache), which are only ever read back by the same
+// build and so are written in host byte order.
+
+/** Appends values in host byte order. */
+class ArchiveWriter {
+  std::vector<uint8_t>& m_out;
+
+  template <typename T>
+  void PutRaw(const T* values, size_t count) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    auto* p = reinterpret_cast<const uint8_t*>(values);
+    m_out.insert(m_out.end(), p, p + count * sizeof(T));
+  }
+
+public:
+  explicit ArchiveWriter(std::vector<uint8_t>& out) : m_out(out) {}
+
+  template <typename T>
+  void Put(const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    auto* p = reinterpret_cast<const uint8_t*>(&value);
+    m_out.insert(m_out.end(), p, p + sizeof(T));
+  }
+
+  template <typename Array>
+  void PutArray(const Array& values) {
+    Put<uint32_t>(values.size());
+    PutRaw(values.data(), values.size());
+  }
+
+  void PutString(const std::string& value) {
+    Put<uint32_t>(value.size());
+    m_out.insert(m_out.end(), value.begin(), value.end());
+  }
+
+  void PutBytes(ByteSpan bytes) {
+    Put<uint64_t>(bytes.size());
+    m_out.insert(m_out.end(), bytes.begin(), bytes.end());
+  }
+
+  /**
+   * Like PutArray, but padded so that the elements are aligned, relative to the start of the output, for
+   * ArchiveReader::ViewArray to use them where they are.
+   */
+  template <typename Array>
+  void PutAlignedArray(const Array& values) {
+    using T = std::remove_cv_t<std::remove_reference_t<decltype(*values.data())>>;
+    Put<uint32_t>(values.size());
+    m_out.resize((m_out.size() + alignof(T) - 1) / alignof(T) * alignof(T));
+    PutRaw(values.data(), values.size());
+  }
+};
+
+/** Reads back what ArchiveWriter wrote, checking bounds so that a corrupt archive can't take the VM down with it. */
+class ArchiveReader {
+  const uint8_t* m_p;
+  const uint8_t* m_end;
+  // Where the writer's output started, which alignment is relative to
+  const uint8_t* m_origin;
+
+  // 64-bit, so that a corrupt length can't wrap around on 32-bit targets
+  const uint8_t* Take(uint64_t n) {
+    if (n > static_cast<uint64_t>(m_end - m_p))
+      throw std::runtime_error("Truncated archive");
+    auto* p = m_p;
+    m_p += n;
+    return p;
+  }
+
+public:
+  explicit ArchiveReader(ByteSpan bytes) : m_p(bytes.begin()), m_end(bytes.end()), m_origin(bytes.begin()) {}
+
+  /** Read bytes which start some way into what was written, at origin. */
+  ArchiveReader(ByteSpan bytes, const uint8_t* origin) : m_p(bytes.begin()), m_end(bytes.end()), m_origin(origin) {}
+
+  template <typename T>
+  T Get() {
+    static_assert(std::is_trivially_copyable_v<T>);
+    T value;
+    std::memcpy(&value, Take(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  template <typename T>
+  ArenaArray<T> GetArray(Arena* arena) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    auto count = Get<uint32_t>();
+    auto* p = Take(static_cast<uint64_t>(count) * sizeof(T));
+    auto values = arena->NewArray<T>(count);
+    if (count)
+      std::memcpy(values.data(), p, count * sizeof(T));
+    return values;
+  }
+
+  /** Read count values into out, which has room for them. */
+  template <typename T>
+  void GetInto(T* out, size_t count) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    if (count)
+      std::memcpy(out, Take(static_cast<uint64_t>(count) * sizeof(T)), count * sizeof(T));
+  }
+
+  /**
+   * An array written by PutAlignedArray, pointing into the archive rather than copied out of it. Nothing may write to
+   * it, as the archive is usually mapped read-only, and it is only valid for as long as the archive is.
+   */
+  template <typename T>
+  ArenaArray<T> ViewArray() {
+    static_assert(std::is_trivially_copyable_v<T>);
+    auto count = Get<uint32_t>();
+    Take((alignof(T) - static_cast<size_t>(m_p - m_origin) % alignof(T)) % alignof(T));
+    auto* p = Take(static_cast<uint64_t>(count) * sizeof(T));
+    if (reinterpret_cast<uintptr_t>(p) % alignof(T))
+      throw std::runtime_error("Misaligned archive");
+    return { reinterpret_cast<T*>(const_cast<uint8_t*>(p)), count };
+  }
+
+  std::string GetString() {
+    auto length = Get<uint32_t>();
+    return { reinterpret_cast<const char*>(Take(length)), length };
+  }
+
+  /** A string written by PutString, pointing into the archive. */
+  std::string_view GetStringView() {
+    auto length = Get<uint32_t>();
+    return { reinterpret_cast<const char*>(Take(length)), length };
+  }
+
+  /** Bytes written by PutBytes, pointing into the archive. */
+  ByteSpan GetBytes() {
+    auto length = Get<uint64_t>();
+    return { Take(length), static_cast<size_t>(length) };
+  }
+
+  bool AtEnd() const {
+    return m_p == m_end;
+  }
+};
+
+} // bjvm
+
+#endif //ARCHIVE_IO_H
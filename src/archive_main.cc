@@ -0,0 +1,36 @@
+//
+// Created by Cowpox on 8/14/24.
+//
+
+// Writes a class archive of everything on a class path, for use with VMOptions::m_class_archive.
+//
+// Usage: bjvm_archive <class path> <archive>
+
+#include <iostream>
+
+#include "vm.h"
+
+int main(int argc, char** argv) {
+  using namespace bjvm;
+
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <class path> <archive>\n";
+    return 1;
+  }
+
+  try {
+    VM vm {
+      VMOptions {
+        .m_classpath = argv[1]
+      }
+    };
+
+    size_t count = vm.WriteClassArchive(argv[2]);
+    std::cout << "Archived " << count << " classes to " << argv[2] << '\n';
+  } catch (std::exception& e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+  }
+
+  return 0;
+}
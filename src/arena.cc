@@ -0,0 +1,78 @@
+//
+// Created by Cowpox on 8/16/24.
+//
+
+#include "arena.h"
+
+#include <algorithm>
+
+namespace bjvm {
+
+Arena::~Arena() {
+  Release();
+}
+
+Arena::Arena(Arena &&other) noexcept {
+  *this = std::move(other);
+}
+
+Arena & Arena::operator=(Arena &&other) noexcept {
+  if (this != &other) {
+    Release();
+    m_chunk_size = other.m_chunk_size;
+    m_chunks = std::move(other.m_chunks);
+    m_destructors = std::move(other.m_destructors);
+    m_cursor = std::exchange(other.m_cursor, nullptr);
+    m_end = std::exchange(other.m_end, nullptr);
+    m_bytes_allocated = std::exchange(other.m_bytes_allocated, 0);
+    m_bytes_reserved = std::exchange(other.m_bytes_reserved, 0);
+    other.m_chunks.clear();
+    other.m_destructors.clear();
+  }
+  return *this;
+}
+
+void * Arena::AllocateSlow(size_t size, size_t align) {
+  // Large requests get a chunk of their own, so they don't waste the rest of the current chunk
+  size_t chunk_size = std::max(m_chunk_size, size + align);
+  auto& chunk = m_chunks.emplace_back(new uint8_t[chunk_size]);
+  m_bytes_reserved += chunk_size;
+
+  auto address = reinterpret_cast<uintptr_t>(chunk.get());
+  uintptr_t aligned = (address + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+
+  if (chunk_size == m_chunk_size) {
+    m_cursor = reinterpret_cast<uint8_t*>(aligned + size);
+    m_end = chunk.get() + chunk_size;
+  }
+
+  m_bytes_allocated += size;
+  return reinterpret_cast<void*>(aligned);
+}
+
+void Arena::Absorb(Arena &&other) {
+  if (&other == this)
+    return;
+
+  for (auto& chunk : other.m_chunks)
+    m_chunks.push_back(std::move(chunk));
+  m_destructors.insert(m_destructors.end(), other.m_destructors.begin(), other.m_destructors.end());
+  m_bytes_allocated += other.m_bytes_allocated;
+  m_bytes_reserved += other.m_bytes_reserved;
+
+  other.m_chunks.clear();
+  other.m_destructors.clear();
+  other.m_cursor = other.m_end = nullptr;
+  other.m_bytes_allocated = other.m_bytes_reserved = 0;
+}
+
+void Arena::Release() {
+  for (auto it = m_destructors.rbegin(); it != m_destructors.rend(); ++it)
+    it->m_destroy(it->m_object);
+  m_destructors.clear();
+  m_chunks.clear();
+  m_cursor = m_end = nullptr;
+  m_bytes_allocated = m_bytes_reserved = 0;
+}
+
+} // bjvm
@@ -0,0 +1,166 @@
+//
+// Created by Cowpox on 8/16/24.
+//
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace bjvm {
+
+/**
+ * Fixed-size array allocated from an Arena. Doesn't own its elements -- they live as long as the arena does -- so it's
+ * trivially copyable and destructible, and structures holding only ArenaArrays can themselves be bump allocated.
+ */
+template <typename T>
+class ArenaArray {
+  T* m_data = nullptr;
+  size_t m_size = 0;
+
+public:
+  ArenaArray() = default;
+  ArenaArray(T* data, size_t size) : m_data(data), m_size(size) {}
+
+  T* data() const { return m_data; }
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+
+  T* begin() const { return m_data; }
+  T* end() const { return m_data + m_size; }
+
+  T& operator[](size_t index) const { return m_data[index]; }
+
+  T& at(size_t index) const {
+    if (index >= m_size)
+      throw std::out_of_range("ArenaArray index out of range");
+    return m_data[index];
+  }
+};
+
+/**
+ * Bump allocator for class metadata. Memory is carved out of large chunks and only released all at once, when the
+ * arena is destroyed, so parsing a class costs a handful of chunk allocations rather than one malloc per vector.
+ *
+ * Objects with non-trivial destructors may be allocated with New; their destructors run, in reverse order of
+ * allocation, when the arena is released. Arrays (NewArray, CopyArray) must be of trivially destructible types.
+ *
+ * An arena is not thread safe. Threads parsing in parallel should each use their own arena and Absorb it into the
+ * owning class loader's afterwards.
+ */
+class Arena {
+  static constexpr size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+  size_t m_chunk_size = DEFAULT_CHUNK_SIZE;
+  std::vector<std::unique_ptr<uint8_t[]>> m_chunks;
+  uint8_t* m_cursor = nullptr;
+  uint8_t* m_end = nullptr;
+
+  struct Destructor {
+    void* m_object;
+    void (*m_destroy)(void*);
+  };
+  std::vector<Destructor> m_destructors;
+
+  size_t m_bytes_allocated = 0;
+  size_t m_bytes_reserved = 0;
+
+  void* AllocateSlow(size_t size, size_t align);
+
+public:
+  Arena() = default;
+
+  /** Use a smaller chunk size for arenas expected to hold little, so that each doesn't reserve a full 64 KiB. */
+  explicit Arena(size_t chunk_size) : m_chunk_size(chunk_size) {}
+
+  ~Arena();
+
+  Arena(Arena&& other) noexcept;
+  Arena& operator=(Arena&& other) noexcept;
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  /** Allocate uninitialised memory. */
+  void* Allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+    auto address = reinterpret_cast<uintptr_t>(m_cursor);
+    uintptr_t aligned = (address + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+    if (m_cursor && aligned + size <= reinterpret_cast<uintptr_t>(m_end)) {
+      m_cursor = reinterpret_cast<uint8_t*>(aligned + size);
+      m_bytes_allocated += size;
+      return reinterpret_cast<void*>(aligned);
+    }
+    return AllocateSlow(size, align);
+  }
+
+  /** Construct an object in the arena. Its destructor, if it has one, runs when the arena is released. */
+  template <typename T, typename... Args>
+  T* New(Args&&... args) {
+    T* object = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      m_destructors.push_back({ object, [] (void* p) { static_cast<T*>(p)->~T(); } });
+    }
+    return object;
+  }
+
+  /** Allocate an array of value-initialised elements. */
+  template <typename T>
+  ArenaArray<T> NewArray(size_t count) {
+    static_assert(std::is_trivially_destructible_v<T>, "arena arrays are never destroyed");
+    if (count == 0)
+      return {};
+    T* data = static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+    for (size_t i = 0; i < count; ++i)
+      new (data + i) T();
+    return { data, count };
+  }
+
+  /** Allocate an array holding a copy of the given elements. */
+  template <typename T>
+  ArenaArray<T> CopyArray(const T* elements, size_t count) {
+    static_assert(std::is_trivially_destructible_v<T>, "arena arrays are never destroyed");
+    if (count == 0)
+      return {};
+    T* data = static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+    std::uninitialized_copy(elements, elements + count, data);
+    return { data, count };
+  }
+
+  template <typename T>
+  ArenaArray<T> CopyArray(const std::vector<T>& elements) {
+    return CopyArray(elements.data(), elements.size());
+  }
+
+  /**
+   * Take ownership of everything allocated from other, which is left empty. Pointers into other remain valid. Used to
+   * merge arenas that worker threads parsed into.
+   */
+  void Absorb(Arena&& other);
+
+  /** Run destructors and free every chunk. The arena can be reused afterwards. */
+  void Release();
+
+  /**
+   * Bytes requested from Allocate. Alignment padding isn't counted, so the difference from BytesReserved is padding
+   * plus whatever is left unused at the ends of chunks.
+   */
+  size_t BytesAllocated() const {
+    return m_bytes_allocated;
+  }
+
+  /** Bytes obtained from the system, i.e. the total size of all chunks. */
+  size_t BytesReserved() const {
+    return m_bytes_reserved;
+  }
+};
+
+} // bjvm
+
+#endif //ARENA_H
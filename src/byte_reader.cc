@@ -5,17 +5,26 @@
 
 namespace bjvm {
 
-std::vector<uint8_t> ByteReader::NextNBytes(int n, const char *reason) {
-  std::vector<uint8_t> result;
-  if (m_read + n > m_bytes.size())
-    throw std::runtime_error("Unexpected end of " + m_current_component + " while reading " + reason);
-  result.resize(n);
-  memcpy(result.data(), m_bytes.data() + m_read, n);
+void ByteReader::ThrowEof(const char *reason) const {
+  throw std::runtime_error("Unexpected end of " + std::string(m_current_component) + " while reading "
+                           + std::string(reason ? reason : "data"));
+}
+
+ByteSpan ByteReader::NextNBytes(int n, const char *reason) {
+  if (n < 0 || m_read + n > m_size)
+    ThrowEof(reason);
+  ByteSpan result { m_bytes + m_read, static_cast<size_t>(n) };
   m_read += n;
   return result;
 }
 
-void ByteReader::SetCurrentComponent(const std::string &component) {
+void ByteReader::Skip(int n, const char *reason) {
+  if (n < 0 || m_read + n > m_size)
+    ThrowEof(reason);
+  m_read += n;
+}
+
+void ByteReader::SetCurrentComponent(const char *component) {
   m_current_component = component;
 }
 
@@ -38,18 +47,22 @@ int ByteReader::GetOffs() const {
   return m_read;
 }
 
-ByteReader ByteReader::slice(const std::string &component, int bytes) const {
-  if (m_read + bytes > m_bytes.size())
-    throw std::runtime_error("Unexpected end of " + m_current_component + " while reading " + component);
+size_t ByteReader::Remaining() const {
+  return m_size - m_read;
+}
+
+ByteReader ByteReader::slice(const char *component, int bytes) const {
+  if (bytes < 0 || m_read + bytes > m_size)
+    ThrowEof(component);
 
-  ByteReader reader ({m_bytes.begin() + m_read, m_bytes.begin() + m_read + bytes});
+  ByteReader reader (m_bytes + m_read, bytes);
   reader.m_current_component = component;
   reader.m_base = m_base + m_read;
   return reader;
 }
 
 bool ByteReader::Eof() const {
-  return m_read >= m_bytes.size();
+  return m_read >= m_size;
 }
 
-}
\ No newline at end of file
+}
@@ -6,42 +6,76 @@
 #define BROWSER_JVM_BYTE_READER_H
 
 #include <exception>
+#include <stdexcept>
 #include <algorithm>
+#include <string>
 #include <vector>
 #include <cassert>
 #include <cstdint>
 
 namespace bjvm {
+
+/**
+ * Non-owning view of a contiguous run of bytes. The underlying storage must outlive the view.
+ */
+struct ByteSpan {
+  const uint8_t* m_data = nullptr;
+  size_t m_size = 0;
+
+  const uint8_t* data() const { return m_data; }
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+
+  const uint8_t* begin() const { return m_data; }
+  const uint8_t* end() const { return m_data + m_size; }
+};
+
 /**
  * Helper class for reading class files.
+ *
+ * The reader borrows its bytes: slices, skipped regions and byte runs returned by NextNBytes all point into the
+ * original buffer, so the buffer must stay alive (and unmodified) for as long as the reader or anything read from it
+ * as a ByteSpan is in use.
  */
 class ByteReader {
-  std::vector<uint8_t> m_bytes;
+  const uint8_t* m_bytes = nullptr;
+  size_t m_size = 0;
   // what we're currently reading -- for more informative ClassFormat- and VerifyErrors
-  std::string m_current_component = "file";
+  const char* m_current_component = "file";
 
   // Base from the original classfile start (in case we're reading a slice)
   int m_base = 0;
   int m_read = 0;
 
+  [[noreturn]] void ThrowEof(const char* reason) const;
+
   template <int N>
   void ReadBytes(const char* reason, char* data) {
-    if (m_read + N > m_bytes.size())
-      throw std::runtime_error("Unexpected end of file while reading " + std::string(reason));
+    if (m_read + N > m_size)
+      ThrowEof(reason);
     // Reverse big endian -> little endian
-    std::reverse_copy(m_bytes.begin() + m_read, m_bytes.begin() + m_read + N, data);
+    std::reverse_copy(m_bytes + m_read, m_bytes + m_read + N, data);
     m_read += N;
   }
 
 public:
-  explicit ByteReader(std::vector<uint8_t> bytes) : m_bytes(std::move(bytes)) {}
+  ByteReader(const uint8_t* bytes, size_t size) : m_bytes(bytes), m_size(size) {}
+  explicit ByteReader(ByteSpan bytes) : ByteReader(bytes.data(), bytes.size()) {}
+  explicit ByteReader(const std::vector<uint8_t>& bytes) : ByteReader(bytes.data(), bytes.size()) {}
+
+  // The reader would outlive a temporary vector
+  explicit ByteReader(std::vector<uint8_t>&& bytes) = delete;
 
-  void SetCurrentComponent(const std::string& component);
+  void SetCurrentComponent(const char* component);
 
-  std::vector<uint8_t> NextNBytes(int n, const char* reason = nullptr);
+  /** Read the next n bytes as a view into the underlying buffer. */
+  ByteSpan NextNBytes(int n, const char* reason = nullptr);
 
-  /** Create a slice of the file starting at the current position. */
-  ByteReader slice(const std::string& component, int bytes) const;
+  /** Skip the next n bytes. */
+  void Skip(int n, const char* reason = nullptr);
+
+  /** Create a slice of the file starting at the current position. The slice shares the underlying buffer. */
+  ByteReader slice(const char* component, int bytes) const;
 
   uint8_t NextU8(const char* reason = nullptr);
   int8_t NextI8(const char* reason = nullptr);
@@ -57,6 +91,9 @@ public:
   int GetOriginalOffs() const;
   int GetOffs() const;
 
+  /** Number of bytes left to read. */
+  size_t Remaining() const;
+
   bool Eof() const;
 };
 }
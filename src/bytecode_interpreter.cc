@@ -4,8 +4,838 @@
 
 #include "bytecode_interpreter.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+
+#include "class_instance.h"
+#include "heap_object.h"
+#include "inline_cache.h"
+
 namespace bjvm {
+
+using namespace classfile;
+
+// Every InsnCode, in declaration order, so that the threaded dispatch table can be indexed by opcode
+#define BJVM_FOR_EACH_INSN(X) \
+  X(nop) \
+  X(aaload) X(aastore) X(aconst_null) X(areturn) X(arraylength) X(athrow) X(baload) X(bastore) X(caload) X(castore) \
+  X(d2f) X(d2i) X(d2l) X(dadd) X(daload) X(dastore) X(dcmpg) X(dcmpl) X(ddiv) X(dmul) X(dneg) X(drem) X(dreturn) \
+  X(dsub) X(dup) X(dup_x1) X(dup_x2) X(dup2) X(dup2_x1) X(dup2_x2) X(f2d) X(f2i) X(f2l) X(fadd) X(faload) X(fastore) \
+  X(fcmpg) X(fcmpl) X(fdiv) X(fmul) X(fneg) X(frem) X(freturn) X(fsub) X(i2b) X(i2c) X(i2d) X(i2f) X(i2l) X(i2s) \
+  X(iadd) X(iaload) X(iand) X(iastore) X(idiv) X(imul) X(ineg) X(ior) X(irem) X(ireturn) X(ishl) X(ishr) X(isub) \
+  X(iushr) X(ixor) X(l2d) X(l2f) X(l2i) X(ladd) X(laload) X(land) X(lastore) X(lcmp) X(ldc) X(ldc2_w) X(ldiv) X(lmul) \
+  X(lneg) X(lor) X(lrem) X(lreturn) X(lshl) X(lshr) X(lsub) X(lushr) X(lxor) X(monitorenter) X(monitorexit) X(pop) \
+  X(pop2) X(return_) X(saload) X(sastore) X(swap) \
+  X(dload) X(fload) X(iload) X(lload) X(dstore) X(fstore) X(istore) X(lstore) X(aload) X(astore) \
+  X(anewarray) X(checkcast) X(getfield) X(getstatic) X(instanceof) X(invokedynamic) X(new_) X(putfield) X(putstatic) \
+  X(invokevirtual) X(invokespecial) X(invokestatic) \
+  X(goto_) X(jsr) \
+  X(if_acmpeq) X(if_acmpne) X(if_icmpeq) X(if_icmpne) X(if_icmplt) X(if_icmpge) X(if_icmpgt) X(if_icmple) X(ifeq) \
+  X(ifne) X(iflt) X(ifge) X(ifgt) X(ifle) X(ifnonnull) X(ifnull) \
+  X(iconst) X(dconst) X(fconst) X(lconst) \
+  X(iinc) X(invokeinterface) X(multianewarray) X(newarray) X(tableswitch) X(lookupswitch) X(ret) \
+  X(getstatic_quick) X(getstatic2_quick) X(putstatic_quick) X(putstatic2_quick) X(invokestatic_quick) \
+  X(invokevirtual_quick) X(invokeinterface_quick) \
+  X(iload_iload_iadd_istore) X(iload_iload_if_icmpge) X(iload_iload_if_icmplt) X(iload_iload) X(aload_aload) \
+  X(iinc_goto) X(iload_ireturn)
+
+namespace {
+
+constexpr InsnCode INSN_ORDER[] = {
+#define X(op) InsnCode::op,
+  BJVM_FOR_EACH_INSN(X)
+#undef X
+};
+
+constexpr bool IsInDeclarationOrder() {
+  for (size_t i = 0; i < std::size(INSN_ORDER); ++i) {
+    if (static_cast<size_t>(INSN_ORDER[i]) != i)
+      return false;
+  }
+  return std::size(INSN_ORDER) == static_cast<size_t>(InsnCode::iload_ireturn) + 1;
+}
+
+static_assert(IsInDeclarationOrder(), "BJVM_FOR_EACH_INSN must list every InsnCode in declaration order");
+
+/** Read a value from the low bytes of a frame entry. */
+template <typename T>
+T Load(const FrameEntry* entry) {
+  T value;
+  std::memcpy(&value, entry, sizeof(T));
+  return value;
+}
+
+/**
+ * Write a value to the low bytes of a frame entry, zeroing the rest. Writing the entry as a whole lets a cached top of
+ * stack be overwritten rather than merged into, and lets the entry be copied by a load that forwards from the store.
+ */
+template <typename T>
+void Store(FrameEntry* entry, T value) {
+  FrameEntry bits = 0;
+  std::memcpy(&bits, &value, sizeof(T));
+  *entry = bits;
+}
+
+// Java integer arithmetic wraps around, which for signed types is undefined behaviour in C++
+
+template <typename T>
+T WrappingAdd(T a, T b) {
+  using U = std::make_unsigned_t<T>;
+  return static_cast<T>(static_cast<U>(a) + static_cast<U>(b));
+}
+
+template <typename T>
+T WrappingSub(T a, T b) {
+  using U = std::make_unsigned_t<T>;
+  return static_cast<T>(static_cast<U>(a) - static_cast<U>(b));
+}
+
+template <typename T>
+T WrappingMul(T a, T b) {
+  using U = std::make_unsigned_t<T>;
+  return static_cast<T>(static_cast<U>(a) * static_cast<U>(b));
+}
+
+template <typename T>
+T WrappingNeg(T a) {
+  using U = std::make_unsigned_t<T>;
+  return static_cast<T>(U(0) - static_cast<U>(a));
+}
+
+// MIN_VALUE / -1 overflows, and is MIN_VALUE in Java (JVMS idiv). The divisor has been checked to be nonzero.
+template <typename T>
+T Divide(T a, T b) {
+  return b == -1 ? WrappingNeg(a) : a / b;
+}
+
+template <typename T>
+T Remainder(T a, T b) {
+  return b == -1 ? 0 : a % b;
+}
+
+// Only the low 5 (int) or 6 (long) bits of the shift distance count
+
+template <typename T>
+T ShiftLeft(T a, int32_t b) {
+  using U = std::make_unsigned_t<T>;
+  return static_cast<T>(static_cast<U>(a) << (b & (sizeof(T) * 8 - 1)));
+}
+
+template <typename T>
+T ShiftRight(T a, int32_t b) {
+  return a >> (b & (sizeof(T) * 8 - 1));
+}
+
+template <typename T>
+T UnsignedShiftRight(T a, int32_t b) {
+  using U = std::make_unsigned_t<T>;
+  return static_cast<T>(static_cast<U>(a) >> (b & (sizeof(T) * 8 - 1)));
+}
+
+/** Narrow a float or double to an int or long as Java does (JVMS 2.8.3): NaN becomes 0, others saturate. */
+template <typename To, typename From>
+To FloatToInteger(From value) {
+  if (std::isnan(value))
+    return 0;
+  if (value >= static_cast<From>(std::numeric_limits<To>::max()))
+    return std::numeric_limits<To>::max();
+  if (value <= static_cast<From>(std::numeric_limits<To>::min()))
+    return std::numeric_limits<To>::min();
+  return static_cast<To>(value);
+}
+
+/**
+ * The operand stack of the running frame, as held in locals of the dispatch loop. Entries are numbered from the top:
+ * operands[1] is the top entry, operands[2] the one below it, and so on.
+ */
+template <StackCaching CACHING>
+class OperandStack;
+
+template <>
+class OperandStack<StackCaching::None> {
+  // One past the top entry
+  FrameEntry* m_sp;
+
+public:
+  OperandStack(FrameEntry* stack, int depth) : m_sp(stack + depth) {}
+
+  FrameEntry& operator[](int k) {
+    return m_sp[-k];
+  }
+
+  /** Pop from entries, then push to entries, which are left for the caller to write. */
+  void Replace(int from, int to) {
+    m_sp += to - from;
+  }
+
+  /** Write the whole stack to the frame, returning one past its top entry. */
+  FrameEntry* Flush() {
+    return m_sp;
+  }
+};
+
+template <>
+class OperandStack<StackCaching::TopOfStack> {
+  // One past the top entry in the frame, i.e. the entry the top would be spilled to. That's the frame's spill entry if
+  // the stack is empty.
+  FrameEntry* m_sp;
+  // The top entry, or garbage if the stack is empty
+  FrameEntry m_top;
+
+public:
+  OperandStack(FrameEntry* stack, int depth) : m_sp(stack + depth - 1), m_top(*m_sp) {}
+
+  FrameEntry& operator[](int k) {
+    return k == 1 ? m_top : m_sp[1 - k];
+  }
+
+  /**
+   * As for StackCaching::None. The top is only spilled if nothing is popped: otherwise it is popped itself, and if more
+   * is pushed than popped (e.g. Replace(1, 2) for i2l) the entry it would have been spilled to is one of those the
+   * caller writes.
+   */
+  void Replace(int from, int to) {
+    // Spill the top if it's about to be covered, and fill it if it's been uncovered
+    if (from == 0)
+      *m_sp = m_top;
+    m_sp += to - from;
+    if (to == 0)
+      m_top = *m_sp;
+  }
+
+  FrameEntry* Flush() {
+    *m_sp = m_top;
+    return m_sp + 1;
+  }
+};
+
+/** Whether a field or method descriptor names a long or double, which take two entries. */
+bool IsWide(const std::string& descriptor) {
+  return descriptor[0] == 'J' || descriptor[0] == 'D';
+}
+
+/** The method a Methodref or InterfaceMethodref refers to, which was resolved when its class was linked. */
+const MethodInfo* ResolvedMethod(const ConstantPool& cp, uint16_t index) {
+  return cp.GetTag(index) == ConstantPoolTag::MethodRef ? cp.GetUnchecked<EntryMethodRef>(index).m_method_info
+                                                        : cp.GetUnchecked<EntryInterfaceMethodRef>(index).m_method_info;
+}
+
+/** fcmpl and friends: nan_result is what a comparison involving NaN gives (-1 for the l forms, 1 for the g forms). */
+template <typename T>
+int32_t CompareFloating(T a, T b, int32_t nan_result) {
+  if (a < b)
+    return -1;
+  if (a > b)
+    return 1;
+  return a == b ? 0 : nan_result;
+}
+
+}
+
+BytecodeInterpreter::BytecodeInterpreter(VM *vm, DispatchMode dispatch_mode, StackCaching stack_caching)
+    : m_vm(vm), m_dispatch_mode(BJVM_THREADED_DISPATCH ? dispatch_mode : DispatchMode::Switch),
+      m_stack_caching(stack_caching) {}
+
+void BytecodeInterpreter::PushFrame(const MethodInfo *method, const FrameEntry *args) {
+  FrameEntry* locals = m_frames.End();
+  PushFrameAt(method, locals);
+  // Arguments were checked against max_locals when the method was verified
+  std::copy(args, args + method->m_argument_slots, locals);
+}
+
+void BytecodeInterpreter::PushFrameAt(const MethodInfo *method, FrameEntry *locals) {
+  const CodeAttribute* code = method->GetExecutableCode();
+  if (!code)
+    throw std::runtime_error("UnsatisfiedLinkError: method has no code");
+
+  m_frames.Push(method, code, locals);
+  ++method->m_code->m_profile->m_invocations;
+}
+
+bool BytecodeInterpreter::Return(FrameEntry value, int slots) {
+  m_frames.Pop();
+  if (m_frames.Empty()) {
+    m_return_value = value;
+    return false;
+  }
+
+  ExecutionFrame* caller = m_frames.Top();
+  caller->Stack()[caller->m_stack_index] = value;
+  caller->m_stack_index += slots;
+  return true;
+}
+
+void BytecodeInterpreter::Quicken(const Insn *insn, InsnCode code, decltype(Insn::m_data) data) {
+  // Executable code is the interpreter's own copy (see GetExecutableCode), in an arena rather than read-only memory
+  auto* quickened = const_cast<Insn*>(insn);
+  quickened->m_data = data;
+  quickened->m_code = code;
+}
+
 bool BytecodeInterpreter::step() {
-  return false;
+#if BJVM_THREADED_DISPATCH
+  if (m_dispatch_mode == DispatchMode::Threaded)
+    return Run<DispatchMode::Threaded>(m_stack_caching);
+#endif
+  return Run<DispatchMode::Switch>(m_stack_caching);
 }
-} // bjvm
\ No newline at end of file
+
+template <DispatchMode MODE>
+bool BytecodeInterpreter::Run(StackCaching caching) {
+  if (caching == StackCaching::TopOfStack)
+    return Run<MODE, StackCaching::TopOfStack>();
+  return Run<MODE, StackCaching::None>();
+}
+
+template <DispatchMode MODE, StackCaching CACHING>
+bool BytecodeInterpreter::Run() {
+  if (m_frames.Empty())
+    return false;
+
+  ExecutionFrame* const frame = m_frames.Top();
+  const ConstantPool& cp = frame->m_method->m_class->GetClassfile()->m_cp;
+
+  const Insn* const code = frame->m_code->m_code.data();
+  uint64_t* const backedges = frame->m_method->m_code->m_profile->m_backedges.data();
+  FrameEntry* const locals = frame->Locals();
+  FrameEntry* const stack = frame->Stack();
+
+  // The registers: the current instruction, and the operand stack pointer (and cached top)
+  const Insn* insn = code + frame->m_instruction_index;
+  OperandStack<CACHING> operands { stack, frame->m_stack_index };
+
+#if BJVM_THREADED_DISPATCH
+  static const void* const HANDLERS[] = {
+#define X(op) &&op_##op,
+    BJVM_FOR_EACH_INSN(X)
+#undef X
+  };
+  (void) HANDLERS;
+#endif
+
+  // Verified code doesn't fall off the end of the method, so the instruction pointer needn't be checked
+#if BJVM_THREADED_DISPATCH
+#define DISPATCH() do { \
+    if constexpr (MODE == DispatchMode::Threaded) goto *HANDLERS[static_cast<int>(insn->m_code)]; \
+    else goto dispatch; \
+  } while (0)
+#else
+#define DISPATCH() goto dispatch
+#endif
+#define NEXT() do { ++insn; DISPATCH(); } while (0)
+// Counts the iterations of loops, which is every jump that isn't forward
+#define JUMP(target) do { \
+    const Insn* jump_target = code + (target); \
+    if (jump_target <= insn) \
+      ++backedges[jump_target - code]; \
+    insn = jump_target; \
+    DISPATCH(); \
+  } while (0)
+#define HANDLER(op) op_##op:
+
+  // Saves the registers to the frame, e.g. before calling
+#define SAVE(next_insn) do { \
+    frame->m_instruction_index = static_cast<int>((next_insn) - code); \
+    frame->m_stack_index = static_cast<int>(operands.Flush() - stack); \
+  } while (0)
+
+// Operands are read into a (and b), then replaced by the result. Longs and doubles take two entries.
+#define UNARY(op, From, from_slots, To, to_slots, expr) HANDLER(op) { \
+    From a = Load<From>(&operands[from_slots]); \
+    operands.Replace(from_slots, to_slots); \
+    Store<To>(&operands[to_slots], (expr)); \
+    NEXT(); \
+  }
+#define BINARY(op, T, slots, expr) HANDLER(op) { \
+    T b = Load<T>(&operands[slots]); \
+    T a = Load<T>(&operands[2 * (slots)]); \
+    operands.Replace(2 * (slots), slots); \
+    Store<T>(&operands[slots], (expr)); \
+    NEXT(); \
+  }
+// Like BINARY, but throws ArithmeticException with the operands still on the stack if the divisor is zero
+#define DIVIDE(op, T, slots, expr) HANDLER(op) { \
+    T b = Load<T>(&operands[slots]); \
+    if (b == 0) { \
+      SAVE(insn); \
+      throw std::runtime_error("ArithmeticException: / by zero"); \
+    } \
+    T a = Load<T>(&operands[2 * (slots)]); \
+    operands.Replace(2 * (slots), slots); \
+    Store<T>(&operands[slots], (expr)); \
+    NEXT(); \
+  }
+#define LONG_SHIFT(op, expr) HANDLER(op) { \
+    int32_t b = Load<int32_t>(&operands[1]); \
+    int64_t a = Load<int64_t>(&operands[3]); \
+    operands.Replace(3, 2); \
+    Store<int64_t>(&operands[2], (expr)); \
+    NEXT(); \
+  }
+#define COMPARE(op, T, slots, expr) HANDLER(op) { \
+    T b = Load<T>(&operands[slots]); \
+    T a = Load<T>(&operands[2 * (slots)]); \
+    operands.Replace(2 * (slots), 1); \
+    Store<int32_t>(&operands[1], (expr)); \
+    NEXT(); \
+  }
+#define IF(op, T, cond) HANDLER(op) { \
+    T a = Load<T>(&operands[1]); \
+    operands.Replace(1, 0); \
+    if (cond) \
+      JUMP(insn->m_data.index); \
+    NEXT(); \
+  }
+#define IF_COMPARE(op, T, cond) HANDLER(op) { \
+    T b = Load<T>(&operands[1]); \
+    T a = Load<T>(&operands[2]); \
+    operands.Replace(2, 0); \
+    if (cond) \
+      JUMP(insn->m_data.index); \
+    NEXT(); \
+  }
+// Push a value taking slots entries
+#define PUSH(T, slots, value) do { \
+    operands.Replace(0, slots); \
+    Store<T>(&operands[slots], (value)); \
+  } while (0)
+
+  // The first instruction goes through the switch whatever the mode
+  goto dispatch;
+
+dispatch:
+  switch (insn->m_code) {
+#define X(op) case InsnCode::op: goto op_##op;
+    BJVM_FOR_EACH_INSN(X)
+#undef X
+  }
+  throw std::runtime_error("Invalid instruction code " + std::to_string(static_cast<int>(insn->m_code)));
+
+  HANDLER(nop) {
+    NEXT();
+  }
+
+  // Constants
+
+  HANDLER(aconst_null) {
+    PUSH(void*, 1, nullptr);
+    NEXT();
+  }
+  HANDLER(iconst) {
+    PUSH(int32_t, 1, static_cast<int32_t>(insn->m_data.imm));
+    NEXT();
+  }
+  HANDLER(fconst) {
+    PUSH(float, 1, insn->m_data.f_imm);
+    NEXT();
+  }
+  HANDLER(lconst) {
+    PUSH(int64_t, 2, insn->m_data.imm);
+    NEXT();
+  }
+  HANDLER(dconst) {
+    PUSH(double, 2, insn->m_data.d_imm);
+    NEXT();
+  }
+  HANDLER(ldc) {
+    uint16_t index = insn->m_data.index;
+    switch (cp.GetTag(index)) {
+      case ConstantPoolTag::Integer:
+        PUSH(int32_t, 1, cp.GetUnchecked<EntryInteger>(index).m_value);
+        break;
+      case ConstantPoolTag::Float:
+        PUSH(float, 1, cp.GetUnchecked<EntryFloat>(index).m_value);
+        break;
+      default:
+        // Strings, classes, method types and method handles are objects
+        goto unimplemented;
+    }
+    NEXT();
+  }
+  HANDLER(ldc2_w) {
+    uint16_t index = insn->m_data.index;
+    if (cp.GetTag(index) == ConstantPoolTag::Long)
+      PUSH(int64_t, 2, cp.GetUnchecked<EntryLong>(index).m_value);
+    else
+      PUSH(double, 2, cp.GetUnchecked<EntryDouble>(index).value);
+    NEXT();
+  }
+
+  // Locals
+
+  HANDLER(iload) HANDLER(fload) HANDLER(aload) {
+    PUSH(FrameEntry, 1, locals[insn->m_data.index]);
+    NEXT();
+  }
+  HANDLER(lload) HANDLER(dload) {
+    PUSH(FrameEntry, 2, locals[insn->m_data.index]);
+    NEXT();
+  }
+  HANDLER(istore) HANDLER(fstore) HANDLER(astore) {
+    locals[insn->m_data.index] = operands[1];
+    operands.Replace(1, 0);
+    NEXT();
+  }
+  HANDLER(lstore) HANDLER(dstore) {
+    locals[insn->m_data.index] = operands[2];
+    operands.Replace(2, 0);
+    NEXT();
+  }
+  HANDLER(iinc) {
+    IIncData iinc = insn->m_data.iinc;
+    Store<int32_t>(locals + iinc.m_index, WrappingAdd<int32_t>(Load<int32_t>(locals + iinc.m_index), iinc.m_const));
+    NEXT();
+  }
+
+  // Operand stack manipulation, which only moves whole entries around
+
+  HANDLER(pop) {
+    operands.Replace(1, 0);
+    NEXT();
+  }
+  HANDLER(pop2) {
+    operands.Replace(2, 0);
+    NEXT();
+  }
+  HANDLER(dup) {
+    FrameEntry v1 = operands[1];
+    operands.Replace(0, 1);
+    operands[1] = v1;
+    NEXT();
+  }
+  HANDLER(dup_x1) {
+    // ..., v2, v1 -> ..., v1, v2, v1
+    FrameEntry v1 = operands[1], v2 = operands[2];
+    operands.Replace(0, 1);
+    operands[1] = v1;
+    operands[2] = v2;
+    operands[3] = v1;
+    NEXT();
+  }
+  HANDLER(dup_x2) {
+    // ..., v3, v2, v1 -> ..., v1, v3, v2, v1
+    FrameEntry v1 = operands[1], v2 = operands[2], v3 = operands[3];
+    operands.Replace(0, 1);
+    operands[1] = v1;
+    operands[2] = v2;
+    operands[3] = v3;
+    operands[4] = v1;
+    NEXT();
+  }
+  HANDLER(dup2) {
+    // ..., v2, v1 -> ..., v2, v1, v2, v1
+    FrameEntry v1 = operands[1], v2 = operands[2];
+    operands.Replace(0, 2);
+    operands[1] = v1;
+    operands[2] = v2;
+    NEXT();
+  }
+  HANDLER(dup2_x1) {
+    // ..., v3, v2, v1 -> ..., v2, v1, v3, v2, v1
+    FrameEntry v1 = operands[1], v2 = operands[2], v3 = operands[3];
+    operands.Replace(0, 2);
+    operands[1] = v1;
+    operands[2] = v2;
+    operands[3] = v3;
+    operands[4] = v1;
+    operands[5] = v2;
+    NEXT();
+  }
+  HANDLER(dup2_x2) {
+    // ..., v4, v3, v2, v1 -> ..., v2, v1, v4, v3, v2, v1
+    FrameEntry v1 = operands[1], v2 = operands[2], v3 = operands[3], v4 = operands[4];
+    operands.Replace(0, 2);
+    operands[1] = v1;
+    operands[2] = v2;
+    operands[3] = v3;
+    operands[4] = v4;
+    operands[5] = v1;
+    operands[6] = v2;
+    NEXT();
+  }
+  HANDLER(swap) {
+    std::swap(operands[1], operands[2]);
+    NEXT();
+  }
+
+  // Arithmetic
+
+  BINARY(iadd, int32_t, 1, WrappingAdd(a, b))
+  BINARY(isub, int32_t, 1, WrappingSub(a, b))
+  BINARY(imul, int32_t, 1, WrappingMul(a, b))
+  DIVIDE(idiv, int32_t, 1, Divide(a, b))
+  DIVIDE(irem, int32_t, 1, Remainder(a, b))
+  BINARY(iand, int32_t, 1, a & b)
+  BINARY(ior, int32_t, 1, a | b)
+  BINARY(ixor, int32_t, 1, a ^ b)
+  BINARY(ishl, int32_t, 1, ShiftLeft(a, b))
+  BINARY(ishr, int32_t, 1, ShiftRight(a, b))
+  BINARY(iushr, int32_t, 1, UnsignedShiftRight(a, b))
+  UNARY(ineg, int32_t, 1, int32_t, 1, WrappingNeg(a))
+
+  BINARY(ladd, int64_t, 2, WrappingAdd(a, b))
+  BINARY(lsub, int64_t, 2, WrappingSub(a, b))
+  BINARY(lmul, int64_t, 2, WrappingMul(a, b))
+  DIVIDE(ldiv, int64_t, 2, Divide(a, b))
+  DIVIDE(lrem, int64_t, 2, Remainder(a, b))
+  BINARY(land, int64_t, 2, a & b)
+  BINARY(lor, int64_t, 2, a | b)
+  BINARY(lxor, int64_t, 2, a ^ b)
+  LONG_SHIFT(lshl, ShiftLeft(a, b))
+  LONG_SHIFT(lshr, ShiftRight(a, b))
+  LONG_SHIFT(lushr, UnsignedShiftRight(a, b))
+  UNARY(lneg, int64_t, 2, int64_t, 2, WrappingNeg(a))
+
+  BINARY(fadd, float, 1, a + b)
+  BINARY(fsub, float, 1, a - b)
+  BINARY(fmul, float, 1, a * b)
+  BINARY(fdiv, float, 1, a / b)
+  BINARY(frem, float, 1, std::fmod(a, b))
+  UNARY(fneg, float, 1, float, 1, -a)
+
+  BINARY(dadd, double, 2, a + b)
+  BINARY(dsub, double, 2, a - b)
+  BINARY(dmul, double, 2, a * b)
+  BINARY(ddiv, double, 2, a / b)
+  BINARY(drem, double, 2, std::fmod(a, b))
+  UNARY(dneg, double, 2, double, 2, -a)
+
+  // Conversions
+
+  UNARY(i2l, int32_t, 1, int64_t, 2, a)
+  UNARY(i2f, int32_t, 1, float, 1, static_cast<float>(a))
+  UNARY(i2d, int32_t, 1, double, 2, a)
+  UNARY(i2b, int32_t, 1, int32_t, 1, static_cast<int8_t>(a))
+  UNARY(i2c, int32_t, 1, int32_t, 1, static_cast<uint16_t>(a))
+  UNARY(i2s, int32_t, 1, int32_t, 1, static_cast<int16_t>(a))
+  UNARY(l2i, int64_t, 2, int32_t, 1, static_cast<int32_t>(a))
+  UNARY(l2f, int64_t, 2, float, 1, static_cast<float>(a))
+  UNARY(l2d, int64_t, 2, double, 2, static_cast<double>(a))
+  UNARY(f2i, float, 1, int32_t, 1, FloatToInteger<int32_t>(a))
+  UNARY(f2l, float, 1, int64_t, 2, FloatToInteger<int64_t>(a))
+  UNARY(f2d, float, 1, double, 2, a)
+  UNARY(d2i, double, 2, int32_t, 1, FloatToInteger<int32_t>(a))
+  UNARY(d2l, double, 2, int64_t, 2, FloatToInteger<int64_t>(a))
+  UNARY(d2f, double, 2, float, 1, static_cast<float>(a))
+
+  // Comparisons and branches
+
+  COMPARE(lcmp, int64_t, 2, a < b ? -1 : a > b)
+  COMPARE(fcmpl, float, 1, CompareFloating(a, b, -1))
+  COMPARE(fcmpg, float, 1, CompareFloating(a, b, 1))
+  COMPARE(dcmpl, double, 2, CompareFloating(a, b, -1))
+  COMPARE(dcmpg, double, 2, CompareFloating(a, b, 1))
+
+  IF(ifeq, int32_t, a == 0)
+  IF(ifne, int32_t, a != 0)
+  IF(iflt, int32_t, a < 0)
+  IF(ifge, int32_t, a >= 0)
+  IF(ifgt, int32_t, a > 0)
+  IF(ifle, int32_t, a <= 0)
+  IF(ifnull, void*, a == nullptr)
+  IF(ifnonnull, void*, a != nullptr)
+
+  IF_COMPARE(if_icmpeq, int32_t, a == b)
+  IF_COMPARE(if_icmpne, int32_t, a != b)
+  IF_COMPARE(if_icmplt, int32_t, a < b)
+  IF_COMPARE(if_icmpge, int32_t, a >= b)
+  IF_COMPARE(if_icmpgt, int32_t, a > b)
+  IF_COMPARE(if_icmple, int32_t, a <= b)
+  IF_COMPARE(if_acmpeq, void*, a == b)
+  IF_COMPARE(if_acmpne, void*, a != b)
+
+  HANDLER(goto_) {
+    JUMP(insn->m_data.index);
+  }
+  HANDLER(tableswitch) {
+    const TableswitchData* table = insn->m_data.ts;
+    int64_t key = Load<int32_t>(&operands[1]);
+    operands.Replace(1, 0);
+    JUMP(key < table->m_low || key > table->m_high ? table->m_default_target : table->m_targets[key - table->m_low]);
+  }
+  HANDLER(lookupswitch) {
+    // Keys are sorted (JVMS 4.10.1.9)
+    const LookupswitchData* lookup = insn->m_data.ls;
+    int32_t key = Load<int32_t>(&operands[1]);
+    operands.Replace(1, 0);
+    auto it = std::lower_bound(lookup->m_keys.begin(), lookup->m_keys.end(), key);
+    JUMP(it != lookup->m_keys.end() && *it == key ? lookup->m_targets[it - lookup->m_keys.begin()]
+                                                  : lookup->m_default_target);
+  }
+
+  // Static fields
+
+  HANDLER(getstatic) HANDLER(putstatic) {
+    // Resolved when the class was linked
+    const FieldInfo* field = cp.GetUnchecked<EntryFieldRef>(insn->m_data.index).m_field_info;
+    if (!field->IsStatic())
+      throw std::runtime_error(std::string("IncompatibleClassChangeError: ") + CodeName(insn->m_code)
+                               + " of an instance field");
+    // The quick forms don't check that the class is initialised (5.5), so it must be before quickening
+    SAVE(insn);
+    if (!field->m_class->InitClass(m_vm))
+      throw std::runtime_error("NoClassDefFoundError: Could not initialize class "
+                               + field->m_class->GetClassfile()->GetName());
+
+    bool wide = IsWide(field->m_class->GetClassfile()->m_cp.GetUtf8(field->m_descriptor_index));
+    InsnCode quick = insn->m_code == InsnCode::getstatic
+      ? (wide ? InsnCode::getstatic2_quick : InsnCode::getstatic_quick)
+      : (wide ? InsnCode::putstatic2_quick : InsnCode::putstatic_quick);
+    Quicken(insn, quick, { .static_slot = field->m_class->GetStaticSlot(field) });
+    DISPATCH();
+  }
+  HANDLER(getstatic_quick) {
+    PUSH(FrameEntry, 1, *insn->m_data.static_slot);
+    NEXT();
+  }
+  HANDLER(getstatic2_quick) {
+    PUSH(FrameEntry, 2, *insn->m_data.static_slot);
+    NEXT();
+  }
+  HANDLER(putstatic_quick) {
+    *insn->m_data.static_slot = operands[1];
+    operands.Replace(1, 0);
+    NEXT();
+  }
+  HANDLER(putstatic2_quick) {
+    *insn->m_data.static_slot = operands[2];
+    operands.Replace(2, 0);
+    NEXT();
+  }
+
+  // Calls and returns
+
+  HANDLER(invokestatic) {
+    const MethodInfo* method = ResolvedMethod(cp, insn->m_data.index);
+    // As for getstatic, the class is initialised before the instruction is quickened
+    SAVE(insn);
+    if (!method->m_class->InitClass(m_vm))
+      throw std::runtime_error("NoClassDefFoundError: Could not initialize class "
+                               + method->m_class->GetClassfile()->GetName());
+
+    Quicken(insn, InsnCode::invokestatic_quick, { .method = method });
+    DISPATCH();
+  }
+  HANDLER(invokestatic_quick) {
+    const MethodInfo* method = insn->m_data.method;
+
+    // The arguments become the callee's first locals where they are
+    FrameEntry* args = operands.Flush() - method->m_argument_slots;
+    operands.Replace(method->m_argument_slots, 0);
+    SAVE(insn + 1);
+
+    PushFrameAt(method, args);
+    return true;
+  }
+  HANDLER(invokevirtual) HANDLER(invokeinterface) {
+    const MethodInfo* method = ResolvedMethod(cp, insn->m_code == InsnCode::invokevirtual ? insn->m_data.index
+                                                                                          : insn->m_data.ii.m_index);
+    if (method->IsStatic())
+      throw std::runtime_error(std::string("IncompatibleClassChangeError: ") + CodeName(insn->m_code)
+                               + " of a static method");
+
+    // Each call site gets its own cache, which lives as long as the code
+    auto* cache = frame->m_method->m_code->m_decoder->New<InlineCache>(method);
+    InsnCode quick = insn->m_code == InsnCode::invokevirtual ? InsnCode::invokevirtual_quick
+                                                              : InsnCode::invokeinterface_quick;
+    Quicken(insn, quick, { .cache = cache });
+    DISPATCH();
+  }
+  HANDLER(invokevirtual_quick) HANDLER(invokeinterface_quick) {
+    InlineCache* cache = insn->m_data.cache;
+    int slots = cache->GetResolved()->m_argument_slots;
+
+    // The receiver is the first argument
+    FrameEntry* args = operands.Flush() - slots;
+    auto* receiver = Load<const HeapObject*>(args);
+    if (!receiver) {
+      SAVE(insn);
+      throw std::runtime_error("NullPointerException");
+    }
+    const MethodInfo* method = cache->Lookup(receiver->GetClass());
+
+    operands.Replace(slots, 0);
+    SAVE(insn + 1);
+    PushFrameAt(method, args);
+    return true;
+  }
+  HANDLER(ireturn) HANDLER(freturn) HANDLER(areturn) {
+    return Return(operands[1], 1);
+  }
+  HANDLER(lreturn) HANDLER(dreturn) {
+    return Return(operands[2], 2);
+  }
+  HANDLER(return_) {
+    return Return(0, 0);
+  }
+
+  // Superinstructions (see superinstructions.h). insn is the first instruction of the fused sequence, and the rest of
+  // the sequence follows it, supplying the other operands.
+
+  HANDLER(iload_iload_iadd_istore) {
+    int32_t a = Load<int32_t>(locals + insn[0].m_data.index);
+    int32_t b = Load<int32_t>(locals + insn[1].m_data.index);
+    Store<int32_t>(locals + insn[3].m_data.index, WrappingAdd(a, b));
+    insn += 4;
+    DISPATCH();
+  }
+  HANDLER(iload_iload_if_icmpge) {
+    if (Load<int32_t>(locals + insn[0].m_data.index) >= Load<int32_t>(locals + insn[1].m_data.index))
+      JUMP(insn[2].m_data.index);
+    insn += 3;
+    DISPATCH();
+  }
+  HANDLER(iload_iload_if_icmplt) {
+    if (Load<int32_t>(locals + insn[0].m_data.index) < Load<int32_t>(locals + insn[1].m_data.index))
+      JUMP(insn[2].m_data.index);
+    insn += 3;
+    DISPATCH();
+  }
+  HANDLER(iload_iload) HANDLER(aload_aload) {
+    operands.Replace(0, 2);
+    operands[2] = locals[insn[0].m_data.index];
+    operands[1] = locals[insn[1].m_data.index];
+    insn += 2;
+    DISPATCH();
+  }
+  HANDLER(iinc_goto) {
+    IIncData iinc = insn->m_data.iinc;
+    Store<int32_t>(locals + iinc.m_index, WrappingAdd<int32_t>(Load<int32_t>(locals + iinc.m_index), iinc.m_const));
+    JUMP(insn[1].m_data.index);
+  }
+  HANDLER(iload_ireturn) {
+    return Return(locals[insn->m_data.index], 1);
+  }
+
+  // Everything else needs objects, or (jsr and ret) isn't supported
+
+  HANDLER(aaload) HANDLER(aastore) HANDLER(arraylength) HANDLER(athrow) HANDLER(baload) HANDLER(bastore)
+  HANDLER(caload) HANDLER(castore) HANDLER(daload) HANDLER(dastore) HANDLER(faload) HANDLER(fastore) HANDLER(iaload)
+  HANDLER(iastore) HANDLER(laload) HANDLER(lastore) HANDLER(saload) HANDLER(sastore) HANDLER(monitorenter)
+  HANDLER(monitorexit) HANDLER(anewarray) HANDLER(checkcast) HANDLER(getfield) HANDLER(instanceof)
+  HANDLER(invokedynamic) HANDLER(new_) HANDLER(putfield) HANDLER(invokespecial) HANDLER(multianewarray)
+  HANDLER(newarray) HANDLER(jsr) HANDLER(ret)
+  unimplemented:
+    SAVE(insn);
+    throw std::runtime_error(std::string("Unimplemented instruction: ") + CodeName(insn->m_code));
+
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef HANDLER
+#undef UNARY
+#undef BINARY
+#undef DIVIDE
+#undef LONG_SHIFT
+#undef COMPARE
+#undef IF
+#undef IF_COMPARE
+#undef PUSH
+#undef SAVE
+}
+
+} // bjvm
@@ -8,16 +8,107 @@
 #include "classfile.h"
 #include "execution_frame.h"
 
+// Labels as values (computed goto) are a GCC extension, also supported by Clang. Define BJVM_NO_THREADED_DISPATCH to
+// build only the portable switch loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(BJVM_NO_THREADED_DISPATCH)
+#define BJVM_THREADED_DISPATCH 1
+#else
+#define BJVM_THREADED_DISPATCH 0
+#endif
+
 namespace bjvm {
 class VM;
 
+/**
+ * How the interpreter gets from one instruction to the next.
+ */
+enum class DispatchMode {
+  // Every handler ends with its own indirect jump through a table of label addresses (computed goto), so the branch
+  // predictor sees one jump per opcode rather than one for the whole loop. Only available if BJVM_THREADED_DISPATCH.
+  Threaded,
+  // A switch statement, which every handler jumps back to
+  Switch
+};
+
+/**
+ * Where the interpreter keeps the operand stack.
+ */
+enum class StackCaching {
+  // Every entry lives in the frame
+  None,
+  // The top entry lives in a local of the dispatch loop, and so usually a register. It is only written to the frame
+  // when something is pushed on top of it or the frame stops running, so that e.g. iadd reads one operand from memory
+  // rather than two, and writes nothing.
+  TopOfStack
+};
+
+/**
+ * Interprets the decoded instruction stream (CodeAttribute::m_code) of one thread.
+ *
+ * The running frame's instruction pointer, operand stack pointer and locals (and with StackCaching::TopOfStack, the top
+ * of its operand stack) live in local variables of the dispatch loop, so the compiler can keep them in registers; they
+ * are only written back to the frame when it calls or returns.
+ *
+ * Calls and loop iterations are counted in the MethodProfile of the method they're in.
+ *
+ * Instructions are quickened, and inline caches updated, in code shared by every thread without synchronisation, as
+ * Java code is only interpreted on one thread so far. Interpreting on several will need the instruction code to be
+ * published with release and read with acquire semantics.
+ */
 class BytecodeInterpreter {
   VM* m_vm;
+  DispatchMode m_dispatch_mode;
+  StackCaching m_stack_caching;
+
+  FrameStack m_frames;
+
+  FrameEntry m_return_value = 0;
+
+  template <DispatchMode MODE, StackCaching CACHING>
+  bool Run();
 
-  std::vector<ExecutionFrame> m_frames;
+  template <DispatchMode MODE>
+  bool Run(StackCaching caching);
+
+  /** Push a frame calling the given method, whose arguments are already in place as its first locals. */
+  void PushFrameAt(const classfile::MethodInfo* method, FrameEntry* locals);
+
+  /**
+   * Rewrite an instruction in place into its quick form, once what it refers to has been resolved and its class
+   * initialised. Not synchronised (see the class comment).
+   */
+  static void Quicken(const classfile::Insn* insn, classfile::InsnCode code, decltype(classfile::Insn::m_data) data);
+
+  /** Pop the innermost frame, passing its return value (slots entries; 0, 1 or 2) to the caller if there is one. */
+  bool Return(FrameEntry value, int slots);
 
 public:
+  static constexpr DispatchMode DEFAULT_DISPATCH_MODE = BJVM_THREADED_DISPATCH ? DispatchMode::Threaded
+                                                                               : DispatchMode::Switch;
+
+  explicit BytecodeInterpreter(VM* vm, DispatchMode dispatch_mode = DEFAULT_DISPATCH_MODE,
+                               StackCaching stack_caching = StackCaching::None);
+
+  /**
+   * Push a frame calling the given method, which must have code. args holds method->m_argument_slots entries: the
+   * receiver if there is one, then the arguments, with longs and doubles taking two.
+   */
+  void PushFrame(const classfile::MethodInfo* method, const FrameEntry* args);
+
+  /**
+   * Run the innermost frame until it calls another method, returns, or throws. Returns false once the outermost frame
+   * has returned, after which its return value is available from GetReturnValue.
+   *
+   * Only instructions which don't touch the heap (besides reading the class of a virtual call's receiver) are
+   * implemented so far; the others throw std::runtime_error, as do Java exceptions (e.g. ArithmeticException), leaving
+   * the interpreter unusable.
+   */
   bool step();
+
+  /** The value returned by the outermost frame: an int, float, long or double in its low bytes, as in a frame. */
+  FrameEntry GetReturnValue() const {
+    return m_return_value;
+  }
 };
 
 } // bjvm
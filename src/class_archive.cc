@@ -0,0 +1,371 @@
+//
+// Created by Cowpox on 8/14/24.
+//
+
+#include "class_archive.h"
+
+#include <cstring>
+#include <filesystem>
+#include <type_traits>
+
+
+namespace bjvm {
+
+using namespace classfile;
+
+// Bump whenever the serialized form of a Classfile changes, including the numbering of InsnCode
+constexpr uint32_t ARCHIVE_VERSION = 8;
+constexpr char ARCHIVE_MAGIC[8] = "BJVMCDS";
+
+// Records are raw copies of these structures, so archives can only be shared between builds which agree on their layout
+constexpr uint32_t LAYOUT_FINGERPRINT = sizeof(Insn) | sizeof(void*) << 8 | sizeof(long) << 16;
+
+struct ArchiveHeader {
+  char m_magic[8];
+  uint32_t m_version;
+  uint32_t m_layout;
+  uint16_t m_endianness;
+  uint64_t m_class_count;
+  uint64_t m_directory_offset;
+};
+
+static_assert(std::is_trivially_copyable_v<Insn>);
+static_assert(std::is_trivially_copyable_v<ExceptionTableEntry>);
+static_assert(std::is_trivially_copyable_v<LineNumberTableEntry>);
+
+
+void ClassArchive::Serialize(const Classfile &cf, std::vector<uint8_t> &out) {
+  ArchiveWriter w { out };
+
+  w.Put(cf.m_version);
+  w.Put<uint8_t>(cf.m_digest.has_value());
+  if (cf.m_digest)
+    w.Put(*cf.m_digest);
+  w.Put(cf.m_access_flags);
+  w.Put(cf.m_this_class);
+  w.Put(cf.m_super_class);
+  w.PutAlignedArray(cf.m_interfaces);
+
+  // The constant pool's arrays, minus any resolution state, followed by the string of each UTF-8 entry in place of the
+  // address of its symbol
+  const ConstantPool& cp = cf.m_cp;
+  std::vector<uint64_t> payloads = cp.m_payloads;
+  for (size_t i = 0; i < payloads.size(); ++i) {
+    if (cp.m_tags[i] == ConstantPoolTag::Utf8)
+      payloads[i] = 0;
+  }
+  w.PutArray(cp.m_tags);
+  w.PutArray(payloads);
+  w.Put<uint32_t>(cp.m_resolved.size());
+  for (int i = 1; i < cp.Size(); ++i) {
+    if (cp.m_tags[i] == ConstantPoolTag::Utf8)
+      w.PutString(cp.GetUtf8(i));
+  }
+
+  w.Put<uint32_t>(cf.m_fields.size());
+  for (const auto& field : cf.m_fields) {
+    w.Put(field.m_access_flags);
+    w.Put(field.m_name_index);
+    w.Put(field.m_descriptor_index);
+    w.Put<uint8_t>(field.m_constant_value.has_value());
+    if (field.m_constant_value)
+      w.Put(field.m_constant_value->m_index);
+  }
+
+  w.Put<uint32_t>(cf.m_methods.size());
+  for (const auto& method : cf.m_methods) {
+    w.Put(method.m_access_flags);
+    w.Put(method.m_name_index);
+    w.Put(method.m_descriptor_index);
+    w.Put<uint8_t>(method.HasCode());
+    if (method.HasCode())
+      SerializeCode(method, w);
+  }
+
+  w.Put<uint8_t>(cf.m_bootstrap_methods.has_value());
+  if (cf.m_bootstrap_methods) {
+    w.Put<uint32_t>(cf.m_bootstrap_methods->m_methods.size());
+    for (const auto& method : cf.m_bootstrap_methods->m_methods) {
+      w.Put(method.m_method_ref);
+      w.PutAlignedArray(method.m_arguments);
+    }
+  }
+}
+
+void ClassArchive::SerializeCode(const MethodInfo &method, ArchiveWriter &w) {
+  // The raw attribute, which the verifier reads
+  const auto& raw = method.m_code->m_raw;
+  w.PutAlignedArray(raw.m_bytes);
+  w.Put(raw.m_line_number_table);
+  w.Put(raw.m_stack_map_table);
+  w.Put(raw.m_stack_map_table_length);
+
+  const CodeAttribute* code = method.GetCode();
+  w.Put(code->m_max_stack);
+  w.Put(code->m_max_locals);
+
+  // Switch instructions point at their tables, so they're archived with the index of their table instead. Instructions
+  // are copied member by member so that their padding is zero, and the archive the same every time it's written.
+  std::vector<const TableswitchData*> tableswitches;
+  std::vector<const LookupswitchData*> lookupswitches;
+  std::vector<Insn> insns(code->m_code.size());
+  for (size_t i = 0; i < insns.size(); ++i) {
+    const Insn& insn = code->m_code[i];
+    std::memset(static_cast<void*>(&insns[i]), 0, sizeof(Insn));
+    insns[i].m_data = insn.m_data;
+    insns[i].m_code = insn.m_code;
+    insns[i].m_pc = insn.m_pc;
+    if (insn.m_code == InsnCode::tableswitch) {
+      insns[i].m_data.imm = static_cast<long>(tableswitches.size());
+      tableswitches.push_back(insn.m_data.ts);
+    } else if (insn.m_code == InsnCode::lookupswitch) {
+      insns[i].m_data.imm = static_cast<long>(lookupswitches.size());
+      lookupswitches.push_back(insn.m_data.ls);
+    }
+  }
+
+  w.Put<uint32_t>(tableswitches.size());
+  for (const auto* table : tableswitches) {
+    w.Put(table->m_default_target);
+    w.PutAlignedArray(table->m_targets);
+    w.Put(table->m_low);
+    w.Put(table->m_high);
+  }
+  w.Put<uint32_t>(lookupswitches.size());
+  for (const auto* table : lookupswitches) {
+    w.Put(table->m_default_target);
+    w.PutAlignedArray(table->m_targets);
+    w.PutAlignedArray(table->m_keys);
+  }
+
+  w.PutAlignedArray(insns);
+  w.PutAlignedArray(code->m_exception_table.m_exceptions);
+  w.PutAlignedArray(code->m_exceptions);
+  w.Put<uint8_t>(code->m_line_number_table.has_value());
+  if (code->m_line_number_table)
+    w.PutAlignedArray(code->m_line_number_table->m_entries);
+}
+
+Classfile ClassArchive::Deserialize(const Record& record, Arena* arena) const {
+  const uint8_t* origin = m_file.Bytes().data();
+  ArchiveReader r { { origin + record.m_offset, record.m_size }, origin };
+
+  auto version = r.Get<ClassfileVersion>();
+  std::optional<Sha256Digest> digest;
+  if (r.Get<uint8_t>())
+    digest = r.Get<Sha256Digest>();
+  auto access_flags = r.Get<AccessFlags>();
+  auto this_class = r.Get<uint16_t>();
+  auto super_class = r.Get<uint16_t>();
+  auto interfaces = r.ViewArray<uint16_t>();
+
+  // Copied, as resolving entries writes to the pool
+  auto cp_size = r.Get<uint32_t>();
+  ConstantPool cp { static_cast<int>(cp_size) };
+  r.GetInto(cp.m_tags.data(), cp_size);
+  if (r.Get<uint32_t>() != cp_size)
+    throw std::runtime_error("Corrupt constant pool in class archive");
+  r.GetInto(cp.m_payloads.data(), cp_size);
+  cp.m_resolved.resize(r.Get<uint32_t>());
+  for (size_t i = 0; i < cp_size; ++i) {
+    switch (cp.m_tags[i]) {
+      case ConstantPoolTag::Utf8:
+        cp.m_payloads[i] = reinterpret_cast<uintptr_t>(Intern(r.GetStringView()));
+        break;
+      case ConstantPoolTag::Class:
+      case ConstantPoolTag::String:
+      case ConstantPoolTag::FieldRef:
+      case ConstantPoolTag::MethodRef:
+      case ConstantPoolTag::InterfaceMethodRef:
+        if ((cp.m_payloads[i] >> 32) >= cp.m_resolved.size())
+          throw std::runtime_error("Corrupt constant pool in class archive");
+        break;
+      case ConstantPoolTag::Invalid:
+      case ConstantPoolTag::Integer:
+      case ConstantPoolTag::Float:
+      case ConstantPoolTag::Long:
+      case ConstantPoolTag::Double:
+      case ConstantPoolTag::NameAndType:
+      case ConstantPoolTag::MethodHandle:
+      case ConstantPoolTag::MethodType:
+      case ConstantPoolTag::InvokeDynamic:
+        break;
+      default:
+        throw std::runtime_error("Corrupt constant pool in class archive");
+    }
+  }
+
+  auto fields = arena->NewArray<FieldInfo>(r.Get<uint32_t>());
+  for (auto& field : fields) {
+    field.m_access_flags = r.Get<FieldAccessFlags>();
+    field.m_name_index = r.Get<uint16_t>();
+    field.m_descriptor_index = r.Get<uint16_t>();
+    if (r.Get<uint8_t>())
+      field.m_constant_value = ConstantValueAttribute { .m_index = r.Get<uint16_t>() };
+  }
+
+  auto* decoder = arena->New<CodeDecoder>();
+  auto methods = arena->NewArray<MethodInfo>(r.Get<uint32_t>());
+  for (auto& method : methods) {
+    method.m_access_flags = r.Get<MethodAccessFlags>();
+    method.m_name_index = r.Get<uint16_t>();
+    method.m_descriptor_index = r.Get<uint16_t>();
+    if (r.Get<uint8_t>())
+      method.m_code = DeserializeCode(r, decoder, arena);
+  }
+
+  std::optional<BootstrapMethodsAttribute> bootstrap;
+  if (r.Get<uint8_t>()) {
+    bootstrap = BootstrapMethodsAttribute { arena->NewArray<BootstrapMethod>(r.Get<uint32_t>()) };
+    for (auto& method : bootstrap->m_methods) {
+      method.m_method_ref = r.Get<uint16_t>();
+      method.m_arguments = r.ViewArray<uint16_t>();
+    }
+  }
+
+  Classfile cf { std::move(cp) };
+
+  cf.m_version = version;
+  cf.m_digest = digest;
+  cf.m_access_flags = access_flags;
+  cf.m_this_class = this_class;
+  cf.m_super_class = super_class;
+  cf.m_interfaces = interfaces;
+  cf.m_fields = fields;
+  cf.m_methods = methods;
+  cf.m_bootstrap_methods = bootstrap;
+
+  return cf;
+}
+
+LazyCode * ClassArchive::DeserializeCode(ArchiveReader &r, CodeDecoder *decoder, Arena *arena) const {
+  RawCodeAttribute raw;
+  raw.m_bytes = r.ViewArray<uint8_t>();
+  raw.m_line_number_table = r.Get<uint32_t>();
+  raw.m_stack_map_table = r.Get<uint32_t>();
+  raw.m_stack_map_table_length = r.Get<uint32_t>();
+  if (raw.m_line_number_table >= raw.m_bytes.size() || raw.m_stack_map_table >= raw.m_bytes.size()
+      || raw.m_stack_map_table_length > raw.m_bytes.size() - raw.m_stack_map_table)
+    throw std::runtime_error("Corrupt code attribute in class archive");
+
+  CodeAttribute code {};
+  code.m_max_stack = r.Get<uint16_t>();
+  code.m_max_locals = r.Get<uint16_t>();
+
+  auto tableswitches = arena->NewArray<TableswitchData>(r.Get<uint32_t>());
+  for (auto& table : tableswitches) {
+    table.m_default_target = r.Get<int>();
+    table.m_targets = r.ViewArray<int>();
+    table.m_low = r.Get<int>();
+    table.m_high = r.Get<int>();
+  }
+  auto lookupswitches = arena->NewArray<LookupswitchData>(r.Get<uint32_t>());
+  for (auto& table : lookupswitches) {
+    table.m_default_target = r.Get<int>();
+    table.m_targets = r.ViewArray<int>();
+    table.m_keys = r.ViewArray<int>();
+  }
+
+  // Only code with switches needs a copy of its own, to point them at their tables
+  code.m_code = r.ViewArray<Insn>();
+  if (!tableswitches.empty() || !lookupswitches.empty()) {
+    code.m_code = arena->CopyArray(code.m_code.data(), code.m_code.size());
+    for (auto& insn : code.m_code) {
+      if (insn.m_code == InsnCode::tableswitch)
+        insn.m_data.ts = &tableswitches.at(static_cast<size_t>(insn.m_data.imm));
+      else if (insn.m_code == InsnCode::lookupswitch)
+        insn.m_data.ls = &lookupswitches.at(static_cast<size_t>(insn.m_data.imm));
+    }
+  }
+
+  code.m_exception_table = { r.ViewArray<ExceptionTableEntry>() };
+  code.m_exceptions = r.ViewArray<uint16_t>();
+  if (r.Get<uint8_t>())
+    code.m_line_number_table = LineNumberTable { r.ViewArray<LineNumberTableEntry>() };
+
+  // Already decoded, so GetCode needn't
+  auto* lazy = arena->New<LazyCode>(raw, decoder);
+  lazy->m_decoded.store(arena->New<CodeAttribute>(code), std::memory_order_relaxed);
+  return lazy;
+}
+
+ClassArchive::ClassArchive(MappedFile &&file) : m_file(std::move(file)) {
+  ArchiveReader r { m_file.Bytes() };
+
+  auto header = r.Get<ArchiveHeader>();
+  if (std::memcmp(header.m_magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0)
+    throw std::runtime_error("Not a class archive");
+  if (header.m_version != ARCHIVE_VERSION || header.m_layout != LAYOUT_FINGERPRINT || header.m_endianness != 1)
+    throw std::runtime_error("Class archive was written by an incompatible build");
+  if (header.m_directory_offset > m_file.Size())
+    throw std::runtime_error("Truncated class archive");
+
+  ArchiveReader directory { { m_file.Bytes().data() + header.m_directory_offset,
+                              m_file.Size() - header.m_directory_offset } };
+  m_records.reserve(header.m_class_count);
+  for (uint64_t i = 0; i < header.m_class_count; ++i) {
+    std::string_view name = directory.GetStringView();
+    auto record = directory.Get<Record>();
+    if (record.m_offset > m_file.Size() || record.m_size > m_file.Size() - record.m_offset)
+      throw std::runtime_error("Corrupt class archive directory");
+    m_records.emplace(name, record);
+  }
+}
+
+std::unique_ptr<ClassArchive> ClassArchive::Open(const std::string &path) {
+  if (!std::filesystem::exists(path)) {
+    BJVM_DEBUG("Class archive not found: " + path);
+    return nullptr;
+  }
+
+  try {
+    return std::unique_ptr<ClassArchive>(new ClassArchive(MappedFile { path }));
+  } catch (std::exception& e) {
+    BJVM_DEBUG("Ignoring class archive " + path + ": " + e.what());
+    return nullptr;
+  }
+}
+
+void ClassArchive::Write(const std::string &path, const std::vector<Entry> &classes) {
+  std::vector<uint8_t> out(sizeof(ArchiveHeader));
+  std::vector<uint8_t> directory_bytes;
+  ArchiveWriter directory { directory_bytes };
+
+  for (const auto& entry : classes) {
+    Record record { entry.m_crc32, entry.m_length, out.size(), 0 };
+    Serialize(*entry.m_classfile, out);
+    record.m_size = out.size() - record.m_offset;
+
+    directory.PutString(entry.m_name);
+    directory.Put(record);
+  }
+
+  ArchiveHeader header {};
+  std::memcpy(header.m_magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+  header.m_version = ARCHIVE_VERSION;
+  header.m_layout = LAYOUT_FINGERPRINT;
+  header.m_endianness = 1;  // reads back as 0x0100 on a machine of the other endianness
+  header.m_class_count = classes.size();
+  header.m_directory_offset = out.size();
+  std::memcpy(out.data(), &header, sizeof(header));
+
+  out.insert(out.end(), directory_bytes.begin(), directory_bytes.end());
+  WriteFile(path, { out.data(), out.size() });
+}
+
+Classfile * ClassArchive::Load(std::string_view class_name, uint32_t crc32, uint32_t length, Arena* arena) const {
+  auto it = m_records.find(class_name);
+  if (it == m_records.end() || it->second.m_crc32 != crc32 || it->second.m_length != length)
+    return nullptr;
+
+  try {
+    auto* cf = arena->New<Classfile>(Deserialize(it->second, arena));
+    m_hits.fetch_add(1, std::memory_order_relaxed);
+    return cf;
+  } catch (std::exception& e) {
+    BJVM_DEBUG("Could not load " + std::string(class_name) + " from class archive: " + e.what());
+    return nullptr;
+  }
+}
+
+} // bjvm
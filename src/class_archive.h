@@ -0,0 +1,102 @@
+//
+// Created by Cowpox on 8/14/24.
+//
+
+#ifndef CLASS_ARCHIVE_H
+#define CLASS_ARCHIVE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "archive_io.h"
+#include "classfile.h"
+#include "utilities.h"
+
+namespace bjvm {
+
+/**
+ * Archive of pre-parsed classes, so that classes which never change (e.g. the JRE) needn't be re-parsed on every
+ * startup. Archives are created with the bjvm_archive tool (see VM::WriteClassArchive).
+ *
+ * Layout: a header (magic, format version and a fingerprint of the in-memory layout of Insn and friends), then one
+ * record per class, then a directory mapping class names to the CRC-32 and length of the classfile each record was made
+ * from and the record's byte range. Records are in host byte order and refer to other structures only by constant pool
+ * or table index, never by pointer, so the archive is position independent and can be mapped at any address.
+ *
+ * The archive stays mapped for as long as it's open, and loaded classes use their arrays -- decoded instructions,
+ * exception tables, raw code for the verifier and so on -- where they are in the mapping. Only what gets written to
+ * once the class is loaded (fields, methods and the constant pool) is copied out, and only code with switches needs
+ * fixing up.
+ *
+ * An archive from another format version or build is ignored, and a class whose classfile no longer has the recorded
+ * CRC-32 and length is parsed normally. For a JAR entry both are in the central directory, so a class can be found in
+ * the archive without inflating or hashing it. That guards against a class path changing since the archive was made,
+ * not against a classfile crafted to collide, but whoever can write to the class path can run their own code anyway.
+ * Records keep the SHA-256 of their classfile, for the verification cache.
+ */
+class ClassArchive {
+  struct Record {
+    uint32_t m_crc32;
+    uint32_t m_length;
+    uint64_t m_offset;
+    uint64_t m_size;
+  };
+
+  MappedFile m_file;
+  // Keyed by names in the mapped directory
+  std::unordered_map<std::string_view, Record> m_records;
+
+  mutable std::atomic<size_t> m_hits { 0 };
+
+  explicit ClassArchive(MappedFile&& file);
+
+  static void Serialize(const classfile::Classfile& cf, std::vector<uint8_t>& out);
+  static void SerializeCode(const classfile::MethodInfo& method, ArchiveWriter& w);
+  classfile::Classfile Deserialize(const Record& record, Arena* arena) const;
+  classfile::LazyCode* DeserializeCode(ArchiveReader& r, classfile::CodeDecoder* decoder, Arena* arena) const;
+
+public:
+  /** A class to be written to an archive, which must have its digest (Classfile::m_digest). */
+  struct Entry {
+    std::string m_name;
+    const classfile::Classfile* m_classfile;
+    // Of the classfile it was parsed from
+    uint32_t m_crc32;
+    uint32_t m_length;
+  };
+
+  /** Map an archive, or return nullptr if it doesn't exist, is corrupt, or was written by an incompatible build. */
+  static std::unique_ptr<ClassArchive> Open(const std::string& path);
+
+  /**
+   * Write an archive containing the given classes, in the order given. Their method code is decoded if it hasn't been
+   * already, so that loaded classes needn't decode it.
+   */
+  static void Write(const std::string& path, const std::vector<Entry>& classes);
+
+  /**
+   * Get the archived version of a class, allocated from arena, or nullptr if the archive doesn't have it or it was made
+   * from a classfile with a different CRC-32 or length. The class refers into the archive, which must stay open for as
+   * long as the class is used. Safe to call from several threads, provided each uses its own arena.
+   */
+  classfile::Classfile* Load(std::string_view class_name, uint32_t crc32, uint32_t length, Arena* arena) const;
+
+  /** Number of classes in the archive. */
+  size_t Size() const {
+    return m_records.size();
+  }
+
+  /** Number of classes successfully loaded from the archive so far. */
+  size_t Hits() const {
+    return m_hits.load(std::memory_order_relaxed);
+  }
+};
+
+} // bjvm
+
+#endif //CLASS_ARCHIVE_H
@@ -5,70 +5,441 @@
 #include "class_instance.h"
 
 #include "utilities.h"
+#include "verification_cache.h"
+#include "verifier.h"
 #include "vm.h"
 
 namespace bjvm {
-bool ClassInstance::Link(VM *vm) {
-  // TODO verification -- probably propagate pending VerifyError
 
+/** Answers the verifier's questions about other classes by loading them through the VM. */
+class VMClassHierarchy : public classfile::ClassHierarchy {
+  VM* m_vm;
+
+public:
+  explicit VMClassHierarchy(VM* vm) : m_vm(vm) {}
+
+  const Symbol* GetSuperclassName(const Symbol* klass) override {
+    ClassInstance* superclass = m_vm->LoadClass(klass)->GetSuperclass();
+    return superclass ? superclass->GetNameSymbol() : nullptr;
+  }
+
+  bool IsInterface(const Symbol* klass) override {
+    return m_vm->LoadClass(klass)->IsInterface();
+  }
+};
+
+/** Number of local variable slots taken by the arguments in a method descriptor, not counting any receiver. */
+static uint16_t ArgumentSlots(const std::string& descriptor) {
+  uint16_t slots = 0;
+  for (size_t i = 1; i < descriptor.size() && descriptor[i] != ')'; ++i) {
+    char c = descriptor[i];
+    slots += c == 'J' || c == 'D' ? 2 : 1;
+
+    while (i < descriptor.size() && descriptor[i] == '[')
+      ++i;
+    if (i < descriptor.size() && descriptor[i] == 'L') {
+      i = descriptor.find(';', i);
+      if (i == std::string::npos)
+        break;
+    }
+  }
+  return slots;
+}
+
+ClassInstance::ClassInstance(classfile::Classfile *classfile, ClassInstance *superclass,
+                             std::vector<ClassInstance *> interfaces)
+    : m_classfile(classfile), m_superclass(superclass), m_interfaces(std::move(interfaces)) {
+  const auto& cp = m_classfile->m_cp;
+
+  m_instance_field_count = superclass ? superclass->m_instance_field_count : 0;
+  uint16_t static_field_count = 0;
+
+  m_fields.reserve(m_classfile->m_fields.size());
+  for (auto& field : m_classfile->m_fields) {
+    m_fields.emplace(MemberKey { cp.GetSymbol(field.m_name_index), cp.GetSymbol(field.m_descriptor_index) }, &field);
+
+    field.m_class = this;
+    field.m_slot = field.IsStatic() ? static_field_count++ : m_instance_field_count++;
+  }
+  m_static_fields.resize(static_field_count);  // zero initialisation is fine for all
+
+  m_methods.reserve(m_classfile->m_methods.size());
+  for (auto& method : m_classfile->m_methods) {
+    m_methods.emplace(MemberKey { cp.GetSymbol(method.m_name_index), cp.GetSymbol(method.m_descriptor_index) }, &method);
+
+    method.m_class = this;
+    method.m_argument_slots = ArgumentSlots(cp.GetUtf8(method.m_descriptor_index)) + !method.IsStatic();
+  }
+}
+
+/** Whether calls to a method are dispatched on the class of the receiver, and so it needs a vtable or itable slot. */
+static bool IsDispatched(const classfile::MethodInfo& method, const ConstantPool& cp) {
+  return !method.IsStatic() && !method.IsPrivate() && cp.GetUtf8(method.m_name_index)[0] != '<';
+}
+
+/** Add the interfaces klass implements, directly or not, which aren't already in interfaces. */
+static void CollectInterfaces(const ClassInstance* klass, std::vector<const ClassInstance*>& interfaces) {
+  for (; klass; klass = klass->GetSuperclass()) {
+    for (auto* interface : klass->GetInterfaces()) {
+      if (std::find(interfaces.begin(), interfaces.end(), interface) == interfaces.end()) {
+        interfaces.push_back(interface);
+        CollectInterfaces(interface, interfaces);
+      }
+    }
+  }
+}
+
+classfile::FieldInfo * ClassInstance::FindFieldInSuperinterfaces(const MemberKey &key) const {
+  for (auto* interface : m_interfaces) {
+    auto it = interface->m_fields.find(key);
+    if (it != interface->m_fields.end())
+      return it->second;
+    if (auto* field = interface->FindFieldInSuperinterfaces(key))
+      return field;
+  }
+  return nullptr;
+}
+
+classfile::FieldInfo * ClassInstance::GetFieldInfo(const Symbol *name, const Symbol *descriptor) const {
+  MemberKey key { name, descriptor };
+  for (auto* klass = this; klass; klass = klass->m_superclass) {
+    auto it = klass->m_fields.find(key);
+    if (it != klass->m_fields.end())
+      return it->second;
+    if (auto* field = klass->FindFieldInSuperinterfaces(key))
+      return field;
+  }
+  return nullptr;
+}
+
+/** Whether klass extends interface, directly or not. */
+static bool IsSubinterface(const ClassInstance* klass, const ClassInstance* interface) {
+  for (auto* superinterface : klass->GetInterfaces()) {
+    if (superinterface == interface || IsSubinterface(superinterface, interface))
+      return true;
+  }
+  return false;
+}
+
+std::vector<classfile::MethodInfo *> ClassInstance::FindMaximallySpecificMethods(const MemberKey &key) const {
+  std::vector<const ClassInstance*> interfaces;
+  CollectInterfaces(this, interfaces);
+
+  std::vector<classfile::MethodInfo*> candidates;
+  for (auto* interface : interfaces) {
+    auto it = interface->m_methods.find(key);
+    if (it != interface->m_methods.end() && !it->second->IsStatic() && !it->second->IsPrivate())
+      candidates.push_back(it->second);
+  }
+
+  // A method is only maximally specific if no subinterface of the one declaring it declares it again
+  std::vector<classfile::MethodInfo*> result;
+  for (auto* method : candidates) {
+    bool redeclared = std::any_of(candidates.begin(), candidates.end(), [&] (const classfile::MethodInfo* other) {
+      return IsSubinterface(other->m_class, method->m_class);
+    });
+    if (!redeclared)
+      result.push_back(method);
+  }
+  return result;
+}
+
+classfile::MethodInfo * ClassInstance::FindMethodInSuperinterfaces(const MemberKey &key) const {
+  std::vector<classfile::MethodInfo*> methods = FindMaximallySpecificMethods(key);
+
+  // The one non-abstract method if there's exactly one, and otherwise any of them
+  classfile::MethodInfo* concrete = nullptr;
+  for (auto* method : methods) {
+    if (!method->IsAbstract()) {
+      if (concrete)
+        return methods[0];
+      concrete = method;
+    }
+  }
+  if (concrete)
+    return concrete;
+  return methods.empty() ? nullptr : methods[0];
+}
+
+classfile::MethodInfo * ClassInstance::GetMethodInfo(const Symbol *name, const Symbol *descriptor) const {
+  MemberKey key { name, descriptor };
+  for (auto* klass = this; klass; klass = klass->m_superclass) {
+    auto it = klass->m_methods.find(key);
+    if (it != klass->m_methods.end())
+      return it->second;
+  }
+  return FindMethodInSuperinterfaces(key);
+}
+
+/** Whether two classes are in the same run-time package, which so far only depends on their names (no loaders). */
+static bool IsSamePackage(const ClassInstance* a, const ClassInstance* b) {
+  const std::string& a_name = a->GetClassfile()->GetName();
+  const std::string& b_name = b->GetClassfile()->GetName();
+  size_t a_end = a_name.rfind('/'), b_end = b_name.rfind('/');
+  if (a_end == std::string::npos || b_end == std::string::npos)
+    return a_end == b_end;
+  return a_name.compare(0, a_end, b_name, 0, b_end) == 0;
+}
+
+bool ClassInstance::CanOverride(const classfile::MethodInfo *overrider, const classfile::MethodInfo *overridden,
+                                const MemberKey &key) {
+  if (!overridden->IsPackagePrivate() || IsSamePackage(overrider->m_class, overridden->m_class))
+    return true;
+
+  for (auto* klass = overrider->m_class->m_superclass; klass && klass != overridden->m_class;
+       klass = klass->m_superclass) {
+    auto it = klass->m_methods.find(key);
+    if (it == klass->m_methods.end() || it->second->IsStatic() || it->second->IsPrivate())
+      continue;
+    if (CanOverride(it->second, overridden, key) && CanOverride(overrider, it->second, key))
+      return true;
+  }
+  return false;
+}
+
+const classfile::MethodInfo * ClassInstance::SelectMethod(const classfile::MethodInfo *resolved) const {
+  if (resolved->IsPrivate())
+    return resolved;
+
+  const auto& cp = resolved->m_class->GetClassfile()->m_cp;
+  MemberKey key { cp.GetSymbol(resolved->m_name_index), cp.GetSymbol(resolved->m_descriptor_index) };
+
+  for (auto* klass = this; klass; klass = klass->m_superclass) {
+    auto it = klass->m_methods.find(key);
+    if (it != klass->m_methods.end() && !it->second->IsStatic() && !it->second->IsPrivate()
+        && CanOverride(it->second, resolved, key))
+      return it->second->IsAbstract() ? nullptr : it->second;
+  }
+
+  // Otherwise the default method, provided there's exactly one maximally specific one which isn't abstract
+  const classfile::MethodInfo* selected = nullptr;
+  for (auto* method : FindMaximallySpecificMethods(key)) {
+    if (!method->IsAbstract()) {
+      if (selected)
+        return nullptr;
+      selected = method;
+    }
+  }
+  return selected;
+}
+
+const classfile::MethodInfo * ClassInstance::GetVirtualMethod(const classfile::MethodInfo *resolved) const {
+  assert(m_methods_linked);
+  if (resolved->IsPrivate())
+    return resolved;
+
+  // Like SelectMethod, give nullptr for an abstract method, which itables already have in its place
+  const ClassInstance* declaring = resolved->m_class;
+  if (!declaring->IsInterface()) {
+    const classfile::MethodInfo* method = m_vtable[resolved->m_table_index];
+    return method->IsAbstract() ? nullptr : method;
+  }
+
+  for (const auto& itable : m_itables) {
+    if (itable.m_interface == declaring)
+      return itable.m_methods[resolved->m_table_index];
+  }
+  throw std::runtime_error("IncompatibleClassChangeError: " + m_classfile->GetName() + " does not implement "
+                           + declaring->GetClassfile()->GetName());
+}
+
+bool ClassInstance::LinkMethods(VM *vm) {
+  if (m_methods_linked)
+    return true;
+  if (m_superclass && !m_superclass->LinkMethods(vm))
+    return false;
+  for (auto* interface : m_interfaces) {
+    if (!interface->LinkMethods(vm))
+      return false;
+  }
+
+  const auto& cp = m_classfile->m_cp;
+
+  if (IsInterface()) {
+    for (auto& method : m_classfile->m_methods) {
+      if (IsDispatched(method, cp)) {
+        method.m_table_index = static_cast<int>(m_vtable.size());
+        m_vtable.push_back(&method);
+      }
+    }
+    m_methods_linked = true;
+    return true;
+  }
+
+  // Start from the superclass's vtable, overriding its slots and adding new ones after them
+  if (m_superclass)
+    m_vtable = m_superclass->m_vtable;
+
+  // A name and descriptor has several slots if a package-private method was redeclared where it couldn't be overridden
+  std::unordered_map<MemberKey, std::vector<int>, MemberKeyHash> slots;
+  for (size_t i = 0; i < m_vtable.size(); ++i) {
+    const auto& inherited_cp = m_vtable[i]->m_class->GetClassfile()->m_cp;
+    slots[MemberKey { inherited_cp.GetSymbol(m_vtable[i]->m_name_index),
+                      inherited_cp.GetSymbol(m_vtable[i]->m_descriptor_index) }].push_back(static_cast<int>(i));
+  }
+
+  for (auto& method : m_classfile->m_methods) {
+    if (!IsDispatched(method, cp))
+      continue;
+
+    // Take over every slot whose method this one overrides, and if there are none, get a new one
+    MemberKey key { cp.GetSymbol(method.m_name_index), cp.GetSymbol(method.m_descriptor_index) };
+    auto& key_slots = slots[key];
+    for (int slot : key_slots) {
+      if (!CanOverride(&method, m_vtable[slot], key))
+        continue;
+      m_vtable[slot] = &method;
+      if (method.m_table_index < 0)
+        method.m_table_index = slot;
+    }
+    if (method.m_table_index < 0) {
+      method.m_table_index = static_cast<int>(m_vtable.size());
+      key_slots.push_back(method.m_table_index);
+      m_vtable.push_back(&method);
+    }
+  }
+
+  std::vector<const ClassInstance*> interfaces;
+  CollectInterfaces(this, interfaces);
+  m_itables.reserve(interfaces.size());
+  for (auto* interface : interfaces) {
+    ITable itable { interface, {} };
+    itable.m_methods.reserve(interface->m_vtable.size());
+    for (auto* method : interface->m_vtable)
+      itable.m_methods.push_back(SelectMethod(method));
+    m_itables.push_back(std::move(itable));
+  }
+
+  m_methods_linked = true;
+  return true;
+}
+
+classfile::MethodInfo * ClassInstance::FindStaticMethod(const char *name, const char *descriptor) const {
+  // If either symbol has never been interned, no class can declare the method
+  const Symbol* name_symbol = SymbolTable::Global().Find(name);
+  const Symbol* descriptor_symbol = SymbolTable::Global().Find(descriptor);
+  if (!name_symbol || !descriptor_symbol)
+    return nullptr;
+
+  auto it = m_methods.find({ name_symbol, descriptor_symbol });
+  if (it == m_methods.end())
+    return nullptr;
+  return it->second->IsStatic() ? it->second : nullptr;
+}
+
+bool ClassInstance::Link(VM *vm) {
   if (m_status != Status::Loaded) {
     throw std::runtime_error("Class not loaded, or already linked: " + m_classfile->GetName());
   }
 
   BJVM_DEBUG("Linking class: " + m_classfile->GetName());
 
+  /** Verification: https://docs.oracle.com/javase/specs/jvms/se8/html/jvms-4.html#jvms-4.10 */
+  try {
+    VMClassHierarchy hierarchy { vm };
+    VerificationCache* cache = vm->GetVerificationCache();
+    if (!cache || !cache->Apply(m_classfile, &hierarchy, &vm->GetMetadataArena())) {
+      RecordingClassHierarchy recording { &hierarchy };
+      for (auto& method : m_classfile->m_methods) {
+        if (method.HasCode())
+          method.m_code->m_type_states = classfile::VerifyMethod(*m_classfile, method, &recording, &vm->GetMetadataArena());
+      }
+      if (cache)
+        cache->Add(*m_classfile, recording.Facts());
+    }
+  } catch (classfile::VerifyError&) {
+    m_status = Status::Error;
+    throw;
+  }
+
   /** Preparation: https://docs.oracle.com/javase/specs/jvms/se8/html/jvms-5.html#jvms-5.4.2 */
   auto& constant_pool = m_classfile->m_cp;
 
-  m_static_fields.resize(m_classfile->m_fields.size());  // zero initialisation is fine for all
+  // Static fields were allocated (and zeroed) when the class was loaded
 
-  std::string my_name = m_classfile->GetName();
+  if (!LinkMethods(vm)) {
+    m_status = Status::Error;
+    return false;
+  }
+
+  const Symbol* my_name = m_classfile->GetNameSymbol();
 
   /** 5.4.3: Resolution */
   for (int i = 1; i < constant_pool.Size(); ++i) {
-    auto entry = constant_pool.GetAny(i);
-
-    std::visit(overloaded { [&] (EntryClass& klass) {
-        std::string name = constant_pool.GetUtf8(klass.m_name_index);
-        if (name != my_name) {
-          klass.m_instance = vm->LoadClass(name);
-        } else {
-          klass.m_instance = this;
-        }
-      },
-      [] (auto && arg) {}
-      }, *entry);
+    if (!constant_pool.Has<EntryClass>(i))
+      continue;
+
+    auto klass = constant_pool.GetUnchecked<EntryClass>(i);
+    const Symbol* name = constant_pool.GetSymbol(klass.m_name_index);
+    if (name != my_name) {
+      klass.m_instance = vm->LoadClass(name);
+    } else {
+      klass.m_instance = this;
+    }
+    constant_pool.Put(i, klass);
   }
 
   for (int i = 1; i < constant_pool.Size(); ++i) {
-    auto entry = constant_pool.GetAny(i);
-
-    std::visit(overloaded {
-      [&] (EntryFieldRef field_ref) {
+    switch (constant_pool.GetTag(i)) {
+      case ConstantPoolTag::FieldRef: {
+        auto field_ref = constant_pool.GetUnchecked<EntryFieldRef>(i);
         auto klass = constant_pool.Get<EntryClass>(field_ref.struct_index);
         auto name_and_type = constant_pool.Get<EntryNameAndType>(field_ref.name_and_type_index);
 
-        auto* result = klass->m_instance->GetFieldInfo(constant_pool.GetUtf8(name_and_type->name_index));
+        const Symbol* name = constant_pool.GetSymbol(name_and_type.name_index);
+        const Symbol* descriptor = constant_pool.GetSymbol(name_and_type.descriptor_index);
+
+        auto* result = klass.m_instance->GetFieldInfo(name, descriptor);
         if (!result) {
-          throw std::runtime_error("Field not found: " + constant_pool.GetUtf8(name_and_type->name_index));
+          throw std::runtime_error("Field not found: " + name->m_value);
         }
         field_ref.m_field_info = result;
-      },
-      [&] (EntryMethodRef method_ref) {
+        constant_pool.Put(i, field_ref);
+        break;
+      }
+      case ConstantPoolTag::MethodRef: {
+        auto method_ref = constant_pool.GetUnchecked<EntryMethodRef>(i);
+        auto klass = constant_pool.Get<EntryClass>(method_ref.struct_index);
+        auto name_and_type = constant_pool.Get<EntryNameAndType>(method_ref.name_and_type_index);
+
+        const Symbol* name = constant_pool.GetSymbol(name_and_type.name_index);
+        const Symbol* descriptor = constant_pool.GetSymbol(name_and_type.descriptor_index);
+
+        auto* result = klass.m_instance->GetMethodInfo(name, descriptor);
+        if (!result) {
+          throw std::runtime_error("Method not found: " + name->m_value);
+        }
+        method_ref.m_method_info = result;
+        constant_pool.Put(i, method_ref);
+        break;
+      }
+      case ConstantPoolTag::InterfaceMethodRef: {
+        auto method_ref = constant_pool.GetUnchecked<EntryInterfaceMethodRef>(i);
         auto klass = constant_pool.Get<EntryClass>(method_ref.struct_index);
         auto name_and_type = constant_pool.Get<EntryNameAndType>(method_ref.name_and_type_index);
 
-        std::string name = constant_pool.GetUtf8(name_and_type->name_index);
-        std::string descriptor = constant_pool.GetUtf8(name_and_type->descriptor_index);
+        const Symbol* name = constant_pool.GetSymbol(name_and_type.name_index);
+        const Symbol* descriptor = constant_pool.GetSymbol(name_and_type.descriptor_index);
 
-        auto* result = klass->m_instance->GetMethodInfo(name, descriptor);
+        // Interface method resolution (5.4.3.4) differs only in also finding methods of java/lang/Object, which an
+        // interface's superclass is
+        auto* result = klass.m_instance->GetMethodInfo(name, descriptor);
         if (!result) {
-          throw std::runtime_error("Method not found: " + constant_pool.GetUtf8(name_and_type->name_index));
+          throw std::runtime_error("Method not found: " + name->m_value);
         }
         method_ref.m_method_info = result;
-      },
-      [&] (auto&& arg) { }
-    }, *entry);
+        constant_pool.Put(i, method_ref);
+        break;
+      }
+      case ConstantPoolTag::String: {
+        auto string = constant_pool.GetUnchecked<EntryString>(i);
+        string.m_string = vm->InternString(constant_pool.GetSymbol(string.string_index));
+        constant_pool.Put(i, string);
+        break;
+      }
+      default:
+        break;
+    }
   }
 
   return true;
@@ -18,18 +18,56 @@ enum class Status {
   Initialised,
 };
 
+/** Name and descriptor of a field or method, as interned symbols. */
+struct MemberKey {
+  const Symbol* m_name;
+  const Symbol* m_descriptor;
+
+  bool operator==(const MemberKey& other) const {
+    return m_name == other.m_name && m_descriptor == other.m_descriptor;
+  }
+};
+
+struct MemberKeyHash {
+  size_t operator()(const MemberKey& key) const {
+    return key.m_name->m_hash * 31 + key.m_descriptor->m_hash;
+  }
+};
+
 class ClassInstance {
+  /** The methods of one interface, as implemented by a class: indexed like its vtable, and null where abstract. */
+  struct ITable {
+    const ClassInstance* m_interface;
+    std::vector<const classfile::MethodInfo*> m_methods;
+  };
+
   classfile::Classfile* m_classfile = nullptr;
 
   Status m_status = Status::Loaded;
 
-  std::unordered_map<std::string, classfile::MethodInfo*> m_static_methods;
-  std::unordered_map<std::string, classfile::MethodInfo*> m_instance_methods;
+  // Null only for java/lang/Object (and, in future, interfaces and arrays, whose superclass is implicit)
+  ClassInstance* m_superclass = nullptr;
+  std::vector<ClassInstance*> m_interfaces;
+
+  // Members declared by this class (not inherited ones), built when the class is loaded
+  std::unordered_map<MemberKey, classfile::FieldInfo*, MemberKeyHash> m_fields;
+  std::unordered_map<MemberKey, classfile::MethodInfo*, MemberKeyHash> m_methods;
 
+  // One slot per static field, zero until the class is initialised. Allocated when the class is loaded rather than when
+  // it's prepared, so that the slots can be pointed at as soon as the fields are resolved.
   std::vector<uint64_t> m_static_fields;
 
+  // Including those of superclasses
+
   int m_instance_field_count = 0;
 
+  // Built by LinkMethods. The vtable is indexed by the m_table_index of methods declared by this class and its
+  // superclasses; an interface's instead lists the methods it declares, which is how its itables are indexed. There is
+  // an itable for every interface a class implements, directly or not.
+  std::vector<const classfile::MethodInfo*> m_vtable;
+  std::vector<ITable> m_itables;
+  bool m_methods_linked = false;
+
   // TODO add loaders
 
   [[nodiscard]] bool LinkSuperClass(VM* vm);
@@ -38,12 +76,33 @@ class ClassInstance {
 
   [[nodiscard]] bool LinkFields(VM* vm);
 
-  [[nodiscard]] bool LinkMethods(VM* vm);
-
   [[nodiscard]] bool LinkAttributes(VM* vm);
 
+  classfile::FieldInfo* FindFieldInSuperinterfaces(const MemberKey& key) const;
+
+  /**
+   * The maximally-specific superinterface methods with the given name and descriptor (JVMS 5.4.3.3): those declared,
+   * neither private nor static, by an interface this class implements, directly or not, which isn't extended by
+   * another such interface declaring the method too.
+   */
+  std::vector<classfile::MethodInfo*> FindMaximallySpecificMethods(const MemberKey& key) const;
+
+  /**
+   * Whether overrider can override overridden, which it has the name and descriptor of (JVMS 5.4.5): always, unless
+   * overridden is package-private, in which case only from the same package, or by way of a method declared between
+   * the two which can override overridden and can itself be overridden by overrider.
+   */
+  static bool CanOverride(const classfile::MethodInfo* overrider, const classfile::MethodInfo* overridden,
+                          const MemberKey& key);
+
+  /**
+   * Step 3 of method resolution: the only non-abstract maximally-specific superinterface method if there's exactly
+   * one, otherwise any maximally-specific one, or nullptr if there are none.
+   */
+  classfile::MethodInfo* FindMethodInSuperinterfaces(const MemberKey& key) const;
+
 public:
-  ClassInstance(classfile::Classfile* classfile) : m_classfile(classfile) {}
+  ClassInstance(classfile::Classfile* classfile, ClassInstance* superclass, std::vector<ClassInstance*> interfaces);
 
   ClassInstance(ClassInstance&&) = delete;
   ClassInstance(const ClassInstance&) = delete;
@@ -54,36 +113,74 @@ public:
 
   [[nodiscard]] bool Link(VM* vm);
 
+  /**
+   * Build the vtable and itables, doing so first for the superclass and superinterfaces if they haven't been. Part of
+   * Link, and otherwise only needed by classes which are put together by hand.
+   */
+  [[nodiscard]] bool LinkMethods(VM* vm);
+
   [[nodiscard]] bool InitClass(VM* vm) {
     return true;
   }
 
-  classfile::MethodInfo* FindStaticMethod(const char * str, const char * text) {
-    return nullptr;
-  }
+  /** Find a static method declared by this class, or return nullptr if there is none. */
+  classfile::MethodInfo* FindStaticMethod(const char* name, const char* descriptor) const;
 
   bool IsInterface() const {
     return (static_cast<int>(m_classfile->m_access_flags) & static_cast<int>(classfile::AccessFlags::ACC_INTERFACE)) != 0;
   }
 
-  classfile::FieldInfo * GetFieldInfo(const std::string & string) {
-    for (auto& field : m_classfile->m_fields) {
-      if (m_classfile->m_cp.GetUtf8(field.m_name_index) == string) {
-        return &field;
-      }
-    }
+  /** Where the value of one of this class's static fields lives. */
+  uint64_t* GetStaticSlot(const classfile::FieldInfo* field) {
+    return &m_static_fields[field->m_slot];
+  }
 
-    return nullptr;
+  classfile::Classfile* GetClassfile() const {
+    return m_classfile;
   }
 
-  classfile::MethodInfo * GetMethodInfo(const std::string &method_name, const std::string &descriptor) {
-    for (auto& method : m_classfile->m_methods) {
-      if (m_classfile->m_cp.GetUtf8(method.m_name_index) == method_name &&
-          m_classfile->m_cp.GetUtf8(method.m_descriptor_index) == descriptor) {
-        return &method;
-      }
-    }
+  const Symbol* GetNameSymbol() const {
+    return m_classfile->GetNameSymbol();
   }
+
+  ClassInstance* GetSuperclass() const {
+    return m_superclass;
+  }
+
+  const std::vector<ClassInstance*>& GetInterfaces() const {
+    return m_interfaces;
+  }
+
+  /**
+   * Find a field by name and descriptor, following field resolution (JVMS 5.4.3.2): this class, then its
+   * superinterfaces, then its superclass, recursively. Returns nullptr if there is no such field.
+   */
+  classfile::FieldInfo* GetFieldInfo(const Symbol* name, const Symbol* descriptor) const;
+
+  /**
+   * Find a method by name and descriptor, following method resolution (JVMS 5.4.3.3): this class and its superclasses,
+   * then its superinterfaces. Returns nullptr if there is no such method.
+   */
+  classfile::MethodInfo* GetMethodInfo(const Symbol* name, const Symbol* descriptor) const;
+
+  /**
+   * Select the method that invokevirtual or invokeinterface of a resolved method calls on an instance of this class
+   * (JVMS 5.4.6): the resolved method itself if it's private, otherwise the first method in this class and its
+   * superclasses which can override it (see CanOverride), or failing that the one non-abstract maximally-specific
+   * superinterface method. Returns nullptr if the method found is abstract, or there's none. Several non-abstract
+   * maximally-specific methods also give nullptr, so calls raise AbstractMethodError where the JVMS has
+   * IncompatibleClassChangeError.
+   *
+   * This searches the hierarchy, so it's only used to build itables; calls go through GetVirtualMethod.
+   */
+  const classfile::MethodInfo* SelectMethod(const classfile::MethodInfo* resolved) const;
+
+  /**
+   * Get the method SelectMethod would select, by indexing the vtable or an itable. The class's methods must have been
+   * linked. Throws IncompatibleClassChangeError if the resolved method is an interface's and this class doesn't
+   * implement it.
+   */
+  const classfile::MethodInfo* GetVirtualMethod(const classfile::MethodInfo* resolved) const;
 };
 
 } // bjvm
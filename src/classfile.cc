@@ -4,13 +4,43 @@
 
 #include "classfile.h"
 
+#include <array>
+#include <chrono>
 #include <sstream>
 #include <iostream>
 
+#include "superinstructions.h"
 #include "utilities.h"
 
 namespace bjvm::classfile {
 
+// Attribute names, interned once so that attributes can be recognised by pointer comparison
+static const Symbol* const CODE = Intern("Code");
+static const Symbol* const CONSTANT_VALUE = Intern("ConstantValue");
+static const Symbol* const LINE_NUMBER_TABLE = Intern("LineNumberTable");
+static const Symbol* const STACK_MAP_TABLE = Intern("StackMapTable");
+static const Symbol* const BOOTSTRAP_METHODS = Intern("BootstrapMethods");
+
+/**
+ * Adds the time until it goes out of scope to a ParseProfile counter. Does nothing (and doesn't read the clock) if
+ * the counter is null, i.e. there is no profile.
+ */
+class PhaseTimer {
+  uint64_t* m_counter;
+  std::chrono::steady_clock::time_point m_start;
+
+public:
+  explicit PhaseTimer(uint64_t* counter) : m_counter(counter) {
+    if (m_counter)
+      m_start = std::chrono::steady_clock::now();
+  }
+
+  ~PhaseTimer() {
+    if (m_counter)
+      *m_counter += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+  }
+};
+
 /**
  * Converts the atype field of a newarray instruction to a primitive type.
  * @param byte The classfile byte.
@@ -238,286 +268,289 @@ enum RawOpcode {
   jsr_w = 0xc9
 };
 
-// The following fixups are required once all instructions are parsed:
+// The following fixups are required once all instructions are decoded:
 //  1. lookupswitch/tableswitch need to have their data converted to pointers to the statically allocated data.
 //  2. Branch offsets must be converted to instruction indices.
-//     a. goto, jsr store the offset in the 32-bit imm.
-//     b. if<cond> store the offset in the 16-bit index (interpreted as int16_t).
-//     c. tableswitch, lookupswitch store their offsets in the statically allocated tableswitch/lookupswitch data.
+//     a. goto, jsr and if<cond> store the offset in the 32-bit imm.
+//     b. tableswitch, lookupswitch store their offsets in the statically allocated tableswitch/lookupswitch data.
+
+/** How an opcode's operands are encoded, and so how Insn::Decode fills in the instruction's data. */
+enum class OperandKind : uint8_t {
+  Invalid,  // not an opcode
+  None,
+  ImplicitIndex,  // e.g. aload_0: the local variable index is part of the opcode
+  ImplicitInt,  // iconst_<n>, lconst_<n>
+  ImplicitFloat,  // fconst_<f>
+  ImplicitDouble,  // dconst_<d>
+  U8Index,
+  U16Index,
+  I8Imm,
+  I16Imm,
+  Branch16,
+  Branch32,
+  NewArray,
+  IInc,
+  InvokeInterface,
+  InvokeDynamic,
+  Multianewarray,
+  // Variable length
+  Tableswitch,
+  Lookupswitch,
+  Wide
+};
 
-Insn Insn::parse(ByteReader *reader, ParseContext* ctx) {
-  auto opc = reader->NextU8("instruction opcode");
+struct OpcodeInfo {
+  InsnCode m_code = InsnCode::nop;
+  OperandKind m_operand = OperandKind::Invalid;
+  // Including the opcode itself; 0 if the length varies
+  uint8_t m_length = 0;
+  // Operand encoded in the opcode, for the Implicit* kinds
+  int8_t m_implicit = 0;
+};
+
+static constexpr void SetOpcode(std::array<OpcodeInfo, 256>& table, RawOpcode opc, InsnCode code, OperandKind operand,
+                                int length, int implicit = 0) {
+  table[opc] = { code, operand, static_cast<uint8_t>(length), static_cast<int8_t>(implicit) };
+}
+
+/** Sets a run of opcodes like iload_0 ... iload_3, which differ only in their implicit operand. */
+static constexpr void SetOpcodes(std::array<OpcodeInfo, 256>& table, RawOpcode first, RawOpcode last, InsnCode code,
+                                 OperandKind operand, int first_implicit) {
+  for (int opc = first; opc <= last; ++opc)
+    SetOpcode(table, static_cast<RawOpcode>(opc), code, operand, 1, first_implicit + opc - first);
+}
+
+static constexpr std::array<OpcodeInfo, 256> MakeOpcodeTable() {
   using IC = InsnCode;
+  using OK = OperandKind;
+  std::array<OpcodeInfo, 256> table {};
 
-  // std::cout << "Parsing " << std::to_string(opc) << " at offset " << reader->GetOffs() << '\n';
+  struct Simple {
+    RawOpcode m_opc;
+    InsnCode m_code;
+  };
 
-  switch (opc) {
-    case nop: return Insn(IC::nop);
-    case aconst_null: return Insn(IC::aconst_null);
-    case iconst_m1: case iconst_0: case iconst_1: case iconst_2: case iconst_3: case iconst_4: case iconst_5:
-      return Insn(IC::iconst, { .imm = opc - iconst_0 });
-    case lconst_0: case lconst_1:
-      return Insn(IC::lconst, { .imm = opc - lconst_0 });
-    case fconst_0: case fconst_1: case fconst_2:
-      return Insn(IC::fconst, { .f_imm = static_cast<float>(opc - fconst_0) });
-    case dconst_0: case dconst_1:
-      return Insn(IC::dconst, { .d_imm = static_cast<double>(opc - dconst_0) });
-    case bipush: return Insn(IC::iconst, { .imm = reader->NextI8("bipush immediate") });
-    case sipush: return Insn(IC::iconst, { .imm = reader->NextI16("sipush immediate") });
-    case ldc: return Insn(IC::ldc, { .index = reader->NextU8("ldc index") });
-    case ldc_w: return Insn(IC::ldc, { .index = reader->NextU16("ldc_w index") });
-    case ldc2_w: return Insn(IC::ldc2_w, { .index = reader->NextU16("ldc_w index") });
-    case iload: return Insn(IC::iload, { .index = reader->NextU8("iload index") });
-    case lload: return Insn(IC::lload, { .index = reader->NextU8("lload index") });
-    case fload: return Insn(IC::fload, { .index = reader->NextU8("fload index") });
-    case dload: return Insn(IC::dload, { .index = reader->NextU8("dload index") });
-    case aload: return Insn(IC::aload, { .index = reader->NextU8("aload index") });
-    case iload_0: case iload_1: case iload_2: case iload_3:
-      return Insn(IC::iload, { .index = static_cast<uint16_t>(opc - iload_0) });
-    case lload_0: case lload_1: case lload_2: case lload_3:
-      return Insn(IC::lload, { .index = static_cast<uint16_t>(opc - lload_0) });
-    case fload_0: case fload_1: case fload_2: case fload_3:
-      return Insn(IC::fload, { .index = static_cast<uint16_t>(opc - fload_0) });
-    case dload_0: case dload_1: case dload_2: case dload_3:
-      return Insn(IC::dload, { .index = static_cast<uint16_t>(opc - dload_0) });
-    case aload_0: case aload_1: case aload_2: case aload_3:
-      return Insn(IC::aload, { .index = static_cast<uint16_t>(opc - aload_0) });
-    case iaload: return Insn(IC::iaload);
-    case laload: return Insn(IC::laload);
-    case faload: return Insn(IC::faload);
-    case daload: return Insn(IC::daload);
-    case aaload: return Insn(IC::aaload);
-    case baload: return Insn(IC::baload);
-    case caload: return Insn(IC::caload);
-    case saload: return Insn(IC::saload);
-    case istore: return Insn(IC::istore, { .index = reader->NextU8("istore index") });
-    case lstore: return Insn(IC::lstore, { .index = reader->NextU8("lstore index") });
-    case fstore: return Insn(IC::fstore, { .index = reader->NextU8("fstore index") });
-    case dstore: return Insn(IC::dstore, { .index = reader->NextU8("dstore index") });
-    case astore: return Insn(IC::astore, { .index = reader->NextU8("astore index") });
-    case istore_0: case istore_1: case istore_2: case istore_3:
-      return Insn(IC::istore, { .index = static_cast<uint16_t>(opc - istore_0) });
-    case lstore_0: case lstore_1: case lstore_2: case lstore_3:
-      return Insn(IC::lstore, { .index = static_cast<uint16_t>(opc - lstore_0) });
-    case fstore_0: case fstore_1: case fstore_2: case fstore_3:
-      return Insn(IC::fstore, { .index = static_cast<uint16_t>(opc - fstore_0) });
-    case dstore_0: case dstore_1: case dstore_2: case dstore_3:
-      return Insn(IC::dstore, { .index = static_cast<uint16_t>(opc - dstore_0) });
-    case astore_0: case astore_1: case astore_2: case astore_3:
-      return Insn(IC::astore, { .index = static_cast<uint16_t>(opc - astore_0) });
-    case iastore: return Insn(IC::iastore);
-    case lastore: return Insn(IC::lastore);
-    case fastore: return Insn(IC::fastore);
-    case dastore: return Insn(IC::dastore);
-    case aastore: return Insn(IC::aastore);
-    case bastore: return Insn(IC::bastore);
-    case castore: return Insn(IC::castore);
-    case sastore: return Insn(IC::sastore);
-    case pop: return Insn(IC::pop);
-    case pop2: return Insn(IC::pop2);
-    case dup: return Insn(IC::dup);
-    case dup_x1: return Insn(IC::dup_x1);
-    case dup_x2: return Insn(IC::dup_x2);
-    case dup2: return Insn(IC::dup2);
-    case dup2_x1: return Insn(IC::dup2_x1);
-    case dup2_x2: return Insn(IC::dup2_x2);
-    case swap: return Insn(IC::swap);
-    case iadd: return Insn(IC::iadd);
-    case ladd: return Insn(IC::ladd);
-    case fadd: return Insn(IC::fadd);
-    case dadd: return Insn(IC::dadd);
-    case isub: return Insn(IC::isub);
-    case lsub: return Insn(IC::lsub);
-    case fsub: return Insn(IC::fsub);
-    case dsub: return Insn(IC::dsub);
-    case imul: return Insn(IC::imul);
-    case lmul: return Insn(IC::lmul);
-    case fmul: return Insn(IC::fmul);
-    case dmul: return Insn(IC::dmul);
-    case idiv: return Insn(IC::idiv);
-    case ldiv: return Insn(IC::ldiv);
-    case fdiv: return Insn(IC::fdiv);
-    case ddiv: return Insn(IC::ddiv);
-    case irem: return Insn(IC::irem);
-    case lrem: return Insn(IC::lrem);
-    case frem: return Insn(IC::frem);
-    case drem: return Insn(IC::drem);
-    case ineg: return Insn(IC::ineg);
-    case lneg: return Insn(IC::lneg);
-    case fneg: return Insn(IC::fneg);
-    case dneg: return Insn(IC::dneg);
-    case ishl: return Insn(IC::ishl);
-    case lshl: return Insn(IC::lshl);
-    case ishr: return Insn(IC::ishr);
-    case lshr: return Insn(IC::lshr);
-    case iushr: return Insn(IC::iushr);
-    case lushr: return Insn(IC::lushr);
-    case iand: return Insn(IC::iand);
-    case land: return Insn(IC::land);
-    case ior: return Insn(IC::ior);
-    case lor: return Insn(IC::lor);
-    case ixor: return Insn(IC::ixor);
-    case lxor: return Insn(IC::lxor);
-    case iinc: {
-      auto index = reader->NextU8("iinc index");
-      auto imm = reader->NextI8("iinc immediate");
-      return Insn(IC::iinc, { .iinc = { index, imm }});
-    }
-    case i2l: return Insn(IC::i2l);
-    case i2f: return Insn(IC::i2f);
-    case i2d: return Insn(IC::i2d);
-    case l2i: return Insn(IC::l2i);
-    case l2f: return Insn(IC::l2f);
-    case l2d: return Insn(IC::l2d);
-    case f2i: return Insn(IC::f2i);
-    case f2l: return Insn(IC::f2l);
-    case f2d: return Insn(IC::f2d);
-    case d2i: return Insn(IC::d2i);
-    case d2l: return Insn(IC::d2l);
-    case d2f: return Insn(IC::d2f);
-    case i2b: return Insn(IC::i2b);
-    case i2c: return Insn(IC::i2c);
-    case i2s: return Insn(IC::i2s);
-    case lcmp: return Insn(IC::lcmp);
-    case fcmpl: return Insn(IC::fcmpl);
-    case fcmpg: return Insn(IC::fcmpg);
-    case dcmpl: return Insn(IC::dcmpl);
-    case dcmpg: return Insn(IC::dcmpg);
+  constexpr Simple SIMPLE[] = {
+    { nop, IC::nop }, { aconst_null, IC::aconst_null },
+    { iaload, IC::iaload }, { laload, IC::laload }, { faload, IC::faload }, { daload, IC::daload },
+    { aaload, IC::aaload }, { baload, IC::baload }, { caload, IC::caload }, { saload, IC::saload },
+    { iastore, IC::iastore }, { lastore, IC::lastore }, { fastore, IC::fastore }, { dastore, IC::dastore },
+    { aastore, IC::aastore }, { bastore, IC::bastore }, { castore, IC::castore }, { sastore, IC::sastore },
+    { pop, IC::pop }, { pop2, IC::pop2 }, { dup, IC::dup }, { dup_x1, IC::dup_x1 }, { dup_x2, IC::dup_x2 },
+    { dup2, IC::dup2 }, { dup2_x1, IC::dup2_x1 }, { dup2_x2, IC::dup2_x2 }, { swap, IC::swap },
+    { iadd, IC::iadd }, { ladd, IC::ladd }, { fadd, IC::fadd }, { dadd, IC::dadd },
+    { isub, IC::isub }, { lsub, IC::lsub }, { fsub, IC::fsub }, { dsub, IC::dsub },
+    { imul, IC::imul }, { lmul, IC::lmul }, { fmul, IC::fmul }, { dmul, IC::dmul },
+    { idiv, IC::idiv }, { ldiv, IC::ldiv }, { fdiv, IC::fdiv }, { ddiv, IC::ddiv },
+    { irem, IC::irem }, { lrem, IC::lrem }, { frem, IC::frem }, { drem, IC::drem },
+    { ineg, IC::ineg }, { lneg, IC::lneg }, { fneg, IC::fneg }, { dneg, IC::dneg },
+    { ishl, IC::ishl }, { lshl, IC::lshl }, { ishr, IC::ishr }, { lshr, IC::lshr },
+    { iushr, IC::iushr }, { lushr, IC::lushr }, { iand, IC::iand }, { land, IC::land },
+    { ior, IC::ior }, { lor, IC::lor }, { ixor, IC::ixor }, { lxor, IC::lxor },
+    { i2l, IC::i2l }, { i2f, IC::i2f }, { i2d, IC::i2d }, { l2i, IC::l2i }, { l2f, IC::l2f }, { l2d, IC::l2d },
+    { f2i, IC::f2i }, { f2l, IC::f2l }, { f2d, IC::f2d }, { d2i, IC::d2i }, { d2l, IC::d2l }, { d2f, IC::d2f },
+    { i2b, IC::i2b }, { i2c, IC::i2c }, { i2s, IC::i2s },
+    { lcmp, IC::lcmp }, { fcmpl, IC::fcmpl }, { fcmpg, IC::fcmpg }, { dcmpl, IC::dcmpl }, { dcmpg, IC::dcmpg },
+    { ireturn, IC::ireturn }, { lreturn, IC::lreturn }, { freturn, IC::freturn }, { dreturn, IC::dreturn },
+    { areturn, IC::areturn }, { return_, IC::return_ },
+    { arraylength, IC::arraylength }, { athrow, IC::athrow },
+    { monitorenter, IC::monitorenter }, { monitorexit, IC::monitorexit },
+  };
 
-    // TEMPORARY: Program counter offsets will be converted later to instruction indices
-    case ifeq: return Insn(IC::ifeq, { .index = reader->NextU16("ifeq offset") });
-    case ifne: return Insn(IC::ifne, { .index = reader->NextU16("ifne offset") });
-    case iflt: return Insn(IC::iflt, { .index = reader->NextU16("iflt offset") });
-    case ifge: return Insn(IC::ifge, { .index = reader->NextU16("ifge offset") });
-    case ifgt: return Insn(IC::ifgt, { .index = reader->NextU16("ifgt offset") });
-    case ifle: return Insn(IC::ifle, { .index = reader->NextU16("ifle offset") });
-    case if_icmpeq: return Insn(IC::if_icmpeq, { .index = reader->NextU16("if_icmpeq offset") });
-    case if_icmpne: return Insn(IC::if_icmpne, { .index = reader->NextU16("if_icmpne offset") });
-    case if_icmplt: return Insn(IC::if_icmplt, { .index = reader->NextU16("if_icmplt offset") });
-    case if_icmpge: return Insn(IC::if_icmpge, { .index = reader->NextU16("if_icmpge offset") });
-    case if_icmpgt: return Insn(IC::if_icmpgt, { .index = reader->NextU16("if_icmpgt offset") });
-    case if_icmple: return Insn(IC::if_icmple, { .index = reader->NextU16("if_icmple offset") });
-    case if_acmpeq: return Insn(IC::if_acmpeq, { .index = reader->NextU16("if_acmpeq offset") });
-    case if_acmpne: return Insn(IC::if_acmpne, { .index = reader->NextU16("if_acmpne offset") });
-    case goto_: return Insn(IC::goto_, { .imm = reader->NextI16("goto offset") });
-    case jsr: return Insn(IC::jsr, { .imm = reader->NextI16("jsr offset") });
-    case ret: return Insn(IC::ret, { .index = reader->NextU8("ret index") });
-    case tableswitch: {
-      // Tableswitch data is 4-byte aligned for some reason
-      auto padding = (4 - (reader->GetOffs() % 4)) % 4;
-      reader->NextNBytes(padding, "tableswitch padding");
+  for (const auto& simple : SIMPLE)
+    SetOpcode(table, simple.m_opc, simple.m_code, OK::None, 1);
+
+  SetOpcodes(table, iconst_m1, iconst_5, IC::iconst, OK::ImplicitInt, -1);
+  SetOpcodes(table, lconst_0, lconst_1, IC::lconst, OK::ImplicitInt, 0);
+  SetOpcodes(table, fconst_0, fconst_2, IC::fconst, OK::ImplicitFloat, 0);
+  SetOpcodes(table, dconst_0, dconst_1, IC::dconst, OK::ImplicitDouble, 0);
+
+  SetOpcode(table, bipush, IC::iconst, OK::I8Imm, 2);
+  SetOpcode(table, sipush, IC::iconst, OK::I16Imm, 3);
+  SetOpcode(table, ldc, IC::ldc, OK::U8Index, 2);
+  SetOpcode(table, ldc_w, IC::ldc, OK::U16Index, 3);
+  SetOpcode(table, ldc2_w, IC::ldc2_w, OK::U16Index, 3);
+
+  struct Local {
+    RawOpcode m_opc, m_opc_0;
+    InsnCode m_code;
+  };
+
+  constexpr Local LOCALS[] = {
+    { iload, iload_0, IC::iload }, { lload, lload_0, IC::lload }, { fload, fload_0, IC::fload },
+    { dload, dload_0, IC::dload }, { aload, aload_0, IC::aload },
+    { istore, istore_0, IC::istore }, { lstore, lstore_0, IC::lstore }, { fstore, fstore_0, IC::fstore },
+    { dstore, dstore_0, IC::dstore }, { astore, astore_0, IC::astore },
+  };
+
+  for (const auto& local : LOCALS) {
+    SetOpcode(table, local.m_opc, local.m_code, OK::U8Index, 2);
+    SetOpcodes(table, local.m_opc_0, static_cast<RawOpcode>(local.m_opc_0 + 3), local.m_code, OK::ImplicitIndex, 0);
+  }
+
+  constexpr Simple BRANCHES[] = {
+    { ifeq, IC::ifeq }, { ifne, IC::ifne }, { iflt, IC::iflt }, { ifge, IC::ifge }, { ifgt, IC::ifgt },
+    { ifle, IC::ifle }, { if_icmpeq, IC::if_icmpeq }, { if_icmpne, IC::if_icmpne }, { if_icmplt, IC::if_icmplt },
+    { if_icmpge, IC::if_icmpge }, { if_icmpgt, IC::if_icmpgt }, { if_icmple, IC::if_icmple },
+    { if_acmpeq, IC::if_acmpeq }, { if_acmpne, IC::if_acmpne }, { goto_, IC::goto_ }, { jsr, IC::jsr },
+    { ifnull, IC::ifnull }, { ifnonnull, IC::ifnonnull },
+  };
+
+  for (const auto& branch : BRANCHES)
+    SetOpcode(table, branch.m_opc, branch.m_code, OK::Branch16, 3);
+  SetOpcode(table, goto_w, IC::goto_, OK::Branch32, 5);
+  SetOpcode(table, jsr_w, IC::jsr, OK::Branch32, 5);
+
+  constexpr Simple CP_REFERENCES[] = {
+    { getstatic, IC::getstatic }, { putstatic, IC::putstatic }, { getfield, IC::getfield },
+    { putfield, IC::putfield }, { invokevirtual, IC::invokevirtual }, { invokespecial, IC::invokespecial },
+    { invokestatic, IC::invokestatic }, { new_, IC::new_ }, { anewarray, IC::anewarray },
+    { checkcast, IC::checkcast }, { instanceof, IC::instanceof },
+  };
+
+  for (const auto& reference : CP_REFERENCES)
+    SetOpcode(table, reference.m_opc, reference.m_code, OK::U16Index, 3);
 
-      auto default_offset = reader->NextI32("tableswitch default offset");
-      auto low = reader->NextI32("tableswitch low");
-      auto high = reader->NextI32("tableswitch high");
+  SetOpcode(table, ret, IC::ret, OK::U8Index, 2);
+  SetOpcode(table, iinc, IC::iinc, OK::IInc, 3);
+  SetOpcode(table, newarray, IC::newarray, OK::NewArray, 2);
+  SetOpcode(table, invokeinterface, IC::invokeinterface, OK::InvokeInterface, 5);
+  SetOpcode(table, invokedynamic, IC::invokedynamic, OK::InvokeDynamic, 5);
+  SetOpcode(table, multianewarray, IC::multianewarray, OK::Multianewarray, 4);
 
-      std::vector<int> offsets;
-      for (int i = low; i <= high; i++) {
-        offsets.push_back(reader->NextI32("tableswitch offset"));
+  SetOpcode(table, tableswitch, IC::tableswitch, OK::Tableswitch, 0);
+  SetOpcode(table, lookupswitch, IC::lookupswitch, OK::Lookupswitch, 0);
+  SetOpcode(table, wide, IC::nop, OK::Wide, 0);
+
+  return table;
+}
+
+static constexpr std::array<OpcodeInfo, 256> OPCODES = MakeOpcodeTable();
+
+static uint16_t ReadU16(const uint8_t* bytes) {
+  return bytes[0] << 8 | bytes[1];
+}
+
+static int32_t ReadI32(const uint8_t* bytes) {
+  return static_cast<int32_t>(static_cast<uint32_t>(bytes[0]) << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3]);
+}
+
+Insn Insn::DecodeVariableLength(ByteSpan code, uint32_t* pc, ParseContext* ctx) {
+  using IC = InsnCode;
+
+  uint8_t opc = code.data()[*pc];
+  ByteReader reader { code.data() + *pc + 1, code.size() - *pc - 1 };
+  reader.SetCurrentComponent("code");
+
+  const auto Finish = [&] (Insn insn) {
+    *pc += 1 + reader.GetOffs();
+    return insn;
+  };
+
+  switch (opc) {
+    case tableswitch: {
+      // Tableswitch data is 4-byte aligned (relative to the start of the code)
+      auto padding = (4 - (*pc + 1) % 4) % 4;
+      reader.Skip(padding, "tableswitch padding");
+
+      auto default_offset = reader.NextI32("tableswitch default offset");
+      auto low = reader.NextI32("tableswitch low");
+      auto high = reader.NextI32("tableswitch high");
+
+      // Checked up front so a corrupt table can't make us allocate gigabytes before running out of bytes
+      int64_t count = static_cast<int64_t>(high) - low + 1;
+      if (count < 0 || count > static_cast<int64_t>(reader.Remaining() / 4))
+        throw VerifyError("Invalid tableswitch bounds", *pc);
+
+      auto offsets = ctx->m_arena->NewArray<int>(count);
+      for (int& offset : offsets) {
+        offset = reader.NextI32("tableswitch offset");
       }
 
       // TEMPORARY: Will convert offsets to instruction index, and tableswitch index to tableswitch pointer once
       // all have been allocated
       auto ts_index = ctx->MakeTableswitch({
-        SwitchDataBase { .m_default_target = default_offset, .m_targets = std::move(offsets) }, .m_low = low, .m_high = high
+        SwitchDataBase { .m_default_target = default_offset, .m_targets = offsets }, .m_low = low, .m_high = high
       });
-      return Insn(IC::tableswitch, { .imm = ts_index });
+      return Finish(Insn(IC::tableswitch, { .imm = ts_index }));
     }
     case lookupswitch: {
-      auto padding = (4 - (reader->GetOffs() % 4)) % 4;
-      reader->NextNBytes(padding, "lookupswitch padding");
+      auto padding = (4 - (*pc + 1) % 4) % 4;
+      reader.Skip(padding, "lookupswitch padding");
 
-      auto default_offset = reader->NextI32("lookupswitch default offset");
-      auto npairs = reader->NextI32("lookupswitch npairs");
+      auto default_offset = reader.NextI32("lookupswitch default offset");
+      auto npairs = reader.NextI32("lookupswitch npairs");
 
-      std::vector<int> keys, pairs;
-      for (int i = 0; i < npairs; i++) {
-        auto match = reader->NextI32("lookupswitch match");
-        auto offset = reader->NextI32("lookupswitch offset");
+      if (npairs < 0 || static_cast<size_t>(npairs) > reader.Remaining() / 8)
+        throw VerifyError("Invalid lookupswitch pair count", *pc);
 
-        keys.push_back(match);
-        pairs.push_back(offset);
+      auto keys = ctx->m_arena->NewArray<int>(npairs), pairs = ctx->m_arena->NewArray<int>(npairs);
+      for (int i = 0; i < npairs; i++) {
+        keys[i] = reader.NextI32("lookupswitch match");
+        pairs[i] = reader.NextI32("lookupswitch offset");
       }
 
       auto ls_index = ctx->MakeLookupswitch({
-        { .m_default_target = default_offset, .m_targets = std::move(pairs) }, .m_keys = std::move(keys)
+        { .m_default_target = default_offset, .m_targets = pairs }, .m_keys = keys
       });
-      return Insn(IC::lookupswitch, { .imm = ls_index });
+      return Finish(Insn(IC::lookupswitch, { .imm = ls_index }));
     }
-    case ireturn: return Insn(IC::ireturn);
-    case lreturn: return Insn(IC::lreturn);
-    case freturn: return Insn(IC::freturn);
-    case dreturn: return Insn(IC::dreturn);
-    case areturn: return Insn(IC::areturn);
-    case return_: return Insn(IC::return_);
-
-    case getstatic: return Insn(IC::getstatic, { .index = reader->NextU16("getstatic index") });
-    case putstatic: return Insn(IC::putstatic, { .index = reader->NextU16("putstatic index") });
-
-    case getfield: return Insn(IC::getfield, { .index = reader->NextU16("getfield index") });
-    case putfield: return Insn(IC::putfield, { .index = reader->NextU16("putfield index") });
-
-    case invokevirtual: return Insn(IC::invokevirtual, { .index = reader->NextU16("invokevirtual index") });
-    case invokespecial: return Insn(IC::invokespecial, { .index = reader->NextU16("invokespecial index") });
-    case invokestatic: return Insn(IC::invokestatic, { .index = reader->NextU16("invokestatic index") });
-    case invokeinterface: {
-      auto index = reader->NextU16("invokeinterface index");
-      auto count = reader->NextU8("invokeinterface count");
-      reader->NextU8("invokeinterface padding");
-      return Insn(IC::invokeinterface, { .ii = { index, count } });
-    }
-    case invokedynamic: {
-      auto index = reader->NextU16("invokedynamic index");
-      reader->NextU16("invokedynamic padding");
-      return Insn(IC::invokedynamic, { .index = index });
-    }
-    case new_: {
-      auto index = reader->NextU16("new index");
-      return Insn(IC::new_, { .index = index });
-    }
-    case newarray: return Insn(IC::newarray, { .atype = CheckAType(reader->NextU8("newarray atype")) });
-    case anewarray: return Insn(IC::anewarray, { .index = reader->NextU16("anewarray index") });
-    case arraylength: return Insn(IC::arraylength);
-    case athrow: return Insn(IC::athrow);
-    case checkcast: return Insn(IC::checkcast, { .index = reader->NextU16("checkcast index") });
-    case instanceof: return Insn(IC::instanceof, { .index = reader->NextU16("instanceof index") });
-    case monitorenter: return Insn(IC::monitorenter);
-    case monitorexit: return Insn(IC::monitorexit);
-
     case wide: {
-      switch (auto widened_opc = reader->NextU8("wide opcode")) {
-        case iload: return Insn(IC::iload, { .index = reader->NextU16("wide iload index") });
-        case lload: return Insn(IC::lload, { .index = reader->NextU16("wide lload index") });
-        case fload: return Insn(IC::fload, { .index = reader->NextU16("wide fload index") });
-        case dload: return Insn(IC::dload, { .index = reader->NextU16("wide dload index") });
-        case aload: return Insn(IC::aload, { .index = reader->NextU16("wide aload index") });
-        case istore: return Insn(IC::istore, { .index = reader->NextU16("wide istore index") });
-        case lstore: return Insn(IC::lstore, { .index = reader->NextU16("wide lstore index") });
-        case fstore: return Insn(IC::fstore, { .index = reader->NextU16("wide fstore index") });
-        case dstore: return Insn(IC::dstore, { .index = reader->NextU16("wide dstore index") });
-        case astore: return Insn(IC::astore, { .index = reader->NextU16("wide astore index") });
-        case iinc: return Insn(IC::iinc, { .iinc = { reader->NextU16("wide iinc index"), reader->NextI16("wide iinc immediate") } });
-        case ret: return Insn(IC::ret, { .index = reader->NextU16("wide ret index") });
-
-        default:
-          throw VerifyError("Unknown wide opcode " + std::to_string(widened_opc), reader->GetOriginalOffs());
-      }
-    }
+      auto widened_opc = reader.NextU8("wide opcode");
+      const OpcodeInfo& info = OPCODES[widened_opc];
 
-    case multianewarray: {
-      auto index = reader->NextU16("multianewarray index");
-      auto dimensions = reader->NextU8("multianewarray dimensions");
-      return Insn(IC::multianewarray, { .mna = { index, dimensions } });
-    }
+      if (widened_opc == iinc) {
+        auto index = reader.NextU16("wide iinc index");
+        auto imm = reader.NextI16("wide iinc immediate");
+        return Finish(Insn(IC::iinc, { .iinc = { index, imm } }));
+      }
 
-    case ifnull: return Insn(IC::ifnull, { .index = reader->NextU16("ifnull offset") });
-    case ifnonnull: return Insn(IC::ifnonnull, { .index = reader->NextU16("ifnonnull offset") });
+      // Only the forms taking a local variable index can be widened
+      bool is_local = info.m_operand == OperandKind::U8Index && info.m_code != IC::ldc;
+      if (!is_local)
+        throw VerifyError("Unknown wide opcode " + std::to_string(widened_opc), *pc);
 
-    case goto_w: return Insn(IC::goto_, { .imm = reader->NextI32("goto_w offset") });
-    case jsr_w: return Insn(IC::jsr, { .imm = reader->NextI32("jsr_w offset") });
+      return Finish(Insn(info.m_code, { .index = reader.NextU16("wide index") }));
+    }
+    default:
+      throw VerifyError("Unknown opcode " + std::to_string(opc), *pc);
+  }
+}
 
+Insn Insn::Decode(ByteSpan code, uint32_t* pc, ParseContext* ctx) {
+  const uint8_t* bytes = code.data() + *pc;
+  const OpcodeInfo& info = OPCODES[bytes[0]];
+
+  if (info.m_length == 0)
+    return DecodeVariableLength(code, pc, ctx);
+
+  if (*pc + info.m_length > code.size())
+    throw VerifyError("Unexpected end of code while reading " + std::string(CodeName(info.m_code)) + " operands", *pc);
+  *pc += info.m_length;
+
+  switch (info.m_operand) {
+    case OperandKind::None: return Insn(info.m_code);
+    case OperandKind::ImplicitIndex: return Insn(info.m_code, { .index = static_cast<uint16_t>(info.m_implicit) });
+    case OperandKind::ImplicitInt: return Insn(info.m_code, { .imm = info.m_implicit });
+    case OperandKind::ImplicitFloat: return Insn(info.m_code, { .f_imm = static_cast<float>(info.m_implicit) });
+    case OperandKind::ImplicitDouble: return Insn(info.m_code, { .d_imm = static_cast<double>(info.m_implicit) });
+    case OperandKind::U8Index: return Insn(info.m_code, { .index = bytes[1] });
+    case OperandKind::U16Index: return Insn(info.m_code, { .index = ReadU16(bytes + 1) });
+    case OperandKind::I8Imm: return Insn(info.m_code, { .imm = static_cast<int8_t>(bytes[1]) });
+    case OperandKind::I16Imm: return Insn(info.m_code, { .imm = static_cast<int16_t>(ReadU16(bytes + 1)) });
+    // TEMPORARY: Program counter offsets will be converted later to instruction indices
+    case OperandKind::Branch16: return Insn(info.m_code, { .imm = static_cast<int16_t>(ReadU16(bytes + 1)) });
+    case OperandKind::Branch32: return Insn(info.m_code, { .imm = ReadI32(bytes + 1) });
+    case OperandKind::NewArray: return Insn(info.m_code, { .atype = CheckAType(bytes[1]) });
+    case OperandKind::IInc:
+      return Insn(info.m_code, { .iinc = { bytes[1], static_cast<int8_t>(bytes[2]) } });
+    case OperandKind::InvokeInterface:
+      return Insn(info.m_code, { .ii = { ReadU16(bytes + 1), bytes[3] } });
+    case OperandKind::InvokeDynamic: return Insn(info.m_code, { .index = ReadU16(bytes + 1) });
+    case OperandKind::Multianewarray:
+      return Insn(info.m_code, { .mna = { ReadU16(bytes + 1), bytes[3] } });
     default:
-      throw VerifyError("Unknown opcode " + std::to_string(opc), reader->GetOriginalOffs());
+      throw VerifyError("Unknown opcode " + std::to_string(bytes[0]), *pc - info.m_length);
   }
 }
 
@@ -526,61 +559,146 @@ bool Insn::IsIf() const {
 }
 
 bool Insn::ContainsBranch() const {
-  return m_code >= InsnCode::goto_ && m_code <= InsnCode::ifnull || m_code == InsnCode::tableswitch || m_code == InsnCode::lookupswitch;
+  return (m_code >= InsnCode::goto_ && m_code <= InsnCode::ifnull) || m_code == InsnCode::tableswitch
+         || m_code == InsnCode::lookupswitch;
 }
 
-BootstrapMethodsAttribute BootstrapMethodsAttribute::parse(ByteReader *reader) {
+BootstrapMethodsAttribute BootstrapMethodsAttribute::parse(ByteReader *reader, ParseContext *ctx) {
   BootstrapMethodsAttribute attr;
 
   uint16_t num_bootstrap_methods = reader->NextU16("num bootstrap methods");
-  for (int i = 0; i < num_bootstrap_methods; i++) {
-    BootstrapMethod method {
-      .m_method_ref = reader->NextU16("bootstrap method ref")
-    };
+  attr.m_methods = ctx->m_arena->NewArray<BootstrapMethod>(num_bootstrap_methods);
+  for (auto& method : attr.m_methods) {
+    method.m_method_ref = reader->NextU16("bootstrap method ref");
 
     uint16_t num_bootstrap_arguments = reader->NextU16("num bootstrap arguments");
-    for (int j = 0; j < num_bootstrap_arguments; j++) {
-      method.m_arguments.push_back(reader->NextU16("bootstrap argument"));
+    method.m_arguments = ctx->m_arena->NewArray<uint16_t>(num_bootstrap_arguments);
+    for (auto& argument : method.m_arguments) {
+      argument = reader->NextU16("bootstrap argument");
     }
-
-    attr.m_methods.push_back(method);
   }
 
   return attr;
 }
 
 std::optional<int> CodeAttribute::ProgramCounterToInsnIndex(int pc) const {
-  if (0 <= pc && pc < m_pc_to_index.size()) {
-    return m_pc_to_index[pc];
+  auto it = std::lower_bound(m_code.begin(), m_code.end(), pc, [] (const Insn& insn, int pc) {
+    return insn.GetPC() < pc;
+  });
+  if (it != m_code.end() && it->GetPC() == pc) {
+    return static_cast<int>(it - m_code.begin());
   }
   return std::nullopt;
 }
 
-CodeAttribute CodeAttribute::parse(ByteReader *reader, ParseContext *parse_context) {
-  auto max_stack = reader->NextU16("max stack");
-  auto max_locals = reader->NextU16("max locals");
+/**
+ * Which PCs of a method's code start an instruction, as a bitmap with a running count per word, so that a PC can be
+ * mapped to its instruction index in constant time with an eighth of a byte per byte of code.
+ */
+class InstructionStarts {
+  std::vector<uint64_t> m_bits;
+  // Number of instructions starting before each word of m_bits
+  std::vector<uint16_t> m_ranks;
+
+public:
+  void Reset(uint32_t code_length) {
+    m_bits.assign((code_length + 63) / 64, 0);
+  }
+
+  void Mark(uint32_t pc) {
+    m_bits[pc / 64] |= uint64_t{1} << (pc % 64);
+  }
+
+  /** Call once every instruction is marked, before IndexOf. */
+  void ComputeRanks() {
+    m_ranks.resize(m_bits.size());
+    uint16_t rank = 0;
+    for (size_t i = 0; i < m_bits.size(); ++i) {
+      m_ranks[i] = rank;
+      rank += __builtin_popcountll(m_bits[i]);
+    }
+  }
+
+  /** Instruction index of the instruction starting at pc, or -1 if no instruction starts there. */
+  int IndexOf(int64_t pc) const {
+    if (pc < 0 || pc >= static_cast<int64_t>(m_bits.size() * 64))
+      return -1;
+    uint64_t word = m_bits[pc / 64], bit = uint64_t{1} << (pc % 64);
+    if (!(word & bit))
+      return -1;
+    return m_ranks[pc / 64] + __builtin_popcountll(word & (bit - 1));
+  }
+};
+
+RawCodeAttribute RawCodeAttribute::parse(ByteReader *reader, uint32_t length, ParseContext *parse_context) {
+  PhaseTimer timer { parse_context->m_profile ? &parse_context->m_profile->m_code_ns : nullptr };
+
+  ByteSpan bytes = reader->NextNBytes(length, "code attribute");
+
+  // Walk the attribute's structure, so that it's known to be well formed and we know where the line numbers are
+  RawCodeAttribute raw;
+  ByteReader skim { bytes };
+  skim.SetCurrentComponent("code attribute");
+  skim.Skip(4, "max stack and locals");
+  skim.Skip(skim.NextU32("code length"), "code");
+  skim.Skip(skim.NextU16("exception table length") * 8, "exception table");
+
+  uint16_t attributes_count = skim.NextU16("attributes count");
+  for (int i = 0; i < attributes_count; i++) {
+    auto name_index = skim.NextU16("attribute name index");
+    auto attribute_length = skim.NextU32("attribute length");
+    const Symbol* name = parse_context->cp->GetSymbol(name_index);
+    if (name == LINE_NUMBER_TABLE)
+      raw.m_line_number_table = skim.GetOffs();
+    else if (name == STACK_MAP_TABLE) {
+      raw.m_stack_map_table = skim.GetOffs();
+      raw.m_stack_map_table_length = attribute_length;
+    }
+    skim.Skip(attribute_length, "attribute");
+  }
+
+  raw.m_bytes = parse_context->m_arena->CopyArray(bytes.data(), bytes.size());
+  return raw;
+}
+
+CodeAttribute CodeAttribute::parse(const RawCodeAttribute& raw, Arena* arena) {
+  ByteReader reader { raw.m_bytes.data(), raw.m_bytes.size() };
+  reader.SetCurrentComponent("code attribute");
+
+  // Only used to collect switch tables; the constant pool was needed when the attribute was copied, but not now
+  ParseContext ctx { {}, {}, nullptr, arena };
 
-  uint32_t code_length = reader->NextU32("code length");
-  auto code_reader = reader->slice("code", code_length);
+  auto max_stack = reader.NextU16("max stack");
+  auto max_locals = reader.NextU16("max locals");
 
-  std::vector<std::optional<uint16_t>> pc_to_index(code_length);
+  uint32_t code_length = reader.NextU32("code length");
+  ByteSpan bytes = reader.NextNBytes(code_length, "code");
+  if (code_length > UINT16_MAX)
+    throw VerifyError("Code attribute too long", reader.GetOriginalOffs());
 
-  std::vector<Insn> code;
-  int instruction_index = 0;
-  while (!code_reader.Eof()) {
-    uint16_t pc = code_reader.GetOffs();
+  // Instructions are collected in a reused buffer, then copied into the arena once we know how many there are
+  thread_local std::vector<Insn> code;
+  thread_local InstructionStarts starts;
+  code.clear();
+  starts.Reset(code_length);
 
-    auto instruction = Insn::parse(&code_reader, parse_context);
-    instruction.SetPC(pc);
+  uint32_t pc = 0;
+  while (pc < code_length) {
+    uint32_t start = pc;
+    starts.Mark(start);
 
+    auto instruction = Insn::Decode(bytes, &pc, &ctx);
+    instruction.SetPC(start);
     code.push_back(instruction);
-    pc_to_index[pc] = instruction_index++;
   }
 
-  const auto CheckedPcToIndex = [&](int pc) {
-    if (pc < 0 || pc >= pc_to_index.size() || !pc_to_index[pc].has_value())
+  starts.ComputeRanks();
+
+  const auto CheckedPcToIndex = [&](int64_t pc) {
+    int index = starts.IndexOf(pc);
+    if (index < 0)
       throw VerifyError("Invalid program counter", pc);
-    return pc_to_index[pc].value();
+    return static_cast<uint16_t>(index);
   };
 
   // Now that we know where all instructions are, replace PC offsets with branch indices
@@ -588,64 +706,67 @@ CodeAttribute CodeAttribute::parse(ByteReader *reader, ParseContext *parse_conte
     int pc = instruction.GetPC();
 
     const auto PcToIndex = [&](int& branch) {
-      branch = CheckedPcToIndex(pc + branch);
+      branch = CheckedPcToIndex(static_cast<int64_t>(pc) + branch);
     };
 
     if (instruction.ContainsBranch()) {
       if (instruction.GetCode() == InsnCode::lookupswitch) {
-        parse_context->m_lookupswitches.at(instruction.m_data.imm).TransformTargets(PcToIndex);
+        ctx.m_lookupswitches.at(instruction.m_data.imm).TransformTargets(PcToIndex);
       } else if (instruction.GetCode() == InsnCode::tableswitch) {
-        parse_context->m_tableswitches.at(instruction.m_data.imm).TransformTargets(PcToIndex);
-      } else if (instruction.GetCode() == InsnCode::jsr || instruction.GetCode() == InsnCode::goto_) {
-        instruction.m_data.index = CheckedPcToIndex(pc + instruction.m_data.imm);
+        ctx.m_tableswitches.at(instruction.m_data.imm).TransformTargets(PcToIndex);
       } else {
-        instruction.m_data.index = CheckedPcToIndex(pc + static_cast<int16_t>(instruction.m_data.index));
+        instruction.m_data.index = CheckedPcToIndex(pc + instruction.m_data.imm);
       }
     }
   }
 
-  reader->NextNBytes(code_length, "code");
+  // Switch instructions point into these tables, so they need their final addresses before the fixup
+  auto tableswitches = arena->CopyArray(ctx.m_tableswitches);
+  auto lookupswitches = arena->CopyArray(ctx.m_lookupswitches);
+  for (auto& instruction : code) {
+    if (instruction.GetCode() == InsnCode::tableswitch) {
+      instruction.m_data.ts = &tableswitches[instruction.m_data.imm];
+    } else if (instruction.GetCode() == InsnCode::lookupswitch) {
+      instruction.m_data.ls = &lookupswitches[instruction.m_data.imm];
+    }
+  }
 
-  uint16_t exception_table_length = reader->NextU16("exception table length");
-  ExceptionTableAttribute table;
+  // The end of a range is exclusive, so it may also be the end of the code
+  const auto EndPcToIndex = [&](int64_t pc) {
+    return pc == code_length ? static_cast<uint16_t>(code.size()) : CheckedPcToIndex(pc);
+  };
 
-  for (int i = 0; i < exception_table_length; i++) {
-    ExceptionTableEntry ent {
-      .m_start = CheckedPcToIndex(reader->NextU16("start pc")),
-      .m_end = CheckedPcToIndex(reader->NextU16("end pc")),
-      .m_handler = CheckedPcToIndex(reader->NextU16("handler pc")),
-      .m_catch_type = reader->NextU16("catch type")
+  uint16_t exception_table_length = reader.NextU16("exception table length");
+  ExceptionTableAttribute table { arena->NewArray<ExceptionTableEntry>(exception_table_length) };
+
+  for (auto& ent : table.m_exceptions) {
+    ent = {
+      .m_start = CheckedPcToIndex(reader.NextU16("start pc")),
+      .m_end = EndPcToIndex(reader.NextU16("end pc")),
+      .m_handler = CheckedPcToIndex(reader.NextU16("handler pc")),
+      .m_catch_type = reader.NextU16("catch type")
     };
-    table.m_exceptions.push_back(ent);
   }
 
   std::optional<LineNumberTable> lnt;
 
-  uint16_t attributes_count = reader->NextU16("attributes count");
-  for (int i = 0; i < attributes_count; i++) {
-    auto name_index = reader->NextU16("attribute name index");
-    auto length = reader->NextU32("attribute length");
-
-    if (parse_context->cp->GetUtf8(name_index) == "LineNumberTable") {
-      lnt = LineNumberTable {};
-      uint16_t table_length = reader->NextU16("line number table length");
-
-      for (int j = 0; j < table_length; j++) {
-        LineNumberTableEntry ent {
-          .m_start = CheckedPcToIndex(reader->NextU16("start pc")),
-          .m_line_number = reader->NextU16("line number")
-        };
-        lnt.value().m_entries.push_back(ent);
-      }
-    } else {
-      reader->NextNBytes(length, "attribute");
+  if (raw.m_line_number_table) {
+    ByteReader lnt_reader { raw.m_bytes.data() + raw.m_line_number_table, raw.m_bytes.size() - raw.m_line_number_table };
+    uint16_t table_length = lnt_reader.NextU16("line number table length");
+    lnt = LineNumberTable { arena->NewArray<LineNumberTableEntry>(table_length) };
+
+    for (auto& ent : lnt->m_entries) {
+      ent = {
+        .m_start = CheckedPcToIndex(lnt_reader.NextU16("start pc")),
+        .m_line_number = lnt_reader.NextU16("line number")
+      };
     }
   }
 
   return CodeAttribute {
     .m_max_stack = max_stack,
     .m_max_locals = max_locals,
-    .m_code = code,
+    .m_code = arena->CopyArray(code),
     .m_exceptions = {},
     .m_exception_table = table,
     .m_line_number_table = lnt
@@ -664,10 +785,10 @@ FieldInfo FieldInfo::parse(ByteReader *reader, ParseContext *ctx) {
     auto name_index = reader->NextU16("field attribute name index");
     auto length = reader->NextU32("field attribute length");
 
-    if (ctx->cp->Get<EntryUtf8>(name_index)->m_value == "ConstantValue") {
+    if (ctx->cp->GetSymbol(name_index) == CONSTANT_VALUE) {
       info.m_constant_value = ConstantValueAttribute { .m_index = reader->NextU16("constant value index") };
     } else {
-      reader->NextNBytes(length, "field attribute");
+      reader->Skip(length, "field attribute");
     }
   }
 
@@ -688,29 +809,62 @@ MethodInfo MethodInfo::parse(ByteReader *reader, ParseContext *parse_context) {
     auto name_index = reader->NextU16("method attribute name index");
     auto length = reader->NextU32("method attribute length");
 
-    const auto &attrib_name = parse_context->cp->Get<EntryUtf8>(name_index)->m_value;
-
-    if (attrib_name == "Code") {
-      info.m_code = CodeAttribute::parse(reader, parse_context);
+    if (parse_context->cp->GetSymbol(name_index) == CODE) {
+      auto raw = RawCodeAttribute::parse(reader, length, parse_context);
+      info.m_code = parse_context->m_arena->New<LazyCode>(raw, parse_context->m_code_decoder);
     } else {
-      reader->NextNBytes(length, "method attribute");
+      reader->Skip(length, "method attribute");
     }
   }
 
   return info;
 }
 
-void MethodInfo::FixupSwitchInstructions(ParseContext *ctx) {
-  if (!m_code.has_value()) return;
+const CodeAttribute * MethodInfo::GetCode() const {
+  if (!m_code)
+    return nullptr;
 
-  auto& code = m_code.value();
-  for (auto& insn : code.m_code) {
-    if (insn.GetCode() == InsnCode::tableswitch) {
-      insn.m_data.ts = &ctx->m_tableswitches.at(insn.m_data.imm);
-    } else if (insn.GetCode() == InsnCode::lookupswitch) {
-      insn.m_data.ls = &ctx->m_lookupswitches.at(insn.m_data.imm);
-    }
-  }
+  if (auto* decoded = m_code->m_decoded.load(std::memory_order_acquire))
+    return decoded;
+
+  CodeDecoder* decoder = m_code->m_decoder;
+  std::lock_guard lock { decoder->m_mutex };
+
+  // Another thread may have decoded it while we waited
+  if (auto* decoded = m_code->m_decoded.load(std::memory_order_relaxed))
+    return decoded;
+
+  auto* decoded = decoder->m_arena.New<CodeAttribute>(CodeAttribute::parse(m_code->m_raw, &decoder->m_arena));
+  m_code->m_decoded.store(decoded, std::memory_order_release);
+  return decoded;
+}
+
+const CodeAttribute * MethodInfo::GetExecutableCode() const {
+  if (!m_code)
+    return nullptr;
+
+  if (auto* executable = m_code->m_executable.load(std::memory_order_acquire))
+    return executable;
+
+  const CodeAttribute* decoded = GetCode();
+
+  std::lock_guard lock { m_code->m_decoder->m_mutex };
+  if (auto* executable = m_code->m_executable.load(std::memory_order_relaxed))
+    return executable;
+
+  // Fused (and later quickened) in a copy of the instructions, so that the decoded code stays as it was. The switch
+  // tables are never written to, so they are shared.
+  Arena& arena = m_code->m_decoder->m_arena;
+  auto* executable = arena.New<CodeAttribute>(*decoded);
+  executable->m_code = arena.CopyArray(decoded->m_code.data(), decoded->m_code.size());
+  FuseSuperinstructions(executable);
+
+  auto* profile = arena.New<MethodProfile>();
+  profile->m_backedges = arena.NewArray<uint64_t>(executable->m_code.size());
+  m_code->m_profile = profile;
+
+  m_code->m_executable.store(executable, std::memory_order_release);
+  return executable;
 }
 
 long ParseContext::MakeTableswitch(TableswitchData &&data) {
@@ -727,14 +881,15 @@ Insn::Insn(InsnCode code) : m_code(code) {
   m_data.imm = 0;
 }
 
-Insn::Insn(InsnCode code, decltype(Insn::m_data) data) : m_code(code), m_data(data) {}
+Insn::Insn(InsnCode code, decltype(Insn::m_data) data) : m_data(data), m_code(code) {}
 
 InsnCode Insn::GetCode() const {
   return m_code;
 }
 
 uint16_t Insn::Index() const {
-  assert(m_code >= InsnCode::dload && m_code <= InsnCode::ifnull);
+  assert((m_code >= InsnCode::dload && m_code <= InsnCode::ifnull) || m_code == InsnCode::ldc
+         || m_code == InsnCode::ldc2_w || m_code == InsnCode::ret);
   return m_data.index;
 }
 
@@ -791,6 +946,11 @@ const InvokeInterfaceData * Insn::GetInvokeInterfaceData() const {
   return &m_data.ii;
 }
 
+InlineCache * Insn::GetInlineCache() const {
+  assert(m_code == InsnCode::invokevirtual_quick || m_code == InsnCode::invokeinterface_quick);
+  return m_data.cache;
+}
+
 PrimitiveType Insn::GetArrayType() const {
   assert(m_code == InsnCode::newarray);
   return m_data.atype;
@@ -947,12 +1107,32 @@ const char *CodeName(InsnCode code) {
     case I::newarray: return "newarray";
     case I::tableswitch: return "tableswitch";
     case I::lookupswitch: return "lookupswitch";
+    case I::getstatic_quick: return "getstatic_quick";
+    case I::getstatic2_quick: return "getstatic2_quick";
+    case I::putstatic_quick: return "putstatic_quick";
+    case I::putstatic2_quick: return "putstatic2_quick";
+    case I::invokestatic_quick: return "invokestatic_quick";
+    case I::invokevirtual_quick: return "invokevirtual_quick";
+    case I::invokeinterface_quick: return "invokeinterface_quick";
+    case I::iload_iload_iadd_istore: return "iload_iload_iadd_istore";
+    case I::iload_iload_if_icmpge: return "iload_iload_if_icmpge";
+    case I::iload_iload_if_icmplt: return "iload_iload_if_icmplt";
+    case I::iload_iload: return "iload_iload";
+    case I::aload_aload: return "aload_aload";
+    case I::iinc_goto: return "iinc_goto";
+    case I::iload_ireturn: return "iload_ireturn";
   }
 
   throw std::runtime_error("Unreachable");
 }
 
-Classfile Classfile::parse(ByteReader *reader) {
+Classfile Classfile::parse(ByteReader *reader, Arena* arena, ParseProfile* profile) {
+  PhaseTimer total_timer { profile ? &profile->m_total_ns : nullptr };
+  if (profile) {
+    profile->m_classes++;
+    profile->m_bytes += reader->Remaining();
+  }
+
   uint32_t magic = reader->NextU32("magic");
   if (magic != 0xCAFEBABE) {
     throw VerifyError("Invalid magic number", 0);
@@ -961,14 +1141,14 @@ Classfile Classfile::parse(ByteReader *reader) {
   uint16_t minor = reader->NextU16("minor version");
   uint16_t major = reader->NextU16("major version");
 
-  ClassfileVersion version { major, minor };
-
-  ConstantPool cp = ConstantPool::parse(reader);
+  ClassfileVersion version { minor, major };
 
-  std::vector<LookupswitchData> ls;
-  std::vector<TableswitchData> ts;
+  ConstantPool cp = [&] {
+    PhaseTimer timer { profile ? &profile->m_constant_pool_ns : nullptr };
+    return ConstantPool::parse(reader);
+  }();
 
-  ParseContext ctx { ts, ls, &cp };
+  ParseContext ctx { {}, {}, &cp, arena, profile, arena->New<CodeDecoder>() };
 
   auto access_flags = static_cast<AccessFlags>(reader->NextU16("access flags"));
   uint16_t this_class = reader->NextU16("this class");
@@ -978,60 +1158,81 @@ Classfile Classfile::parse(ByteReader *reader) {
   assert(super_class == 0 || cp.Has<EntryClass>(super_class));
 
   uint16_t interfaces_count = reader->NextU16("interfaces count");
-  std::vector<uint16_t> interfaces;
+  auto interfaces = arena->NewArray<uint16_t>(interfaces_count);
 
-  for (int i = 0; i < interfaces_count; i++) {
-    uint16_t v = reader->NextU16("interface");
-    interfaces.push_back(v);
+  for (auto& v : interfaces) {
+    v = reader->NextU16("interface");
     assert(cp.Has<EntryClass>(v));
   }
 
   uint16_t fields_count = reader->NextU16("fields count");
-  std::vector<FieldInfo> fields;
+  auto fields = arena->NewArray<FieldInfo>(fields_count);
 
-  for (int i = 0; i < fields_count; i++) {
-    fields.push_back(FieldInfo::parse(reader, &ctx));
+  {
+    PhaseTimer timer { profile ? &profile->m_fields_ns : nullptr };
+    for (auto& field : fields) {
+      field = FieldInfo::parse(reader, &ctx);
+    }
   }
 
   uint16_t methods_count = reader->NextU16("methods count");
-  std::vector<MethodInfo> methods;
-
-  for (int i = 0; i < methods_count; i++) {
-    methods.push_back(MethodInfo::parse(reader, &ctx));
+  auto methods = arena->NewArray<MethodInfo>(methods_count);
+
+  // Code attributes are timed separately, so take their share back out of the methods phase afterwards
+  uint64_t methods_ns = 0, code_ns_before = profile ? profile->m_code_ns : 0;
+  {
+    PhaseTimer timer { profile ? &methods_ns : nullptr };
+    for (auto& method : methods) {
+      method = MethodInfo::parse(reader, &ctx);
+    }
   }
+  if (profile)
+    profile->m_methods_ns += methods_ns - (profile->m_code_ns - code_ns_before);
 
   uint16_t attributes_count = reader->NextU16("attributes count");
   std::optional<BootstrapMethodsAttribute> bootstrap;
 
-  for (int i = 0; i < attributes_count; i++) {
-    const auto& name = cp.GetUtf8(reader->NextU16("attribute name"));
-    auto length = reader->NextU32("attribute length");
+  {
+    PhaseTimer timer { profile ? &profile->m_attributes_ns : nullptr };
+    for (int i = 0; i < attributes_count; i++) {
+      const Symbol* name = cp.GetSymbol(reader->NextU16("attribute name"));
+      auto length = reader->NextU32("attribute length");
 
-    if (name == "BootstrapMethods") {
-      bootstrap = BootstrapMethodsAttribute::parse(reader);
-    } else {
-      reader->NextNBytes(length, "attribute data");
+      if (name == BOOTSTRAP_METHODS) {
+        bootstrap = BootstrapMethodsAttribute::parse(reader, &ctx);
+      } else {
+        reader->Skip(length, "attribute data");
+      }
     }
   }
 
-  for (auto & method : methods) {
-    method.FixupSwitchInstructions(&ctx);
-  }
-
   Classfile cf { std::move(cp) };
 
   cf.m_version = version;
   cf.m_access_flags = access_flags;
   cf.m_this_class = this_class;
   cf.m_super_class = super_class;
-  cf.m_interfaces = std::move(interfaces);
-  cf.m_fields = std::move(fields);
-  cf.m_methods = std::move(methods);
-  cf.m_bootstrap_methods = std::move(bootstrap);
+  cf.m_interfaces = interfaces;
+  cf.m_fields = fields;
+  cf.m_methods = methods;
+  cf.m_bootstrap_methods = bootstrap;
 
   return cf;
 }
 
+std::string Classfile::PeekName(ByteSpan bytes) {
+  ByteReader reader { bytes };
+  if (reader.NextU32("magic") != 0xCAFEBABE) {
+    throw VerifyError("Invalid magic number", 0);
+  }
+
+  reader.Skip(4, "version");
+  ConstantPoolLayout layout = ConstantPool::Skim(&reader);
+  reader.Skip(2, "access flags");
+
+  return ConstantPool::ReadClassName(bytes, layout, reader.NextU16("this class"));
+}
+
 std::string Classfile::ToString() const {
   std::stringstream ss;
 
@@ -1041,18 +1242,22 @@ std::string Classfile::ToString() const {
 }
 
 const std::string & Classfile::GetName() const {
-  return m_cp.GetUtf8(m_cp.Get<EntryClass>(m_this_class)->m_name_index);
+  return GetNameSymbol()->m_value;
+}
+
+const Symbol * Classfile::GetNameSymbol() const {
+  return m_cp.GetSymbol(m_cp.Get<EntryClass>(m_this_class).m_name_index);
 }
 
-std::optional<std::string> Classfile::GetSuperclassName() const {
-  return m_super_class ? (std::optional { m_cp.GetUtf8(m_cp.Get<EntryClass>(m_super_class)->m_name_index) }) : std::nullopt;
+const Symbol* Classfile::GetSuperclassName() const {
+  return m_super_class ? m_cp.GetSymbol(m_cp.Get<EntryClass>(m_super_class).m_name_index) : nullptr;
 }
 
-std::vector<std::string> Classfile::GetInterfaceNames() const {
-  std::vector<std::string> result;
+std::vector<const Symbol*> Classfile::GetInterfaceNames() const {
+  std::vector<const Symbol*> result;
 
   for (auto idx : m_interfaces) {
-    result.push_back(m_cp.GetUtf8(m_cp.Get<EntryClass>(idx)->m_name_index));
+    result.push_back(m_cp.GetSymbol(m_cp.Get<EntryClass>(idx).m_name_index));
   }
 
   return result;
@@ -11,12 +11,24 @@
 #include <algorithm>
 #include <exception>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include "arena.h"
 #include "byte_reader.h"
 #include "constant_pool.h"
+#include "sha256.h"
+
+namespace bjvm {
+class BytecodeInterpreter;
+class ClassArchive;
+class ClassInstance;
+class InlineCache;
+}
 
 namespace bjvm::classfile {
 
-/** Exception thrown when a classfile fails verification. For now we'll do very light verification. */
+/** Exception thrown when a classfile is malformed, or its code fails verification (see verifier.h). */
 struct VerifyError : std::runtime_error {
   int m_offset;
 
@@ -59,7 +71,21 @@ enum class InsnCode : uint8_t {
   iconst, dconst, fconst, lconst,
 
   /** Cursed */
-  iinc, invokeinterface, multianewarray, newarray, tableswitch, lookupswitch, ret
+  iinc, invokeinterface, multianewarray, newarray, tableswitch, lookupswitch, ret,
+
+  /**
+   * Quickened: never decoded, but written over an instruction by the interpreter once it has resolved what the
+   * instruction refers to. The 2 forms move longs and doubles.
+   */
+  getstatic_quick, getstatic2_quick, putstatic_quick, putstatic2_quick, invokestatic_quick, invokevirtual_quick,
+  invokeinterface_quick,
+
+  /**
+   * Superinstructions: written over the first instruction of a common sequence (see superinstructions.h), which they
+   * execute in one go. The rest of the sequence is left in place, and supplies the operands.
+   */
+  iload_iload_iadd_istore, iload_iload_if_icmpge, iload_iload_if_icmplt, iload_iload, aload_aload, iinc_goto,
+  iload_ireturn
 };
 
 enum class PrimitiveType : uint8_t {
@@ -71,7 +97,7 @@ const char* CodeName(InsnCode code);
 struct SwitchDataBase {
   int m_default_target;
   // Instruction index, not PC
-  std::vector<int> m_targets;
+  ArenaArray<int> m_targets;
 
   template <typename L>
   void TransformTargets(L lambda) {
@@ -90,6 +116,11 @@ struct IIncData {
   int16_t m_const;
 };
 
+struct CodeAttribute;
+struct MethodInfo;
+
+void FuseSuperinstructions(CodeAttribute* code);
+
 struct InvokeInterfaceData {
   uint16_t m_index;
   uint8_t m_count;
@@ -101,9 +132,31 @@ struct MultianewarrayData {
 };
 
 struct LookupswitchData : SwitchDataBase {
-  std::vector<int> m_keys;
+  ArenaArray<int> m_keys;
 };
 
+/**
+ * Time spent in each phase of Classfile::parse, accumulated over every call it's passed to. Only gathered when a
+ * profile is given, so ordinary parsing doesn't pay for reading the clock.
+ */
+struct ParseProfile {
+  uint64_t m_constant_pool_ns = 0;
+  uint64_t m_fields_ns = 0;
+  // Method headers and attributes other than Code
+  uint64_t m_methods_ns = 0;
+  // Checking and copying Code attributes (they are decoded later, on first use -- see MethodInfo::GetCode)
+  uint64_t m_code_ns = 0;
+  // Attributes of the class itself
+  uint64_t m_attributes_ns = 0;
+  // Whole of parse, including anything not covered above (header, interfaces, building the Classfile)
+  uint64_t m_total_ns = 0;
+
+  size_t m_classes = 0;
+  size_t m_bytes = 0;
+};
+
+class CodeDecoder;
+
 /** Passed down when parsing to allocate useful information. */
 struct ParseContext {
   std::vector<TableswitchData> m_tableswitches;
@@ -111,6 +164,14 @@ struct ParseContext {
 
   const ConstantPool* cp;
 
+  // Where the class's metadata is allocated
+  Arena* m_arena;
+
+  ParseProfile* m_profile = nullptr;
+
+  // Shared by the class's methods to decode their code on first use
+  CodeDecoder* m_code_decoder = nullptr;
+
   long MakeTableswitch(TableswitchData&& data);
 
   long MakeLookupswitch(LookupswitchData&& data);
@@ -123,6 +184,9 @@ struct ParseContext {
 class Insn {
   friend struct CodeAttribute;
   friend struct MethodInfo;
+  friend class bjvm::BytecodeInterpreter;
+  friend class bjvm::ClassArchive;
+  friend void FuseSuperinstructions(CodeAttribute* code);
 
   union {
     // for newarray
@@ -145,12 +209,21 @@ class Insn {
     InvokeInterfaceData ii;
     // multianewarray
     MultianewarrayData mna;
+    // getstatic_quick and friends: the field's value, in its class's static storage
+    uint64_t* static_slot;
+    // invokestatic_quick
+    const MethodInfo* method;
+    // invokevirtual_quick and invokeinterface_quick: the call site's cache of receiver classes and their targets
+    InlineCache* cache;
   } m_data = { .imm = 0L };
   InsnCode m_code = InsnCode::nop;
   int m_pc = 0;
 
   explicit Insn(InsnCode code);
   Insn(InsnCode code, decltype(m_data) data);
+
+  /** Decode tableswitch, lookupswitch and wide, whose lengths depend on their operands. */
+  static Insn DecodeVariableLength(ByteSpan code, uint32_t* pc, ParseContext* ctx);
 public:
   Insn() = default;
 
@@ -193,11 +266,17 @@ public:
   /** Get the data for this invokeinterface instruction. */
   const InvokeInterfaceData* GetInvokeInterfaceData() const;
 
+  /** Get the inline cache of this invokevirtual_quick or invokeinterface_quick instruction. */
+  InlineCache* GetInlineCache() const;
+
   /** Get the primitive type of this newarray instruction. */
   PrimitiveType GetArrayType() const;
 
-  /** Parse an instruction from a reader. */
-  static Insn parse(ByteReader* reader, ParseContext* cp);
+  /**
+   * Decode the instruction at *pc in a method's code, and advance *pc past it. Branch targets are left as PC offsets
+   * for CodeAttribute::parse to fix up.
+   */
+  static Insn Decode(ByteSpan code, uint32_t* pc, ParseContext* ctx);
 
   /** Convert this instruction to a readable string. */
   std::string ToString(const ConstantPool* pool = nullptr) const;
@@ -241,18 +320,18 @@ struct ExceptionTableEntry {
  * Attribute containing a list of exceptions that a method may throw -- found as part of a CodeAttribute.
  */
 struct ExceptionTableAttribute {
-  std::vector<ExceptionTableEntry> m_exceptions;
+  ArenaArray<ExceptionTableEntry> m_exceptions;
 };
 
 struct BootstrapMethod {
   uint16_t m_method_ref;
-  std::vector<uint16_t> m_arguments;
+  ArenaArray<uint16_t> m_arguments;
 };
 
 struct BootstrapMethodsAttribute {
-  std::vector<BootstrapMethod> m_methods;
+  ArenaArray<BootstrapMethod> m_methods;
 
-  static BootstrapMethodsAttribute parse(ByteReader* reader);
+  static BootstrapMethodsAttribute parse(ByteReader* reader, ParseContext* ctx);
 };
 
 struct ConstantValueAttribute {
@@ -289,24 +368,93 @@ struct LineNumberTableEntry {
  * Line number table attribute, which maps bytecode offsets to line numbers in the source file.
  */
 struct LineNumberTable {
-  std::vector<LineNumberTableEntry> m_entries;
+  ArenaArray<LineNumberTableEntry> m_entries;
+};
+
+/**
+ * A Code attribute as it appears in the classfile, copied into the class's arena but not yet decoded. Copying is much
+ * cheaper than decoding, and the raw bytecode is several times smaller than the decoded instructions.
+ */
+struct RawCodeAttribute {
+  // The attribute's body, from max_stack onwards
+  ArenaArray<uint8_t> m_bytes;
+  // Offset within m_bytes of the body of the LineNumberTable attribute, or 0 if there isn't one. Found when the
+  // attribute is copied, since recognising it needs the constant pool.
+  uint32_t m_line_number_table = 0;
+  // Likewise for the StackMapTable attribute, which is only read by the verifier, and the length of its body
+  uint32_t m_stack_map_table = 0;
+  uint32_t m_stack_map_table_length = 0;
+
+  static RawCodeAttribute parse(ByteReader* reader, uint32_t length, ParseContext* parse_context);
 };
 
 struct CodeAttribute {
   uint16_t m_max_stack;
   uint16_t m_max_locals;
-  std::vector<Insn> m_code;
-  std::vector<uint16_t> m_exceptions;
-
-  // Mapping of program counter to instruction index
-  std::vector<std::optional<uint16_t>> m_pc_to_index;
+  ArenaArray<Insn> m_code;
+  ArenaArray<uint16_t> m_exceptions;
 
   ExceptionTableAttribute m_exception_table;
   std::optional<LineNumberTable> m_line_number_table;
 
+  /** Index of the instruction starting at pc, if any. Instructions are sorted by PC, so this is a binary search. */
   std::optional<int> ProgramCounterToInsnIndex(int pc) const;
 
-  static CodeAttribute parse(ByteReader* reader, ParseContext* parse_context);
+  /** Decode a Code attribute, allocating from arena. Switch instructions point at their own copies of their tables. */
+  static CodeAttribute parse(const RawCodeAttribute& raw, Arena* arena);
+};
+
+/**
+ * Decodes the methods of one class on demand. Decoding is serialised by a mutex, and decoded code is allocated from an
+ * arena of its own, so that methods can be first called from any thread without touching the arena the class was
+ * parsed into.
+ */
+class CodeDecoder {
+  friend struct MethodInfo;
+
+  std::mutex m_mutex;
+  Arena m_arena { 4 * 1024 };
+
+public:
+  /** Allocate something which lives as long as the decoded code, such as what an instruction is quickened to. */
+  template <typename T, typename... Args>
+  T* New(Args&&... args) {
+    std::lock_guard lock { m_mutex };
+    return m_arena.New<T>(std::forward<Args>(args)...);
+  }
+};
+
+struct TypeStates;
+
+/**
+ * How often a method's code has run, as counted by the interpreter, to find hot methods and loops. Counts are updated
+ * without synchronisation, so threads running the same code can lose some of each other's increments.
+ */
+struct MethodProfile {
+  // Calls of the method
+  uint64_t m_invocations = 0;
+  // Jumps from an instruction to itself or an earlier one, i.e. loop iterations, by the index of the instruction jumped
+  // to: the loop's header
+  ArenaArray<uint64_t> m_backedges;
+};
+
+/** A method's code: its raw attribute, and once it has been decoded, the result. */
+struct LazyCode {
+  RawCodeAttribute m_raw;
+  CodeDecoder* m_decoder;
+
+  // Published with release ordering once decoded, so that readers who see it also see the decoded instructions
+  std::atomic<const CodeAttribute*> m_decoded { nullptr };
+
+  // Set when the class is linked, if the code could be verified statically
+  const TypeStates* m_type_states = nullptr;
+
+  // A copy of m_decoded with superinstructions fused in, published once they have been
+  std::atomic<const CodeAttribute*> m_executable { nullptr };
+  // Allocated along with m_executable, and so only to be read once that has been
+  MethodProfile* m_profile = nullptr;
+
+  LazyCode(RawCodeAttribute raw, CodeDecoder* decoder) : m_raw(raw), m_decoder(decoder) {}
 };
 
 enum class FieldAccessFlags {
@@ -332,6 +480,16 @@ struct FieldInfo {
   // If the field is static, this is the value it takes on
   std::optional<ConstantValueAttribute> m_constant_value;
 
+  // Class declaring the field, set when the class is loaded
+  ClassInstance* m_class = nullptr;
+  // Likewise, where the field's value lives: its index in the class's static storage if it's static, otherwise among
+  // the fields of an instance, after those declared by superclasses
+  uint16_t m_slot = 0;
+
+  bool IsStatic() const {
+    return static_cast<int>(m_access_flags) & static_cast<int>(FieldAccessFlags::STATIC);
+  }
+
   static FieldInfo parse(ByteReader* reader, ParseContext* ctx);
 };
 
@@ -355,7 +513,17 @@ struct MethodInfo {
   uint16_t m_name_index;
   uint16_t m_descriptor_index;
 
-  std::optional<CodeAttribute> m_code;
+  // Null for abstract and native methods
+  LazyCode* m_code = nullptr;
+
+  // Class declaring the method, set when the class is loaded
+  ClassInstance* m_class = nullptr;
+  // Local variable slots taken by the arguments, including the receiver (longs and doubles take two), likewise
+  uint16_t m_argument_slots = 0;
+  // Set when the declaring class's methods are linked: the method's slot in the vtable of that class and its
+  // subclasses, or if the class is an interface, in the itables for it. -1 if calls to the method aren't dispatched on
+  // the receiver's class (static and private methods, and constructors).
+  int m_table_index = -1;
 
   static MethodInfo parse(ByteReader* reader, ParseContext* parse_context);
 
@@ -363,19 +531,69 @@ struct MethodInfo {
     throw std::runtime_error("unimplemented");
   }
 
+  bool HasCode() const {
+    return m_code != nullptr;
+  }
+
+  bool IsStatic() const {
+    return static_cast<int>(m_access_flags) & static_cast<int>(MethodAccessFlags::STATIC);
+  }
+
+  bool IsPrivate() const {
+    return static_cast<int>(m_access_flags) & static_cast<int>(MethodAccessFlags::PRIVATE);
+  }
+
+  bool IsAbstract() const {
+    return static_cast<int>(m_access_flags) & static_cast<int>(MethodAccessFlags::ABSTRACT);
+  }
+
+  /** Whether the method is neither public, protected nor private, and so only accessible within its package. */
+  bool IsPackagePrivate() const {
+    constexpr int ACCESS = static_cast<int>(MethodAccessFlags::PUBLIC) | static_cast<int>(MethodAccessFlags::PROTECTED)
+                           | static_cast<int>(MethodAccessFlags::PRIVATE);
+    return !(static_cast<int>(m_access_flags) & ACCESS);
+  }
+
+  /**
+   * Get the method's decoded code, decoding it if this is the first time it's been asked for (e.g. on first
+   * invocation). Returns nullptr if the method has no code. Safe to call from multiple threads; a VerifyError is
+   * thrown if the code is malformed.
+   */
+  const CodeAttribute* GetCode() const;
+
+  /**
+   * Get the method's code for execution: a copy of its decoded code, made the first time it's asked for, with
+   * superinstructions fused in. The interpreter rewrites instructions of the copy as it runs them (e.g. quickening), so
+   * it should only be read by the interpreter and profiler, while GetCode stays as decoded. Safe to call from multiple
+   * threads.
+   */
+  const CodeAttribute* GetExecutableCode() const;
+
+  /** Get the method's profile, or nullptr if it has never been run (i.e. its code was never asked to be executable). */
+  const MethodProfile* GetProfile() const {
+    return m_code && m_code->m_executable.load(std::memory_order_acquire) ? m_code->m_profile : nullptr;
+  }
+
   /**
-   * Replace indices into the lookupswitch/tableswitch data tables with pointers.
-   * @param ctx The parse context.
+   * Get the type state on entry to each instruction, as computed by the verifier when the class was linked. Returns
+   * nullptr if the method has no code, or its code was not verified statically, in which case the interpreter must
+   * check types and stack depths as it goes.
    */
-  void FixupSwitchInstructions(ParseContext * ctx);
+  const TypeStates* GetTypeStates() const {
+    return m_code ? m_code->m_type_states : nullptr;
+  }
 };
 
 /**
  * Parsed Java classfile, along with VM-specific metadata.
+ *
+ * Everything apart from the constant pool -- fields, methods, code and so on -- is allocated from the Arena passed to
+ * parse, which must outlive the Classfile. Method code is only copied when parsing, and decoded on first use (see
+ * MethodInfo::GetCode).
  */
 class Classfile {
-  std::vector<TableswitchData> m_tableswitches;    // used to keep instructions compact and trivially copyable
-  std::vector<LookupswitchData> m_lookupswitches;
+  friend class bjvm::ClassArchive;
+  friend class ClassfileStreamParser;
 
   Classfile(ConstantPool&& cp) : m_cp(std::move(cp)) {}
 
@@ -386,16 +604,25 @@ public:
   AccessFlags m_access_flags;
   uint16_t m_this_class;
   uint16_t m_super_class;
-  std::vector<uint16_t> m_interfaces;
-  std::vector<FieldInfo> m_fields;
-  std::vector<MethodInfo> m_methods;
+  ArenaArray<uint16_t> m_interfaces;
+  ArenaArray<FieldInfo> m_fields;
+  ArenaArray<MethodInfo> m_methods;
 
   std::optional<BootstrapMethodsAttribute> m_bootstrap_methods;
 
+  // SHA-256 of the bytes this class was parsed from, if the loader asked for it (see VMOptions::m_verification_cache)
+  std::optional<Sha256Digest> m_digest;
+
   /**
-   * Parse a classfile from a reader.
+   * Parse a classfile from a reader, allocating its metadata from arena. If profile is given, the time spent in each
+   * phase is added to it.
    */
-  static Classfile parse(ByteReader* reader);
+  static Classfile parse(ByteReader* reader, Arena* arena, ParseProfile* profile = nullptr);
+
+  /**
+   * Read just the name of the class in the given classfile bytes, without parsing the rest of the file.
+   */
+  static std::string PeekName(ByteSpan bytes);
 
   /**
    * Pretty print this classfile in the same format as javap.
@@ -407,6 +634,11 @@ public:
    */
   const std::string& GetName() const;
 
+  /**
+   * Get the name of this class as an interned symbol.
+   */
+  const Symbol* GetNameSymbol() const;
+
   /**
    * Get a MethodInfo for the method with the given name and descriptor.
    */
@@ -415,11 +647,11 @@ public:
   MethodInfo* FindStaticMethod(const char * str, const char * text);
 
   /**
-   * Get the name of this class's superclass. If this class is java/lang/Object, this should return std::nullopt.
+   * Get the name of this class's superclass. If this class is java/lang/Object, this should return nullptr.
    */
-  std::optional<std::string> GetSuperclassName() const;
+  const Symbol* GetSuperclassName() const;
 
-  std::vector<std::string> GetInterfaceNames() const;
+  std::vector<const Symbol*> GetInterfaceNames() const;
 };
 
 }
@@ -0,0 +1,255 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#include "classfile_stream.h"
+
+#include <algorithm>
+
+namespace bjvm::classfile {
+
+static const Symbol* const BOOTSTRAP_METHODS = Intern("BootstrapMethods");
+
+static uint16_t ReadU16(const uint8_t* bytes) {
+  return bytes[0] << 8 | bytes[1];
+}
+
+static uint32_t ReadU32(const uint8_t* bytes) {
+  return static_cast<uint32_t>(bytes[0]) << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+/** Length of a constant pool entry, given at least its tag (and for UTF-8 entries, their length). */
+static std::optional<size_t> ConstantLength(ByteSpan available) {
+  using Tag = ConstantPoolTag;
+
+  if (available.empty())
+    return std::nullopt;
+
+  switch (static_cast<Tag>(available.data()[0])) {
+    case Tag::Utf8:
+      if (available.size() < 3)
+        return std::nullopt;
+      return 3 + ReadU16(available.data() + 1);
+    case Tag::Integer: case Tag::Float: return 5;
+    case Tag::Long: case Tag::Double: return 9;
+    case Tag::Class: case Tag::String: case Tag::MethodType: return 3;
+    case Tag::MethodHandle: return 4;
+    case Tag::FieldRef: case Tag::MethodRef: case Tag::InterfaceMethodRef: case Tag::NameAndType:
+    case Tag::InvokeDynamic:
+      return 5;
+    default:
+      return 1;  // so that ParseEntry sees the tag and reports it
+  }
+}
+
+/** Length of a field or method, which requires walking the headers of its attributes. */
+static std::optional<size_t> MemberLength(ByteSpan available) {
+  if (available.size() < 8)
+    return std::nullopt;
+
+  size_t length = 8;
+  uint16_t attributes_count = ReadU16(available.data() + 6);
+  for (int i = 0; i < attributes_count; ++i) {
+    if (available.size() < length + 6)
+      return std::nullopt;
+    length += 6 + static_cast<size_t>(ReadU32(available.data() + length + 2));
+  }
+
+  return length;
+}
+
+ClassfileStreamParser::ClassfileStreamParser(Arena *arena)
+  : m_arena(arena), m_ctx { {}, {}, nullptr, arena, nullptr, arena->New<CodeDecoder>() } {}
+
+std::optional<size_t> ClassfileStreamParser::NextUnitLength(ByteSpan available) const {
+  switch (m_state) {
+    case State::Header: return 10;  // magic, version and constant pool size
+    case State::ConstantPool: return ConstantLength(available);
+    case State::ClassInfo: return 8;  // access flags, this, super and interfaces count
+    case State::Interfaces: return 2 * m_item_count;
+    case State::FieldCount: case State::MethodCount: case State::AttributeCount: return 2;
+    case State::Fields: case State::Methods: return MemberLength(available);
+    case State::Attributes:
+      if (available.size() < 6)
+        return std::nullopt;
+      return 6 + static_cast<size_t>(ReadU32(available.data() + 2));
+    case State::Done: return std::nullopt;
+  }
+  return std::nullopt;
+}
+
+void ClassfileStreamParser::ParseUnit(ByteSpan unit) {
+  ByteReader reader { unit };
+
+  switch (m_state) {
+    case State::Header: {
+      if (reader.NextU32("magic") != 0xCAFEBABE) {
+        throw VerifyError("Invalid magic number", 0);
+      }
+
+      uint16_t minor = reader.NextU16("minor version");
+      uint16_t major = reader.NextU16("major version");
+      m_version = { minor, major };
+
+      auto size = reader.NextU16("constant pool size");
+      if (size == 0) {
+        throw std::runtime_error("Invalid constant pool size");
+      }
+
+      m_cp.emplace(size);  // 4.1: 1 through size - 1 are considered valid
+      m_ctx.cp = &*m_cp;
+      m_state = size > 1 ? State::ConstantPool : State::ClassInfo;
+      break;
+    }
+    case State::ConstantPool: {
+      m_cp_index += m_cp->ParseEntry(&reader, m_cp_index);
+      if (m_cp_index > m_cp->Size()) {
+        throw std::runtime_error("Invalid constant pool size");
+      }
+      if (m_cp_index == m_cp->Size()) {
+        m_state = State::ClassInfo;
+      }
+      break;
+    }
+    case State::ClassInfo: {
+      m_access_flags = static_cast<AccessFlags>(reader.NextU16("access flags"));
+      m_this_class = reader.NextU16("this class");
+      assert(m_cp->Has<EntryClass>(m_this_class));
+
+      m_super_class = reader.NextU16("super class");
+      assert(m_super_class == 0 || m_cp->Has<EntryClass>(m_super_class));
+
+      m_item_count = reader.NextU16("interfaces count");
+      m_interfaces = m_arena->NewArray<uint16_t>(m_item_count);
+      m_state = m_item_count ? State::Interfaces : State::FieldCount;
+      break;
+    }
+    case State::Interfaces: {
+      for (auto& v : m_interfaces) {
+        v = reader.NextU16("interface");
+        assert(m_cp->Has<EntryClass>(v));
+      }
+      m_state = State::FieldCount;
+      break;
+    }
+    case State::FieldCount: {
+      m_fields = m_arena->NewArray<FieldInfo>(reader.NextU16("fields count"));
+      m_item = 0;
+      m_state = m_fields.empty() ? State::MethodCount : State::Fields;
+      break;
+    }
+    case State::Fields: {
+      m_fields[m_item++] = FieldInfo::parse(&reader, &m_ctx);
+      if (m_item == m_fields.size()) {
+        m_state = State::MethodCount;
+      }
+      break;
+    }
+    case State::MethodCount: {
+      m_methods = m_arena->NewArray<MethodInfo>(reader.NextU16("methods count"));
+      m_item = 0;
+      m_state = m_methods.empty() ? State::AttributeCount : State::Methods;
+      break;
+    }
+    case State::Methods: {
+      m_methods[m_item++] = MethodInfo::parse(&reader, &m_ctx);
+      if (m_item == m_methods.size()) {
+        m_state = State::AttributeCount;
+      }
+      break;
+    }
+    case State::AttributeCount: {
+      m_item_count = reader.NextU16("attributes count");
+      m_item = 0;
+      m_state = m_item_count ? State::Attributes : State::Done;
+      break;
+    }
+    case State::Attributes: {
+      const Symbol* name = m_cp->GetSymbol(reader.NextU16("attribute name"));
+      reader.NextU32("attribute length");
+
+      if (name == BOOTSTRAP_METHODS) {
+        m_bootstrap_methods = BootstrapMethodsAttribute::parse(&reader, &m_ctx);
+      }
+
+      if (++m_item == m_item_count) {
+        m_state = State::Done;
+      }
+      break;
+    }
+    case State::Done:
+      break;
+  }
+}
+
+size_t ClassfileStreamParser::ParseUnits(ByteSpan input) {
+  size_t used = 0;
+  while (m_state != State::Done) {
+    ByteSpan rest { input.data() + used, input.size() - used };
+    auto length = NextUnitLength(rest);
+    if (!length || *length > rest.size())
+      break;
+
+    ParseUnit({ rest.data(), *length });
+    used += *length;
+    m_offset += *length;
+  }
+  return used;
+}
+
+ClassfileStreamParser::Status ClassfileStreamParser::Feed(ByteSpan chunk) {
+  // Finish the unit left over from earlier chunks, copying only as much of this chunk as it needs. If its length isn't
+  // known yet (e.g. a method whose attribute headers haven't all arrived), a few more bytes at a time will tell us.
+  while (!m_pending.empty() && !chunk.empty() && m_state != State::Done) {
+    auto length = NextUnitLength({ m_pending.data(), m_pending.size() });
+    size_t wanted = length ? *length - m_pending.size() : 8;
+    size_t taken = std::min(wanted, chunk.size());
+
+    m_pending.insert(m_pending.end(), chunk.begin(), chunk.begin() + taken);
+    chunk = { chunk.data() + taken, chunk.size() - taken };
+
+    size_t used = ParseUnits({ m_pending.data(), m_pending.size() });
+    m_pending.erase(m_pending.begin(), m_pending.begin() + used);
+  }
+
+  // Then parse straight out of the chunk, keeping whatever incomplete unit is left at the end
+  if (m_pending.empty() && m_state != State::Done) {
+    size_t used = ParseUnits(chunk);
+    chunk = { chunk.data() + used, chunk.size() - used };
+    if (m_state != State::Done) {
+      m_pending.assign(chunk.begin(), chunk.end());
+      chunk = {};
+    }
+  }
+
+  // Anything after the class's last attribute, whether fed with it or later, makes the classfile malformed
+  size_t trailing = IsDone() ? m_pending.size() + chunk.size() : 0;
+  if (trailing) {
+    throw std::runtime_error("Trailing data after classfile: " + std::to_string(trailing) + " bytes at offset "
+                             + std::to_string(m_offset));
+  }
+
+  return IsDone() ? Status::Done : Status::NeedMore;
+}
+
+Classfile ClassfileStreamParser::Take() {
+  if (!IsDone()) {
+    throw std::runtime_error("Unexpected end of classfile after " + std::to_string(m_offset + m_pending.size())
+                             + " bytes");
+  }
+
+  Classfile cf { std::move(*m_cp) };
+
+  cf.m_version = m_version;
+  cf.m_access_flags = m_access_flags;
+  cf.m_this_class = m_this_class;
+  cf.m_super_class = m_super_class;
+  cf.m_interfaces = m_interfaces;
+  cf.m_fields = m_fields;
+  cf.m_methods = m_methods;
+  cf.m_bootstrap_methods = m_bootstrap_methods;
+
+  return cf;
+}
+
+} // bjvm::classfile
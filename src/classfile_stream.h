@@ -0,0 +1,109 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#ifndef CLASSFILE_STREAM_H
+#define CLASSFILE_STREAM_H
+
+#include <optional>
+#include <vector>
+
+#include "classfile.h"
+
+namespace bjvm::classfile {
+
+/**
+ * Incremental classfile parser, for when the bytes of a class arrive in chunks (e.g. over the network in the browser,
+ * or out of a pipe or decompressor) and we'd rather parse as they come than wait for the whole file.
+ *
+ * The classfile is split into units -- the header, each constant pool entry, the class info, each field, method and
+ * attribute -- and each is parsed as soon as all of its bytes have arrived, by the same routines Classfile::parse uses,
+ * so the result is identical. Chunks are parsed in place; only a unit which straddles two chunks is copied.
+ *
+ *   ClassfileStreamParser parser { arena };
+ *   while (parser.Feed(NextChunk()) == ClassfileStreamParser::Status::NeedMore) {}
+ *   Classfile cf = parser.Take();
+ *
+ * Malformed input throws as soon as it is noticed, as Classfile::parse would. A parser parses one class and can't be
+ * moved, since the class's parse context points into it.
+ */
+class ClassfileStreamParser {
+public:
+  enum class Status {
+    NeedMore,
+    Done
+  };
+
+private:
+  enum class State : uint8_t {
+    Header,
+    ConstantPool,
+    ClassInfo,
+    Interfaces,
+    FieldCount,
+    Fields,
+    MethodCount,
+    Methods,
+    AttributeCount,
+    Attributes,
+    Done
+  };
+
+  State m_state = State::Header;
+
+  // The start of a unit which hasn't fully arrived yet
+  std::vector<uint8_t> m_pending;
+
+  // Total bytes consumed so far, for error messages
+  size_t m_offset = 0;
+
+  Arena* m_arena;
+  ParseContext m_ctx;
+
+  ClassfileVersion m_version {};
+  std::optional<ConstantPool> m_cp;
+  int m_cp_index = 1;
+
+  AccessFlags m_access_flags {};
+  uint16_t m_this_class = 0;
+  uint16_t m_super_class = 0;
+  ArenaArray<uint16_t> m_interfaces;
+  ArenaArray<FieldInfo> m_fields;
+  ArenaArray<MethodInfo> m_methods;
+  std::optional<BootstrapMethodsAttribute> m_bootstrap_methods;
+
+  // Index of the next field, method or attribute, and how many there are
+  size_t m_item = 0;
+  size_t m_item_count = 0;
+
+  /** Length of the next unit, if enough of it is available to tell. */
+  std::optional<size_t> NextUnitLength(ByteSpan available) const;
+
+  /** Parse as many whole units from the start of input as possible. Returns the number of bytes used. */
+  size_t ParseUnits(ByteSpan input);
+
+  void ParseUnit(ByteSpan unit);
+
+public:
+  explicit ClassfileStreamParser(Arena* arena);
+
+  ClassfileStreamParser(const ClassfileStreamParser&) = delete;
+  ClassfileStreamParser& operator=(const ClassfileStreamParser&) = delete;
+
+  /**
+   * Consume the next chunk of the classfile. Returns Done once the whole class has been parsed, and throws if the
+   * chunk, or one fed after that, goes on past the end of the class.
+   */
+  Status Feed(ByteSpan chunk);
+
+  bool IsDone() const {
+    return m_state == State::Done;
+  }
+
+  /** Get the parsed class. Throws if the classfile hasn't been fed in full. */
+  Classfile Take();
+};
+
+} // bjvm::classfile
+
+#endif //CLASSFILE_STREAM_H
@@ -3,50 +3,51 @@
 //
 
 #include "constant_pool.h"
+#include "utf8.h"
 #include <iostream>
 
 namespace bjvm {
 
 std::string EntryClass::ToString(const ConstantPool *cp) const {
-  return "Class " + (!cp ? std::to_string(m_name_index) : cp->Get<EntryUtf8>(m_name_index)->ToString(cp));
+  return "Class " + (!cp ? std::to_string(m_name_index) : cp->Get<EntryUtf8>(m_name_index).ToString(cp));
 }
 
 std::string EntryString::ToString(const ConstantPool *cp) const {
-  return "String " + (!cp ? std::to_string(string_index) : '"' + cp->Get<EntryUtf8>(string_index)->ToString(cp)) + '"';
+  return "String " + (!cp ? std::to_string(string_index) : '"' + cp->Get<EntryUtf8>(string_index).ToString(cp)) + '"';
 }
 
 std::string EntryFieldRef::ToString(const ConstantPool *cp) const {
-  return "FieldRef " + (!cp ? std::to_string(struct_index) : cp->Get<EntryClass>(struct_index)->ToString(cp)) + " "
-         + (!cp ? std::to_string(name_and_type_index) : cp->Get<EntryNameAndType>(name_and_type_index)->ToString(cp));
+  return "FieldRef " + (!cp ? std::to_string(struct_index) : cp->Get<EntryClass>(struct_index).ToString(cp)) + " "
+         + (!cp ? std::to_string(name_and_type_index) : cp->Get<EntryNameAndType>(name_and_type_index).ToString(cp));
 }
 
 std::string EntryMethodRef::ToString(const ConstantPool *cp) const {
-  return "MethodRef " + (!cp ? std::to_string(struct_index) : cp->Get<EntryClass>(struct_index)->ToString(cp)) + " "
-         + (!cp ? std::to_string(name_and_type_index) : cp->Get<EntryNameAndType>(name_and_type_index)->ToString(cp));
+  return "MethodRef " + (!cp ? std::to_string(struct_index) : cp->Get<EntryClass>(struct_index).ToString(cp)) + " "
+         + (!cp ? std::to_string(name_and_type_index) : cp->Get<EntryNameAndType>(name_and_type_index).ToString(cp));
 }
 
 std::string EntryInterfaceMethodRef::ToString(const ConstantPool *cp) const {
-  return "InterfaceMethodRef " + (!cp ? std::to_string(struct_index) : cp->Get<EntryClass>(struct_index)->ToString(cp))
-         + " " + (!cp ? std::to_string(name_and_type_index) : cp->Get<EntryNameAndType>(name_and_type_index)->ToString(cp));
+  return "InterfaceMethodRef " + (!cp ? std::to_string(struct_index) : cp->Get<EntryClass>(struct_index).ToString(cp))
+         + " " + (!cp ? std::to_string(name_and_type_index) : cp->Get<EntryNameAndType>(name_and_type_index).ToString(cp));
 }
 
 std::string EntryNameAndType::ToString(const ConstantPool *cp) const {
-  return "NameAndType " + (!cp ? std::to_string(name_index) : cp->Get<EntryUtf8>(name_index)->ToString(cp)) + " "
-         + (!cp ? std::to_string(descriptor_index) : cp->Get<EntryUtf8>(descriptor_index)->ToString(cp));
+  return "NameAndType " + (!cp ? std::to_string(name_index) : cp->Get<EntryUtf8>(name_index).ToString(cp)) + " "
+         + (!cp ? std::to_string(descriptor_index) : cp->Get<EntryUtf8>(descriptor_index).ToString(cp));
 }
 
 std::string EntryMethodHandle::ToString(const ConstantPool *cp) const {
   return "MethodHandle " + std::to_string(reference_kind) + " " +
-    (!cp ? std::to_string(reference_index) : cp->Get<EntryFieldRef>(reference_index)->ToString(cp));
+    (!cp ? std::to_string(reference_index) : cp->Get<EntryFieldRef>(reference_index).ToString(cp));
 }
 
 std::string EntryMethodType::ToString(const ConstantPool *cp) const {
-  return "MethodType " + (!cp ? std::to_string(descriptor_index) : cp->Get<EntryUtf8>(descriptor_index)->ToString(cp));
+  return "MethodType " + (!cp ? std::to_string(descriptor_index) : cp->Get<EntryUtf8>(descriptor_index).ToString(cp));
 }
 
 std::string EntryInvokeDynamic::ToString(const ConstantPool *cp) const {
   return "InvokeDynamic " + std::to_string(bootstrap_method_attr_index) + " " +
-    (!cp ? std::to_string(name_and_type_index) : cp->Get<EntryNameAndType>(name_and_type_index)->ToString(cp));
+    (!cp ? std::to_string(name_and_type_index) : cp->Get<EntryNameAndType>(name_and_type_index).ToString(cp));
 }
 
 std::string EntryInteger::ToString(const ConstantPool *_cp) const {
@@ -66,25 +67,71 @@ std::string EntryDouble::ToString(const ConstantPool *_cp) const {
 }
 
 std::string EntryUtf8::ToString(const ConstantPool *_cp) const {
-  return {m_value.begin(), m_value.end()}; // TODO handle weird Java UTF-8
-}
-
-enum RawTag {
-  Utf8 = 1,
-  Integer = 3,
-  Float = 4,
-  Long = 5,
-  Double = 6,
-  Class = 7,
-  String = 8,
-  FieldRef = 9,
-  MethodRef = 10,
-  InterfaceMethodRef = 11,
-  NameAndType = 12,
-  MethodHandle = 15,
-  MethodType = 16,
-  InvokeDynamic = 18
-};
+  return ModifiedUtf8ToUtf8(m_symbol->m_value);
+}
+
+int ConstantPool::ParseEntry(ByteReader *reader, int index) {
+  using Tag = ConstantPoolTag;
+
+  auto tag = static_cast<Tag>(reader->NextU8("constant pool tag"));
+
+  switch (tag) {
+    case Tag::Utf8: {
+      auto bytes = reader->NextNBytes(reader->NextU16("utf8 length"), "utf8 value");
+      if (!IsValidModifiedUtf8(bytes.data(), bytes.size()))
+        throw std::runtime_error("ClassFormatError Illegal UTF8 string in constant pool at index " + std::to_string(index));
+      Put(index, EntryUtf8{Intern({reinterpret_cast<const char*>(bytes.data()), bytes.size()})});
+      return 1;
+    }
+    case Tag::Integer:
+      Put(index, EntryInteger{reader->NextI32("integer value")});
+      return 1;
+    case Tag::Float:
+      Put(index, EntryFloat{reader->NextF32("float value")});
+      return 1;
+    case Tag::Long:
+      Put(index, EntryLong{reader->NextI64("long value")});
+      return 2;
+    case Tag::Double:
+      Put(index, EntryDouble{reader->NextF64("double value")});
+      return 2;
+    case Tag::Class:
+      Put(index, EntryClass{reader->NextU16("class name index")});
+      return 1;
+    case Tag::String:
+      Put(index, EntryString{reader->NextU16("string index")});
+      return 1;
+    case Tag::FieldRef:
+      Put(index, EntryFieldRef{reader->NextU16("fieldref struct index"),
+                               reader->NextU16("fieldref name and type index")});
+      return 1;
+    case Tag::MethodRef:
+      Put(index, EntryMethodRef{reader->NextU16("methodref struct index"),
+                                reader->NextU16("methodref name and type index")});
+      return 1;
+    case Tag::InterfaceMethodRef:
+      Put(index, EntryInterfaceMethodRef{reader->NextU16("interface methodref struct index"),
+                                         reader->NextU16("interface methodref name and type index")});
+      return 1;
+    case Tag::NameAndType:
+      Put(index, EntryNameAndType{reader->NextU16("name and type name index"),
+                                  reader->NextU16("name and type descriptor index")});
+      return 1;
+    case Tag::MethodHandle:
+      Put(index, EntryMethodHandle{reader->NextU8("method handle reference kind"),
+                                   reader->NextU16("method handle reference index")});
+      return 1;
+    case Tag::MethodType:
+      Put(index, EntryMethodType{reader->NextU16("method type descriptor index")});
+      return 1;
+    case Tag::InvokeDynamic:
+      Put(index, EntryInvokeDynamic{reader->NextU16("invoke dynamic bootstrap method attr index"),
+                                    reader->NextU16("invoke dynamic name and type index")});
+      return 1;
+    default:
+      throw std::runtime_error("Unknown constant pool tag " + std::to_string(static_cast<int>(tag)));
+  }
+}
 
 ConstantPool ConstantPool::parse(ByteReader *reader) {
   auto size = reader->NextU16("constant pool size");
@@ -92,55 +139,7 @@ ConstantPool ConstantPool::parse(ByteReader *reader) {
 
   int index = 1;
   while (index < size) {
-    auto tag = reader->NextU8("constant pool tag");
-
-    cp.m_entries.at(index) = ([&] () -> ConstantPoolEntry {
-      switch (tag) {
-        case Utf8: {
-          auto bytes = reader->NextNBytes(reader->NextU16("utf8 length"), "utf8 value");
-          std::string value{bytes.begin(), bytes.end()};
-          return EntryUtf8{value};
-        }
-        case Integer:
-          return EntryInteger{reader->NextI32("integer value")};
-        case Float:
-          return EntryFloat{reader->NextF32("float value")};
-        case Long:
-          index++;
-          return EntryLong{reader->NextI64("long value")};
-        case Double:
-          index++;
-          return EntryDouble{reader->NextF64("double value")};
-        case Class:
-          return EntryClass{reader->NextU16("class name index")};
-        case String:
-          return EntryString{reader->NextU16("string index")};
-        case FieldRef:
-          return EntryFieldRef{reader->NextU16("fieldref struct index"),
-                               reader->NextU16("fieldref name and type index")};
-        case MethodRef:
-          return EntryMethodRef{reader->NextU16("methodref struct index"),
-                                reader->NextU16("methodref name and type index")};
-        case InterfaceMethodRef:
-          return EntryInterfaceMethodRef{reader->NextU16("interface methodref struct index"),
-                                         reader->NextU16("interface methodref name and type index")};
-        case NameAndType:
-          return EntryNameAndType{reader->NextU16("name and type name index"),
-                                  reader->NextU16("name and type descriptor index")};
-        case MethodHandle:
-          return EntryMethodHandle{reader->NextU8("method handle reference kind"),
-                                   reader->NextU16("method handle reference index")};
-        case MethodType:
-          return EntryMethodType{reader->NextU16("method type descriptor index")};
-        case InvokeDynamic:
-          return EntryInvokeDynamic{reader->NextU16("invoke dynamic bootstrap method attr index"),
-                                    reader->NextU16("invoke dynamic name and type index")};
-        default:
-          throw std::runtime_error("Unknown constant pool tag " + std::to_string(tag));
-      }
-    })();
-
-    index++;
+    index += cp.ParseEntry(reader, index);
   }
 
   if (index > size) {
@@ -150,25 +149,87 @@ ConstantPool ConstantPool::parse(ByteReader *reader) {
   return cp;
 }
 
-ConstantPoolEntry *ConstantPool::GetAny(int index) {
-  if (index == 0 || index >= m_entries.size())
-    throw std::runtime_error("Invalid constant pool index");
-  return &m_entries[index];
-}
+ConstantPoolLayout ConstantPool::Skim(ByteReader *reader) {
+  using Tag = ConstantPoolTag;
+
+  auto size = reader->NextU16("constant pool size");
+  ConstantPoolLayout layout { std::vector<uint8_t>(size), std::vector<uint32_t>(size) };
+
+  int index = 1;
+  while (index < size) {
+    auto tag = reader->NextU8("constant pool tag");
+    layout.m_tags[index] = tag;
+    layout.m_offsets[index] = reader->GetOffs();
+
+    switch (static_cast<Tag>(tag)) {
+      case Tag::Utf8: reader->Skip(reader->NextU16("utf8 length"), "utf8 value"); break;
+      case Tag::Integer: case Tag::Float: reader->Skip(4, "constant value"); break;
+      case Tag::Long: case Tag::Double: reader->Skip(8, "constant value"); index++; break;
+      case Tag::Class: case Tag::String: case Tag::MethodType: reader->Skip(2, "constant pool index"); break;
+      case Tag::MethodHandle: reader->Skip(3, "method handle"); break;
+      case Tag::FieldRef: case Tag::MethodRef: case Tag::InterfaceMethodRef: case Tag::NameAndType:
+      case Tag::InvokeDynamic:
+        reader->Skip(4, "constant pool indices"); break;
+      default:
+        throw std::runtime_error("Unknown constant pool tag " + std::to_string(tag));
+    }
+
+    index++;
+  }
+
+  if (index > size) {
+    throw std::runtime_error("Invalid constant pool size");
+  }
+
+  return layout;
+}
+
+std::string ConstantPool::ReadClassName(ByteSpan bytes, const ConstantPoolLayout &layout, int class_index) {
+  const auto EntryReader = [&] (int index, ConstantPoolTag tag) {
+    if (index <= 0 || static_cast<size_t>(index) >= layout.m_tags.size() || layout.m_tags[index] != static_cast<uint8_t>(tag))
+      throw std::runtime_error("Invalid constant pool index");
+    ByteReader reader { bytes };
+    reader.Skip(layout.m_offsets[index]);
+    return reader;
+  };
+
+  auto name_index = EntryReader(class_index, ConstantPoolTag::Class).NextU16("class name index");
+  auto reader = EntryReader(name_index, ConstantPoolTag::Utf8);
+  auto name = reader.NextNBytes(reader.NextU16("utf8 length"), "utf8 value");
+  return { reinterpret_cast<const char*>(name.data()), name.size() };
+}
+
+ConstantPoolEntry ConstantPool::GetAny(int index) const {
+  using Tag = ConstantPoolTag;
+
+  switch (GetTag(index)) {
+    case Tag::Invalid: return EntryInvalid{};
+    case Tag::Utf8: return GetUnchecked<EntryUtf8>(index);
+    case Tag::Integer: return GetUnchecked<EntryInteger>(index);
+    case Tag::Float: return GetUnchecked<EntryFloat>(index);
+    case Tag::Long: return GetUnchecked<EntryLong>(index);
+    case Tag::Double: return GetUnchecked<EntryDouble>(index);
+    case Tag::Class: return GetUnchecked<EntryClass>(index);
+    case Tag::String: return GetUnchecked<EntryString>(index);
+    case Tag::FieldRef: return GetUnchecked<EntryFieldRef>(index);
+    case Tag::MethodRef: return GetUnchecked<EntryMethodRef>(index);
+    case Tag::InterfaceMethodRef: return GetUnchecked<EntryInterfaceMethodRef>(index);
+    case Tag::NameAndType: return GetUnchecked<EntryNameAndType>(index);
+    case Tag::MethodHandle: return GetUnchecked<EntryMethodHandle>(index);
+    case Tag::MethodType: return GetUnchecked<EntryMethodType>(index);
+    case Tag::InvokeDynamic: return GetUnchecked<EntryInvokeDynamic>(index);
+  }
 
-const ConstantPoolEntry *ConstantPool::GetAny(int index) const {
-  if (index == 0 || index >= m_entries.size())
-    throw std::runtime_error("Invalid constant pool index");
-  return &m_entries[index];
+  throw std::runtime_error("Corrupt constant pool tag");
 }
 
 std::string ConstantPool::ToString() const {
   std::string result;
-  for (int i = 1; i < m_entries.size(); i++) {
+  for (int i = 1; i < Size(); i++) {
     result += std::to_string(i) + ": ";
     std::visit([&](const auto& entry) {
       result += entry.ToString(this);
-    }, m_entries[i]);
+    }, GetAny(i));
     result += '\n';
   }
   return result;
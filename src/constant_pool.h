@@ -5,45 +5,87 @@
 #ifndef BROWSER_JVM_CONSTANT_POOL_H
 #define BROWSER_JVM_CONSTANT_POOL_H
 
+#include <cstring>
+#include <type_traits>
+#include <variant>
 #include <vector>
 #include "byte_reader.h"
+#include "symbol_table.h"
 
 namespace bjvm {
 
 struct ConstantPool;
+class ClassArchive;
+
+/** Constant pool tags, as they appear in the classfile (4.4). Unusable slots have tag Invalid. */
+enum class ConstantPoolTag : uint8_t {
+  Invalid = 0,
+  Utf8 = 1,
+  Integer = 3,
+  Float = 4,
+  Long = 5,
+  Double = 6,
+  Class = 7,
+  String = 8,
+  FieldRef = 9,
+  MethodRef = 10,
+  InterfaceMethodRef = 11,
+  NameAndType = 12,
+  MethodHandle = 15,
+  MethodType = 16,
+  InvokeDynamic = 18
+};
+
+/*
+ * The Entry* structs are decoded copies of constant pool entries (see ConstantPool::Get); modifying one has no effect
+ * on the pool until it is written back with ConstantPool::Put.
+ */
 
 struct EntryUtf8 {
-  std::string m_value;
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::Utf8;
+
+  // Interned, so equal strings in different constant pools share one symbol
+  const Symbol* m_symbol;
 
   std::string ToString(const ConstantPool* _cp) const;
 };
 
 struct EntryInteger {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::Integer;
+
   int32_t m_value;
 
   std::string ToString(const ConstantPool* _cp) const;
 };
 
 struct EntryFloat {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::Float;
+
   float m_value;
 
   std::string ToString(const ConstantPool* _cp) const;
 };
 
 struct EntryLong {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::Long;
+
   int64_t m_value;
 
   std::string ToString(const ConstantPool* _cp) const;
 };
 
 struct EntryDouble {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::Double;
+
   double value;
 
   std::string ToString(const ConstantPool* _cp) const;
 };
 
-struct ClassInstance;
+class ClassInstance;
 struct EntryClass {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::Class;
+
   uint16_t m_name_index;
 
   ClassInstance* m_instance = nullptr;
@@ -52,10 +94,12 @@ struct EntryClass {
 };
 
 namespace native {
-  struct String;
+  class String;
 }
 
 struct EntryString {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::String;
+
   uint16_t string_index;
 
   native::String* m_string = nullptr;
@@ -69,6 +113,8 @@ struct MethodInfo;
 }
 
 struct EntryFieldRef {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::FieldRef;
+
   uint16_t struct_index;
   uint16_t name_and_type_index;
 
@@ -78,6 +124,8 @@ struct EntryFieldRef {
 };
 
 struct EntryMethodRef {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::MethodRef;
+
   uint16_t struct_index;
   uint16_t name_and_type_index;
 
@@ -87,6 +135,8 @@ struct EntryMethodRef {
 };
 
 struct EntryInterfaceMethodRef {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::InterfaceMethodRef;
+
   uint16_t struct_index;
   uint16_t name_and_type_index;
 
@@ -96,6 +146,8 @@ struct EntryInterfaceMethodRef {
 };
 
 struct EntryNameAndType {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::NameAndType;
+
   uint16_t name_index;
   uint16_t descriptor_index;
 
@@ -103,6 +155,8 @@ struct EntryNameAndType {
 };
 
 struct EntryMethodHandle {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::MethodHandle;
+
   uint8_t reference_kind;
   uint16_t reference_index;
 
@@ -110,12 +164,16 @@ struct EntryMethodHandle {
 };
 
 struct EntryMethodType {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::MethodType;
+
   uint16_t descriptor_index;
 
   std::string ToString(const ConstantPool* cp) const;
 };
 
 struct EntryInvokeDynamic {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::InvokeDynamic;
+
   uint16_t bootstrap_method_attr_index;
   uint16_t name_and_type_index;
 
@@ -123,6 +181,8 @@ struct EntryInvokeDynamic {
 };
 
 struct EntryInvalid {
+  static constexpr ConstantPoolTag TAG = ConstantPoolTag::Invalid;
+
   std::string ToString(const ConstantPool* _cp) const;
 };
 
@@ -131,80 +191,239 @@ using ConstantPoolEntry = std::variant<EntryInvalid, EntryUtf8, EntryInteger, En
   EntryString, EntryFieldRef, EntryMethodRef, EntryInterfaceMethodRef, EntryNameAndType, EntryMethodHandle,
   EntryMethodType, EntryInvokeDynamic>;
 
+/**
+ * Tag and payload offset of every slot in a constant pool, gathered without materialising any entries. Unusable slots
+ * (index 0 and the second half of longs and doubles) have a tag of 0.
+ */
+struct ConstantPoolLayout {
+  std::vector<uint8_t> m_tags;
+  // Reader offset of each entry's payload, i.e. just past its tag byte
+  std::vector<uint32_t> m_offsets;
+};
+
+/**
+ * A class's constant pool, stored as parallel arrays rather than as an array of variants: one tag byte and one 64-bit
+ * payload per slot. The payload holds the entry's value (integers, floats, longs and doubles), its constant pool
+ * indices packed into the low 32 bits, or for UTF-8 entries the interned Symbol, so the text itself lives in the
+ * symbol table. Entries which are resolved during linking (Class, String and the three kinds of ref) additionally keep
+ * their resolved pointer in a side array, indexed by the high 32 bits of the payload.
+ *
+ * Entries are read and written by value with Get and Put; the tag is checked directly, without going through a
+ * variant.
+ */
 class ConstantPool {
-  // defaults to EntryInvalid, should not have its contents move
-  std::vector<ConstantPoolEntry> m_entries;
+  friend class ClassArchive;
+
+  std::vector<ConstantPoolTag> m_tags;
+  std::vector<uint64_t> m_payloads;
+  std::vector<void*> m_resolved;
 
-  template <typename T>
-  void Put(int index, T entry) {
-    m_entries.at(index) = entry;
+  template <typename TEntry>
+  static constexpr bool IS_RESOLVABLE = std::is_same_v<TEntry, EntryClass> || std::is_same_v<TEntry, EntryString>
+    || std::is_same_v<TEntry, EntryFieldRef> || std::is_same_v<TEntry, EntryMethodRef>
+    || std::is_same_v<TEntry, EntryInterfaceMethodRef>;
+
+  template <typename TEntry>
+  static uint64_t Pack(const TEntry& entry) {
+    if constexpr (std::is_same_v<TEntry, EntryUtf8>) {
+      return reinterpret_cast<uintptr_t>(entry.m_symbol);
+    } else if constexpr (std::is_same_v<TEntry, EntryInteger>) {
+      return static_cast<uint32_t>(entry.m_value);
+    } else if constexpr (std::is_same_v<TEntry, EntryFloat>) {
+      uint32_t bits;
+      std::memcpy(&bits, &entry.m_value, sizeof(bits));
+      return bits;
+    } else if constexpr (std::is_same_v<TEntry, EntryLong>) {
+      return static_cast<uint64_t>(entry.m_value);
+    } else if constexpr (std::is_same_v<TEntry, EntryDouble>) {
+      uint64_t bits;
+      std::memcpy(&bits, &entry.value, sizeof(bits));
+      return bits;
+    } else if constexpr (std::is_same_v<TEntry, EntryClass>) {
+      return entry.m_name_index;
+    } else if constexpr (std::is_same_v<TEntry, EntryString>) {
+      return entry.string_index;
+    } else if constexpr (std::is_same_v<TEntry, EntryFieldRef> || std::is_same_v<TEntry, EntryMethodRef>
+                         || std::is_same_v<TEntry, EntryInterfaceMethodRef>) {
+      return entry.struct_index | static_cast<uint32_t>(entry.name_and_type_index) << 16;
+    } else if constexpr (std::is_same_v<TEntry, EntryNameAndType>) {
+      return entry.name_index | static_cast<uint32_t>(entry.descriptor_index) << 16;
+    } else if constexpr (std::is_same_v<TEntry, EntryMethodHandle>) {
+      return entry.reference_index | static_cast<uint32_t>(entry.reference_kind) << 16;
+    } else if constexpr (std::is_same_v<TEntry, EntryMethodType>) {
+      return entry.descriptor_index;
+    } else if constexpr (std::is_same_v<TEntry, EntryInvokeDynamic>) {
+      return entry.bootstrap_method_attr_index | static_cast<uint32_t>(entry.name_and_type_index) << 16;
+    } else {
+      return 0;
+    }
+  }
+
+  template <typename TEntry>
+  static TEntry Unpack(uint64_t payload, void* resolved) {
+    auto lo = static_cast<uint16_t>(payload), hi = static_cast<uint16_t>(payload >> 16);
+
+    if constexpr (std::is_same_v<TEntry, EntryUtf8>) {
+      return { reinterpret_cast<const Symbol*>(static_cast<uintptr_t>(payload)) };
+    } else if constexpr (std::is_same_v<TEntry, EntryInteger>) {
+      return { static_cast<int32_t>(payload) };
+    } else if constexpr (std::is_same_v<TEntry, EntryFloat>) {
+      auto bits = static_cast<uint32_t>(payload);
+      float value;
+      std::memcpy(&value, &bits, sizeof(value));
+      return { value };
+    } else if constexpr (std::is_same_v<TEntry, EntryLong>) {
+      return { static_cast<int64_t>(payload) };
+    } else if constexpr (std::is_same_v<TEntry, EntryDouble>) {
+      double value;
+      std::memcpy(&value, &payload, sizeof(value));
+      return { value };
+    } else if constexpr (std::is_same_v<TEntry, EntryClass>) {
+      return { lo, static_cast<ClassInstance*>(resolved) };
+    } else if constexpr (std::is_same_v<TEntry, EntryString>) {
+      return { lo, static_cast<native::String*>(resolved) };
+    } else if constexpr (std::is_same_v<TEntry, EntryFieldRef>) {
+      return { lo, hi, static_cast<classfile::FieldInfo*>(resolved) };
+    } else if constexpr (std::is_same_v<TEntry, EntryMethodRef> || std::is_same_v<TEntry, EntryInterfaceMethodRef>) {
+      return { lo, hi, static_cast<classfile::MethodInfo*>(resolved) };
+    } else if constexpr (std::is_same_v<TEntry, EntryNameAndType> || std::is_same_v<TEntry, EntryInvokeDynamic>) {
+      return { lo, hi };
+    } else if constexpr (std::is_same_v<TEntry, EntryMethodHandle>) {
+      return { static_cast<uint8_t>(hi), lo };
+    } else if constexpr (std::is_same_v<TEntry, EntryMethodType>) {
+      return { lo };
+    } else {
+      return {};
+    }
+  }
+
+  template <typename TEntry>
+  static void* GetResolved(const TEntry& entry) {
+    if constexpr (std::is_same_v<TEntry, EntryClass>) {
+      return entry.m_instance;
+    } else if constexpr (std::is_same_v<TEntry, EntryString>) {
+      return entry.m_string;
+    } else if constexpr (std::is_same_v<TEntry, EntryFieldRef>) {
+      return entry.m_field_info;
+    } else {
+      return entry.m_method_info;
+    }
+  }
+
+  void* GetResolved(int index) const {
+    return m_resolved[m_payloads[index] >> 32];
+  }
+
+  /** Whether index refers to an entry, i.e. is in [1, Size()). */
+  bool IsValidIndex(int index) const {
+    return index > 0 && index < static_cast<int>(m_tags.size());
   }
 
 public:
-  ConstantPool(int size) : m_entries(size) {}
+  ConstantPool(int size) : m_tags(size, ConstantPoolTag::Invalid), m_payloads(size) {}
+
+  ConstantPoolTag GetTag(int index) const {
+    if (!IsValidIndex(index))
+      throw std::runtime_error("Invalid constant pool index");
+    return m_tags[index];
+  }
 
-  /** Get the entry of type TEntry at the given index. */
   template <typename TEntry>
-  TEntry* GetUnchecked(int index) {
-#ifdef DEBUG
-    return Get(index);
-#else
-    return std::get_if<TEntry>(&m_entries[index]);
-#endif
+  bool Has(int index) const {
+    return IsValidIndex(index) && m_tags[index] == TEntry::TAG;
   }
 
+  /** Get the entry of type TEntry at the given index, which must be valid and of that type. */
   template <typename TEntry>
-  const TEntry* GetUnchecked(int index) const {
+  TEntry GetUnchecked(int index) const {
 #ifdef DEBUG
-    return Get(index);
+    return Get<TEntry>(index);
 #else
-    return std::get_if<TEntry>(&m_entries[index]);
+    if constexpr (IS_RESOLVABLE<TEntry>) {
+      return Unpack<TEntry>(m_payloads[index], GetResolved(index));
+    } else {
+      return Unpack<TEntry>(m_payloads[index], nullptr);
+    }
 #endif
   }
 
-  template <typename TEntry>
-  bool Has(int index) const {
-    return index < m_entries.size() && index >= 0 && GetUnchecked<TEntry>(index);
-  }
-
   /** Get a constant pool entry by index. */
-  ConstantPoolEntry* GetAny(int index);
-  const ConstantPoolEntry* GetAny(int index) const;
+  ConstantPoolEntry GetAny(int index) const;
 
   /** Get a constant pool entry of a specific type by index. */
   template <typename TEntry>
-  TEntry* Get(int index) {
-    if (index == 0 || index >= m_entries.size())
+  TEntry Get(int index) const {
+    if (!IsValidIndex(index))
       throw std::runtime_error("Invalid constant pool index");
-    auto p = GetUnchecked<TEntry>(index);
-    if (!p)
+    if (m_tags[index] != TEntry::TAG)
       throw std::runtime_error("Constant pool entry type mismatch");
-    return p;
+    if constexpr (IS_RESOLVABLE<TEntry>) {
+      return Unpack<TEntry>(m_payloads[index], GetResolved(index));
+    } else {
+      return Unpack<TEntry>(m_payloads[index], nullptr);
+    }
   }
 
+  /**
+   * Store an entry at the given index, replacing whatever was there. Writing back an entry of the same type (e.g. to
+   * record its resolution) reuses its resolved slot.
+   */
   template <typename TEntry>
-  const TEntry* Get(int index) const {
-    if (index == 0 || index >= m_entries.size())
-      throw std::runtime_error("Invalid constant pool index");
-    auto p = GetUnchecked<TEntry>(index);
-    if (!p)
-      throw std::runtime_error("Constant pool entry type mismatch");
-    return p;
+  void Put(int index, const TEntry& entry) {
+    uint64_t payload = Pack(entry);
+    if constexpr (IS_RESOLVABLE<TEntry>) {
+      uint64_t slot;
+      if (m_tags.at(index) == TEntry::TAG) {
+        slot = m_payloads[index] >> 32;
+      } else {
+        slot = m_resolved.size();
+        m_resolved.push_back(nullptr);
+      }
+      m_resolved[slot] = GetResolved(entry);
+      payload |= slot << 32;
+    }
+    m_tags.at(index) = TEntry::TAG;
+    m_payloads[index] = payload;
+  }
+
+  /** Store an entry of any type at the given index. */
+  void PutAny(int index, const ConstantPoolEntry& entry) {
+    std::visit([&] (const auto& e) { Put(index, e); }, entry);
   }
 
   /** Get the UTF-8 entry at the given index. */
   const std::string& GetUtf8(int index) const {
-    return Get<EntryUtf8>(index)->m_value;
+    return GetSymbol(index)->m_value;
+  }
+
+  /** Get the interned symbol for the UTF-8 entry at the given index. */
+  const Symbol* GetSymbol(int index) const {
+    return Get<EntryUtf8>(index).m_symbol;
   }
 
   std::string ToString() const;
 
   int Size() const {
-    return m_entries.size();
+    return m_tags.size();
   }
 
   /** Parse a constant pool from the given reader. */
   static ConstantPool parse(ByteReader *reader);
+
+  /**
+   * Parse the entry (tag and contents) at the reader's position into the given index. Returns the number of indices it
+   * occupies: 2 for longs and doubles, otherwise 1.
+   */
+  int ParseEntry(ByteReader *reader, int index);
+
+  /** Skip over a constant pool, recording where each entry lives. */
+  static ConstantPoolLayout Skim(ByteReader *reader);
+
+  /**
+   * Read the name of the Class entry at class_index from a skimmed constant pool. Offsets in the layout must be
+   * relative to the start of bytes.
+   */
+  static std::string ReadClassName(ByteSpan bytes, const ConstantPoolLayout& layout, int class_index);
 };
 
 } // bjvm
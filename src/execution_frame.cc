@@ -4,5 +4,27 @@
 
 #include "execution_frame.h"
 
+#include <cstddef>
+#include <new>
+
 namespace bjvm {
-} // bjvm
\ No newline at end of file
+
+FrameStack::FrameStack(size_t capacity) : m_slab(std::make_unique<FrameEntry[]>(capacity)), m_capacity(capacity) {}
+
+ExecutionFrame * FrameStack::Push(const classfile::MethodInfo *method, const classfile::CodeAttribute *code,
+                                  FrameEntry *locals) {
+  constexpr size_t HEADER_ENTRIES = sizeof(ExecutionFrame) / sizeof(FrameEntry);
+  static_assert(offsetof(ExecutionFrame, m_spill) + sizeof(FrameEntry) == sizeof(ExecutionFrame),
+                "The spill entry must be directly below the operand stack");
+
+  size_t used = locals - m_slab.get();
+  size_t size = code->m_max_locals + HEADER_ENTRIES + code->m_max_stack;
+  if (size > m_capacity - used)
+    throw std::runtime_error("StackOverflowError");
+
+  void* header = locals + code->m_max_locals;
+  m_top = new (header) ExecutionFrame(method, code, m_top, locals);
+  return m_top;
+}
+
+} // bjvm
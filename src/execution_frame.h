@@ -6,28 +6,102 @@
 #define EXECUTION_FRAME_H
 
 #include <cstdint>
-#include <vector>
+#include <memory>
+
+#include "classfile.h"
 
 namespace bjvm {
 
 using FrameEntry = uint64_t;
 
 /**
- * A single execution frame on the call stack. No type checking is performed during bytecode interpretation as this is
- * the point of classfile verification.
+ * The header of a single execution frame on a FrameStack. No type checking is performed during bytecode interpretation
+ * as this is the point of classfile verification.
+ *
+ * A frame is laid out inline as locals (max_locals entries), then this header, then the operand stack (max_stack
+ * entries). Locals come first so that they can start at the arguments on the caller's operand stack, which therefore
+ * needn't be copied.
  *
- * In the future this might be a variable length struct e.g. for better cache locality, since we know max_locals
- * and max_stack.
+ * Longs and doubles take two entries, as in the JVM spec, so that max_locals and max_stack can be used as they are; the
+ * value is in the first entry and the second is unused.
  */
 class ExecutionFrame {
- std::vector<FrameEntry> m_locals;
- std::vector<FrameEntry> m_stack;
+  friend class BytecodeInterpreter;
+  friend class FrameStack;
+
+  const classfile::MethodInfo* m_method;
+  const classfile::CodeAttribute* m_code;
+
+  ExecutionFrame* m_caller;
+  FrameEntry* m_locals;
+
+  // Saved while the frame isn't running, i.e. while it is calling another method
+  int m_stack_index = 0;
+  int m_instruction_index = 0;
+
+  // Directly below the operand stack, so that an interpreter caching the top of the stack in a register can spill it
+  // unconditionally, even when the stack is empty and the register holds nothing
+  FrameEntry m_spill = 0;
+
+  ExecutionFrame(const classfile::MethodInfo* method, const classfile::CodeAttribute* code, ExecutionFrame* caller,
+                 FrameEntry* locals)
+    : m_method(method), m_code(code), m_caller(caller), m_locals(locals) {}
+
+public:
+  FrameEntry* Locals() const {
+    return m_locals;
+  }
+
+  FrameEntry* Stack() {
+    return reinterpret_cast<FrameEntry*>(this + 1);
+  }
+
+  /** One past the last entry of the operand stack, and so of the frame. */
+  FrameEntry* End() {
+    return Stack() + m_code->m_max_stack;
+  }
+};
+
+static_assert(sizeof(ExecutionFrame) % sizeof(FrameEntry) == 0 && alignof(ExecutionFrame) <= alignof(FrameEntry),
+              "Frame headers must sit between frame entries");
+
+/**
+ * One thread's call stack: a fixed-size slab of frames, so that pushing a frame doesn't allocate and frames never move.
+ */
+class FrameStack {
+  std::unique_ptr<FrameEntry[]> m_slab;
+  size_t m_capacity;
 
- int m_stack_index = 0;
- int m_instruction_index = 0;
+  ExecutionFrame* m_top = nullptr;
 
 public:
- ExecutionFrame(int max_locals, int max_stack) : m_locals(max_locals), m_stack(max_stack) {}
+  // 1 MiB, like HotSpot's default thread stack
+  static constexpr size_t DEFAULT_CAPACITY = (1 << 20) / sizeof(FrameEntry);
+
+  explicit FrameStack(size_t capacity = DEFAULT_CAPACITY);
+
+  bool Empty() const {
+    return !m_top;
+  }
+
+  ExecutionFrame* Top() const {
+    return m_top;
+  }
+
+  /** Where a frame with nothing to overlap (i.e. called from outside the interpreter) should put its locals. */
+  FrameEntry* End() const {
+    return m_top ? m_top->End() : m_slab.get();
+  }
+
+  /**
+   * Push a frame for the given method, whose locals start at the given address: either End(), or the arguments on the
+   * top frame's operand stack. Throws StackOverflowError if it doesn't fit.
+   */
+  ExecutionFrame* Push(const classfile::MethodInfo* method, const classfile::CodeAttribute* code, FrameEntry* locals);
+
+  void Pop() {
+    m_top = m_top->m_caller;
+  }
 };
 
 } // bjvm
@@ -8,6 +8,8 @@
 #include <cstdint>
 
 namespace bjvm {
+class ClassInstance;
+
 /**
  * Base class for all heap objects.
  *
@@ -19,9 +21,17 @@ namespace bjvm {
  */
 class HeapObject {
   uint32_t m_mark_word[2] = { 0, 0 };
-  void* m_class = nullptr;
+  ClassInstance* m_class = nullptr;
 
   int IdentityHashCode() const;
+
+public:
+  explicit HeapObject(ClassInstance* klass) : m_class(klass) {}
+
+  /** The object's class, which virtual and interface calls on it dispatch on. */
+  ClassInstance* GetClass() const {
+    return m_class;
+  }
 };
 
 } // bjvm
@@ -0,0 +1,46 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#include "inline_cache.h"
+
+#include "class_instance.h"
+
+namespace bjvm {
+
+const classfile::MethodInfo * InlineCache::Miss(const ClassInstance *klass) {
+  ++m_misses;
+
+  const classfile::MethodInfo* method = klass->GetVirtualMethod(m_resolved);
+  if (!method) {
+    const auto& cp = m_resolved->m_class->GetClassfile()->m_cp;
+    throw std::runtime_error("AbstractMethodError: " + klass->GetClassfile()->GetName() + "."
+                             + cp.GetUtf8(m_resolved->m_name_index) + cp.GetUtf8(m_resolved->m_descriptor_index));
+  }
+
+  if (m_size < POLYMORPHIC_ENTRIES)
+    m_entries[m_size++] = { klass, method };
+  else
+    m_megamorphic = true;
+  return method;
+}
+
+InlineCache::State InlineCache::GetState() const {
+  if (m_megamorphic)
+    return State::Megamorphic;
+  if (m_size == 0)
+    return State::Empty;
+  return m_size == 1 ? State::Monomorphic : State::Polymorphic;
+}
+
+const char* StateName(InlineCache::State state) {
+  switch (state) {
+    case InlineCache::State::Empty: return "empty";
+    case InlineCache::State::Monomorphic: return "monomorphic";
+    case InlineCache::State::Polymorphic: return "polymorphic";
+    case InlineCache::State::Megamorphic: return "megamorphic";
+  }
+  return "unknown";
+}
+
+} // bjvm
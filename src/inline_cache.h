@@ -0,0 +1,92 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#ifndef INLINE_CACHE_H
+#define INLINE_CACHE_H
+
+#include <array>
+#include <cstdint>
+
+#include "classfile.h"
+
+namespace bjvm {
+
+/**
+ * The methods one invokevirtual or invokeinterface instruction has called, by receiver class, so that a call on an
+ * instance of a class seen before needn't look the method up in the class's vtable or itables again.
+ *
+ * A cache starts out empty, is monomorphic once one receiver class has been recorded, and polymorphic once more have,
+ * up to POLYMORPHIC_ENTRIES. Past that it is megamorphic: it keeps the classes it has, and the method for any other
+ * is looked up on every call.
+ *
+ * Caches are updated without synchronisation, as Java code is only interpreted on one thread so far.
+ */
+class InlineCache {
+public:
+  static constexpr int POLYMORPHIC_ENTRIES = 4;
+
+  enum class State {
+    Empty,
+    Monomorphic,
+    Polymorphic,
+    Megamorphic
+  };
+
+private:
+  struct Entry {
+    const ClassInstance* m_class;
+    const classfile::MethodInfo* m_method;
+  };
+
+  // What the instruction refers to, resolved when its class was linked
+  const classfile::MethodInfo* m_resolved;
+
+  int m_size = 0;
+  bool m_megamorphic = false;
+  std::array<Entry, POLYMORPHIC_ENTRIES> m_entries {};
+
+  uint64_t m_hits = 0;
+  uint64_t m_misses = 0;
+
+  const classfile::MethodInfo* Miss(const ClassInstance* klass);
+
+public:
+  explicit InlineCache(const classfile::MethodInfo* resolved) : m_resolved(resolved) {}
+
+  const classfile::MethodInfo* GetResolved() const {
+    return m_resolved;
+  }
+
+  /**
+   * Get the method to call on an instance of klass, looking it up on a miss. Throws AbstractMethodError, or
+   * IncompatibleClassChangeError if klass doesn't implement the interface of an invokeinterface.
+   */
+  const classfile::MethodInfo* Lookup(const ClassInstance* klass) {
+    for (int i = 0; i < m_size; ++i) {
+      if (m_entries[i].m_class == klass) {
+        ++m_hits;
+        return m_entries[i].m_method;
+      }
+    }
+    return Miss(klass);
+  }
+
+  State GetState() const;
+
+  /** Calls which found their receiver's class in the cache. */
+  uint64_t GetHits() const {
+    return m_hits;
+  }
+
+  /** Calls which had to look their method up: the first for each class recorded, and each uncached megamorphic one. */
+  uint64_t GetMisses() const {
+    return m_misses;
+  }
+};
+
+const char* StateName(InlineCache::State state);
+
+} // bjvm
+
+#endif //INLINE_CACHE_H
@@ -0,0 +1,188 @@
+//
+// Created by Cowpox on 8/13/24.
+//
+
+#include "jar_file.h"
+
+#include <zlib.h>
+
+namespace bjvm {
+
+// See https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
+enum ZipSignature : uint32_t {
+  LocalFileHeader = 0x04034b50,
+  CentralDirectoryHeader = 0x02014b50,
+  EndOfCentralDirectory = 0x06054b50
+};
+
+constexpr size_t LOCAL_HEADER_SIZE = 30;
+constexpr size_t CENTRAL_HEADER_SIZE = 46;
+constexpr size_t END_OF_CENTRAL_DIRECTORY_SIZE = 22;
+constexpr size_t MAX_COMMENT_SIZE = 0xffff;
+
+constexpr uint16_t COMPRESSION_STORED = 0;
+constexpr uint16_t COMPRESSION_DEFLATED = 8;
+
+// Far more than any classfile, but keeps a corrupt central directory from having us allocate gigabytes
+constexpr uint32_t MAX_UNCOMPRESSED_SIZE = 64 << 20;
+
+// ZIP is little endian, unlike classfiles, so ByteReader is no help here
+static uint16_t ReadLE16(const uint8_t* p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t ReadLE32(const uint8_t* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+/**
+ * Raw-deflate stream which is reset rather than reallocated between entries.
+ */
+class Inflater {
+  z_stream m_stream{};
+
+public:
+  Inflater() {
+    if (inflateInit2(&m_stream, -MAX_WBITS) != Z_OK)
+      throw std::runtime_error("Could not initialise zlib");
+  }
+
+  ~Inflater() {
+    inflateEnd(&m_stream);
+  }
+
+  void Inflate(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, const std::string& what) {
+    inflateReset(&m_stream);
+    m_stream.next_in = const_cast<Bytef*>(in);
+    m_stream.avail_in = static_cast<uInt>(in_size);
+    m_stream.next_out = out;
+    m_stream.avail_out = static_cast<uInt>(out_size);
+
+    int status = inflate(&m_stream, Z_FINISH);
+    if (status != Z_STREAM_END || m_stream.total_out != out_size)
+      throw std::runtime_error("Corrupt deflate stream in " + what);
+  }
+};
+
+uint32_t Crc32(ByteSpan bytes) {
+  return crc32(crc32(0, nullptr, 0), bytes.data(), static_cast<uInt>(bytes.size()));
+}
+
+JarFile::JarFile(const std::string &path) : m_path(path), m_file(path) {
+  ReadCentralDirectory();
+}
+
+void JarFile::ReadCentralDirectory() {
+  ByteSpan bytes = m_file.Bytes();
+  if (bytes.size() < END_OF_CENTRAL_DIRECTORY_SIZE)
+    throw std::runtime_error("Not a JAR file: " + m_path);
+
+  // The end of central directory record is followed by a variable-length comment, so search backwards for it
+  size_t lowest = bytes.size() > END_OF_CENTRAL_DIRECTORY_SIZE + MAX_COMMENT_SIZE
+    ? bytes.size() - END_OF_CENTRAL_DIRECTORY_SIZE - MAX_COMMENT_SIZE : 0;
+  const uint8_t* eocd = nullptr;
+  for (size_t offs = bytes.size() - END_OF_CENTRAL_DIRECTORY_SIZE + 1; offs-- > lowest;) {
+    if (ReadLE32(bytes.data() + offs) == EndOfCentralDirectory) {
+      eocd = bytes.data() + offs;
+      break;
+    }
+  }
+
+  if (!eocd)
+    throw std::runtime_error("Not a JAR file (no central directory): " + m_path);
+
+  uint16_t entry_count = ReadLE16(eocd + 10);
+  uint32_t directory_size = ReadLE32(eocd + 12);
+  uint32_t directory_offset = ReadLE32(eocd + 16);
+
+  if (entry_count == 0xffff || directory_offset == 0xffffffff)
+    throw std::runtime_error("ZIP64 archives are not supported: " + m_path);
+  if (static_cast<size_t>(directory_offset) + directory_size > bytes.size())
+    throw std::runtime_error("Truncated central directory in " + m_path);
+
+  m_entries.reserve(entry_count);
+
+  const uint8_t* p = bytes.data() + directory_offset;
+  const uint8_t* end = p + directory_size;
+  for (int i = 0; i < entry_count; ++i) {
+    if (p + CENTRAL_HEADER_SIZE > end || ReadLE32(p) != CentralDirectoryHeader)
+      throw std::runtime_error("Corrupt central directory in " + m_path);
+
+    uint16_t flags = ReadLE16(p + 8);
+    uint16_t name_length = ReadLE16(p + 28);
+    uint16_t extra_length = ReadLE16(p + 30);
+    uint16_t comment_length = ReadLE16(p + 32);
+
+    if (p + CENTRAL_HEADER_SIZE + name_length > end)
+      throw std::runtime_error("Corrupt central directory in " + m_path);
+
+    std::string name(reinterpret_cast<const char*>(p + CENTRAL_HEADER_SIZE), name_length);
+    JarEntry entry {
+      .m_local_header_offset = ReadLE32(p + 42),
+      .m_compressed_size = ReadLE32(p + 20),
+      .m_uncompressed_size = ReadLE32(p + 24),
+      .m_crc32 = ReadLE32(p + 16),
+      .m_compression = ReadLE16(p + 10)
+    };
+
+    if (flags & 1)
+      throw std::runtime_error("Encrypted JAR entries are not supported: " + name + " in " + m_path);
+    // The real sizes of an entry this large would be in a ZIP64 extra field, which isn't read
+    if (entry.m_compressed_size == 0xffffffff || entry.m_uncompressed_size == 0xffffffff
+        || entry.m_local_header_offset == 0xffffffff)
+      throw std::runtime_error("ZIP64 entries are not supported: " + name + " in " + m_path);
+
+    m_entries.emplace(std::move(name), entry);  // first entry with a given name wins, as in java.util.zip
+
+    p += CENTRAL_HEADER_SIZE + name_length + extra_length + comment_length;
+  }
+}
+
+const JarEntry * JarFile::Find(const std::string &name) const {
+  auto it = m_entries.find(name);
+  return it == m_entries.end() ? nullptr : &it->second;
+}
+
+ByteSpan JarFile::Read(const JarEntry &entry, std::vector<uint8_t> &buffer) const {
+  ByteSpan bytes = m_file.Bytes();
+
+  // The local header repeats the name and has its own extra field, which may differ from the central directory's
+  size_t header = entry.m_local_header_offset;
+  if (header + LOCAL_HEADER_SIZE > bytes.size() || ReadLE32(bytes.data() + header) != LocalFileHeader)
+    throw std::runtime_error("Corrupt local header in " + m_path);
+
+  size_t data = header + LOCAL_HEADER_SIZE + ReadLE16(bytes.data() + header + 26) + ReadLE16(bytes.data() + header + 28);
+  if (data + entry.m_compressed_size > bytes.size())
+    throw std::runtime_error("Truncated entry in " + m_path);
+
+  ByteSpan contents;
+  switch (entry.m_compression) {
+    case COMPRESSION_STORED:
+      // Only the compressed size has been bounds checked, so the two must agree
+      if (entry.m_compressed_size != entry.m_uncompressed_size)
+        throw std::runtime_error("Corrupt stored entry in " + m_path);
+      contents = { bytes.data() + data, entry.m_compressed_size };
+      break;
+    case COMPRESSION_DEFLATED: {
+      thread_local Inflater inflater;
+
+      if (entry.m_uncompressed_size > MAX_UNCOMPRESSED_SIZE)
+        throw std::runtime_error("Entry too large (" + std::to_string(entry.m_uncompressed_size) + " bytes) in "
+                                 + m_path);
+      buffer.resize(entry.m_uncompressed_size);
+      inflater.Inflate(bytes.data() + data, entry.m_compressed_size, buffer.data(), buffer.size(), m_path);
+      contents = { buffer.data(), buffer.size() };
+      break;
+    }
+    default:
+      throw std::runtime_error("Unsupported compression method " + std::to_string(entry.m_compression) + " in "
+                               + m_path);
+  }
+
+  // Checked before anything is parsed or digested, so a corrupt entry never reaches the archive or verification cache
+  if (Crc32(contents) != entry.m_crc32)
+    throw std::runtime_error("CRC mismatch in " + m_path);
+  return contents;
+}
+
+} // bjvm
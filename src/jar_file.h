@@ -0,0 +1,78 @@
+//
+// Created by Cowpox on 8/13/24.
+//
+
+#ifndef JAR_FILE_H
+#define JAR_FILE_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "byte_reader.h"
+#include "utilities.h"
+
+namespace bjvm {
+
+/**
+ * One file in a JAR's central directory.
+ */
+struct JarEntry {
+  // Offset of the entry's local file header within the archive
+  uint32_t m_local_header_offset;
+  uint32_t m_compressed_size;
+  uint32_t m_uncompressed_size;
+  // CRC-32 of the uncompressed contents
+  uint32_t m_crc32;
+  // ZIP compression method: 0 (stored) or 8 (deflated) are supported
+  uint16_t m_compression;
+};
+
+/** Compute the CRC-32 (as used by ZIP) of some bytes. */
+uint32_t Crc32(ByteSpan bytes);
+
+/**
+ * A JAR (i.e., ZIP) archive on the class path.
+ *
+ * The archive is mapped (see MappedFile) and its central directory is read once, on construction, into a hash index
+ * of entry names. Individual entries are only decompressed when Read is called, so opening rt.jar costs a single pass
+ * over its directory rather than inflating the whole archive.
+ */
+class JarFile {
+  std::string m_path;
+  MappedFile m_file;
+  std::unordered_map<std::string, JarEntry> m_entries;
+
+  void ReadCentralDirectory();
+
+public:
+  explicit JarFile(const std::string& path);
+
+  JarFile(const JarFile&) = delete;
+  JarFile& operator=(const JarFile&) = delete;
+
+  const std::string& GetPath() const {
+    return m_path;
+  }
+
+  /** All entries in the archive, keyed by their path within it (e.g. java/lang/Object.class). */
+  const std::unordered_map<std::string, JarEntry>& Entries() const {
+    return m_entries;
+  }
+
+  /** Look up an entry by its path within the archive, or return nullptr if there is none. */
+  const JarEntry* Find(const std::string& name) const;
+
+  /**
+   * Get the uncompressed contents of an entry. Stored entries are returned in place; deflated entries are inflated into
+   * buffer, which is resized as needed and can be reused across calls to avoid allocating. The returned span is valid
+   * until the buffer is next modified or the JarFile is destroyed. Throws if the contents don't match the entry's
+   * CRC-32, or a deflated entry claims to be implausibly large.
+   */
+  ByteSpan Read(const JarEntry& entry, std::vector<uint8_t>& buffer) const;
+};
+
+} // bjvm
+
+#endif //JAR_FILE_H
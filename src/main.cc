@@ -10,12 +10,13 @@
 int main() {
   using namespace bjvm;
 
-  std::vector<uint8_t> bytes;
   std::string file = "test/jre8/com/oracle/net/Sdp.class";
 
-  ByteReader reader { ReadFile(file) };
+  std::vector<uint8_t> bytes = ReadFile(file);
+  ByteReader reader { bytes };
   try {
-    auto cf = classfile::Classfile::parse(&reader);
+    Arena arena;
+    auto cf = classfile::Classfile::parse(&reader, &arena);
     std::cout << cf.ToString() << '\n';
 
     VM vm {
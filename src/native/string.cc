@@ -4,7 +4,75 @@
 
 #include "string.h"
 
+#include <cstring>
+#include <stdexcept>
+
+#include "../utf8.h"
+
 namespace bjvm {
 namespace native {
+
+String String::FromModifiedUtf8(std::string_view bytes) {
+  auto* data = reinterpret_cast<const uint8_t*>(bytes.data());
+
+  // Pure ASCII (the usual case) is already Latin-1
+  if (AsciiPrefixLength(data, bytes.size()) == bytes.size())
+    return { Coder::Latin1, { data, data + bytes.size() } };
+
+  std::vector<char16_t> units(ModifiedUtf8Utf16Length(data, bytes.size()));
+  bool latin1 = DecodeModifiedUtf8(data, bytes.size(), units.data());
+
+  if (latin1)
+    return { Coder::Latin1, { units.begin(), units.end() } };
+
+  std::vector<uint8_t> value(units.size() * sizeof(char16_t));
+  std::memcpy(value.data(), units.data(), value.size());
+  return { Coder::Utf16, std::move(value) };
+}
+
+char16_t String::CharAt(size_t index) const {
+  if (index >= Length())
+    throw std::out_of_range("StringIndexOutOfBoundsException index " + std::to_string(index));
+
+  if (m_coder == Coder::Latin1)
+    return m_value[index];
+
+  char16_t c;
+  std::memcpy(&c, m_value.data() + index * sizeof(char16_t), sizeof(c));
+  return c;
+}
+
+std::string String::ToUtf8() const {
+  if (m_coder == Coder::Latin1) {
+    std::string result;
+    for (uint8_t c : m_value) {
+      if (c < 0x80) {
+        result += static_cast<char>(c);
+      } else {
+        result += static_cast<char>(0xC0 | c >> 6);
+        result += static_cast<char>(0x80 | (c & 0x3F));
+      }
+    }
+    return result;
+  }
+
+  // Re-encode as modified UTF-8, which ModifiedUtf8ToUtf8 already knows how to turn into UTF-8
+  std::string modified;
+  for (size_t i = 0; i < Length(); ++i) {
+    char16_t c = CharAt(i);
+    if (c != 0 && c < 0x80) {
+      modified += static_cast<char>(c);
+    } else if (c < 0x800) {
+      modified += static_cast<char>(0xC0 | c >> 6);
+      modified += static_cast<char>(0x80 | (c & 0x3F));
+    } else {
+      modified += static_cast<char>(0xE0 | c >> 12);
+      modified += static_cast<char>(0x80 | (c >> 6 & 0x3F));
+      modified += static_cast<char>(0x80 | (c & 0x3F));
+    }
+  }
+  return ModifiedUtf8ToUtf8(modified);
+}
+
 } // native
-} // bjvm
\ No newline at end of file
+} // bjvm
@@ -5,11 +5,49 @@
 #ifndef STRING_H
 #define STRING_H
 
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
 namespace bjvm {
 namespace native {
 
+/**
+ * Contents of a java.lang.String. Following JDK 9+ compact strings, strings whose characters all fit in Latin-1 are
+ * stored one byte per character, and all others as UTF-16.
+ */
 class String {
+public:
+  enum class Coder : uint8_t {
+    Latin1,
+    Utf16
+  };
+
+private:
+  Coder m_coder;
+  // One byte per character if Latin-1, otherwise two (native byte order)
+  std::vector<uint8_t> m_value;
+
+  String(Coder coder, std::vector<uint8_t>&& value) : m_coder(coder), m_value(std::move(value)) {}
+
+public:
+  /** Decode a string from the constant pool. The bytes must be valid modified UTF-8. */
+  static String FromModifiedUtf8(std::string_view bytes);
+
+  Coder GetCoder() const {
+    return m_coder;
+  }
+
+  /** Length in UTF-16 code units, as returned by String.length(). */
+  size_t Length() const {
+    return m_coder == Coder::Latin1 ? m_value.size() : m_value.size() / 2;
+  }
+
+  char16_t CharAt(size_t index) const;
 
+  /** Convert to standard UTF-8, e.g. for printing. */
+  std::string ToUtf8() const;
 };
 
 } // native
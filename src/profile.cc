@@ -0,0 +1,141 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#include "profile.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "class_instance.h"
+#include "inline_cache.h"
+#include "utf8.h"
+
+namespace bjvm {
+
+using namespace classfile;
+
+namespace {
+
+struct MethodEntry {
+  const MethodInfo* m_method;
+  uint64_t m_invocations;
+  uint64_t m_backedges;
+};
+
+struct LoopEntry {
+  const MethodInfo* m_method;
+  const Insn* m_header;
+  uint64_t m_iterations;
+};
+
+struct CallSiteEntry {
+  const MethodInfo* m_method;
+  const Insn* m_insn;
+  const InlineCache* m_cache;
+};
+
+void WriteString(std::ostream& out, const std::string& value) {
+  out << '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out << escaped;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+/** Write the members identifying a method, whose names are modified UTF-8 and so need converting for JSON. */
+void WriteMethod(std::ostream& out, const MethodInfo* method) {
+  const Classfile* cf = method->m_class->GetClassfile();
+  out << "\"class\": ";
+  WriteString(out, ModifiedUtf8ToUtf8(cf->GetName()));
+  out << ", \"name\": ";
+  WriteString(out, ModifiedUtf8ToUtf8(cf->m_cp.GetUtf8(method->m_name_index)));
+  out << ", \"descriptor\": ";
+  WriteString(out, ModifiedUtf8ToUtf8(cf->m_cp.GetUtf8(method->m_descriptor_index)));
+}
+
+/** Sort entries hottest first, keep the first limit and write them as the named list, with write writing each. */
+template <typename Entry, typename Heat, typename Write>
+void WriteList(std::ostream& out, const char* name, std::vector<Entry>& entries, size_t limit, Heat heat,
+               Write write) {
+  std::stable_sort(entries.begin(), entries.end(), [&] (const Entry& a, const Entry& b) {
+    return heat(a) > heat(b);
+  });
+  entries.resize(std::min(entries.size(), limit));
+
+  out << "  \"" << name << "\": [";
+  for (size_t i = 0; i < entries.size(); ++i) {
+    out << (i ? ",\n    { " : "\n    { ");
+    write(entries[i]);
+    out << " }";
+  }
+  out << (entries.empty() ? "]" : "\n  ]");
+}
+
+}
+
+void WriteProfile(std::ostream &out, const std::vector<const ClassInstance *> &classes, size_t limit) {
+  std::vector<MethodEntry> methods;
+  std::vector<LoopEntry> loops;
+  std::vector<CallSiteEntry> call_sites;
+
+  for (const auto* klass : classes) {
+    for (const auto& method : klass->GetClassfile()->m_methods) {
+      const MethodProfile* profile = method.GetProfile();
+      if (!profile)
+        continue;
+
+      const CodeAttribute* code = method.GetExecutableCode();
+      uint64_t backedges = 0;
+      for (size_t i = 0; i < code->m_code.size(); ++i) {
+        const Insn& insn = code->m_code[i];
+        if (uint64_t iterations = profile->m_backedges[i]) {
+          loops.push_back({ &method, &insn, iterations });
+          backedges += iterations;
+        }
+        if (insn.GetCode() == InsnCode::invokevirtual_quick || insn.GetCode() == InsnCode::invokeinterface_quick)
+          call_sites.push_back({ &method, &insn, insn.GetInlineCache() });
+      }
+
+      if (profile->m_invocations || backedges)
+        methods.push_back({ &method, profile->m_invocations, backedges });
+    }
+  }
+
+  out << "{\n";
+  WriteList(out, "methods", methods, limit, [] (const MethodEntry& entry) {
+    return entry.m_invocations + entry.m_backedges;
+  }, [&] (const MethodEntry& entry) {
+    WriteMethod(out, entry.m_method);
+    out << ", \"invocations\": " << entry.m_invocations << ", \"backedges\": " << entry.m_backedges;
+  });
+  out << ",\n";
+  WriteList(out, "loops", loops, limit, [] (const LoopEntry& entry) {
+    return entry.m_iterations;
+  }, [&] (const LoopEntry& entry) {
+    WriteMethod(out, entry.m_method);
+    out << ", \"pc\": " << entry.m_header->GetPC() << ", \"iterations\": " << entry.m_iterations;
+  });
+  out << ",\n";
+  WriteList(out, "call_sites", call_sites, limit, [] (const CallSiteEntry& entry) {
+    return entry.m_cache->GetHits() + entry.m_cache->GetMisses();
+  }, [&] (const CallSiteEntry& entry) {
+    WriteMethod(out, entry.m_method);
+    bool virtual_call = entry.m_insn->GetCode() == InsnCode::invokevirtual_quick;
+    out << ", \"pc\": " << entry.m_insn->GetPC() << ", \"instruction\": \""
+        << (virtual_call ? "invokevirtual" : "invokeinterface") << "\", \"state\": \""
+        << StateName(entry.m_cache->GetState()) << "\", \"hits\": " << entry.m_cache->GetHits() << ", \"misses\": "
+        << entry.m_cache->GetMisses();
+  });
+  out << "\n}\n";
+}
+
+} // bjvm
@@ -0,0 +1,32 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <ostream>
+#include <vector>
+
+namespace bjvm {
+
+class ClassInstance;
+
+/**
+ * Write what the interpreter has counted (see MethodProfile) for the methods of the given classes, as a JSON object
+ * with three lists, each sorted hottest first and cut to at most limit entries:
+ *
+ *   "methods": { "class", "name", "descriptor", "invocations", "backedges" } for each method which has run, by
+ *     invocations plus backedges, the latter being the total iterations of its loops
+ *   "loops": { "class", "name", "descriptor", "pc", "iterations" } for each loop which has iterated, where pc is the
+ *     bytecode offset of its header
+ *   "call_sites": { "class", "name", "descriptor", "pc", "instruction", "state", "hits", "misses" } for each
+ *     invokevirtual or invokeinterface which has run, with its inline cache's state and counts, by calls
+ *
+ * Counters are read while they may still be being updated, so a profile taken while code is running is approximate.
+ */
+void WriteProfile(std::ostream& out, const std::vector<const ClassInstance*>& classes, size_t limit);
+
+} // bjvm
+
+#endif //PROFILE_H
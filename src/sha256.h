@@ -0,0 +1,49 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "byte_reader.h"
+
+namespace bjvm {
+
+/**
+ * SHA-256 digest (FIPS 180-4). Used where a classfile has to be recognised across runs and a collision would be
+ * unsafe rather than merely slow (see ClassArchive and VerificationCache).
+ */
+struct Sha256Digest {
+  std::array<uint8_t, 32> m_bytes {};
+
+  bool operator==(const Sha256Digest& other) const {
+    return m_bytes == other.m_bytes;
+  }
+
+  bool operator!=(const Sha256Digest& other) const {
+    return !(*this == other);
+  }
+
+  /** Lowercase hex, as printed by sha256sum. */
+  std::string ToHex() const;
+};
+
+struct Sha256DigestHash {
+  size_t operator()(const Sha256Digest& digest) const {
+    // The digest is already uniformly distributed
+    size_t hash;
+    std::memcpy(&hash, digest.m_bytes.data(), sizeof(hash));
+    return hash;
+  }
+};
+
+Sha256Digest Sha256(ByteSpan bytes);
+
+} // bjvm
+
+#endif //SHA256_H
@@ -0,0 +1,71 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#include "superinstructions.h"
+
+#include <iterator>
+
+namespace bjvm::classfile {
+
+using I = InsnCode;
+
+// Common javac idioms (loop conditions and increments, int accumulation, pushing two locals), restricted to
+// instructions the interpreter implements and which can't throw. To revise it, count sequences across a corpus with
+// classfile_bench --sequences. When one sequence starts with another, the longer one must come first. Adding a
+// sequence also needs an InsnCode and an interpreter handler for it.
+const Superinstruction SUPERINSTRUCTIONS[] = {
+  { I::iload_iload_iadd_istore, { I::iload, I::iload, I::iadd, I::istore } },
+  { I::iload_iload_if_icmpge, { I::iload, I::iload, I::if_icmpge } },
+  { I::iload_iload_if_icmplt, { I::iload, I::iload, I::if_icmplt } },
+  { I::iload_iload, { I::iload, I::iload } },
+  { I::aload_aload, { I::aload, I::aload } },
+  { I::iinc_goto, { I::iinc, I::goto_ } },
+  { I::iload_ireturn, { I::iload, I::ireturn } },
+};
+
+const size_t SUPERINSTRUCTION_COUNT = std::size(SUPERINSTRUCTIONS);
+
+int Superinstruction::Length() const {
+  int length = 0;
+  while (length < static_cast<int>(m_sequence.size()) && m_sequence[length] != I::nop)
+    ++length;
+  return length;
+}
+
+static bool Matches(const Superinstruction& superinstruction, const Insn* insns, size_t available) {
+  int length = superinstruction.Length();
+  if (static_cast<size_t>(length) > available)
+    return false;
+
+  for (int i = 0; i < length; ++i) {
+    if (insns[i].GetCode() != superinstruction.m_sequence[i])
+      return false;
+  }
+  return true;
+}
+
+void FuseSuperinstructions(CodeAttribute *code) {
+  Insn* insns = code->m_code.data();
+  size_t count = code->m_code.size();
+
+  for (size_t i = 0; i < count;) {
+    const Superinstruction* match = nullptr;
+    for (const auto& superinstruction : SUPERINSTRUCTIONS) {
+      if (Matches(superinstruction, insns + i, count - i)) {
+        match = &superinstruction;
+        break;
+      }
+    }
+
+    if (!match) {
+      ++i;
+      continue;
+    }
+
+    insns[i].m_code = match->m_fused;
+    i += match->Length();
+  }
+}
+
+} // bjvm::classfile
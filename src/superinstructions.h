@@ -0,0 +1,42 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#ifndef SUPERINSTRUCTIONS_H
+#define SUPERINSTRUCTIONS_H
+
+#include <array>
+
+#include "classfile.h"
+
+namespace bjvm::classfile {
+
+/**
+ * A sequence of (canonicalised) instructions which is executed as one superinstruction. Unused trailing entries of
+ * m_sequence are nop.
+ */
+struct Superinstruction {
+  InsnCode m_fused;
+  std::array<InsnCode, 4> m_sequence;
+
+  int Length() const;
+};
+
+/** The sequences fused by FuseSuperinstructions, in the order they're tried at each instruction. */
+extern const Superinstruction SUPERINSTRUCTIONS[];
+extern const size_t SUPERINSTRUCTION_COUNT;
+
+/**
+ * Fuse superinstructions into decoded code, scanning from the start and overwriting the code of the first instruction
+ * of each non-overlapping match.
+ *
+ * Instruction indices don't change, and every instruction after the first of a match is left as it was. So branch
+ * targets, exception ranges and type states all stay valid, and a branch into the middle of a match runs the original
+ * instructions from there. No sequence contains an instruction which can throw, so the instruction index of a frame is
+ * always that of the instruction which threw.
+ */
+void FuseSuperinstructions(CodeAttribute* code);
+
+} // bjvm::classfile
+
+#endif //SUPERINSTRUCTIONS_H
@@ -0,0 +1,37 @@
+//
+// Created by Cowpox on 8/15/24.
+//
+
+#include "symbol_table.h"
+
+namespace bjvm {
+
+SymbolTable& SymbolTable::Global() {
+  static SymbolTable table;
+  return table;
+}
+
+const Symbol* SymbolTable::Intern(std::string_view value) {
+  size_t hash = std::hash<std::string_view>{}(value);
+  Shard& shard = m_shards[hash % SHARD_COUNT];
+
+  std::lock_guard lock { shard.m_mutex };
+  auto it = shard.m_index.find(value);
+  if (it != shard.m_index.end())
+    return it->second;
+
+  const Symbol& symbol = shard.m_symbols.emplace_back(Symbol { std::string(value), hash });
+  shard.m_index.emplace(symbol.m_value, &symbol);
+  return &symbol;
+}
+
+const Symbol* SymbolTable::Find(std::string_view value) {
+  size_t hash = std::hash<std::string_view>{}(value);
+  Shard& shard = m_shards[hash % SHARD_COUNT];
+
+  std::lock_guard lock { shard.m_mutex };
+  auto it = shard.m_index.find(value);
+  return it == shard.m_index.end() ? nullptr : it->second;
+}
+
+} // bjvm
@@ -0,0 +1,74 @@
+//
+// Created by Cowpox on 8/15/24.
+//
+
+#ifndef SYMBOL_TABLE_H
+#define SYMBOL_TABLE_H
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace bjvm {
+
+/**
+ * Interned (modified UTF-8) string, e.g. a class name or method descriptor.
+ *
+ * Symbols are unique: two symbols have the same contents if and only if they are the same object, so they can be compared
+ * and hashed by address. Symbols are never freed.
+ */
+struct Symbol {
+  std::string m_value;
+  // Hash of m_value
+  size_t m_hash;
+
+  const std::string& str() const {
+    return m_value;
+  }
+};
+
+/** Hashes symbols by their precomputed hash, for use as unordered_map keys. */
+struct SymbolHash {
+  size_t operator()(const Symbol* symbol) const {
+    return symbol->m_hash;
+  }
+};
+
+/**
+ * Table of every interned symbol. There is one table per process, shared by all VMs and by classfile parsing (which
+ * runs without a VM). Interning is thread safe, so classes can be parsed in parallel.
+ */
+class SymbolTable {
+  // Split into independently locked shards so parallel parsing doesn't serialise on a single mutex
+  static constexpr int SHARD_COUNT = 16;
+
+  struct Shard {
+    std::mutex m_mutex;
+    std::deque<Symbol> m_symbols;  // deque so that symbols never move
+    std::unordered_map<std::string_view, const Symbol*> m_index;  // keys point into m_symbols
+  };
+
+  Shard m_shards[SHARD_COUNT];
+
+public:
+  /** The process-wide symbol table. */
+  static SymbolTable& Global();
+
+  /** Get the symbol with the given contents, creating it if needed. */
+  const Symbol* Intern(std::string_view value);
+
+  /** Get the symbol with the given contents, or nullptr if no such symbol exists. */
+  const Symbol* Find(std::string_view value);
+};
+
+/** Intern a string in the global symbol table. */
+inline const Symbol* Intern(std::string_view value) {
+  return SymbolTable::Global().Intern(value);
+}
+
+} // bjvm
+
+#endif //SYMBOL_TABLE_H
@@ -0,0 +1,190 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#include "utf8.h"
+
+#include <cstring>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+namespace bjvm {
+
+size_t AsciiPrefixLength(const uint8_t *bytes, size_t length) {
+  size_t i = 0;
+
+  // A byte stops the run if its high bit is set (start of a multi-byte sequence) or it's zero (never valid)
+#if defined(__AVX2__)
+  const __m256i zero = _mm256_setzero_si256();
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + i));
+    auto stop = static_cast<uint32_t>(_mm256_movemask_epi8(v) | _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+    if (stop)
+      return i + __builtin_ctz(stop);
+  }
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + i));
+    auto stop = static_cast<uint32_t>(_mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+    if (stop)
+      return i + __builtin_ctz(stop);
+  }
+#elif defined(__wasm_simd128__)
+  const v128_t zero = wasm_i8x16_splat(0);
+  for (; i + 16 <= length; i += 16) {
+    v128_t v = wasm_v128_load(bytes + i);
+    uint32_t stop = wasm_i8x16_bitmask(v) | wasm_i8x16_bitmask(wasm_i8x16_eq(v, zero));
+    if (stop)
+      return i + __builtin_ctz(stop);
+  }
+#endif
+
+  // Eight bytes at a time; a word containing a stopping byte is finished off below
+  constexpr uint64_t HIGH_BITS = 0x8080808080808080, LOW_BITS = 0x0101010101010101;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, sizeof(word));
+    if ((word & HIGH_BITS) || ((word - LOW_BITS) & ~word & HIGH_BITS))
+      break;
+  }
+
+  while (i < length && bytes[i] != 0 && bytes[i] < 0x80)
+    ++i;
+  return i;
+}
+
+/**
+ * Decode the multi-byte sequence (or single ASCII byte) starting at bytes[0]. Returns the number of bytes it occupies,
+ * or 0 if it's malformed.
+ */
+static int DecodeSequence(const uint8_t* bytes, size_t remaining, char16_t* result) {
+  uint8_t b = bytes[0];
+  if (b != 0 && b < 0x80) {
+    *result = b;
+    return 1;
+  }
+
+  const auto IsContinuation = [&] (size_t i) {
+    return i < remaining && (bytes[i] & 0xC0) == 0x80;
+  };
+
+  if ((b & 0xE0) == 0xC0) {
+    if (!IsContinuation(1))
+      return 0;
+    char16_t c = (b & 0x1F) << 6 | (bytes[1] & 0x3F);
+    if (c != 0 && c < 0x80)  // overlong; only NUL is encoded in two bytes
+      return 0;
+    *result = c;
+    return 2;
+  }
+
+  if ((b & 0xF0) == 0xE0) {
+    if (!IsContinuation(1) || !IsContinuation(2))
+      return 0;
+    char16_t c = (b & 0x0F) << 12 | (bytes[1] & 0x3F) << 6 | (bytes[2] & 0x3F);
+    if (c < 0x800)  // overlong
+      return 0;
+    *result = c;  // may be half of a surrogate pair, which is how supplementary characters are encoded
+    return 3;
+  }
+
+  // Zero bytes, stray continuation bytes, and four-byte sequences (which modified UTF-8 doesn't use)
+  return 0;
+}
+
+bool IsValidModifiedUtf8(const uint8_t *bytes, size_t length) {
+  size_t i = 0;
+  while (true) {
+    i += AsciiPrefixLength(bytes + i, length - i);
+    if (i == length)
+      return true;
+
+    char16_t c;
+    int consumed = DecodeSequence(bytes + i, length - i, &c);
+    if (!consumed)
+      return false;
+    i += consumed;
+  }
+}
+
+size_t ModifiedUtf8Utf16Length(const uint8_t *bytes, size_t length) {
+  size_t units = 0, i = 0;
+  while (true) {
+    size_t run = AsciiPrefixLength(bytes + i, length - i);
+    units += run;
+    i += run;
+    if (i >= length)
+      return units;
+
+    // Every sequence is one code unit; the lead byte tells us how long it is
+    i += (bytes[i] & 0xE0) == 0xC0 ? 2 : 3;
+    units++;
+  }
+}
+
+bool DecodeModifiedUtf8(const uint8_t *bytes, size_t length, char16_t *out) {
+  bool latin1 = true;
+  size_t i = 0;
+  while (true) {
+    size_t run = AsciiPrefixLength(bytes + i, length - i);
+    for (size_t j = 0; j < run; ++j)
+      out[j] = bytes[i + j];
+    out += run;
+    i += run;
+    if (i >= length)
+      return latin1;
+
+    char16_t c = 0;
+    int consumed = DecodeSequence(bytes + i, length - i, &c);
+    i += consumed ? consumed : 1;  // can't happen for valid input, but make progress regardless
+    latin1 &= c <= 0xFF;
+    *out++ = c;
+  }
+}
+
+std::string ModifiedUtf8ToUtf8(std::string_view str) {
+  auto* bytes = reinterpret_cast<const uint8_t*>(str.data());
+  if (AsciiPrefixLength(bytes, str.size()) == str.size())
+    return std::string(str);
+
+  std::vector<char16_t> units(ModifiedUtf8Utf16Length(bytes, str.size()));
+  DecodeModifiedUtf8(bytes, str.size(), units.data());
+
+  std::string result;
+  result.reserve(str.size());
+  for (size_t i = 0; i < units.size(); ++i) {
+    uint32_t c = units[i];
+
+    // Rejoin surrogate pairs into one code point; lone surrogates are passed through as three bytes
+    if (c >= 0xD800 && c <= 0xDBFF && i + 1 < units.size() && units[i + 1] >= 0xDC00 && units[i + 1] <= 0xDFFF) {
+      c = 0x10000 + ((c - 0xD800) << 10) + (units[++i] - 0xDC00);
+    }
+
+    if (c < 0x80) {
+      result += static_cast<char>(c);
+    } else if (c < 0x800) {
+      result += static_cast<char>(0xC0 | c >> 6);
+      result += static_cast<char>(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+      result += static_cast<char>(0xE0 | c >> 12);
+      result += static_cast<char>(0x80 | (c >> 6 & 0x3F));
+      result += static_cast<char>(0x80 | (c & 0x3F));
+    } else {
+      result += static_cast<char>(0xF0 | c >> 18);
+      result += static_cast<char>(0x80 | (c >> 12 & 0x3F));
+      result += static_cast<char>(0x80 | (c >> 6 & 0x3F));
+      result += static_cast<char>(0x80 | (c & 0x3F));
+    }
+  }
+  return result;
+}
+
+} // bjvm
@@ -0,0 +1,47 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace bjvm {
+
+/**
+ * Modified UTF-8, as used by classfiles (JVMS 4.4.7). It differs from standard UTF-8 in that U+0000 is encoded as the
+ * two bytes C0 80 (so there are never any zero bytes), and characters outside the BMP are encoded as a surrogate pair
+ * of three-byte sequences rather than as one four-byte sequence.
+ *
+ * Nearly all constant pool strings are ASCII, so every routine here skips over ASCII runs 16 or 32 bytes at a time
+ * (SSE2, AVX2 or WebAssembly SIMD, with a portable 8-byte fallback) and only decodes multi-byte sequences one by one.
+ */
+
+/** Length of the longest prefix of bytes consisting only of ASCII characters other than NUL. */
+size_t AsciiPrefixLength(const uint8_t* bytes, size_t length);
+
+/** Whether the bytes are well-formed modified UTF-8. Overlong encodings are rejected, apart from C0 80. */
+bool IsValidModifiedUtf8(const uint8_t* bytes, size_t length);
+
+/** Number of UTF-16 code units the string decodes to. The bytes must be valid modified UTF-8. */
+size_t ModifiedUtf8Utf16Length(const uint8_t* bytes, size_t length);
+
+/**
+ * Decode a valid modified UTF-8 string to UTF-16. out must have room for ModifiedUtf8Utf16Length code units. Returns
+ * true if every code unit fits in Latin-1 (i.e. is at most U+00FF), in which case the string could be stored compactly.
+ */
+bool DecodeModifiedUtf8(const uint8_t* bytes, size_t length, char16_t* out);
+
+/**
+ * Convert a valid modified UTF-8 string to standard UTF-8, e.g. for printing. Returns the input unchanged in the
+ * common case that there's nothing to convert.
+ */
+std::string ModifiedUtf8ToUtf8(std::string_view str);
+
+} // bjvm
+
+#endif //UTF8_H
@@ -5,8 +5,15 @@
 #include "utilities.h"
 
 #include <filesystem>
+#include <fstream>
 #ifdef EMSCRIPTEN
 #include <emscripten.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#define BJVM_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 namespace bjvm {
@@ -46,7 +53,7 @@ std::vector<uint8_t> ReadFile(const std::string& file) {
     ifs.seekg(0, std::ios::beg);
     ifs.read(reinterpret_cast<char*>(result.data()), pos);
   } else {
-    throw std::runtime_error("Classpath file not found: " + file);
+    throw std::runtime_error("File not found: " + file);
   }
   return result;
 #endif
@@ -113,4 +120,102 @@ std::vector<std::string> ListDirectory(const std::string& path, bool recursive)
   return result;
 #endif
 }
-} //bjvm
\ No newline at end of file
+void WriteFile(const std::string& file, ByteSpan bytes) {
+#ifdef EMSCRIPTEN
+  EM_ASM({
+    const fs = require('fs');
+    const file = UTF8ToString($0);
+    const temp = file + '.' + process.pid + '.tmp';
+
+    fs.writeFileSync(temp, Module.HEAPU8.subarray($1, $1 + $2));
+    fs.renameSync(temp, file);
+  }, file.c_str(), bytes.data(), bytes.size());
+#else // !EMSCRIPTEN
+  // Unique per writer, so that two processes replacing the same file don't clobber each other's temporary
+  std::string temp = file + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()))
+#ifdef BJVM_HAS_MMAP
+    + "." + std::to_string(getpid())
+#endif
+    + ".tmp";
+
+  {
+    std::ofstream ofs(temp, std::ios::binary | std::ios::trunc);
+    ofs.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    if (!ofs)
+      throw std::runtime_error("Could not write file: " + temp);
+  }
+
+  std::error_code error;
+  std::filesystem::rename(temp, file, error);
+  if (error) {
+    std::filesystem::remove(temp, error);
+    throw std::runtime_error("Could not replace file: " + file);
+  }
+#endif
+}
+
+MappedFile::MappedFile(const std::string& file, Access access) {
+#ifdef BJVM_HAS_MMAP
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("File not found: " + file);
+
+  struct stat st{};
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("Could not stat file: " + file);
+  }
+
+  m_size = static_cast<size_t>(st.st_size);
+  if (m_size > 0) {
+    void* mapped = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+      throw std::runtime_error("Could not map file: " + file);
+
+    if (access == Access::Sequential)
+      madvise(mapped, m_size, MADV_SEQUENTIAL);
+    m_data = static_cast<const uint8_t*>(mapped);
+  } else {
+    close(fd);
+  }
+#else
+  (void) access;
+  m_buffer = ReadFile(file);
+  m_data = m_buffer.data();
+  m_size = m_buffer.size();
+#endif
+}
+
+void MappedFile::Release() {
+#ifdef BJVM_HAS_MMAP
+  if (m_data && m_buffer.empty())
+    munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+  m_data = nullptr;
+  m_size = 0;
+  m_buffer.clear();
+}
+
+MappedFile::~MappedFile() {
+  Release();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+  : m_data(other.m_data), m_size(other.m_size), m_buffer(std::move(other.m_buffer)) {
+  other.m_data = nullptr;
+  other.m_size = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+  if (this != &other) {
+    Release();
+    m_data = other.m_data;
+    m_size = other.m_size;
+    m_buffer = std::move(other.m_buffer);
+    other.m_data = nullptr;
+    other.m_size = 0;
+  }
+  return *this;
+}
+} //bjvm
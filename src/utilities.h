@@ -5,11 +5,16 @@
 #ifndef UTILITIES_H
 #define UTILITIES_H
 
+#include <algorithm>
+#include <atomic>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 #include <iostream>
 
+#include "byte_reader.h"
+
 #define BJVM_DEBUG(arg) do { std::cout << __FILE__ << ":" << __LINE__ << ": " << (arg) << "\n"; } while (0)
 
 namespace bjvm {
@@ -17,6 +22,78 @@ bool HasSuffix(std::string_view str, std::string_view suffix);
 std::vector<uint8_t> ReadFile(const std::string& file);
 std::vector<std::string> ListDirectory(const std::string& path, bool recursive);
 
+/**
+ * Replace the contents of a file. The bytes are written to a temporary file next to it which is then renamed over the
+ * original, so concurrent readers (including other processes) see either the old or the new contents, never a mix.
+ */
+void WriteFile(const std::string& file, ByteSpan bytes);
+
+/**
+ * Read-only contents of a file. On native POSIX builds the file is memory mapped and the mapping is released when the
+ * MappedFile is destroyed, so the pages only stay resident for as long as the bytes are in use. Elsewhere (e.g.
+ * Emscripten) the file is read into memory with ReadFile.
+ */
+class MappedFile {
+  const uint8_t* m_data = nullptr;
+  size_t m_size = 0;
+  std::vector<uint8_t> m_buffer;  // only used when the file could not be mapped
+
+  void Release();
+
+public:
+  /** How the bytes will be read, which the kernel can use to decide what to read ahead. */
+  enum class Access {
+    Random,
+    // Front to back, once, as a classfile is parsed
+    Sequential
+  };
+
+  explicit MappedFile(const std::string& file, Access access = Access::Random);
+  ~MappedFile();
+
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ByteSpan Bytes() const {
+    return { m_data, m_size };
+  }
+
+  size_t Size() const {
+    return m_size;
+  }
+};
+
+/**
+ * Run fn(i, worker) for every i in [0, count) on up to `threads` threads, one of which is the calling thread. Indices
+ * are handed out dynamically, so the result of fn must not depend on which thread runs it, and it must not throw.
+ * worker identifies the thread (0 is the calling thread, and all are less than threads) so that fn can use per-thread
+ * scratch state without locking. With threads <= 1 everything runs in order on the calling thread.
+ */
+template <typename F>
+void ParallelFor(size_t count, int threads, F&& fn) {
+  if (threads <= 1 || count <= 1) {
+    for (size_t i = 0; i < count; ++i)
+      fn(i, 0);
+    return;
+  }
+
+  std::atomic<size_t> next { 0 };
+  auto worker = [&] (int worker_index) {
+    for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;)
+      fn(i, worker_index);
+  };
+
+  std::vector<std::thread> pool;
+  size_t thread_count = std::min(static_cast<size_t>(threads), count);
+  for (size_t t = 1; t < thread_count; ++t)
+    pool.emplace_back(worker, static_cast<int>(t));
+  worker(0);
+  for (auto& thread : pool)
+    thread.join();
+}
+
 // Credit: https://en.cppreference.com/w/cpp/utility/variant/visit
 template<class... Ts>
 struct overloaded : Ts... { using Ts::operator()...; };
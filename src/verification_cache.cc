@@ -0,0 +1,196 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#include "verification_cache.h"
+
+#include <filesystem>
+
+#include "archive_io.h"
+#include "jar_file.h"
+
+namespace bjvm {
+
+using namespace classfile;
+
+// Bump whenever the layout of the cache file changes (changes to the verifier bump VERIFIER_VERSION instead)
+constexpr uint32_t CACHE_VERSION = 1;
+constexpr char CACHE_MAGIC[8] = "BJVMVFY";
+
+struct CacheHeader {
+  char m_magic[8];
+  uint32_t m_version;
+  uint32_t m_verifier_version;
+  uint16_t m_endianness;
+  uint64_t m_entry_count;
+};
+
+const HierarchyFact & RecordingClassHierarchy::Lookup(const Symbol *klass) {
+  for (const auto& fact : m_facts) {
+    if (fact.m_class == klass)
+      return fact;
+  }
+  return m_facts.emplace_back(HierarchyFact { klass, m_inner->GetSuperclassName(klass), m_inner->IsInterface(klass) });
+}
+
+std::unique_ptr<MappedFile> VerificationCache::Read(const std::string &path,
+                                                    std::unordered_map<Sha256Digest, ByteSpan, Sha256DigestHash> &entries) {
+  if (!std::filesystem::exists(path))
+    return nullptr;
+
+  try {
+    auto file = std::make_unique<MappedFile>(path);
+    ArchiveReader r { file->Bytes() };
+
+    auto header = r.Get<CacheHeader>();
+    if (std::memcmp(header.m_magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0)
+      throw std::runtime_error("Not a verification cache");
+    if (header.m_version != CACHE_VERSION || header.m_verifier_version != VERIFIER_VERSION || header.m_endianness != 1)
+      throw std::runtime_error("Verification cache was written by an incompatible build");
+
+    // Parse everything before adding anything, so that a truncated file contributes nothing
+    std::vector<std::pair<Sha256Digest, ByteSpan>> read;
+    for (uint64_t i = 0; i < header.m_entry_count; ++i) {
+      auto digest = r.Get<Sha256Digest>();
+      read.emplace_back(digest, r.GetBytes());
+    }
+
+    for (const auto& [digest, bytes] : read)
+      entries.emplace(digest, bytes);
+    return file;
+  } catch (std::exception& e) {
+    BJVM_DEBUG("Ignoring verification cache " + path + ": " + e.what());
+    return nullptr;
+  }
+}
+
+VerificationCache::VerificationCache(std::string path) : m_path(std::move(path)) {
+  m_file = Read(m_path, m_entries);
+}
+
+bool VerificationCache::Apply(Classfile *cf, ClassHierarchy *hierarchy, Arena *arena) {
+  if (!cf->m_digest)
+    return false;
+
+  auto it = m_entries.find(*cf->m_digest);
+  if (it == m_entries.end())
+    return false;
+
+  try {
+    ArchiveReader r { it->second };
+
+    // The type states are trusted by the interpreter, so a damaged entry must not be used
+    auto crc = r.Get<uint32_t>();
+    if (crc != Crc32({ it->second.data() + sizeof(crc), it->second.size() - sizeof(crc) }))
+      throw std::runtime_error("Checksum mismatch");
+
+    auto fact_count = r.Get<uint32_t>();
+    for (uint32_t i = 0; i < fact_count; ++i) {
+      const Symbol* klass = Intern(r.GetString());
+      std::string superclass = r.GetString();
+      bool is_interface = r.Get<uint8_t>();
+
+      // Loading a class which has since disappeared throws; verifying afresh will report that properly
+      const Symbol* actual_superclass = hierarchy->GetSuperclassName(klass);
+      if ((actual_superclass ? actual_superclass->m_value : "") != superclass
+          || hierarchy->IsInterface(klass) != is_interface)
+        return false;
+    }
+
+    if (r.Get<uint32_t>() != cf->m_methods.size())
+      throw std::runtime_error("Method count mismatch");
+
+    // Read every method's states before giving any out, so that a corrupt entry leaves the class untouched
+    std::vector<const TypeStates*> type_states(cf->m_methods.size());
+    for (size_t i = 0; i < type_states.size(); ++i) {
+      if (!r.Get<uint8_t>())
+        continue;
+      if (!cf->m_methods[i].HasCode())
+        throw std::runtime_error("Type states for a method without code");
+
+      auto* states = arena->New<TypeStates>();
+      states->m_words_per_insn = r.Get<uint16_t>();
+      states->m_stack_depths = r.GetArray<uint16_t>(arena);
+      states->m_reference_maps = r.GetArray<uint64_t>(arena);
+      if (states->m_reference_maps.size() != states->m_stack_depths.size() * states->m_words_per_insn)
+        throw std::runtime_error("Reference map size mismatch");
+      type_states[i] = states;
+    }
+
+    if (!r.AtEnd())
+      throw std::runtime_error("Trailing bytes");
+
+    for (size_t i = 0; i < type_states.size(); ++i) {
+      if (cf->m_methods[i].HasCode())
+        cf->m_methods[i].m_code->m_type_states = type_states[i];
+    }
+  } catch (std::exception& e) {
+    BJVM_DEBUG("Ignoring cached verification of " + cf->GetName() + ": " + e.what());
+    return false;
+  }
+
+  m_hits++;
+  return true;
+}
+
+void VerificationCache::Add(const Classfile &cf, const std::vector<HierarchyFact> &facts) {
+  if (!cf.m_digest)
+    return;
+
+  auto& entry = m_added.emplace_back();
+  ArchiveWriter w { entry };
+
+  w.Put<uint32_t>(0);  // CRC-32 of the rest of the entry, filled in below
+  w.Put<uint32_t>(facts.size());
+  for (const auto& fact : facts) {
+    w.PutString(fact.m_class->m_value);
+    w.PutString(fact.m_superclass ? fact.m_superclass->m_value : "");
+    w.Put<uint8_t>(fact.m_is_interface);
+  }
+
+  w.Put<uint32_t>(cf.m_methods.size());
+  for (const auto& method : cf.m_methods) {
+    const TypeStates* states = method.GetTypeStates();
+    w.Put<uint8_t>(states != nullptr);
+    if (states) {
+      w.Put(states->m_words_per_insn);
+      w.PutArray(states->m_stack_depths);
+      w.PutArray(states->m_reference_maps);
+    }
+  }
+
+  uint32_t crc = Crc32({ entry.data() + sizeof(crc), entry.size() - sizeof(crc) });
+  std::memcpy(entry.data(), &crc, sizeof(crc));
+
+  m_entries[*cf.m_digest] = { entry.data(), entry.size() };
+  m_dirty = true;
+}
+
+void VerificationCache::Save() {
+  if (!m_dirty)
+    return;
+
+  // Keep whatever other VMs have saved since this one started; results are deterministic, so ours can take precedence
+  auto entries = m_entries;
+  auto current = Read(m_path, entries);
+
+  std::vector<uint8_t> out(sizeof(CacheHeader));
+  ArchiveWriter w { out };
+  for (const auto& [digest, bytes] : entries) {
+    w.Put(digest);
+    w.PutBytes(bytes);
+  }
+
+  CacheHeader header {};
+  std::memcpy(header.m_magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.m_version = CACHE_VERSION;
+  header.m_verifier_version = VERIFIER_VERSION;
+  header.m_endianness = 1;  // reads back as 0x0100 on a machine of the other endianness
+  header.m_entry_count = entries.size();
+  std::memcpy(out.data(), &header, sizeof(header));
+
+  WriteFile(m_path, { out.data(), out.size() });
+  m_dirty = false;
+}
+
+} // bjvm
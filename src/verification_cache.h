@@ -0,0 +1,112 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#ifndef VERIFICATION_CACHE_H
+#define VERIFICATION_CACHE_H
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "classfile.h"
+#include "sha256.h"
+#include "utilities.h"
+#include "verifier.h"
+
+namespace bjvm {
+
+/**
+ * One class as the verifier saw it through a ClassHierarchy. Whether a class verifies depends only on its own bytes and
+ * on these answers, so a cached verdict still holds for as long as the hierarchy keeps giving the same ones.
+ */
+struct HierarchyFact {
+  const Symbol* m_class;
+  const Symbol* m_superclass;  // nullptr for java/lang/Object
+  bool m_is_interface;
+};
+
+/** Forwards to another hierarchy, remembering every class it was asked about. */
+class RecordingClassHierarchy : public classfile::ClassHierarchy {
+  classfile::ClassHierarchy* m_inner;
+  std::vector<HierarchyFact> m_facts;
+
+  const HierarchyFact& Lookup(const Symbol* klass);
+
+public:
+  explicit RecordingClassHierarchy(classfile::ClassHierarchy* inner) : m_inner(inner) {}
+
+  const Symbol* GetSuperclassName(const Symbol* klass) override {
+    return Lookup(klass).m_superclass;
+  }
+
+  bool IsInterface(const Symbol* klass) override {
+    return Lookup(klass).m_is_interface;
+  }
+
+  const std::vector<HierarchyFact>& Facts() const {
+    return m_facts;
+  }
+};
+
+/**
+ * Persistent record of classes which passed verification, with the type states derived for their methods, so that
+ * unchanged classes (e.g. the JRE) needn't be re-verified on every startup. See VMOptions::m_verification_cache.
+ *
+ * Results are keyed by the SHA-256 of the classfile (Classfile::m_digest), and each records the hierarchy facts
+ * verification relied on, which are checked again before the result is used. Each result also carries a CRC-32, since
+ * the interpreter trusts the type states; a damaged result is ignored, as is a whole file written by a different
+ * VERIFIER_VERSION or on a machine of the other byte order.
+ *
+ * The file is only ever replaced whole (see WriteFile), so several VMs may share it: each reads it once at startup and,
+ * on Save, merges in whatever other processes have saved in the meantime. Not thread safe.
+ */
+class VerificationCache {
+  std::string m_path;
+
+  // The cache file as it was when opened, if there was a usable one
+  std::unique_ptr<MappedFile> m_file;
+  // Results verified by this VM since then
+  std::deque<std::vector<uint8_t>> m_added;
+  // Every result, pointing into m_file or m_added
+  std::unordered_map<Sha256Digest, ByteSpan, Sha256DigestHash> m_entries;
+
+  size_t m_hits = 0;
+  bool m_dirty = false;
+
+  /** Map a cache file and add its entries to entries (keeping existing ones), or return nullptr if it's unusable. */
+  static std::unique_ptr<MappedFile> Read(const std::string& path,
+                                          std::unordered_map<Sha256Digest, ByteSpan, Sha256DigestHash>& entries);
+
+public:
+  /** Open the cache at path. A missing, corrupt or incompatible file leaves the cache empty. */
+  explicit VerificationCache(std::string path);
+
+  /**
+   * If the class has a cached result which still holds, give its methods their cached type states and return true.
+   * Otherwise leave the class untouched and return false, and it should be verified as normal.
+   */
+  bool Apply(classfile::Classfile* cf, classfile::ClassHierarchy* hierarchy, Arena* arena);
+
+  /** Record that cf passed verification, having asked hierarchy the given questions. */
+  void Add(const classfile::Classfile& cf, const std::vector<HierarchyFact>& facts);
+
+  /** Write the cache back, if anything was added. */
+  void Save();
+
+  /** Number of classes in the cache. */
+  size_t Size() const {
+    return m_entries.size();
+  }
+
+  /** Number of classes whose verification was skipped so far. */
+  size_t Hits() const {
+    return m_hits;
+  }
+};
+
+} // bjvm
+
+#endif //VERIFICATION_CACHE_H
@@ -0,0 +1,1153 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#include "verifier.h"
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+
+namespace bjvm::classfile {
+
+using Kind = VerificationType::Kind;
+using VType = VerificationType;
+
+static const Symbol* const OBJECT = Intern("java/lang/Object");
+static const Symbol* const STRING = Intern("java/lang/String");
+static const Symbol* const CLASS = Intern("java/lang/Class");
+static const Symbol* const THROWABLE = Intern("java/lang/Throwable");
+static const Symbol* const CLONEABLE = Intern("java/lang/Cloneable");
+static const Symbol* const SERIALIZABLE = Intern("java/io/Serializable");
+static const Symbol* const METHOD_TYPE = Intern("java/lang/invoke/MethodType");
+static const Symbol* const METHOD_HANDLE = Intern("java/lang/invoke/MethodHandle");
+static const Symbol* const INIT = Intern("<init>");
+
+static const Symbol* const INT_ARRAY = Intern("[I");
+static const Symbol* const LONG_ARRAY = Intern("[J");
+static const Symbol* const FLOAT_ARRAY = Intern("[F");
+static const Symbol* const DOUBLE_ARRAY = Intern("[D");
+static const Symbol* const BYTE_ARRAY = Intern("[B");
+static const Symbol* const BOOLEAN_ARRAY = Intern("[Z");
+static const Symbol* const CHAR_ARRAY = Intern("[C");
+static const Symbol* const SHORT_ARRAY = Intern("[S");
+
+std::string VerificationType::ToString() const {
+  switch (m_kind) {
+    case Kind::Top: return "top";
+    case Kind::Integer: return "int";
+    case Kind::Float: return "float";
+    case Kind::Long: return "long";
+    case Kind::Double: return "double";
+    case Kind::Null: return "null";
+    case Kind::UninitializedThis: return "uninitializedThis";
+    case Kind::Uninitialized: return "uninitialized(" + std::to_string(m_new_insn) + ")";
+    case Kind::Reference: return m_class->m_value;
+  }
+  return "?";
+}
+
+/** Parse the field type starting at desc[*pos], advancing *pos past it. Returns nullopt if it's malformed. */
+static std::optional<VType> ParseFieldType(std::string_view desc, size_t* pos) {
+  size_t start = *pos;
+  while (*pos < desc.size() && desc[*pos] == '[')
+    ++*pos;
+  if (*pos >= desc.size() || *pos - start > 255)
+    return std::nullopt;
+
+  bool array = *pos > start;
+  char c = desc[(*pos)++];
+  if (c == 'L') {
+    size_t end = desc.find(';', *pos);
+    if (end == std::string_view::npos || end == *pos)
+      return std::nullopt;
+    *pos = end + 1;
+    // Classes are named without the L and ;, arrays by their whole descriptor
+    return VType::OfClass(Intern(array ? desc.substr(start, *pos - start) : desc.substr(start + 1, end - start - 1)));
+  }
+
+  if (array) {
+    if (!std::strchr("BCDFIJSZ", c))
+      return std::nullopt;
+    return VType::OfClass(Intern(desc.substr(start, *pos - start)));
+  }
+
+  switch (c) {
+    case 'B': case 'C': case 'I': case 'S': case 'Z': return VType::Of(Kind::Integer);
+    case 'F': return VType::Of(Kind::Float);
+    case 'J': return VType::Of(Kind::Long);
+    case 'D': return VType::Of(Kind::Double);
+    default: return std::nullopt;
+  }
+}
+
+/** Parameter and return types of a method descriptor. */
+struct MethodSignature {
+  std::vector<VType> m_parameters;
+  // Empty for void
+  std::optional<VType> m_return;
+
+  int ParameterSlots() const {
+    int slots = 0;
+    for (const auto& parameter : m_parameters)
+      slots += parameter.IsCategory2() ? 2 : 1;
+    return slots;
+  }
+};
+
+/** Type of the elements of an array, given its descriptor. */
+static VType ArrayComponent(const Symbol* array) {
+  size_t pos = 1;
+  return *ParseFieldType(array->m_value, &pos);  // the descriptor was checked when the type was made
+}
+
+/** Field descriptor for a reference type, e.g. Ljava/lang/String; for java/lang/String. */
+static std::string Descriptor(const Symbol* klass) {
+  return klass->m_value[0] == '[' ? klass->m_value : "L" + klass->m_value + ";";
+}
+
+static bool IsArray(const Symbol* klass) {
+  return klass->m_value[0] == '[';
+}
+
+/** Type state at one point in a method: the types of its locals and operand stack. */
+struct Frame {
+  std::vector<VType> m_locals;
+  std::vector<VType> m_stack;
+  // Set in a constructor until it has called another constructor on this (JVMS 4.10.1.4, flagThisUninit)
+  bool m_this_uninit = false;
+};
+
+class MethodVerifier {
+  const Classfile& m_cf;
+  const ConstantPool& m_cp;
+  const MethodInfo& m_method;
+  const CodeAttribute& m_code;
+  ClassHierarchy* m_hierarchy;
+
+  const Symbol* m_class_name;
+  const Symbol* m_method_name;
+  const Symbol* m_descriptor;
+  MethodSignature m_signature;
+
+  // Type state before (while executing) or after (once executed) the instruction being verified
+  Frame m_frame;
+  int m_insn = 0;
+
+  [[noreturn]] void Fail(const std::string& message) const {
+    int pc = static_cast<size_t>(m_insn) < m_code.m_code.size() ? m_code.m_code[m_insn].GetPC() : 0;
+    throw VerifyError(message + " (" + m_class_name->m_value + "." + m_method_name->m_value + m_descriptor->m_value
+                      + " at pc " + std::to_string(pc) + ")", pc);
+  }
+
+  template <typename TEntry>
+  TEntry Constant(int index) const {
+    if (!m_cp.Has<TEntry>(index))
+      Fail("Bad constant pool index " + std::to_string(index));
+    return m_cp.GetUnchecked<TEntry>(index);
+  }
+
+  const Symbol* Utf8(int index) const {
+    return Constant<EntryUtf8>(index).m_symbol;
+  }
+
+  VType ClassType(int index) const {
+    const Symbol* name = Utf8(Constant<EntryClass>(index).m_name_index);
+    if (IsArray(name)) {
+      size_t pos = 0;
+      auto type = ParseFieldType(name->m_value, &pos);
+      if (!type || pos != name->m_value.size())
+        Fail("Bad array class name " + name->m_value);
+    }
+    return VType::OfClass(name);
+  }
+
+  VType FieldType(const Symbol* descriptor) const {
+    size_t pos = 0;
+    auto type = ParseFieldType(descriptor->m_value, &pos);
+    if (!type || pos != descriptor->m_value.size())
+      Fail("Bad field descriptor " + descriptor->m_value);
+    return *type;
+  }
+
+  MethodSignature ParseMethodDescriptor(const Symbol* descriptor) const {
+    std::string_view desc = descriptor->m_value;
+    MethodSignature signature;
+    if (desc.empty() || desc[0] != '(')
+      Fail("Bad method descriptor " + descriptor->m_value);
+
+    size_t pos = 1;
+    while (pos < desc.size() && desc[pos] != ')') {
+      auto type = ParseFieldType(desc, &pos);
+      if (!type)
+        Fail("Bad method descriptor " + descriptor->m_value);
+      signature.m_parameters.push_back(*type);
+    }
+
+    if (++pos > desc.size())
+      Fail("Bad method descriptor " + descriptor->m_value);
+    if (desc.substr(pos) != "V") {
+      signature.m_return = ParseFieldType(desc, &pos);
+      if (!signature.m_return || pos != desc.size())
+        Fail("Bad method descriptor " + descriptor->m_value);
+    }
+    return signature;
+  }
+
+  /** Class, name and descriptor of a field or method reference. */
+  struct MemberRef {
+    const Symbol* m_class;
+    const Symbol* m_name;
+    const Symbol* m_descriptor;
+  };
+
+  MemberRef GetMemberRef(uint16_t class_index, uint16_t name_and_type_index) const {
+    auto name_and_type = Constant<EntryNameAndType>(name_and_type_index);
+    return { ClassType(class_index).m_class, Utf8(name_and_type.name_index), Utf8(name_and_type.descriptor_index) };
+  }
+
+  bool IsClassAssignable(const Symbol* from, const Symbol* to) const {
+    if (from == to || to == OBJECT)
+      return true;
+
+    if (IsArray(to)) {
+      if (!IsArray(from))
+        return false;
+      VType from_component = ArrayComponent(from), to_component = ArrayComponent(to);
+      // Arrays of primitives are only assignable to the same type, which was checked above
+      return from_component.m_kind == Kind::Reference && to_component.m_kind == Kind::Reference
+             && IsClassAssignable(from_component.m_class, to_component.m_class);
+    }
+
+    if (IsArray(from))
+      return to == CLONEABLE || to == SERIALIZABLE;
+
+    for (const Symbol* klass = m_hierarchy->GetSuperclassName(from); klass;
+         klass = m_hierarchy->GetSuperclassName(klass)) {
+      if (klass == to)
+        return true;
+    }
+
+    // As in the JVMS, any reference is assignable to an interface; invokeinterface checks at run time instead
+    return m_hierarchy->IsInterface(to);
+  }
+
+  bool IsAssignable(const VType& from, const VType& to) const {
+    if (from == to || to.m_kind == Kind::Top)
+      return true;
+    if (to.m_kind != Kind::Reference)
+      return false;
+    return from.m_kind == Kind::Null || (from.m_kind == Kind::Reference && IsClassAssignable(from.m_class, to.m_class));
+  }
+
+  /** Least upper bound of two classes, for merging type states when inferring types. */
+  const Symbol* CommonSuperclass(const Symbol* a, const Symbol* b) const {
+    if (a == b)
+      return a;
+    if (a == OBJECT || b == OBJECT)
+      return OBJECT;
+
+    if (IsArray(a) && IsArray(b)) {
+      VType a_component = ArrayComponent(a), b_component = ArrayComponent(b);
+      if (a_component.m_kind != Kind::Reference || b_component.m_kind != Kind::Reference)
+        return OBJECT;
+      return Intern("[" + Descriptor(CommonSuperclass(a_component.m_class, b_component.m_class)));
+    }
+
+    // Interfaces have no single common superclass with anything, so (like the old verifier) fall back to Object
+    if (IsArray(a) || IsArray(b) || m_hierarchy->IsInterface(a) || m_hierarchy->IsInterface(b))
+      return OBJECT;
+
+    std::vector<const Symbol*> a_superclasses;
+    for (const Symbol* klass = a; klass; klass = m_hierarchy->GetSuperclassName(klass))
+      a_superclasses.push_back(klass);
+    for (const Symbol* klass = b; klass; klass = m_hierarchy->GetSuperclassName(klass)) {
+      if (std::find(a_superclasses.begin(), a_superclasses.end(), klass) != a_superclasses.end())
+        return klass;
+    }
+    return OBJECT;
+  }
+
+  /** Merge two types, giving Top if they have nothing in common. */
+  VType MergeTypes(const VType& a, const VType& b) const {
+    if (a == b)
+      return a;
+    if (a.m_kind == Kind::Null && b.m_kind == Kind::Reference)
+      return b;
+    if (b.m_kind == Kind::Null && a.m_kind == Kind::Reference)
+      return a;
+    if (a.m_kind == Kind::Reference && b.m_kind == Kind::Reference)
+      return VType::OfClass(CommonSuperclass(a.m_class, b.m_class));
+    return VType::Of(Kind::Top);
+  }
+
+  void Push(const VType& type) {
+    auto& stack = m_frame.m_stack;
+    if (stack.size() + (type.IsCategory2() ? 2 : 1) > m_code.m_max_stack)
+      Fail("Operand stack overflow");
+    stack.push_back(type);
+    if (type.IsCategory2())
+      stack.push_back(VType::Of(Kind::Top));
+  }
+
+  VType PopSlot() {
+    auto& stack = m_frame.m_stack;
+    if (stack.empty())
+      Fail("Unable to pop operand off an empty stack");
+    VType type = stack.back();
+    stack.pop_back();
+    return type;
+  }
+
+  /** Pop a value which must be assignable to expected. */
+  VType Pop(const VType& expected) {
+    if (expected.IsCategory2() && PopSlot().m_kind != Kind::Top)
+      Fail("Bad type on operand stack: expected " + expected.ToString());
+
+    VType type = PopSlot();
+    if (!IsAssignable(type, expected))
+      Fail("Bad type on operand stack: expected " + expected.ToString() + ", found " + type.ToString());
+    return type;
+  }
+
+  VType Pop(Kind expected) {
+    return Pop(VType::Of(expected));
+  }
+
+  /** Pop any reference, including an uninitialised one. */
+  VType PopReference() {
+    VType type = PopSlot();
+    if (!type.IsReference())
+      Fail("Bad type on operand stack: expected a reference, found " + type.ToString());
+    return type;
+  }
+
+  /** Pop an array reference (or null), which must be one of the given types. */
+  VType PopArray(std::initializer_list<const Symbol*> allowed) {
+    VType type = PopSlot();
+    if (type.m_kind == Kind::Null)
+      return type;
+    if (type.m_kind == Kind::Reference && IsArray(type.m_class)) {
+      if (allowed.size() == 0 || std::find(allowed.begin(), allowed.end(), type.m_class) != allowed.end())
+        return type;
+    }
+    Fail("Bad type on operand stack: expected an array, found " + type.ToString());
+  }
+
+  /** Pop an array of references (or null), returning the type of its elements. */
+  VType PopReferenceArray() {
+    VType array = PopArray({});
+    if (array.m_kind == Kind::Null)
+      return array;
+    VType component = ArrayComponent(array.m_class);
+    if (component.m_kind != Kind::Reference)
+      Fail("Bad type on operand stack: expected an array of references, found " + array.ToString());
+    return component;
+  }
+
+  /**
+   * Check that the top slots of the operand stack hold whole values, without splitting a long or double, so that
+   * they can be popped or duplicated as a group by the untyped stack instructions.
+   */
+  void CheckWholeSlots(int slots) {
+    const auto& stack = m_frame.m_stack;
+    if (stack.size() < static_cast<size_t>(slots))
+      Fail("Unable to pop operand off an empty stack");
+    if (stack[stack.size() - slots].m_kind == Kind::Top)
+      Fail("Bad type on operand stack: instruction splits a long or double");
+  }
+
+  /** Rearrange the top of the stack for the dup, pop and swap family: pop groups (top first), push them in order. */
+  void ShuffleStack(std::initializer_list<int> groups, std::initializer_list<int> order) {
+    std::vector<std::vector<VType>> popped;
+    for (int slots : groups) {
+      CheckWholeSlots(slots);
+      auto& stack = m_frame.m_stack;
+      popped.emplace_back(stack.end() - slots, stack.end());
+      stack.resize(stack.size() - slots);
+    }
+    for (int group : order) {
+      for (const auto& type : popped[group]) {
+        if (m_frame.m_stack.size() >= m_code.m_max_stack)
+          Fail("Operand stack overflow");
+        m_frame.m_stack.push_back(type);
+      }
+    }
+  }
+
+  VType GetLocal(int index, const VType& expected) const {
+    const auto& locals = m_frame.m_locals;
+    if (static_cast<size_t>(index + (expected.IsCategory2() ? 2 : 1)) > locals.size())
+      Fail("Illegal local variable number " + std::to_string(index));
+    if (locals[index] != expected)
+      Fail("Bad local variable type: expected " + expected.ToString() + ", found " + locals[index].ToString());
+    return locals[index];
+  }
+
+  void SetLocal(int index, const VType& type) {
+    auto& locals = m_frame.m_locals;
+    if (static_cast<size_t>(index + (type.IsCategory2() ? 2 : 1)) > locals.size())
+      Fail("Illegal local variable number " + std::to_string(index));
+    // Overwriting the second half of a long or double invalidates the first
+    if (index > 0 && locals[index - 1].IsCategory2())
+      locals[index - 1] = VType::Of(Kind::Top);
+    locals[index] = type;
+    if (type.IsCategory2())
+      locals[index + 1] = VType::Of(Kind::Top);
+  }
+
+  /** Replace every occurrence of an uninitialised type once its constructor has been called. */
+  void ReplaceUninitialized(const VType& uninitialized, const VType& initialized) {
+    for (auto& type : m_frame.m_locals) {
+      if (type == uninitialized)
+        type = initialized;
+    }
+    for (auto& type : m_frame.m_stack) {
+      if (type == uninitialized)
+        type = initialized;
+    }
+  }
+
+  void Return(std::optional<Kind> kind) {
+    const auto& expected = m_signature.m_return;
+    if (!kind) {
+      if (expected)
+        Fail("Method expects a return value");
+      if (m_method_name == INIT && m_frame.m_this_uninit)
+        Fail("Constructor must call super() or this() before return");
+      return;
+    }
+    if (!expected || (*kind == Kind::Reference ? expected->m_kind != Kind::Reference : expected->m_kind != *kind))
+      Fail("Bad return type");
+    Pop(*expected);
+  }
+
+  void Ldc(const Insn& insn) {
+    int index = insn.Index();
+    bool wide = insn.GetCode() == InsnCode::ldc2_w;
+    ConstantPoolTag tag = index > 0 && index < m_cp.Size() ? m_cp.GetTag(index) : ConstantPoolTag::Invalid;
+    uint16_t major = m_cf.m_version.m_major;
+
+    switch (tag) {
+      case ConstantPoolTag::Integer: if (!wide) return Push(VType::Of(Kind::Integer)); break;
+      case ConstantPoolTag::Float: if (!wide) return Push(VType::Of(Kind::Float)); break;
+      case ConstantPoolTag::String: if (!wide) return Push(VType::OfClass(STRING)); break;
+      case ConstantPoolTag::Class: if (!wide && major >= 49) return Push(VType::OfClass(CLASS)); break;
+      case ConstantPoolTag::MethodType: if (!wide && major >= 51) return Push(VType::OfClass(METHOD_TYPE)); break;
+      case ConstantPoolTag::MethodHandle: if (!wide && major >= 51) return Push(VType::OfClass(METHOD_HANDLE)); break;
+      case ConstantPoolTag::Long: if (wide) return Push(VType::Of(Kind::Long)); break;
+      case ConstantPoolTag::Double: if (wide) return Push(VType::Of(Kind::Double)); break;
+      default: break;
+    }
+    Fail("Invalid index " + std::to_string(index) + " in " + CodeName(insn.GetCode()));
+  }
+
+  void FieldAccess(const Insn& insn) {
+    auto ref_entry = Constant<EntryFieldRef>(insn.Index());
+    MemberRef ref = GetMemberRef(ref_entry.struct_index, ref_entry.name_and_type_index);
+    VType type = FieldType(ref.m_descriptor);
+
+    switch (insn.GetCode()) {
+      case InsnCode::getstatic:
+        Push(type);
+        break;
+      case InsnCode::putstatic:
+        Pop(type);
+        break;
+      case InsnCode::getfield:
+        Pop(VType::OfClass(ref.m_class));
+        Push(type);
+        break;
+      case InsnCode::putfield: {
+        Pop(type);
+        // A constructor may assign its own class's fields before calling the superclass constructor
+        VType receiver = PopSlot();
+        bool own_field = receiver.m_kind == Kind::UninitializedThis && ref.m_class == m_class_name;
+        if (!own_field && !IsAssignable(receiver, VType::OfClass(ref.m_class)))
+          Fail("Bad type on operand stack in putfield: found " + receiver.ToString());
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  void Invoke(const Insn& insn) {
+    InsnCode code = insn.GetCode();
+    MemberRef ref;
+
+    switch (code) {
+      case InsnCode::invokedynamic: {
+        auto entry = Constant<EntryInvokeDynamic>(insn.Index());
+        auto name_and_type = Constant<EntryNameAndType>(entry.name_and_type_index);
+        ref = { nullptr, Utf8(name_and_type.name_index), Utf8(name_and_type.descriptor_index) };
+        break;
+      }
+      case InsnCode::invokeinterface: {
+        auto entry = Constant<EntryInterfaceMethodRef>(insn.GetInvokeInterfaceData()->m_index);
+        ref = GetMemberRef(entry.struct_index, entry.name_and_type_index);
+        break;
+      }
+      case InsnCode::invokevirtual: {
+        auto entry = Constant<EntryMethodRef>(insn.Index());
+        ref = GetMemberRef(entry.struct_index, entry.name_and_type_index);
+        break;
+      }
+      default: {
+        // invokespecial and invokestatic may also name interface methods (since version 52)
+        if (m_cp.Has<EntryInterfaceMethodRef>(insn.Index())) {
+          auto entry = m_cp.GetUnchecked<EntryInterfaceMethodRef>(insn.Index());
+          ref = GetMemberRef(entry.struct_index, entry.name_and_type_index);
+        } else {
+          auto entry = Constant<EntryMethodRef>(insn.Index());
+          ref = GetMemberRef(entry.struct_index, entry.name_and_type_index);
+        }
+        break;
+      }
+    }
+
+    bool is_init = ref.m_name == INIT;
+    if (ref.m_name->m_value[0] == '<' && !(is_init && code == InsnCode::invokespecial))
+      Fail("Illegal call to internal method " + ref.m_name->m_value);
+
+    MethodSignature signature = ParseMethodDescriptor(ref.m_descriptor);
+    if (is_init && signature.m_return)
+      Fail("Constructor must return void");
+    if (code == InsnCode::invokeinterface && insn.GetInvokeInterfaceData()->m_count != signature.ParameterSlots() + 1)
+      Fail("Inconsistent args count operand in invokeinterface");
+
+    for (auto it = signature.m_parameters.rbegin(); it != signature.m_parameters.rend(); ++it)
+      Pop(*it);
+
+    if (is_init) {
+      VType receiver = PopSlot(), initialized;
+      if (receiver.m_kind == Kind::UninitializedThis) {
+        if (ref.m_class != m_class_name && ref.m_class != m_cf.GetSuperclassName())
+          Fail("Bad <init> method call");
+        initialized = VType::OfClass(m_class_name);
+        m_frame.m_this_uninit = false;
+      } else if (receiver.m_kind == Kind::Uninitialized) {
+        initialized = ClassType(m_code.m_code[receiver.m_new_insn].Index());
+        if (initialized.m_class != ref.m_class)
+          Fail("Call to wrong <init> method");
+      } else {
+        Fail("Bad operand type when invoking <init>: " + receiver.ToString());
+      }
+      ReplaceUninitialized(receiver, initialized);
+    } else if (code == InsnCode::invokeinterface) {
+      VType receiver = PopSlot();
+      if (receiver.m_kind != Kind::Null && receiver.m_kind != Kind::Reference)
+        Fail("Bad type on operand stack in invokeinterface: found " + receiver.ToString());
+    } else if (code == InsnCode::invokevirtual) {
+      Pop(VType::OfClass(ref.m_class));
+    } else if (code == InsnCode::invokespecial) {
+      // Private and superclass methods can only be called on this class (or its subclasses)
+      VType receiver = Pop(VType::OfClass(ref.m_class));
+      if (!IsAssignable(receiver, VType::OfClass(m_class_name)))
+        Fail("Bad type on operand stack in invokespecial: found " + receiver.ToString());
+    }
+
+    if (signature.m_return)
+      Push(*signature.m_return);
+  }
+
+  void NewArray(const Insn& insn) {
+    static const Symbol* const ARRAYS[] = {
+      BOOLEAN_ARRAY, BYTE_ARRAY, CHAR_ARRAY, SHORT_ARRAY, INT_ARRAY, LONG_ARRAY, FLOAT_ARRAY, DOUBLE_ARRAY
+    };
+    Pop(Kind::Integer);
+    Push(VType::OfClass(ARRAYS[static_cast<int>(insn.GetArrayType())]));
+  }
+
+  /** Apply an instruction's effect on the types in m_frame. Control flow is handled by the caller. */
+  void Execute(const Insn& insn) {
+    using I = InsnCode;
+    const VType INT = VType::Of(Kind::Integer), FLOAT = VType::Of(Kind::Float), LONG = VType::Of(Kind::Long),
+      DOUBLE = VType::Of(Kind::Double);
+
+    const auto Unary = [&] (const VType& in, const VType& out) {
+      Pop(in);
+      Push(out);
+    };
+    const auto Binary = [&] (const VType& in, const VType& out) {
+      Pop(in);
+      Pop(in);
+      Push(out);
+    };
+
+    switch (insn.GetCode()) {
+      case I::nop: break;
+
+      case I::aconst_null: Push(VType::Of(Kind::Null)); break;
+      case I::iconst: Push(INT); break;
+      case I::lconst: Push(LONG); break;
+      case I::fconst: Push(FLOAT); break;
+      case I::dconst: Push(DOUBLE); break;
+      case I::ldc: case I::ldc2_w: Ldc(insn); break;
+
+      case I::iload: Push(GetLocal(insn.Index(), INT)); break;
+      case I::lload: Push(GetLocal(insn.Index(), LONG)); break;
+      case I::fload: Push(GetLocal(insn.Index(), FLOAT)); break;
+      case I::dload: Push(GetLocal(insn.Index(), DOUBLE)); break;
+      case I::aload: {
+        if (insn.Index() >= m_frame.m_locals.size())
+          Fail("Illegal local variable number " + std::to_string(insn.Index()));
+        VType type = m_frame.m_locals[insn.Index()];
+        if (!type.IsReference())
+          Fail("Bad local variable type: expected a reference, found " + type.ToString());
+        Push(type);
+        break;
+      }
+
+      case I::istore: SetLocal(insn.Index(), Pop(INT)); break;
+      case I::lstore: SetLocal(insn.Index(), Pop(LONG)); break;
+      case I::fstore: SetLocal(insn.Index(), Pop(FLOAT)); break;
+      case I::dstore: SetLocal(insn.Index(), Pop(DOUBLE)); break;
+      case I::astore: SetLocal(insn.Index(), PopReference()); break;
+
+      case I::iinc: GetLocal(insn.GetIIncData().m_index, INT); break;
+
+      case I::iaload: Pop(INT); PopArray({ INT_ARRAY }); Push(INT); break;
+      case I::laload: Pop(INT); PopArray({ LONG_ARRAY }); Push(LONG); break;
+      case I::faload: Pop(INT); PopArray({ FLOAT_ARRAY }); Push(FLOAT); break;
+      case I::daload: Pop(INT); PopArray({ DOUBLE_ARRAY }); Push(DOUBLE); break;
+      case I::baload: Pop(INT); PopArray({ BYTE_ARRAY, BOOLEAN_ARRAY }); Push(INT); break;
+      case I::caload: Pop(INT); PopArray({ CHAR_ARRAY }); Push(INT); break;
+      case I::saload: Pop(INT); PopArray({ SHORT_ARRAY }); Push(INT); break;
+      case I::aaload: {
+        Pop(INT);
+        VType component = PopReferenceArray();
+        Push(component);
+        break;
+      }
+
+      case I::iastore: Pop(INT); Pop(INT); PopArray({ INT_ARRAY }); break;
+      case I::lastore: Pop(LONG); Pop(INT); PopArray({ LONG_ARRAY }); break;
+      case I::fastore: Pop(FLOAT); Pop(INT); PopArray({ FLOAT_ARRAY }); break;
+      case I::dastore: Pop(DOUBLE); Pop(INT); PopArray({ DOUBLE_ARRAY }); break;
+      case I::bastore: Pop(INT); Pop(INT); PopArray({ BYTE_ARRAY, BOOLEAN_ARRAY }); break;
+      case I::castore: Pop(INT); Pop(INT); PopArray({ CHAR_ARRAY }); break;
+      case I::sastore: Pop(INT); Pop(INT); PopArray({ SHORT_ARRAY }); break;
+      case I::aastore: {
+        // The element's type is checked at run time (ArrayStoreException), so any object will do here
+        Pop(VType::OfClass(OBJECT));
+        Pop(INT);
+        PopReferenceArray();
+        break;
+      }
+
+      case I::pop: ShuffleStack({ 1 }, {}); break;
+      case I::pop2: ShuffleStack({ 2 }, {}); break;
+      case I::dup: ShuffleStack({ 1 }, { 0, 0 }); break;
+      case I::dup_x1: ShuffleStack({ 1, 1 }, { 0, 1, 0 }); break;
+      case I::dup_x2: ShuffleStack({ 1, 2 }, { 0, 1, 0 }); break;
+      case I::dup2: ShuffleStack({ 2 }, { 0, 0 }); break;
+      case I::dup2_x1: ShuffleStack({ 2, 1 }, { 0, 1, 0 }); break;
+      case I::dup2_x2: ShuffleStack({ 2, 2 }, { 0, 1, 0 }); break;
+      case I::swap: ShuffleStack({ 1, 1 }, { 0, 1 }); break;
+
+      case I::iadd: case I::isub: case I::imul: case I::idiv: case I::irem: case I::iand: case I::ior: case I::ixor:
+      case I::ishl: case I::ishr: case I::iushr:
+        Binary(INT, INT);
+        break;
+      case I::ladd: case I::lsub: case I::lmul: case I::ldiv: case I::lrem: case I::land: case I::lor: case I::lxor:
+        Binary(LONG, LONG);
+        break;
+      case I::lshl: case I::lshr: case I::lushr: Pop(INT); Unary(LONG, LONG); break;
+      case I::fadd: case I::fsub: case I::fmul: case I::fdiv: case I::frem: Binary(FLOAT, FLOAT); break;
+      case I::dadd: case I::dsub: case I::dmul: case I::ddiv: case I::drem: Binary(DOUBLE, DOUBLE); break;
+      case I::ineg: case I::i2b: case I::i2c: case I::i2s: Unary(INT, INT); break;
+      case I::lneg: Unary(LONG, LONG); break;
+      case I::fneg: Unary(FLOAT, FLOAT); break;
+      case I::dneg: Unary(DOUBLE, DOUBLE); break;
+
+      case I::i2l: Unary(INT, LONG); break;
+      case I::i2f: Unary(INT, FLOAT); break;
+      case I::i2d: Unary(INT, DOUBLE); break;
+      case I::l2i: Unary(LONG, INT); break;
+      case I::l2f: Unary(LONG, FLOAT); break;
+      case I::l2d: Unary(LONG, DOUBLE); break;
+      case I::f2i: Unary(FLOAT, INT); break;
+      case I::f2l: Unary(FLOAT, LONG); break;
+      case I::f2d: Unary(FLOAT, DOUBLE); break;
+      case I::d2i: Unary(DOUBLE, INT); break;
+      case I::d2l: Unary(DOUBLE, LONG); break;
+      case I::d2f: Unary(DOUBLE, FLOAT); break;
+
+      case I::lcmp: Binary(LONG, INT); break;
+      case I::fcmpl: case I::fcmpg: Binary(FLOAT, INT); break;
+      case I::dcmpl: case I::dcmpg: Binary(DOUBLE, INT); break;
+
+      case I::ifeq: case I::ifne: case I::iflt: case I::ifge: case I::ifgt: case I::ifle:
+      case I::tableswitch: case I::lookupswitch:
+        Pop(INT);
+        break;
+      case I::if_icmpeq: case I::if_icmpne: case I::if_icmplt: case I::if_icmpge: case I::if_icmpgt: case I::if_icmple:
+        Pop(INT);
+        Pop(INT);
+        break;
+      case I::if_acmpeq: case I::if_acmpne:
+        PopReference();
+        PopReference();
+        break;
+      case I::ifnull: case I::ifnonnull: PopReference(); break;
+      case I::goto_: break;
+
+      case I::ireturn: Return(Kind::Integer); break;
+      case I::lreturn: Return(Kind::Long); break;
+      case I::freturn: Return(Kind::Float); break;
+      case I::dreturn: Return(Kind::Double); break;
+      case I::areturn: Return(Kind::Reference); break;
+      case I::return_: Return(std::nullopt); break;
+      case I::athrow: Pop(VType::OfClass(THROWABLE)); break;
+
+      case I::getstatic: case I::putstatic: case I::getfield: case I::putfield: FieldAccess(insn); break;
+      case I::invokevirtual: case I::invokespecial: case I::invokestatic: case I::invokeinterface:
+      case I::invokedynamic:
+        Invoke(insn);
+        break;
+
+      case I::new_: {
+        VType type = ClassType(insn.Index());
+        if (IsArray(type.m_class))
+          Fail("Illegal use of new on array class " + type.m_class->m_value);
+        VType uninitialized { Kind::Uninitialized, static_cast<uint16_t>(m_insn) };
+        for (const auto& slot : m_frame.m_stack) {
+          if (slot == uninitialized)
+            Fail("Uninitialized object on operand stack at new");
+        }
+        ReplaceUninitialized(uninitialized, VType::Of(Kind::Top));
+        Push(uninitialized);
+        break;
+      }
+      case I::newarray: NewArray(insn); break;
+      case I::anewarray: {
+        VType component = ClassType(insn.Index());
+        if (component.m_class->m_value.find_first_not_of('[') >= 255)
+          Fail("Array with too many dimensions");
+        Pop(INT);
+        Push(VType::OfClass(Intern("[" + Descriptor(component.m_class))));
+        break;
+      }
+      case I::multianewarray: {
+        auto data = insn.GetMultianewarrayData();
+        VType type = ClassType(data.m_index);
+        if (data.m_dims == 0 || type.m_class->m_value.find_first_not_of('[') < data.m_dims)
+          Fail("Bad dimensions in multianewarray");
+        for (int i = 0; i < data.m_dims; ++i)
+          Pop(INT);
+        Push(type);
+        break;
+      }
+      case I::arraylength: PopArray({}); Push(INT); break;
+      case I::checkcast: Pop(VType::OfClass(OBJECT)); Push(ClassType(insn.Index())); break;
+      case I::instanceof: Pop(VType::OfClass(OBJECT)); ClassType(insn.Index()); Push(INT); break;
+      case I::monitorenter: case I::monitorexit: PopReference(); break;
+
+      case I::jsr: case I::ret:
+        Fail("Subroutines can't be verified");
+
+      // Only ever written over code by the interpreter, after verification
+      case I::getstatic_quick: case I::getstatic2_quick: case I::putstatic_quick: case I::putstatic2_quick:
+      case I::invokestatic_quick: case I::invokevirtual_quick: case I::invokeinterface_quick:
+      case I::iload_iload_iadd_istore: case I::iload_iload_if_icmpge: case I::iload_iload_if_icmplt:
+      case I::iload_iload: case I::aload_aload: case I::iinc_goto: case I::iload_ireturn:
+        Fail(std::string("Unexpected ") + CodeName(insn.GetCode()));
+    }
+  }
+
+  /** Call f with each instruction that insn may branch to, other than the next one. */
+  template <typename F>
+  void ForEachBranchTarget(const Insn& insn, F f) const {
+    switch (insn.GetCode()) {
+      case InsnCode::tableswitch: {
+        const auto* data = insn.GetTableswitchData();
+        f(data->m_default_target);
+        for (int target : data->m_targets)
+          f(target);
+        break;
+      }
+      case InsnCode::lookupswitch: {
+        const auto* data = insn.GetLookupswitchData();
+        f(data->m_default_target);
+        for (int target : data->m_targets)
+          f(target);
+        break;
+      }
+      default:
+        if (insn.ContainsBranch())
+          f(insn.Index());
+        break;
+    }
+  }
+
+  /** Whether execution never continues to the next instruction after insn. */
+  static bool EndsFlow(const Insn& insn) {
+    switch (insn.GetCode()) {
+      case InsnCode::goto_: case InsnCode::tableswitch: case InsnCode::lookupswitch: case InsnCode::athrow:
+      case InsnCode::ireturn: case InsnCode::lreturn: case InsnCode::freturn: case InsnCode::dreturn:
+      case InsnCode::areturn: case InsnCode::return_:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /** Call f with each exception handler covering the current instruction, and the type of what it catches. */
+  template <typename F>
+  void ForEachHandler(F f) const {
+    for (const auto& entry : m_code.m_exception_table.m_exceptions) {
+      if (entry.m_start > m_insn || m_insn >= entry.m_end)
+        continue;
+      VType caught = entry.m_catch_type ? ClassType(entry.m_catch_type) : VType::OfClass(THROWABLE);
+      if (!IsClassAssignable(caught.m_class, THROWABLE))
+        Fail("Catch type is not a subclass of Throwable");
+      f(entry.m_handler, caught);
+    }
+  }
+
+  /** The frame on entry to the method, with the receiver and parameters in the first locals. */
+  Frame InitialFrame() const {
+    Frame frame;
+    frame.m_locals.assign(m_code.m_max_locals, VType::Of(Kind::Top));
+    int slot = 0;
+    for (const auto& type : InitialLocals()) {
+      if (static_cast<size_t>(slot + (type.IsCategory2() ? 2 : 1)) > frame.m_locals.size())
+        Fail("Arguments can't fit into locals");
+      frame.m_locals[slot++] = type;
+      if (type.IsCategory2())
+        frame.m_locals[slot++] = VType::Of(Kind::Top);
+      frame.m_this_uninit |= type.m_kind == Kind::UninitializedThis;
+    }
+    return frame;
+  }
+
+  /** The receiver (if any) and parameters, one entry per value as in a StackMapTable. */
+  std::vector<VType> InitialLocals() const {
+    std::vector<VType> locals;
+    if (!(static_cast<int>(m_method.m_access_flags) & static_cast<int>(MethodAccessFlags::STATIC))) {
+      bool uninitialized = m_method_name == INIT && m_class_name != OBJECT;
+      locals.push_back(uninitialized ? VType::Of(Kind::UninitializedThis) : VType::OfClass(m_class_name));
+    }
+    locals.insert(locals.end(), m_signature.m_parameters.begin(), m_signature.m_parameters.end());
+    return locals;
+  }
+
+  VType ReadStackMapType(ByteReader* reader) const {
+    switch (reader->NextU8("verification type")) {
+      case 0: return VType::Of(Kind::Top);
+      case 1: return VType::Of(Kind::Integer);
+      case 2: return VType::Of(Kind::Float);
+      case 3: return VType::Of(Kind::Double);
+      case 4: return VType::Of(Kind::Long);
+      case 5: return VType::Of(Kind::Null);
+      case 6: return VType::Of(Kind::UninitializedThis);
+      case 7: return ClassType(reader->NextU16("class index"));
+      case 8: {
+        auto index = m_code.ProgramCounterToInsnIndex(reader->NextU16("new offset"));
+        if (!index || m_code.m_code[*index].GetCode() != InsnCode::new_)
+          Fail("Uninitialized type in StackMapTable doesn't refer to a new instruction");
+        return { Kind::Uninitialized, static_cast<uint16_t>(*index) };
+      }
+      default:
+        Fail("Bad verification type in StackMapTable");
+    }
+  }
+
+  /** Expand a StackMapTable frame, where longs and doubles take one entry, into slots. */
+  Frame ExpandStackMapFrame(const std::vector<VType>& locals, const std::vector<VType>& stack) const {
+    Frame frame;
+    for (const auto& type : locals) {
+      frame.m_locals.push_back(type);
+      if (type.IsCategory2())
+        frame.m_locals.push_back(VType::Of(Kind::Top));
+      frame.m_this_uninit |= type.m_kind == Kind::UninitializedThis;
+    }
+    for (const auto& type : stack) {
+      frame.m_stack.push_back(type);
+      if (type.IsCategory2())
+        frame.m_stack.push_back(VType::Of(Kind::Top));
+    }
+
+    if (frame.m_locals.size() > m_code.m_max_locals || frame.m_stack.size() > m_code.m_max_stack)
+      Fail("StackMapTable frame doesn't fit in max_locals or max_stack");
+    frame.m_locals.resize(m_code.m_max_locals, VType::Of(Kind::Top));
+    return frame;
+  }
+
+  /** Decode the StackMapTable. frame_at gets the index in frames of each instruction's frame, or -1 for none. */
+  void ParseStackMapTable(std::vector<Frame>* frames, std::vector<int>* frame_at) const {
+    frame_at->assign(m_code.m_code.size(), -1);
+
+    const RawCodeAttribute& raw = m_method.m_code->m_raw;
+    if (!raw.m_stack_map_table)
+      return;
+
+    ByteReader reader { raw.m_bytes.data() + raw.m_stack_map_table, raw.m_stack_map_table_length };
+    reader.SetCurrentComponent("stack map table");
+
+    // Running off the end of the attribute is a VerifyError like any other malformed frame, so that version 50
+    // classes still fall back to inference
+    try {
+      std::vector<VType> locals = InitialLocals(), stack;
+      int pc = -1;
+
+      uint16_t count = reader.NextU16("number of entries");
+      for (int i = 0; i < count; ++i) {
+        uint8_t type = reader.NextU8("frame type");
+        int offset_delta = type < 128 ? type % 64 : 0;
+        if (type >= 247)
+          offset_delta = reader.NextU16("offset delta");
+        stack.clear();
+
+        if (type < 64 || type == 251) {  // same_frame, same_frame_extended
+        } else if (type < 128 || type == 247) {  // same_locals_1_stack_item
+          stack.push_back(ReadStackMapType(&reader));
+        } else if (type < 247) {
+          Fail("Reserved frame type in StackMapTable");
+        } else if (type < 251) {  // chop_frame
+          int chopped = 251 - type;
+          if (static_cast<size_t>(chopped) > locals.size())
+            Fail("Chopped too many locals in StackMapTable");
+          locals.resize(locals.size() - chopped);
+        } else if (type < 255) {  // append_frame
+          for (int j = 0; j < type - 251; ++j)
+            locals.push_back(ReadStackMapType(&reader));
+        } else {  // full_frame
+          locals.clear();
+          uint16_t locals_count = reader.NextU16("number of locals");
+          for (int j = 0; j < locals_count; ++j)
+            locals.push_back(ReadStackMapType(&reader));
+          uint16_t stack_count = reader.NextU16("number of stack items");
+          for (int j = 0; j < stack_count; ++j)
+            stack.push_back(ReadStackMapType(&reader));
+        }
+
+        pc += offset_delta + 1;
+        auto index = m_code.ProgramCounterToInsnIndex(pc);
+        if (!index)
+          Fail("StackMapTable frame at pc " + std::to_string(pc) + " isn't at an instruction");
+        (*frame_at)[*index] = static_cast<int>(frames->size());
+        frames->push_back(ExpandStackMapFrame(locals, stack));
+      }
+
+      if (reader.Remaining())
+        Fail("StackMapTable attribute is longer than its frames");
+    } catch (VerifyError&) {
+      throw;
+    } catch (std::runtime_error& e) {
+      Fail(e.what());
+    }
+  }
+
+  /** Check that a frame can flow into a target whose frame is given (JVMS 4.10.1.4, frameIsAssignable). */
+  void CheckFrameAssignable(const Frame& from, const Frame& to, int target) const {
+    if (from.m_stack.size() != to.m_stack.size())
+      Fail("Inconsistent stack height at pc " + std::to_string(m_code.m_code[target].GetPC()));
+    for (size_t i = 0; i < from.m_locals.size(); ++i) {
+      if (!IsAssignable(from.m_locals[i], to.m_locals[i]))
+        Fail("Bad type in local " + std::to_string(i) + " at pc " + std::to_string(m_code.m_code[target].GetPC())
+             + ": found " + from.m_locals[i].ToString() + ", expected " + to.m_locals[i].ToString());
+    }
+    for (size_t i = 0; i < from.m_stack.size(); ++i) {
+      if (!IsAssignable(from.m_stack[i], to.m_stack[i]))
+        Fail("Bad type on operand stack at pc " + std::to_string(m_code.m_code[target].GetPC()) + ": found "
+             + from.m_stack[i].ToString() + ", expected " + to.m_stack[i].ToString());
+    }
+    if (from.m_this_uninit && !to.m_this_uninit)
+      Fail("Uninitialized this at pc " + std::to_string(m_code.m_code[target].GetPC()));
+  }
+
+  Frame ExceptionFrame(const Frame& frame, const VType& caught) const {
+    return { frame.m_locals, { caught }, frame.m_this_uninit };
+  }
+
+  /** Type check against the StackMapTable (JVMS 4.10.1), recording each instruction's state in states. */
+  void TypeCheck(TypeStates* states) {
+    std::vector<Frame> frames;
+    std::vector<int> frame_at;
+    ParseStackMapTable(&frames, &frame_at);
+
+    const auto CheckTarget = [&] (const Frame& from, int target) {
+      if (frame_at[target] < 0)
+        Fail("Expecting a stackmap frame at branch target " + std::to_string(m_code.m_code[target].GetPC()));
+      CheckFrameAssignable(from, frames[frame_at[target]], target);
+    };
+
+    m_frame = InitialFrame();
+    bool reachable = true;
+
+    for (m_insn = 0; static_cast<size_t>(m_insn) < m_code.m_code.size(); ++m_insn) {
+      if (frame_at[m_insn] >= 0) {
+        if (reachable)
+          CheckFrameAssignable(m_frame, frames[frame_at[m_insn]], m_insn);
+        m_frame = frames[frame_at[m_insn]];
+      } else if (!reachable) {
+        Fail("Expecting a stackmap frame after an unconditional branch");
+      }
+
+      Record(states, m_insn, m_frame);
+      ForEachHandler([&] (int handler, const VType& caught) {
+        CheckTarget(ExceptionFrame(m_frame, caught), handler);
+      });
+
+      const Insn& insn = m_code.m_code[m_insn];
+      Execute(insn);
+      ForEachBranchTarget(insn, [&] (int target) {
+        CheckTarget(m_frame, target);
+      });
+      reachable = !EndsFlow(insn);
+    }
+
+    if (reachable)
+      Fail("Falling off the end of the code");
+  }
+
+  /** Infer types by data-flow analysis (JVMS 4.10.2), recording each instruction's state in states. */
+  void Infer(TypeStates* states) {
+    size_t count = m_code.m_code.size();
+    std::vector<std::optional<Frame>> frames(count);
+    std::vector<int> worklist;
+    std::vector<bool> queued(count);
+
+    const auto MergeInto = [&] (const Frame& from, int target) {
+      auto& to = frames[target];
+      if (!to) {
+        to = from;
+      } else {
+        if (from.m_stack.size() != to->m_stack.size())
+          Fail("Inconsistent stack height at pc " + std::to_string(m_code.m_code[target].GetPC()));
+
+        bool changed = false;
+        for (size_t i = 0; i < from.m_locals.size(); ++i) {
+          VType merged = MergeTypes(from.m_locals[i], to->m_locals[i]);
+          changed |= merged != to->m_locals[i];
+          to->m_locals[i] = merged;
+        }
+        for (size_t i = 0; i < from.m_stack.size(); ++i) {
+          VType merged = MergeTypes(from.m_stack[i], to->m_stack[i]);
+          if (merged.m_kind == Kind::Top && (from.m_stack[i].m_kind != Kind::Top || to->m_stack[i].m_kind != Kind::Top))
+            Fail("Mismatched stack types at pc " + std::to_string(m_code.m_code[target].GetPC()));
+          changed |= merged != to->m_stack[i];
+          to->m_stack[i] = merged;
+        }
+        changed |= from.m_this_uninit && !to->m_this_uninit;
+        to->m_this_uninit |= from.m_this_uninit;
+
+        if (!changed)
+          return;
+      }
+
+      if (!queued[target]) {
+        queued[target] = true;
+        worklist.push_back(target);
+      }
+    };
+
+    MergeInto(InitialFrame(), 0);
+    while (!worklist.empty()) {
+      m_insn = worklist.back();
+      worklist.pop_back();
+      queued[m_insn] = false;
+
+      m_frame = *frames[m_insn];
+      ForEachHandler([&] (int handler, const VType& caught) {
+        MergeInto(ExceptionFrame(m_frame, caught), handler);
+      });
+
+      const Insn& insn = m_code.m_code[m_insn];
+      Execute(insn);
+      ForEachBranchTarget(insn, [&] (int target) {
+        MergeInto(m_frame, target);
+      });
+
+      if (!EndsFlow(insn)) {
+        if (static_cast<size_t>(m_insn) + 1 == count)
+          Fail("Falling off the end of the code");
+        MergeInto(m_frame, m_insn + 1);
+      }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      if (frames[i])
+        Record(states, i, *frames[i]);
+    }
+  }
+
+  void Record(TypeStates* states, int insn, const Frame& frame) const {
+    states->m_stack_depths[insn] = frame.m_stack.size();
+    uint64_t* bits = &states->m_reference_maps[insn * states->m_words_per_insn];
+    std::fill(bits, bits + states->m_words_per_insn, 0);
+
+    size_t slot = 0;
+    for (const auto* slots : { &frame.m_locals, &frame.m_stack }) {
+      for (const auto& type : *slots) {
+        if (type.IsReference())
+          bits[slot / 64] |= uint64_t{1} << (slot % 64);
+        ++slot;
+      }
+    }
+  }
+
+public:
+  MethodVerifier(const Classfile& cf, const MethodInfo& method, const CodeAttribute& code, ClassHierarchy* hierarchy)
+    : m_cf(cf), m_cp(cf.m_cp), m_method(method), m_code(code), m_hierarchy(hierarchy),
+      m_class_name(cf.GetNameSymbol()), m_method_name(m_cp.GetSymbol(method.m_name_index)),
+      m_descriptor(m_cp.GetSymbol(method.m_descriptor_index)) {
+    m_signature = ParseMethodDescriptor(m_descriptor);
+  }
+
+  const TypeStates* Verify(Arena* arena) {
+    size_t count = m_code.m_code.size();
+    if (count == 0)
+      Fail("Code is empty");
+
+    bool subroutines = std::any_of(m_code.m_code.begin(), m_code.m_code.end(), [] (const Insn& insn) {
+      return insn.GetCode() == InsnCode::jsr || insn.GetCode() == InsnCode::ret;
+    });
+    if (subroutines) {
+      if (m_cf.m_version.m_major >= 51)
+        Fail("jsr and ret are not allowed in classfile version 51 or later");
+      return nullptr;
+    }
+
+    for (const auto& entry : m_code.m_exception_table.m_exceptions) {
+      if (entry.m_start >= entry.m_end || entry.m_handler >= count)
+        Fail("Illegal exception table range");
+    }
+
+    auto* states = arena->New<TypeStates>();
+    states->m_words_per_insn = (m_code.m_max_locals + m_code.m_max_stack + 63) / 64;
+    states->m_stack_depths = arena->NewArray<uint16_t>(count);
+    std::fill(states->m_stack_depths.begin(), states->m_stack_depths.end(), TypeStates::UNREACHABLE);
+    states->m_reference_maps = arena->NewArray<uint64_t>(count * states->m_words_per_insn);
+
+    if (m_cf.m_version.m_major < 50) {
+      Infer(states);
+    } else if (m_cf.m_version.m_major == 50) {
+      // Like HotSpot, fall back to inference for version 50, whose StackMapTables were optional
+      try {
+        TypeCheck(states);
+      } catch (VerifyError&) {
+        std::fill(states->m_stack_depths.begin(), states->m_stack_depths.end(), TypeStates::UNREACHABLE);
+        std::fill(states->m_reference_maps.begin(), states->m_reference_maps.end(), 0);
+        Infer(states);
+      }
+    } else {
+      TypeCheck(states);
+    }
+
+    return states;
+  }
+};
+
+const TypeStates* VerifyMethod(const Classfile& cf, const MethodInfo& method, ClassHierarchy* hierarchy, Arena* arena) {
+  const CodeAttribute* code = method.GetCode();
+  if (!code)
+    return nullptr;
+
+  MethodVerifier verifier { cf, method, *code, hierarchy };
+  return verifier.Verify(arena);
+}
+
+} // bjvm::classfile
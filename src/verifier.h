@@ -0,0 +1,128 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "classfile.h"
+
+namespace bjvm::classfile {
+
+// Bump whenever a change to the verifier could change its verdict on a class or the type states it derives, so that
+// results cached by earlier builds are discarded (see VerificationCache)
+constexpr uint32_t VERIFIER_VERSION = 2;
+
+/**
+ * Verification type of one local variable or operand stack slot (JVMS 4.10.1.2). Longs and doubles take two slots,
+ * the second of which is Top, both in the locals and on the operand stack.
+ */
+struct VerificationType {
+  enum class Kind : uint8_t {
+    Top,
+    Integer,
+    Float,
+    Long,
+    Double,
+    Null,
+    // The receiver of a constructor, before it has called another constructor
+    UninitializedThis,
+    // An object created by the new instruction at m_new_insn, before its constructor has been called
+    Uninitialized,
+    // A class or array type named by m_class
+    Reference
+  };
+
+  Kind m_kind = Kind::Top;
+  // Instruction index of the new instruction, for Uninitialized
+  uint16_t m_new_insn = 0;
+  // For Reference: an internal class name such as java/lang/String, or an array descriptor such as [I
+  const Symbol* m_class = nullptr;
+
+  static VerificationType Of(Kind kind) {
+    return { kind };
+  }
+
+  static VerificationType OfClass(const Symbol* name) {
+    return { Kind::Reference, 0, name };
+  }
+
+  bool operator==(const VerificationType& other) const {
+    return m_kind == other.m_kind && m_new_insn == other.m_new_insn && m_class == other.m_class;
+  }
+
+  bool operator!=(const VerificationType& other) const {
+    return !(*this == other);
+  }
+
+  bool IsCategory2() const {
+    return m_kind == Kind::Long || m_kind == Kind::Double;
+  }
+
+  /** Whether a slot of this type holds a pointer to the heap (or null). */
+  bool IsReference() const {
+    return m_kind >= Kind::Null;
+  }
+
+  std::string ToString() const;
+};
+
+/**
+ * What a verified method's locals and operand stack hold on entry to each instruction, in the compact form the
+ * interpreter and garbage collector need: how deep the operand stack is, and which slots hold references.
+ */
+struct TypeStates {
+  static constexpr uint16_t UNREACHABLE = UINT16_MAX;
+
+  // Operand stack depth in slots on entry to each instruction, or UNREACHABLE for dead code
+  ArenaArray<uint16_t> m_stack_depths;
+  // For each instruction, a bitmap of the slots holding references: the locals, then the operand stack from the
+  // bottom. Each instruction's bitmap takes m_words_per_insn words.
+  ArenaArray<uint64_t> m_reference_maps;
+  uint16_t m_words_per_insn = 0;
+
+  bool IsReachable(int insn) const {
+    return m_stack_depths[insn] != UNREACHABLE;
+  }
+
+  uint16_t GetStackDepth(int insn) const {
+    return m_stack_depths[insn];
+  }
+
+  /** Whether the given slot (a local, or max_locals + an operand stack slot) holds a reference on entry to insn. */
+  bool IsReference(int insn, int slot) const {
+    return m_reference_maps[insn * m_words_per_insn + slot / 64] >> (slot % 64) & 1;
+  }
+};
+
+/**
+ * The class hierarchy as seen by the verifier, which needs to know about classes other than the one being verified to
+ * check that references are assignable. Implementations load classes as needed (see ClassInstance::Link).
+ */
+class ClassHierarchy {
+public:
+  virtual ~ClassHierarchy() = default;
+
+  /** Name of the class's superclass, or nullptr for java/lang/Object. Throws if the class can't be loaded. */
+  virtual const Symbol* GetSuperclassName(const Symbol* klass) = 0;
+
+  /** Whether the class is an interface. Throws if the class can't be loaded. */
+  virtual bool IsInterface(const Symbol* klass) = 0;
+};
+
+/**
+ * Verify a method's code, returning its type states allocated from arena, or nullptr if the method has no code.
+ *
+ * Methods in classfiles of version 50 and later are type checked in a single pass against their StackMapTable (JVMS
+ * 4.10.1). Older classfiles have no stack maps, so their types are inferred by data-flow analysis instead (4.10.2).
+ * Either way, once a method has passed, the interpreter can run it without checking types or stack depths.
+ *
+ * Old methods using the jsr and ret subroutine instructions are not verified statically; nullptr is returned for
+ * them as for methods without code, and the interpreter has to check them as it goes. Throws VerifyError if the code
+ * is not type safe.
+ */
+const TypeStates* VerifyMethod(const Classfile& cf, const MethodInfo& method, ClassHierarchy* hierarchy, Arena* arena);
+
+} // bjvm::classfile
+
+#endif //VERIFIER_H
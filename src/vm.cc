@@ -8,32 +8,43 @@
 #include <emscripten.h>
 #else
 #endif
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <sstream>
 
-namespace bjvm {
+#include "profile.h"
 
-const char* PRIMORDIAL_OBJECT = "java/lang/Object";
+namespace bjvm {
 
-void VM::AddClassFromClasspath(const std::string &class_name, std::vector<uint8_t> &&class_bytes) {
-  if (m_classpath_classes.count(class_name) == 0) {  // only first definition of a class is used
-    BJVM_DEBUG("Adding class to classpath: " + class_name);
+static const Symbol* const PRIMORDIAL_OBJECT = Intern("java/lang/Object");
 
-    ByteReader reader { class_bytes };
+// Entries in each list of the profile written when the VM is destroyed
+static constexpr size_t PROFILE_ENTRIES = 100;
 
-    auto* cf = new classfile::Classfile(classfile::Classfile::parse(&reader));
-    m_classpath_classes[cf->GetName()] = cf;
-    m_counters.m_class_bytes += class_bytes.size();
+void VM::IndexClass(const std::string &class_name, ClasspathLocation &&location) {
+  // only first definition of a class is used
+  const Symbol* name = Intern(class_name);
+  if (m_classpath_index.emplace(name, std::move(location)).second) {
+    m_classpath_order.push_back(name);
+    m_counters.m_classes_indexed++;
   }
 }
 
-void VM::LoadClasspathEntry(const std::string &entry) {
+void VM::IndexClasspathEntry(const std::string &entry) {
   if (HasSuffix(entry, ".class")) {
-    AddClassFromClasspath(entry, ReadFile(entry));
+    // A lone classfile doesn't tell us its package, so read the name out of the constant pool
+    MappedFile file { entry, MappedFile::Access::Sequential };
+    IndexClass(classfile::Classfile::PeekName(file.Bytes()), { entry, 0, file.Size() });
   } else if (HasSuffix(entry, ".jar")) {
-    std::vector<uint8_t> compressed_bytes = ReadFile(entry);
+    const JarFile* jar = m_jars.emplace_back(std::make_unique<JarFile>(entry)).get();
 
-    BJVM_DEBUG("Skipping JAR file: " + entry);
+    for (const auto& [path, jar_entry] : jar->Entries()) {
+      if (HasSuffix(path, ".class")) {
+        IndexClass(path.substr(0, path.size() - std::strlen(".class")),
+                   { entry, jar_entry.m_local_header_offset, jar_entry.m_uncompressed_size, jar, &jar_entry });
+      }
+    }
   } else {
     bool recursive = HasSuffix(entry, "/*");
     std::string use_entry = entry;
@@ -42,88 +53,282 @@ void VM::LoadClasspathEntry(const std::string &entry) {
 
     auto list = ListDirectory(use_entry, recursive);
     for (const auto& subentry : list) {
-      if (HasSuffix(subentry, ".class") || HasSuffix(subentry, ".jar")) {
-        LoadClasspathEntry(subentry);
+      if (HasSuffix(subentry, ".class")) {
+        // Inside a directory the class name is the path relative to the directory, e.g. java/lang/Object.class
+        std::string name = std::filesystem::path(subentry).lexically_relative(use_entry).generic_string();
+        name.resize(name.size() - std::strlen(".class"));
+
+        IndexClass(name, { subentry, 0, std::filesystem::file_size(subentry) });
+      } else if (HasSuffix(subentry, ".jar")) {
+        IndexClasspathEntry(subentry);
       }
     }
   }
 }
 
-ClassInstance * VM::LoadClass(const std::string &klass) {
+classfile::Classfile * VM::ParseClasspathClass(const std::string &class_name, const ClasspathLocation &location,
+                                               Arena *arena) {
+  // Reused so that inflating stops allocating once the buffer has grown to fit the largest class
+  thread_local std::vector<uint8_t> buffer;
+
+  // A JAR entry's CRC-32 and length are in the central directory, so an archived class needn't even be inflated
+  if (m_class_archive && location.m_jar) {
+    if (auto* cf = m_class_archive->Load(class_name, location.m_jar_entry->m_crc32, location.m_length, arena))
+      return cf;
+  }
+
+  // The mapping is released once the class has been parsed
+  std::optional<MappedFile> file;
+  ByteSpan bytes;
+  if (location.m_jar) {
+    bytes = location.m_jar->Read(*location.m_jar_entry, buffer);
+  } else {
+    file.emplace(location.m_file, MappedFile::Access::Sequential);
+    if (location.m_offset + location.m_length > file->Size())
+      throw std::runtime_error("Classpath file changed since startup: " + location.m_file);
+    bytes = { file->Bytes().data() + location.m_offset, location.m_length };
+
+    if (m_class_archive) {
+      if (auto* cf = m_class_archive->Load(class_name, Crc32(bytes), bytes.size(), arena))
+        return cf;
+    }
+  }
+
+  ByteReader reader { bytes };
+  auto* cf = arena->New<classfile::Classfile>(classfile::Classfile::parse(&reader, arena));
+  if (m_verification_cache)
+    cf->m_digest = Sha256(bytes);
+  return cf;
+}
+
+void VM::ParseClasspath() {
+  int threads = m_options.m_classpath_threads;
+  if (threads == 0)
+    threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+  struct ParsedClass {
+    const Symbol* m_name = nullptr;
+    const ClasspathLocation* m_location = nullptr;
+    classfile::Classfile* m_classfile = nullptr;
+    std::exception_ptr m_error;
+  };
+
+  // In class path order, so that the error reported if several classes are malformed doesn't depend on hashing
+  std::vector<ParsedClass> parsed;
+  parsed.reserve(m_classpath_order.size());
+  for (const Symbol* name : m_classpath_order)
+    parsed.push_back({ name, &m_classpath_index.at(name) });
+
+  // Arenas aren't thread safe, so each worker parses into its own and they're merged into the VM's afterwards
+  std::vector<Arena> arenas(threads);
+
+  ParallelFor(parsed.size(), threads, [&] (size_t i, int worker) {
+    try {
+      parsed[i].m_classfile = ParseClasspathClass(parsed[i].m_name->m_value, *parsed[i].m_location, &arenas[worker]);
+    } catch (...) {
+      parsed[i].m_error = std::current_exception();
+    }
+  });
+
+  for (auto& arena : arenas)
+    m_metadata_arena.Absorb(std::move(arena));
+
+  for (size_t i = 0; i < parsed.size(); ++i) {
+    if (parsed[i].m_error)
+      std::rethrow_exception(parsed[i].m_error);
+
+    // A misplaced classfile is left for FindClasspathClass, which raises NoClassDefFoundError if anyone loads it, just
+    // as when the class path is lazy
+    auto* cf = parsed[i].m_classfile;
+    if (cf->GetNameSymbol() != parsed[i].m_name)
+      continue;
+
+    m_classpath_classes[parsed[i].m_name] = cf;
+    m_counters.m_class_bytes += parsed[i].m_location->m_length;
+  }
+}
+
+classfile::Classfile * VM::FindClasspathClass(const Symbol *class_name) {
+  auto parsed = m_classpath_classes.find(class_name);
+  if (parsed != m_classpath_classes.end())
+    return parsed->second;
+
+  auto indexed = m_classpath_index.find(class_name);
+  if (indexed == m_classpath_index.end())
+    return nullptr;
+
+  BJVM_DEBUG("Parsing class " + class_name->m_value + " from " + indexed->second.m_file);
+
+  auto* cf = ParseClasspathClass(class_name->m_value, indexed->second, &m_metadata_arena);
+  if (cf->GetNameSymbol() != class_name) {
+    std::string actual_name = cf->GetName();
+    throw std::runtime_error("NoClassDefFoundError: " + class_name->m_value + " (wrong name: " + actual_name + ")");
+  }
+
+  m_classpath_classes[class_name] = cf;
+  m_counters.m_class_bytes += indexed->second.m_length;
+  return cf;
+}
+
+ClassInstance * VM::LoadClass(const Symbol *klass) {
   using namespace classfile;
   try {
-    if (!klass.empty() && klass[0] == '[') {
-      return LoadArrayClass(klass);
+    if (!klass->m_value.empty() && klass->m_value[0] == '[') {
+      return LoadArrayClass(klass->m_value);
     }
 
-    if (m_loaded_classes.count(klass) == 0) {
-      if (m_classpath_classes.count(klass) == 0) {
-        throw std::runtime_error("Class not found: " + klass);
+    auto loaded = m_loaded_classes.find(klass);
+    if (loaded == m_loaded_classes.end()) {
+      auto* cf = FindClasspathClass(klass);
+      if (!cf) {
+        throw std::runtime_error("Class not found: " + klass->m_value);
       }
 
-      BJVM_DEBUG("Loading class " + klass);
-
-      auto* cf = m_classpath_classes.at(klass);
+      BJVM_DEBUG("Loading class " + klass->m_value);
 
-      assert(cf->GetName() == klass);
+      assert(cf->GetNameSymbol() == klass);
 
-      std::optional<std::string> superclass_name = cf->GetSuperclassName();
+      const Symbol* superclass_name = cf->GetSuperclassName();
 
       ClassInstance* superclass = nullptr;
 
-      if (superclass_name.has_value()) {
-        superclass = LoadClass(superclass_name.value());
+      if (superclass_name) {
+        superclass = LoadClass(superclass_name);
         if (!superclass) {
-          throw std::runtime_error("Superclass not found: " + superclass_name.value());
+          throw std::runtime_error("Superclass not found: " + superclass_name->m_value);
         }
 
         if (superclass->IsInterface())
-          throw std::runtime_error("IncompatibleClassChangeError Superclass is an interface: " + superclass_name.value());
+          throw std::runtime_error("IncompatibleClassChangeError Superclass is an interface: " + superclass_name->m_value);
       } else if (klass != PRIMORDIAL_OBJECT) {
-        throw std::runtime_error("Class has no superclass: " + klass);
+        throw std::runtime_error("Class has no superclass: " + klass->m_value);
       }
 
       std::vector<ClassInstance*> superinterfaces;
 
-      for (const auto& interface_name : cf->GetInterfaceNames()) {
+      for (const Symbol* interface_name : cf->GetInterfaceNames()) {
         auto* interface = LoadClass(interface_name);
         if (!interface)
-          throw std::runtime_error("Interface not found: " + interface_name);
+          throw std::runtime_error("Interface not found: " + interface_name->m_value);
 
         if (!interface->IsInterface())
-          throw std::runtime_error("IncompatibleClassChangeError Interface is not an interface: " + interface_name);
+          throw std::runtime_error("IncompatibleClassChangeError Interface is not an interface: " + interface_name->m_value);
 
         superinterfaces.push_back(interface);
       }
 
-      auto* instance = new ClassInstance(cf);
+      auto* instance = new ClassInstance(cf, superclass, std::move(superinterfaces));
       m_loaded_classes[klass] = instance;
       return instance;
     }
 
-    return m_loaded_classes.at(klass);
+    return loaded->second;
   } catch (VerifyError& e) {
     // TODO
     throw;
   }
 }
 
+native::String * VM::InternString(const Symbol *value) {
+  auto& string = m_interned_strings[value];
+  if (!string)
+    string = std::make_unique<native::String>(native::String::FromModifiedUtf8(value->m_value));
+  return string.get();
+}
+
+size_t VM::WriteClassArchive(const std::string &path) {
+  std::vector<ClassArchive::Entry> classes;
+
+  // In class path order, so that archiving the same class path always writes the same bytes
+  for (const Symbol* name : m_classpath_order) {
+    const ClasspathLocation& location = m_classpath_index.at(name);
+    classfile::Classfile* cf;
+    try {
+      cf = FindClasspathClass(name);
+    } catch (std::exception& e) {
+      BJVM_DEBUG("Not archiving " + name->m_value + ": " + e.what());
+      continue;
+    }
+
+    // Archived classes are looked up by the CRC-32 and length of their classfile, and keep its digest
+    std::vector<uint8_t> buffer;
+    std::optional<MappedFile> file;
+    ByteSpan bytes;
+    if (location.m_jar) {
+      bytes = location.m_jar->Read(*location.m_jar_entry, buffer);
+    } else {
+      file.emplace(location.m_file);
+      bytes = { file->Bytes().data() + location.m_offset, location.m_length };
+    }
+    if (!cf->m_digest)
+      cf->m_digest = Sha256(bytes);
+
+    classes.push_back({ name->m_value, cf, Crc32(bytes), static_cast<uint32_t>(bytes.size()) });
+  }
+
+  ClassArchive::Write(path, classes);
+  return classes.size();
+}
+
 VM::VM(VMOptions&& vm_options) {
   this->m_options = vm_options;
   const auto& cp = vm_options.m_classpath;
 
+  if (!m_options.m_class_archive.empty()) {
+    m_class_archive = ClassArchive::Open(m_options.m_class_archive);
+  }
+
+  if (!m_options.m_verification_cache.empty()) {
+    m_verification_cache = std::make_unique<VerificationCache>(m_options.m_verification_cache);
+  }
+
   // Split by :
   size_t start = 0;
   size_t end = cp.find(':');
 
   while (end != std::string::npos) {
-    LoadClasspathEntry(cp.substr(start, end - start));
+    IndexClasspathEntry(cp.substr(start, end - start));
     start = end + 1;
     end = cp.find(':', start);
   }
 
   if (start < cp.size()) {
-    LoadClasspathEntry(cp.substr(start));
+    IndexClasspathEntry(cp.substr(start));
+  }
+
+  if (!m_options.m_lazy_classpath) {
+    ParseClasspath();
+  }
+}
+
+void VM::WriteProfile(std::ostream &out, size_t limit) const {
+  std::vector<const ClassInstance*> classes;
+  classes.reserve(m_loaded_classes.size());
+  for (const auto& [name, klass] : m_loaded_classes)
+    classes.push_back(klass);
+  bjvm::WriteProfile(out, classes, limit);
+}
+
+VM::~VM() {
+  if (!m_options.m_profile.empty()) {
+    try {
+      std::ostringstream out;
+      WriteProfile(out, PROFILE_ENTRIES);
+      std::string profile = out.str();
+      WriteFile(m_options.m_profile, { reinterpret_cast<const uint8_t*>(profile.data()), profile.size() });
+    } catch (std::exception& e) {
+      BJVM_DEBUG(std::string("Could not write profile: ") + e.what());
+    }
+  }
+
+  if (!m_verification_cache)
+    return;
+
+  try {
+    m_verification_cache->Save();
+  } catch (std::exception& e) {
+    // Only costs the next VM some time
+    BJVM_DEBUG(std::string("Could not save verification cache: ") + e.what());
   }
 }
 } // bjvm
\ No newline at end of file
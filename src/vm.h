@@ -6,12 +6,19 @@
 #define VM_H
 
 #include <cstdint>
+#include <memory>
+#include <ostream>
 #include <unordered_map>
 #include <vector>
 
+#include "arena.h"
 #include "classfile.h"
+#include "class_archive.h"
 #include "class_instance.h"
+#include "jar_file.h"
+#include "native/string.h"
 #include "utilities.h"
+#include "verification_cache.h"
 
 namespace bjvm {
 class HeapObject;
@@ -23,7 +30,7 @@ struct VMOptions {
    * The class path is formatted as a colon-delimited series of .class or .jar files, or paths ending in *, which
    * indicate that all .class and .jar files (recursively) present in that directory should be included.
    *
-   * For now, the runtime classes (i.e., rt.jar) must be provided as part of the class path.
+   * For now, the runtime classes (i.e., rt.jar or an extracted copy of it) must be provided as part of the class path.
    */
   std::string m_classpath;
 
@@ -31,34 +38,132 @@ struct VMOptions {
    * Main class to execute, e.g., "com.example.Main".
    */
   std::string m_main;
+
+  /**
+   * If true, the class path is only indexed at startup and each class is parsed the first time it is loaded. Otherwise
+   * every class on the class path is parsed eagerly in the constructor.
+   */
+  bool m_lazy_classpath = true;
+
+  /**
+   * Number of threads used to read and parse the class path when it is loaded eagerly. 1 parses everything on the calling thread;
+   * 0 uses one thread per hardware thread. Values above 1 require a threaded build (e.g. Emscripten with -pthread).
+   */
+  int m_classpath_threads = 1;
+
+  /**
+   * Path of a pre-parsed class archive written by the bjvm_archive tool, or empty for none. Classes whose classfile
+   * still has the SHA-256 recorded in the archive are loaded from it instead of being parsed.
+   */
+  std::string m_class_archive;
+
+  /**
+   * Path of a verification cache (see VerificationCache), or empty for none. Classes found in it are not verified
+   * again, and classes verified by this VM are added to it when the VM is destroyed. The file is created if needed and
+   * may be shared by several VMs at once.
+   */
+  std::string m_verification_cache;
+
+  /**
+   * Path to write a JSON profile of the hottest methods, loops and call sites (see WriteProfile) to when the VM is
+   * destroyed, or empty for none.
+   */
+  std::string m_profile;
 };
 
 /**
  * Performance counters for the virtual machine.
  */
 struct VMCounters {
+  // Bytes of classfiles parsed so far
   size_t m_class_bytes = 0;
+  // Number of classes found on the class path
+  size_t m_classes_indexed = 0;
+};
+
+/**
+ * Where the bytes of a class on the class path live.
+ */
+struct ClasspathLocation {
+  // Path of the .class or .jar file containing the class
+  std::string m_file;
+  // Byte range of the class within m_file; for JAR entries, the offset of the local header and the uncompressed length
+  size_t m_offset = 0;
+  size_t m_length = 0;
+
+  // Set if the class is an entry in a JAR
+  const JarFile* m_jar = nullptr;
+  const JarEntry* m_jar_entry = nullptr;
 };
 
 class VM {
   /**
-   * Classes found in the classpath -- eagerly loaded and parsed
+   * Every class found on the classpath, by name. Only the first definition of a class is recorded.
+   */
+  std::unordered_map<const Symbol*, ClasspathLocation, SymbolHash> m_classpath_index;
+
+  /**
+   * The keys of m_classpath_index, in the order they were found on the classpath
+   */
+  std::vector<const Symbol*> m_classpath_order;
+
+  /**
+   * JAR files on the classpath, kept open (and mapped) so their entries can be read on demand
+   */
+  std::vector<std::unique_ptr<JarFile>> m_jars;
+
+  /**
+   * Metadata of classes loaded by the bootstrap class loader (parsed classfiles and everything they point to)
+   */
+  Arena m_metadata_arena;
+
+  /**
+   * Archive of pre-parsed classes, if one was given and is usable
    */
-  std::unordered_map<std::string, classfile::Classfile*> m_classpath_classes;
+  std::unique_ptr<ClassArchive> m_class_archive;
+
+  /**
+   * Results of verifying classes in earlier runs, if a cache was given
+   */
+  std::unique_ptr<VerificationCache> m_verification_cache;
+
+  /**
+   * Classes from the classpath which have been parsed -- on first load, or all at startup if the classpath is eager
+   */
+  std::unordered_map<const Symbol*, classfile::Classfile*, SymbolHash> m_classpath_classes;
 
   /**
    * Classes which have been successfully loaded by the bootstrap class loader
    */
-  std::unordered_map<std::string, ClassInstance*> m_loaded_classes;
+  std::unordered_map<const Symbol*, ClassInstance*, SymbolHash> m_loaded_classes;
+
+  /**
+   * String literals, decoded once per distinct constant pool string and shared by every class that uses them (5.1)
+   */
+  std::unordered_map<const Symbol*, std::unique_ptr<native::String>, SymbolHash> m_interned_strings;
 
   /**
    * Currently propagating throwable (including if e.g. raised by a native method); null if no throwable is propagating.
    */
   HeapObject* m_current_throwable{};
 
-  void AddClassFromClasspath(const std::string& class_name, std::vector<uint8_t>&& class_bytes);
+  void IndexClass(const std::string& class_name, ClasspathLocation&& location);
+
+  /** Add every class in a classpath entry to the index, without parsing them. */
+  void IndexClasspathEntry(const std::string& entry);
 
-  void LoadClasspathEntry(const std::string& entry);
+  /**
+   * Read and parse a class from the classpath, or load it from the class archive if it's there and up to date. The
+   * class is allocated from arena.
+   */
+  classfile::Classfile* ParseClasspathClass(const std::string& class_name, const ClasspathLocation& location,
+                                            Arena* arena);
+
+  /** Parse every indexed class up front, using m_options.m_classpath_threads workers. */
+  void ParseClasspath();
+
+  /** Get the parsed classfile for the given class, parsing it if needed, or nullptr if it is not on the classpath. */
+  classfile::Classfile* FindClasspathClass(const Symbol* class_name);
 
 public:
   VMCounters m_counters{};
@@ -80,7 +185,40 @@ public:
     return nullptr;
   }
 
-  ClassInstance* LoadClass(const std::string& klass);
+  ClassInstance* LoadClass(const Symbol* klass);
+
+  ClassInstance* LoadClass(const std::string& klass) {
+    return LoadClass(Intern(klass));
+  }
+
+  /** Get the string literal with the given (modified UTF-8) contents, creating it on first use. */
+  native::String* InternString(const Symbol* value);
+
+  /**
+   * Parse every class on the class path and write them to a class archive (see VMOptions::m_class_archive). Returns the
+   * number of classes archived. Archived classes keep the SHA-256 of their classfile, so they can use the verification
+   * cache without being re-read. Classes are written in class path order, so the same class path gives the same archive.
+   */
+  size_t WriteClassArchive(const std::string& path);
+
+  const ClassArchive* GetClassArchive() const {
+    return m_class_archive.get();
+  }
+
+  VerificationCache* GetVerificationCache() {
+    return m_verification_cache.get();
+  }
+
+  /** Write the profile of the loaded classes' hottest methods, loops and call sites, at most limit of each. */
+  void WriteProfile(std::ostream& out, size_t limit) const;
+
+  const Arena& GetMetadataArena() const {
+    return m_metadata_arena;
+  }
+
+  Arena& GetMetadataArena() {
+    return m_metadata_arena;
+  }
 
   void Start() {
     ClassInstance* main_class = LoadClass(m_options.m_main);
@@ -95,6 +233,9 @@ public:
   }
 
   explicit VM(VMOptions&& vm_options);
+
+  /** Saves the verification cache and writes the profile, if the options ask for them. */
+  ~VM();
 };
 
 } // bjvm
@@ -0,0 +1,487 @@
+//
+// Created by Cowpox on 8/17/24.
+//
+// An assembler for classfiles, so that tests and benchmarks can make exactly the bytecode they need in memory, without a
+// Java compiler or class library, and a way to load what it makes without a VM.
+
+#ifndef CLASS_BUILDER_H
+#define CLASS_BUILDER_H
+
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "../src/arena.h"
+#include "../src/byte_reader.h"
+#include "../src/class_instance.h"
+#include "../src/classfile.h"
+
+namespace bjvm::test {
+
+enum Opcode : uint8_t {
+  NOP = 0x00, ACONST_NULL = 0x01, ICONST_M1 = 0x02, ICONST_0 = 0x03, ICONST_1 = 0x04, ICONST_2 = 0x05, ICONST_3 = 0x06,
+  ICONST_4 = 0x07, ICONST_5 = 0x08, LCONST_0 = 0x09, LCONST_1 = 0x0a, FCONST_0 = 0x0b, FCONST_1 = 0x0c,
+  FCONST_2 = 0x0d, DCONST_0 = 0x0e, DCONST_1 = 0x0f, BIPUSH = 0x10, SIPUSH = 0x11, LDC = 0x12, LDC_W = 0x13,
+  LDC2_W = 0x14, ILOAD = 0x15, LLOAD = 0x16, FLOAD = 0x17, DLOAD = 0x18, ALOAD = 0x19, ILOAD_0 = 0x1a, ILOAD_1 = 0x1b,
+  ALOAD_0 = 0x2a, ISTORE = 0x36, LSTORE = 0x37, FSTORE = 0x38, DSTORE = 0x39, ASTORE = 0x3a, ISTORE_1 = 0x3c,
+  POP = 0x57, POP2 = 0x58, DUP = 0x59, DUP_X1 = 0x5a, DUP_X2 = 0x5b, DUP2 = 0x5c, DUP2_X1 = 0x5d, DUP2_X2 = 0x5e,
+  SWAP = 0x5f, IADD = 0x60, LADD = 0x61, FADD = 0x62, DADD = 0x63, ISUB = 0x64, LSUB = 0x65, IMUL = 0x68, LMUL = 0x69,
+  DMUL = 0x6b, IDIV = 0x6c, LDIV = 0x6d, IREM = 0x70, LREM = 0x71, INEG = 0x74, ISHL = 0x78, LSHL = 0x79, ISHR = 0x7a,
+  LSHR = 0x7b, IUSHR = 0x7c, LUSHR = 0x7d, IAND = 0x7e, IOR = 0x80, IXOR = 0x82, LXOR = 0x83, IINC = 0x84, I2L = 0x85,
+  I2F = 0x86, I2D = 0x87, L2I = 0x88, F2I = 0x8b, F2L = 0x8c, D2I = 0x8e, D2L = 0x8f, LCMP = 0x94, FCMPL = 0x95,
+  FCMPG = 0x96, IFEQ = 0x99, IFNE = 0x9a, IFLT = 0x9b, IFGE = 0x9c, IFGT = 0x9d, IFLE = 0x9e, IF_ICMPEQ = 0x9f,
+  IF_ICMPNE = 0xa0, IF_ICMPLT = 0xa1, IF_ICMPGE = 0xa2, GOTO = 0xa7, TABLESWITCH = 0xaa, LOOKUPSWITCH = 0xab,
+  IRETURN = 0xac, LRETURN = 0xad, FRETURN = 0xae, DRETURN = 0xaf, ARETURN = 0xb0, RETURN = 0xb1, GETSTATIC = 0xb2,
+  PUTSTATIC = 0xb3, GETFIELD = 0xb4, PUTFIELD = 0xb5, INVOKEVIRTUAL = 0xb6, INVOKESPECIAL = 0xb7, INVOKESTATIC = 0xb8,
+  INVOKEINTERFACE = 0xb9, NEW = 0xbb, ATHROW = 0xbf, CHECKCAST = 0xc0, INSTANCEOF = 0xc1
+};
+
+// Access flags
+constexpr uint16_t ACC_PUBLIC = 0x0001, ACC_PRIVATE = 0x0002, ACC_STATIC = 0x0008, ACC_SUPER = 0x0020,
+  ACC_INTERFACE = 0x0200, ACC_ABSTRACT = 0x0400;
+
+/** Assembles one method's bytecode, with branches to named labels, and its exception table and stack maps. */
+class CodeBuilder {
+  struct Fixup {
+    size_t m_offset;  // of the branch offset to patch
+    size_t m_width;   // 2 or 4 bytes
+    size_t m_insn_pc;
+    std::string m_label;
+  };
+
+  struct Handler {
+    std::string m_start;
+    std::string m_end;
+    std::string m_handler;
+    uint16_t m_catch_type;
+  };
+
+  std::vector<uint8_t> m_code;
+  std::map<std::string, size_t> m_labels;
+  std::vector<Fixup> m_fixups;
+  std::vector<Handler> m_handlers;
+  std::optional<std::vector<uint8_t>> m_stack_map_table;
+
+  void Put(uint32_t value, size_t width) {
+    for (size_t i = width; i-- > 0;)
+      m_code.push_back(static_cast<uint8_t>(value >> 8 * i));
+  }
+
+  void PutTarget(size_t insn_pc, const std::string& label, size_t width) {
+    m_fixups.push_back({ m_code.size(), width, insn_pc, label });
+    Put(0, width);
+  }
+
+public:
+  CodeBuilder& Op(uint8_t opcode, std::initializer_list<uint8_t> operands = {}) {
+    m_code.push_back(opcode);
+    m_code.insert(m_code.end(), operands);
+    return *this;
+  }
+
+  /** Append bytes as they are, e.g. code which is deliberately malformed. */
+  CodeBuilder& Bytes(const std::vector<uint8_t>& bytes) {
+    m_code.insert(m_code.end(), bytes.begin(), bytes.end());
+    return *this;
+  }
+
+  CodeBuilder& U16(uint8_t opcode, uint16_t operand) {
+    m_code.push_back(opcode);
+    Put(operand, 2);
+    return *this;
+  }
+
+  CodeBuilder& InvokeInterface(uint16_t method_ref, uint8_t count) {
+    U16(INVOKEINTERFACE, method_ref);
+    m_code.push_back(count);
+    m_code.push_back(0);
+    return *this;
+  }
+
+  CodeBuilder& Branch(uint8_t opcode, const std::string& label) {
+    size_t pc = m_code.size();
+    m_code.push_back(opcode);
+    PutTarget(pc, label, 2);
+    return *this;
+  }
+
+  CodeBuilder& Tableswitch(int32_t low, const std::vector<std::string>& labels, const std::string& default_label) {
+    size_t pc = m_code.size();
+    m_code.push_back(TABLESWITCH);
+    while (m_code.size() % 4)
+      m_code.push_back(0);
+    PutTarget(pc, default_label, 4);
+    Put(low, 4);
+    Put(low + static_cast<int32_t>(labels.size()) - 1, 4);
+    for (const auto& label : labels)
+      PutTarget(pc, label, 4);
+    return *this;
+  }
+
+  /** A lookupswitch on the given keys, which are sorted as the JVMS requires. */
+  CodeBuilder& Lookupswitch(const std::map<int32_t, std::string>& labels, const std::string& default_label) {
+    size_t pc = m_code.size();
+    m_code.push_back(LOOKUPSWITCH);
+    while (m_code.size() % 4)
+      m_code.push_back(0);
+    PutTarget(pc, default_label, 4);
+    Put(static_cast<uint32_t>(labels.size()), 4);
+    for (const auto& [key, label] : labels) {
+      Put(static_cast<uint32_t>(key), 4);
+      PutTarget(pc, label, 4);
+    }
+    return *this;
+  }
+
+  CodeBuilder& Label(const std::string& name) {
+    m_labels[name] = m_code.size();
+    return *this;
+  }
+
+  /** Offset of a label, once it has been placed. */
+  size_t PC(const std::string& label) const {
+    return m_labels.at(label);
+  }
+
+  /** Catch exceptions of catch_type (a Class index, or 0 for any) thrown from start to end, in the code at handler. */
+  CodeBuilder& Catch(const std::string& start, const std::string& end, const std::string& handler,
+                     uint16_t catch_type = 0) {
+    m_handlers.push_back({ start, end, handler, catch_type });
+    return *this;
+  }
+
+  /** Give the method a StackMapTable attribute with the given body, which starts with number_of_entries. */
+  CodeBuilder& StackMapTable(std::vector<uint8_t> body) {
+    m_stack_map_table = std::move(body);
+    return *this;
+  }
+
+  const std::optional<std::vector<uint8_t>>& GetStackMapTable() const {
+    return m_stack_map_table;
+  }
+
+  /** The exception table, with its length first. */
+  std::vector<uint8_t> ExceptionTable() const {
+    std::vector<uint8_t> table;
+    auto put = [&] (size_t value) {
+      table.push_back(static_cast<uint8_t>(value >> 8));
+      table.push_back(static_cast<uint8_t>(value));
+    };
+    put(m_handlers.size());
+    for (const auto& handler : m_handlers) {
+      put(PC(handler.m_start));
+      put(PC(handler.m_end));
+      put(PC(handler.m_handler));
+      put(handler.m_catch_type);
+    }
+    return table;
+  }
+
+  std::vector<uint8_t> Finish() {
+    for (const auto& fixup : m_fixups) {
+      auto offset = static_cast<uint32_t>(m_labels.at(fixup.m_label) - fixup.m_insn_pc);
+      for (size_t i = 0; i < fixup.m_width; ++i)
+        m_code[fixup.m_offset + i] = static_cast<uint8_t>(offset >> 8 * (fixup.m_width - 1 - i));
+    }
+    return m_code;
+  }
+};
+
+/**
+ * Assembles a classfile of public static fields and methods. Classfiles are version 49 unless set otherwise, so that
+ * methods needn't have stack maps.
+ */
+class ClassBuilder {
+  struct Method {
+    uint16_t m_access_flags;
+    uint16_t m_name;
+    uint16_t m_descriptor;
+    uint16_t m_max_locals;
+    std::vector<uint8_t> m_code;  // empty if abstract
+    std::vector<uint8_t> m_exception_table;
+    std::optional<std::vector<uint8_t>> m_stack_map_table;
+  };
+
+  std::string m_name;
+  uint16_t m_access_flags;
+  uint16_t m_major_version = 49;
+  uint16_t m_minor_version = 0;
+  std::vector<uint8_t> m_pool;
+  uint16_t m_pool_count = 1;
+  std::map<std::string, uint16_t> m_utf8;
+  std::vector<std::pair<uint16_t, uint16_t>> m_fields;  // name, descriptor
+  std::map<std::string, uint16_t> m_field_refs;
+  std::vector<Method> m_methods;
+  uint16_t m_this_class;
+  uint16_t m_super_class;
+  std::vector<uint16_t> m_interfaces;
+
+  static void Put(std::vector<uint8_t>& out, uint64_t value, size_t width) {
+    for (size_t i = width; i-- > 0;)
+      out.push_back(static_cast<uint8_t>(value >> 8 * i));
+  }
+
+  uint16_t Entry(uint8_t tag, uint64_t payload, size_t width, uint16_t slots = 1) {
+    m_pool.push_back(tag);
+    Put(m_pool, payload, width);
+    uint16_t index = m_pool_count;
+    m_pool_count += slots;
+    return index;
+  }
+
+public:
+  explicit ClassBuilder(std::string name, const std::string& superclass = "java/lang/Object",
+                        uint16_t access_flags = ACC_PUBLIC | ACC_SUPER)
+      : m_name(std::move(name)), m_access_flags(access_flags) {
+    m_this_class = Class(m_name);
+    m_super_class = Class(superclass);
+  }
+
+  /** An interface, extending the given ones. */
+  static ClassBuilder Interface(std::string name, const std::vector<std::string>& superinterfaces = {}) {
+    ClassBuilder builder { std::move(name), "java/lang/Object", ACC_PUBLIC | ACC_INTERFACE | ACC_ABSTRACT };
+    for (const auto& superinterface : superinterfaces)
+      builder.Implement(superinterface);
+    return builder;
+  }
+
+  const std::string& GetName() const {
+    return m_name;
+  }
+
+  void SetVersion(uint16_t major, uint16_t minor = 0) {
+    m_major_version = major;
+    m_minor_version = minor;
+  }
+
+  void Implement(const std::string& interface) {
+    m_interfaces.push_back(Class(interface));
+  }
+
+  uint16_t Utf8(const std::string& value) {
+    auto it = m_utf8.find(value);
+    if (it != m_utf8.end())
+      return it->second;
+    m_pool.push_back(1);
+    Put(m_pool, value.size(), 2);
+    m_pool.insert(m_pool.end(), value.begin(), value.end());
+    return m_utf8[value] = m_pool_count++;
+  }
+
+  uint16_t Class(const std::string& name) {
+    return Entry(7, Utf8(name), 2);
+  }
+
+  uint16_t Long(int64_t value) {
+    return Entry(5, static_cast<uint64_t>(value), 8, 2);
+  }
+
+  uint16_t Double(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return Entry(6, bits, 8, 2);
+  }
+
+  /** A Methodref to a method of this class. */
+  uint16_t MethodRef(const std::string& name, const std::string& descriptor) {
+    return MethodRef(m_name, name, descriptor);
+  }
+
+  /** A Methodref to a method of another class. */
+  uint16_t MethodRef(const std::string& klass, const std::string& name, const std::string& descriptor) {
+    uint16_t name_and_type = Entry(12, Utf8(name) << 16 | Utf8(descriptor), 4);
+    return Entry(10, static_cast<uint32_t>(Class(klass)) << 16 | name_and_type, 4);
+  }
+
+  uint16_t InterfaceMethodRef(const std::string& interface, const std::string& name, const std::string& descriptor) {
+    uint16_t name_and_type = Entry(12, Utf8(name) << 16 | Utf8(descriptor), 4);
+    return Entry(11, static_cast<uint32_t>(Class(interface)) << 16 | name_and_type, 4);
+  }
+
+  /** Declare a static field, unless it already has been, returning a Fieldref to it. */
+  uint16_t StaticField(const std::string& name, const std::string& descriptor) {
+    auto it = m_field_refs.find(name);
+    if (it != m_field_refs.end())
+      return it->second;
+
+    m_fields.emplace_back(Utf8(name), Utf8(descriptor));
+    uint16_t name_and_type = Entry(12, Utf8(name) << 16 | Utf8(descriptor), 4);
+    return m_field_refs[name] = Entry(9, static_cast<uint32_t>(m_this_class) << 16 | name_and_type, 4);
+  }
+
+  void AddMethod(const std::string& name, const std::string& descriptor, uint16_t max_locals, CodeBuilder& code,
+                 uint16_t access_flags = ACC_PUBLIC | ACC_STATIC) {
+    if (code.GetStackMapTable())
+      Utf8("StackMapTable");
+    std::vector<uint8_t> bytes = code.Finish();
+    m_methods.push_back({ access_flags, Utf8(name), Utf8(descriptor), max_locals, std::move(bytes),
+                          code.ExceptionTable(), code.GetStackMapTable() });
+  }
+
+  void AddAbstractMethod(const std::string& name, const std::string& descriptor) {
+    m_methods.push_back({ ACC_PUBLIC | ACC_ABSTRACT, Utf8(name), Utf8(descriptor), 0, {}, {}, {} });
+  }
+
+  /** Add a method whose body is just return, e.g. to give a class something to override. */
+  void AddEmptyMethod(const std::string& name, uint16_t access_flags = ACC_PUBLIC) {
+    CodeBuilder code;
+    code.Op(RETURN);
+    AddMethod(name, "()V", 1, code, access_flags);
+  }
+
+  std::vector<uint8_t> Finish() {
+    uint16_t code_name = Utf8("Code");
+
+    std::vector<uint8_t> out;
+    Put(out, 0xCAFEBABE, 4);
+    Put(out, m_minor_version, 2);
+    Put(out, m_major_version, 2);
+    Put(out, m_pool_count, 2);
+    out.insert(out.end(), m_pool.begin(), m_pool.end());
+    Put(out, m_access_flags, 2);
+    Put(out, m_this_class, 2);
+    Put(out, m_super_class, 2);
+    Put(out, m_interfaces.size(), 2);
+    for (uint16_t interface : m_interfaces)
+      Put(out, interface, 2);
+    Put(out, m_fields.size(), 2);
+    for (const auto& [name, descriptor] : m_fields) {
+      Put(out, ACC_PUBLIC | ACC_STATIC, 2);
+      Put(out, name, 2);
+      Put(out, descriptor, 2);
+      Put(out, 0, 2);
+    }
+    Put(out, m_methods.size(), 2);
+    for (const auto& method : m_methods) {
+      Put(out, method.m_access_flags, 2);
+      Put(out, method.m_name, 2);
+      Put(out, method.m_descriptor, 2);
+      if (method.m_code.empty()) {
+        Put(out, 0, 2);
+        continue;
+      }
+      const auto& stack_map_table = method.m_stack_map_table;
+      Put(out, 1, 2);
+      Put(out, code_name, 2);
+      Put(out, 10 + method.m_code.size() + method.m_exception_table.size()
+               + (stack_map_table ? 6 + stack_map_table->size() : 0), 4);
+      Put(out, 16, 2);  // max_stack, comfortably more than any test needs
+      Put(out, method.m_max_locals, 2);
+      Put(out, method.m_code.size(), 4);
+      out.insert(out.end(), method.m_code.begin(), method.m_code.end());
+      out.insert(out.end(), method.m_exception_table.begin(), method.m_exception_table.end());
+      Put(out, stack_map_table ? 1 : 0, 2);  // attributes
+      if (stack_map_table) {
+        Put(out, Utf8("StackMapTable"), 2);
+        Put(out, stack_map_table->size(), 4);
+        out.insert(out.end(), stack_map_table->begin(), stack_map_table->end());
+      }
+    }
+    Put(out, 0, 2);
+    return out;
+  }
+};
+
+/**
+ * Classes assembled by ClassBuilder, loaded without a VM (or java/lang/Object). A class's superclass and interfaces
+ * must be added before it; a superclass which was never added, like java/lang/Object, is taken to be none.
+ */
+class LoadedClasses {
+  Arena m_arena;
+  std::vector<std::unique_ptr<ClassInstance>> m_instances;
+  std::map<std::string, ClassInstance*> m_classes;
+
+  /** Resolve a class's field and method references by hand, as Link would. */
+  void ResolveReferences(classfile::Classfile* cf) {
+    auto& cp = cf->m_cp;
+    auto resolve = [&] (uint16_t class_index, uint16_t name_and_type_index) {
+      const ClassInstance* klass = Get(cp.GetSymbol(cp.Get<EntryClass>(class_index).m_name_index)->m_value);
+      auto name_and_type = cp.Get<EntryNameAndType>(name_and_type_index);
+      return std::make_tuple(klass, cp.GetSymbol(name_and_type.name_index),
+                             cp.GetSymbol(name_and_type.descriptor_index));
+    };
+
+    for (int i = 1; i < cp.Size(); ++i) {
+      if (cp.GetTag(i) == ConstantPoolTag::FieldRef) {
+        auto ref = cp.GetUnchecked<EntryFieldRef>(i);
+        auto [klass, name, descriptor] = resolve(ref.struct_index, ref.name_and_type_index);
+        ref.m_field_info = klass->GetFieldInfo(name, descriptor);
+        cp.Put(i, ref);
+      } else if (cp.GetTag(i) == ConstantPoolTag::MethodRef) {
+        auto ref = cp.GetUnchecked<EntryMethodRef>(i);
+        auto [klass, name, descriptor] = resolve(ref.struct_index, ref.name_and_type_index);
+        ref.m_method_info = klass->GetMethodInfo(name, descriptor);
+        cp.Put(i, ref);
+      } else if (cp.GetTag(i) == ConstantPoolTag::InterfaceMethodRef) {
+        auto ref = cp.GetUnchecked<EntryInterfaceMethodRef>(i);
+        auto [klass, name, descriptor] = resolve(ref.struct_index, ref.name_and_type_index);
+        ref.m_method_info = klass->GetMethodInfo(name, descriptor);
+        cp.Put(i, ref);
+      }
+    }
+  }
+
+public:
+  ClassInstance* Add(ClassBuilder& builder) {
+    std::vector<uint8_t> bytes = builder.Finish();
+    ByteReader reader { bytes };
+    return Add(m_arena.New<classfile::Classfile>(classfile::Classfile::parse(&reader, &m_arena)));
+  }
+
+  /** Add a class parsed (or loaded) elsewhere, which must outlive this. */
+  ClassInstance* Add(classfile::Classfile* cf) {
+    const auto& cp = cf->m_cp;
+    auto it = m_classes.find(cp.GetSymbol(cp.Get<EntryClass>(cf->m_super_class).m_name_index)->m_value);
+    ClassInstance* superclass = it == m_classes.end() ? nullptr : it->second;
+    std::vector<ClassInstance*> interfaces;
+    for (uint16_t interface : cf->m_interfaces)
+      interfaces.push_back(Get(cp.GetSymbol(cp.Get<EntryClass>(interface).m_name_index)->m_value));
+
+    m_instances.push_back(std::make_unique<ClassInstance>(cf, superclass, std::move(interfaces)));
+    return m_classes[cf->GetName()] = m_instances.back().get();
+  }
+
+  ClassInstance* Get(const std::string& name) const {
+    return m_classes.at(name);
+  }
+
+  /** Resolve every class's references and build its vtable and itables, which is as far as linking goes here. */
+  bool Link() {
+    for (auto& instance : m_instances) {
+      ResolveReferences(instance->GetClassfile());
+      if (!instance->LinkMethods(nullptr))
+        return false;
+    }
+    return true;
+  }
+
+  /** Every class, superclasses and interfaces first. */
+  std::vector<const ClassInstance*> All() const {
+    std::vector<const ClassInstance*> all;
+    for (const auto& instance : m_instances)
+      all.push_back(instance.get());
+    return all;
+  }
+
+  /** The method a class declares with the given name and descriptor. */
+  const classfile::MethodInfo* Method(const std::string& klass, const std::string& name,
+                                      const std::string& descriptor = "()V") const {
+    const classfile::Classfile* cf = Get(klass)->GetClassfile();
+    for (const auto& method : cf->m_methods) {
+      if (cf->m_cp.GetUtf8(method.m_name_index) == name && cf->m_cp.GetUtf8(method.m_descriptor_index) == descriptor)
+        return &method;
+    }
+    return nullptr;
+  }
+};
+
+} // bjvm::test
+
+#endif //CLASS_BUILDER_H
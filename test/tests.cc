@@ -5,10 +5,36 @@
 #include <emscripten.h>
 #include <catch2/catch_test_macros.hpp>
 
+#include <algorithm>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <tuple>
+#include <variant>
 #include "../src/byte_reader.h"
+#include "../src/bytecode_interpreter.h"
+#include "../src/class_archive.h"
 #include "../src/classfile.h"
+#include "../src/classfile_stream.h"
+#include "../src/inline_cache.h"
+#include "../src/jar_file.h"
+#include "../src/profile.h"
+#include "../src/sha256.h"
+#include "../src/superinstructions.h"
 #include "../src/utilities.h"
+#include "../src/verification_cache.h"
+#include "../src/verifier.h"
+#include "../src/vm.h"
+#include "class_builder.h"
 
 bool EndsWith(const std::string& s, const std::string& suffix) {
   if (s.size() < suffix.size()) {
@@ -25,17 +51,19 @@ TEST_CASE("Test classfile parsing") {
 
   long total_millis = 0;
   std::string longest;
+  Arena arena;
 
   for (const auto& file : files) {
     if (!EndsWith(file, ".class")) {
       continue;
     }
-    ByteReader reader { ReadFile(file) };
+    std::vector<uint8_t> bytes = ReadFile(file);
+    ByteReader reader { bytes };
 
     long start = emscripten_get_now();
 
     std::cout << "Reading " << file << "\n";
-    auto cf = classfile::Classfile::parse(&reader);
+    auto cf = classfile::Classfile::parse(&reader, &arena);
     std::string s = cf.ToString();
     if (s.size() > longest.size()) longest = std::move(s);
 
@@ -44,4 +72,1933 @@ TEST_CASE("Test classfile parsing") {
 
   std::cout << "Total time: " << total_millis << "ms\n";
   std::cout << "Longest: " << longest << "\n";
-}
\ No newline at end of file
+}
+
+struct ZipEntrySpec {
+  std::string name;
+  std::string data;
+  uint16_t flags = 0;
+  // Sizes recorded in the central directory; the length of data if left at -1
+  int64_t compressed_size = -1;
+  int64_t uncompressed_size = -1;
+  uint16_t compression = 0;
+  // Recorded CRC-32; that of data if left at -1
+  int64_t crc = -1;
+};
+
+/** Write a ZIP archive with a single entry to path. Its data is written as is, whatever its compression. */
+void WriteZip(const std::string& path, const ZipEntrySpec& spec) {
+  std::string out;
+  auto le16 = [&] (uint32_t v) { out.push_back(v & 0xff); out.push_back(v >> 8 & 0xff); };
+  auto le32 = [&] (uint32_t v) { le16(v & 0xffff); le16(v >> 16); };
+  uint32_t compressed = spec.compressed_size < 0 ? spec.data.size() : spec.compressed_size;
+  uint32_t uncompressed = spec.uncompressed_size < 0 ? spec.data.size() : spec.uncompressed_size;
+  uint32_t crc = spec.crc < 0 ? bjvm::Crc32({ reinterpret_cast<const uint8_t*>(spec.data.data()), spec.data.size() })
+                              : spec.crc;
+
+  le32(0x04034b50); le16(10); le16(spec.flags); le16(spec.compression); le32(0); le32(crc); le32(compressed);
+  le32(uncompressed); le16(spec.name.size()); le16(0);
+  out += spec.name + spec.data;
+
+  uint32_t directory = out.size();
+  le32(0x02014b50); le16(10); le16(10); le16(spec.flags); le16(spec.compression); le32(0); le32(crc); le32(compressed);
+  le32(uncompressed); le16(spec.name.size()); le16(0); le16(0); le16(0); le16(0); le32(0); le32(0);
+  out += spec.name;
+
+  uint32_t directory_size = out.size() - directory;
+  le32(0x06054b50); le16(0); le16(0); le16(1); le16(1); le32(directory_size); le32(directory); le16(0);
+
+  std::ofstream(path, std::ios::binary) << out;
+}
+
+TEST_CASE("Mapped files read like ReadFile whatever their access pattern") {
+  using namespace bjvm;
+  std::vector<uint8_t> expected = ReadFile("Main.class");
+  for (auto access : { MappedFile::Access::Random, MappedFile::Access::Sequential }) {
+    MappedFile file { "Main.class", access };
+    REQUIRE(std::vector<uint8_t>(file.Bytes().begin(), file.Bytes().end()) == expected);
+  }
+
+  std::string error;
+  try {
+    MappedFile file { "does_not_exist.bin" };
+  } catch (const std::runtime_error& e) {
+    error = e.what();
+  }
+  REQUIRE(error == "File not found: does_not_exist.bin");
+}
+
+TEST_CASE("JAR entries are read and malformed ones rejected") {
+  using namespace bjvm;
+  const std::string path = "test_jar_file.zip";
+  std::vector<uint8_t> buffer;
+
+  WriteZip(path, { "A.class", "contents" });
+  {
+    JarFile jar(path);
+    const JarEntry* entry = jar.Find("A.class");
+    REQUIRE(entry);
+    ByteSpan bytes = jar.Read(*entry, buffer);
+    REQUIRE(std::string(bytes.begin(), bytes.end()) == "contents");
+  }
+
+  // A stored entry whose uncompressed size claims more than was bounds checked
+  WriteZip(path, { "A.class", "contents", 0, -1, 1 << 20 });
+  {
+    JarFile jar(path);
+    REQUIRE_THROWS(jar.Read(*jar.Find("A.class"), buffer));
+  }
+
+  WriteZip(path, { "A.class", "contents", 0, -1, 0xffffffff });
+  REQUIRE_THROWS(JarFile(path));
+
+  WriteZip(path, { "A.class", "contents", 1 });
+  REQUIRE_THROWS(JarFile(path));
+
+  // Contents which don't match their CRC-32
+  WriteZip(path, { "A.class", "contents", 0, -1, -1, 0, 0x12345678 });
+  {
+    JarFile jar(path);
+    REQUIRE_THROWS_WITH(jar.Read(*jar.Find("A.class"), buffer), "CRC mismatch in " + path);
+  }
+
+  // A deflated entry claiming to inflate to 2 GiB is rejected before anything is allocated
+  WriteZip(path, { "A.class", "contents", 0, -1, 0x7fffffff, 8 });
+  {
+    JarFile jar(path);
+    REQUIRE_THROWS_WITH(jar.Read(*jar.Find("A.class"), buffer), "Entry too large (2147483647 bytes) in " + path);
+    REQUIRE(buffer.capacity() < 1 << 20);
+  }
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("Class archive records are matched by name, CRC-32 and length") {
+  using namespace bjvm;
+  const std::string path = "test_class_archive.bin";
+  Arena arena;
+
+  std::vector<uint8_t> bytes = ReadFile("Main.class");
+  ByteReader reader { bytes };
+  auto cf = classfile::Classfile::parse(&reader, &arena);
+  cf.m_digest = Sha256({ bytes.data(), bytes.size() });
+  uint32_t crc = Crc32({ bytes.data(), bytes.size() });
+  auto length = static_cast<uint32_t>(bytes.size());
+  ClassArchive::Write(path, { { "Main", &cf, crc, length } });
+
+  auto archive = ClassArchive::Open(path);
+  REQUIRE(archive);
+  classfile::Classfile* loaded = archive->Load("Main", crc, length, &arena);
+  REQUIRE(loaded);
+  REQUIRE(loaded->GetName() == cf.GetName());
+  REQUIRE(loaded->m_digest == cf.m_digest);
+  REQUIRE(loaded->m_methods.size() == cf.m_methods.size());
+  for (const auto& method : loaded->m_methods) {
+    // Code comes decoded, and is where it is in the archive
+    if (method.HasCode())
+      REQUIRE(method.m_code->m_decoded.load());
+  }
+
+  REQUIRE_FALSE(archive->Load("Main", crc ^ 1, length, &arena));
+  REQUIRE_FALSE(archive->Load("Main", crc, length + 1, &arena));
+  REQUIRE_FALSE(archive->Load("Other", crc, length, &arena));
+  REQUIRE(archive->Hits() == 1);
+
+  archive.reset();
+  std::remove(path.c_str());
+}
+
+TEST_CASE("Constant pool indices are bounds checked") {
+  using namespace bjvm;
+
+  ConstantPool cp { 3 };
+  cp.Put(1, EntryInteger { 42 });
+
+  REQUIRE(cp.Has<EntryInteger>(1));
+  REQUIRE(cp.Get<EntryInteger>(1).m_value == 42);
+  for (int index : { -1, 0, 3, 0x10000 }) {
+    REQUIRE_FALSE(cp.Has<EntryInteger>(index));
+    REQUIRE_THROWS(cp.GetTag(index));
+    REQUIRE_THROWS(cp.Get<EntryInteger>(index));
+  }
+  REQUIRE_THROWS(cp.Get<EntryFloat>(1));
+}
+
+TEST_CASE("Default methods are chosen by maximal specificity") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+
+  // J and L redeclare I.m, as a default and abstract method respectively; K declares an unrelated default m
+  LoadedClasses classes;
+  ClassBuilder i = ClassBuilder::Interface("I"), j = ClassBuilder::Interface("J", { "I" }),
+    k = ClassBuilder::Interface("K"), l = ClassBuilder::Interface("L", { "I" });
+  i.AddEmptyMethod("m");
+  j.AddEmptyMethod("m");
+  k.AddEmptyMethod("m");
+  l.AddAbstractMethod("m", "()V");
+  for (auto* interface : { &i, &j, &k, &l })
+    classes.Add(*interface);
+
+  ClassBuilder c { "C" }, d { "D" }, e { "E" }, f { "F", "C" };
+  c.Implement("I");  // listed before J, so the first found isn't the most specific
+  c.Implement("J");
+  d.Implement("J");
+  d.Implement("K");
+  e.Implement("I");
+  e.Implement("L");
+  for (auto* klass : { &c, &d, &e, &f })
+    classes.Add(*klass);
+
+  const Symbol* name = Intern("m");
+  const Symbol* descriptor = Intern("()V");
+  auto* i_m = classes.Method("I", "m");
+  auto* j_m = classes.Method("J", "m");
+
+  REQUIRE(classes.Get("C")->GetMethodInfo(name, descriptor) == j_m);
+  REQUIRE(classes.Get("C")->SelectMethod(i_m) == j_m);
+  REQUIRE(classes.Get("F")->GetMethodInfo(name, descriptor) == j_m);  // through the superclass's interfaces
+  REQUIRE(classes.Get("F")->SelectMethod(i_m) == j_m);
+
+  // Two non-abstract candidates: resolution picks either, but there's nothing to select
+  auto* d_m = classes.Get("D")->GetMethodInfo(name, descriptor);
+  REQUIRE((d_m == j_m || d_m == classes.Method("K", "m")));
+  REQUIRE(classes.Get("D")->SelectMethod(j_m) == nullptr);
+
+  // L's abstract redeclaration hides I's default
+  REQUIRE(classes.Get("E")->GetMethodInfo(name, descriptor) == classes.Method("L", "m"));
+  REQUIRE(classes.Get("E")->SelectMethod(i_m) == nullptr);
+}
+
+TEST_CASE("Arena counts requested bytes, not padding") {
+  using namespace bjvm;
+
+  Arena arena { 1024 };
+  arena.Allocate(1, 1);
+  arena.Allocate(8, 8);  // after 7 bytes of padding
+  REQUIRE(arena.BytesAllocated() == 9);
+  REQUIRE(arena.BytesReserved() == 1024);
+
+  arena.Allocate(4096, 8);  // a chunk of its own
+  REQUIRE(arena.BytesAllocated() == 9 + 4096);
+  REQUIRE(arena.BytesReserved() >= 1024 + 4096);
+}
+
+// Mnemonics of opcodes 0x00 to 0xc9, as in JVMS chapter 6
+const char* const MNEMONICS =
+  "nop aconst_null iconst_m1 iconst_0 iconst_1 iconst_2 iconst_3 iconst_4 iconst_5 lconst_0 lconst_1 fconst_0 fconst_1 "
+  "fconst_2 dconst_0 dconst_1 bipush sipush ldc ldc_w ldc2_w iload lload fload dload aload iload_0 iload_1 iload_2 "
+  "iload_3 lload_0 lload_1 lload_2 lload_3 fload_0 fload_1 fload_2 fload_3 dload_0 dload_1 dload_2 dload_3 aload_0 "
+  "aload_1 aload_2 aload_3 iaload laload faload daload aaload baload caload saload istore lstore fstore dstore astore "
+  "istore_0 istore_1 istore_2 istore_3 lstore_0 lstore_1 lstore_2 lstore_3 fstore_0 fstore_1 fstore_2 fstore_3 "
+  "dstore_0 dstore_1 dstore_2 dstore_3 astore_0 astore_1 astore_2 astore_3 iastore lastore fastore dastore aastore "
+  "bastore castore sastore pop pop2 dup dup_x1 dup_x2 dup2 dup2_x1 dup2_x2 swap iadd ladd fadd dadd isub lsub fsub "
+  "dsub imul lmul fmul dmul idiv ldiv fdiv ddiv irem lrem frem drem ineg lneg fneg dneg ishl lshl ishr lshr iushr "
+  "lushr iand land ior lor ixor lxor iinc i2l i2f i2d l2i l2f l2d f2i f2l f2d d2i d2l d2f i2b i2c i2s lcmp fcmpl "
+  "fcmpg dcmpl dcmpg ifeq ifne iflt ifge ifgt ifle if_icmpeq if_icmpne if_icmplt if_icmpge if_icmpgt if_icmple "
+  "if_acmpeq if_acmpne goto jsr ret tableswitch lookupswitch ireturn lreturn freturn dreturn areturn return getstatic "
+  "putstatic getfield putfield invokevirtual invokespecial invokestatic invokeinterface invokedynamic new newarray "
+  "anewarray arraylength athrow checkcast instanceof monitorenter monitorexit wide multianewarray ifnull ifnonnull "
+  "goto_w jsr_w";
+
+/**
+ * One instruction of a fuzzed method, encoded independently of the decoder, with what decoding it should give: the
+ * InsnCode's name, and an operand where the instruction has one which decoding keeps as is.
+ */
+struct FuzzedInsn {
+  std::vector<uint8_t> m_bytes;
+  std::string m_name;
+  std::optional<int64_t> m_operand;
+  // Branch targets as instruction indices, default first for switches; patched into m_bytes once all PCs are known
+  std::vector<int> m_targets;
+  std::vector<int32_t> m_keys;  // tableswitch low and high, or lookupswitch keys
+  uint32_t m_pc = 0;
+};
+
+/** What the decoder is expected to call an instruction: locals, constants and wide forms are folded together. */
+std::string CanonicalName(std::string mnemonic) {
+  static const std::map<std::string, std::string> RENAMED = {
+    { "bipush", "iconst" }, { "sipush", "iconst" }, { "ldc_w", "ldc" }, { "goto_w", "goto_" }, { "jsr_w", "jsr" },
+    { "goto", "goto_" }, { "return", "return_" }, { "new", "new_" }
+  };
+  if (auto it = RENAMED.find(mnemonic); it != RENAMED.end())
+    return it->second;
+  size_t underscore = mnemonic.rfind('_');
+  if (underscore != std::string::npos && mnemonic.find_first_not_of("m0123456789", underscore + 1) == std::string::npos)
+    mnemonic.resize(underscore);
+  return mnemonic;
+}
+
+/** A method using every opcode at least once, and others at random, with random operands. */
+std::vector<FuzzedInsn> FuzzMethod(std::mt19937& rng, size_t extra) {
+  std::vector<std::string> mnemonics;
+  std::istringstream stream { MNEMONICS };
+  for (std::string mnemonic; stream >> mnemonic;)
+    mnemonics.push_back(mnemonic);
+  REQUIRE(mnemonics.size() == 0xca);
+
+  std::vector<uint8_t> opcodes;
+  for (int opc = 0; opc < 0xca; ++opc)
+    opcodes.push_back(opc);
+  opcodes.push_back(0xc4);  // wide iinc as well as the wide loads and stores
+  for (size_t i = 0; i < extra; ++i)
+    opcodes.push_back(rng() % 0xca);
+  std::shuffle(opcodes.begin(), opcodes.end(), rng);
+
+  auto u8 = [&] { return static_cast<uint8_t>(rng()); };
+  auto u16 = [&] { return static_cast<uint16_t>(rng()); };
+  auto put = [] (std::vector<uint8_t>& out, uint32_t value, int width) {
+    for (int i = width; i-- > 0;)
+      out.push_back(static_cast<uint8_t>(value >> 8 * i));
+  };
+  int count = static_cast<int>(opcodes.size());
+  auto target = [&] { return static_cast<int>(rng() % count); };
+
+  std::vector<FuzzedInsn> method;
+  uint32_t pc = 0;
+  for (uint8_t opc : opcodes) {
+    FuzzedInsn insn;
+    insn.m_pc = pc;
+    const std::string& mnemonic = mnemonics[opc];
+    insn.m_name = CanonicalName(mnemonic);
+    auto& bytes = insn.m_bytes;
+    bytes.push_back(opc);
+
+    size_t underscore = mnemonic.rfind('_');
+    std::string suffix = underscore == std::string::npos ? "" : mnemonic.substr(underscore + 1);
+
+    if (opc >= 0x02 && opc <= 0x0f) {
+      insn.m_operand = suffix == "m1" ? -1 : std::stoi(suffix);  // xconst_<n>
+    } else if (opc == 0x10) {
+      bytes.push_back(u8());
+      insn.m_operand = static_cast<int8_t>(bytes[1]);
+    } else if (opc == 0x11) {
+      put(bytes, u16(), 2);
+      insn.m_operand = static_cast<int16_t>(bytes[1] << 8 | bytes[2]);
+    } else if (opc == 0x12 || (opc >= 0x15 && opc <= 0x19) || (opc >= 0x36 && opc <= 0x3a) || opc == 0xa9) {
+      bytes.push_back(u8());  // ldc, <x>load, <x>store and ret
+      insn.m_operand = bytes[1];
+    } else if ((opc >= 0x1a && opc <= 0x2d) || (opc >= 0x3b && opc <= 0x4e)) {
+      insn.m_operand = std::stoi(suffix);  // <x>load_<n> and <x>store_<n>
+    } else if (opc == 0x13 || opc == 0x14 || (opc >= 0xb2 && opc <= 0xb8) || opc == 0xbb || opc == 0xbd
+               || opc == 0xc0 || opc == 0xc1) {
+      uint16_t index = u16();
+      put(bytes, index, 2);
+      insn.m_operand = index;
+    } else if (opc == 0x84) {
+      bytes.push_back(u8());
+      bytes.push_back(u8());
+      insn.m_operand = bytes[1] << 16 | static_cast<uint16_t>(static_cast<int8_t>(bytes[2]));
+    } else if ((opc >= 0x99 && opc <= 0xa8) || opc == 0xc6 || opc == 0xc7) {
+      put(bytes, 0, 2);
+      insn.m_targets = { target() };
+    } else if (opc == 0xc8 || opc == 0xc9) {
+      put(bytes, 0, 4);
+      insn.m_targets = { target() };
+    } else if (opc == 0xaa || opc == 0xab) {
+      while ((pc + bytes.size()) % 4)
+        bytes.push_back(0);
+      int n = static_cast<int>(rng() % 5);
+      insn.m_targets.push_back(target());
+      if (opc == 0xaa) {
+        int32_t low = static_cast<int32_t>(rng() % 100) - 50;
+        insn.m_keys = { low, low + n - 1 };
+      } else {
+        int32_t key = -1000;
+        for (int i = 0; i < n; ++i)
+          insn.m_keys.push_back(key += 1 + static_cast<int32_t>(rng() % 100));  // sorted, as lookupswitch requires
+      }
+      for (int i = 0; i < n; ++i)
+        insn.m_targets.push_back(target());
+      // Offsets are patched later; the rest of the layout is fixed now
+      bytes.resize(bytes.size() + 4);
+      if (opc == 0xaa) {
+        put(bytes, insn.m_keys[0], 4);
+        put(bytes, insn.m_keys[1], 4);
+        bytes.resize(bytes.size() + 4 * n);
+      } else {
+        put(bytes, n, 4);
+        for (int32_t key : insn.m_keys) {
+          put(bytes, key, 4);
+          bytes.resize(bytes.size() + 4);
+        }
+      }
+    } else if (opc == 0xb9) {
+      uint16_t index = u16();
+      put(bytes, index, 2);
+      bytes.push_back(u8());
+      bytes.push_back(0);
+      insn.m_operand = index << 8 | bytes[3];
+    } else if (opc == 0xba) {
+      uint16_t index = u16();
+      put(bytes, index, 2);
+      put(bytes, 0, 2);
+      insn.m_operand = index;
+    } else if (opc == 0xbc) {
+      bytes.push_back(4 + rng() % 8);
+    } else if (opc == 0xc5) {
+      uint16_t index = u16();
+      put(bytes, index, 2);
+      bytes.push_back(u8());
+      insn.m_operand = index << 8 | bytes[3];
+    } else if (opc == 0xc4) {
+      // Widen iinc or a random load, store or ret
+      static const uint8_t WIDENABLE[] = { 0x84, 0x15, 0x16, 0x17, 0x18, 0x19, 0x36, 0x37, 0x38, 0x39, 0x3a, 0xa9 };
+      uint8_t widened = WIDENABLE[rng() % std::size(WIDENABLE)];
+      insn.m_name = mnemonics[widened];
+      bytes.push_back(widened);
+      uint16_t index = u16();
+      put(bytes, index, 2);
+      insn.m_operand = index;
+      if (widened == 0x84) {
+        int16_t value = static_cast<int16_t>(u16());
+        put(bytes, static_cast<uint16_t>(value), 2);
+        insn.m_operand = index << 16 | static_cast<uint16_t>(value);
+      }
+    }
+
+    pc += bytes.size();
+    method.push_back(std::move(insn));
+  }
+
+  // Now that every PC is known, fill in the branch offsets
+  for (auto& insn : method) {
+    if (insn.m_targets.empty())
+      continue;
+
+    auto offset = [&] (int target) { return static_cast<uint32_t>(method[target].m_pc - insn.m_pc); };
+    auto patch = [&] (size_t at, uint32_t value, int width) {
+      for (int i = 0; i < width; ++i)
+        insn.m_bytes[at + i] = static_cast<uint8_t>(value >> 8 * (width - 1 - i));
+    };
+    uint8_t opc = insn.m_bytes[0];
+    if (opc == 0xaa || opc == 0xab) {
+      size_t at = 1 + (4 - (insn.m_pc + 1) % 4) % 4;
+      patch(at, offset(insn.m_targets[0]), 4);
+      for (size_t i = 1; i < insn.m_targets.size(); ++i) {
+        // tableswitch offsets follow default, low and high; lookupswitch pairs follow default and npairs
+        size_t position = opc == 0xaa ? at + 12 + 4 * (i - 1) : at + 8 + 8 * (i - 1) + 4;
+        patch(position, offset(insn.m_targets[i]), 4);
+      }
+    } else {
+      patch(1, offset(insn.m_targets[0]), opc == 0xc8 || opc == 0xc9 ? 4 : 2);
+    }
+  }
+  return method;
+}
+
+/** Decode code bytes by wrapping them in a method of a class and asking for the method's code. */
+const bjvm::classfile::CodeAttribute* DecodeMethod(const std::vector<uint8_t>& code, bjvm::Arena* arena,
+                                                   bjvm::classfile::Classfile** cf = nullptr) {
+  using namespace bjvm::test;
+  ClassBuilder builder { "Fuzzed" };
+  CodeBuilder body;
+  body.Bytes(code);
+  builder.AddMethod("fuzzed", "()V", 0, body);
+  std::vector<uint8_t> bytes = builder.Finish();
+
+  bjvm::ByteReader reader { bytes };
+  auto* parsed = arena->New<bjvm::classfile::Classfile>(bjvm::classfile::Classfile::parse(&reader, arena));
+  if (cf)
+    *cf = parsed;
+  return parsed->m_methods[0].GetCode();
+}
+
+TEST_CASE("Fuzzed methods decode to what they encode") {
+  using namespace bjvm;
+  using namespace bjvm::classfile;
+
+  std::mt19937 rng { 1234 };
+  for (int round = 0; round < 50; ++round) {
+    std::vector<FuzzedInsn> method = FuzzMethod(rng, 300);
+    std::vector<uint8_t> code;
+    for (const auto& insn : method)
+      code.insert(code.end(), insn.m_bytes.begin(), insn.m_bytes.end());
+
+    Arena arena;
+    const CodeAttribute* decoded = DecodeMethod(code, &arena);
+    REQUIRE(decoded->m_code.size() == method.size());
+
+    for (size_t i = 0; i < method.size(); ++i) {
+      const Insn& insn = decoded->m_code[i];
+      const FuzzedInsn& expected = method[i];
+      REQUIRE(insn.GetPC() == expected.m_pc);
+      REQUIRE(CodeName(insn.GetCode()) == expected.m_name);
+      REQUIRE(decoded->ProgramCounterToInsnIndex(expected.m_pc) == static_cast<int>(i));
+
+      switch (insn.GetCode()) {
+        case InsnCode::iconst: REQUIRE(insn.GetIntData() == *expected.m_operand); break;
+        case InsnCode::lconst: REQUIRE(insn.GetLongData() == *expected.m_operand); break;
+        case InsnCode::fconst: REQUIRE(insn.GetFloatData() == static_cast<float>(*expected.m_operand)); break;
+        case InsnCode::dconst: REQUIRE(insn.GetDoubleData() == static_cast<double>(*expected.m_operand)); break;
+        case InsnCode::iinc:
+          REQUIRE((insn.GetIIncData().m_index << 16 | static_cast<uint16_t>(insn.GetIIncData().m_const))
+                  == *expected.m_operand);
+          break;
+        case InsnCode::invokeinterface:
+          REQUIRE((insn.GetInvokeInterfaceData()->m_index << 8 | insn.GetInvokeInterfaceData()->m_count)
+                  == *expected.m_operand);
+          break;
+        case InsnCode::multianewarray:
+          REQUIRE((insn.GetMultianewarrayData().m_index << 8 | insn.GetMultianewarrayData().m_dims)
+                  == *expected.m_operand);
+          break;
+        case InsnCode::tableswitch: {
+          const TableswitchData* data = insn.GetTableswitchData();
+          REQUIRE(data->m_low == expected.m_keys[0]);
+          REQUIRE(data->m_high == expected.m_keys[1]);
+          REQUIRE(data->m_default_target == expected.m_targets[0]);
+          REQUIRE(data->m_targets.size() == expected.m_targets.size() - 1);
+          for (size_t j = 0; j < data->m_targets.size(); ++j)
+            REQUIRE(data->m_targets[j] == expected.m_targets[j + 1]);
+          break;
+        }
+        case InsnCode::lookupswitch: {
+          const LookupswitchData* data = insn.GetLookupswitchData();
+          REQUIRE(data->m_default_target == expected.m_targets[0]);
+          REQUIRE(data->m_keys.size() == expected.m_keys.size());
+          for (size_t j = 0; j < data->m_keys.size(); ++j) {
+            REQUIRE(data->m_keys[j] == expected.m_keys[j]);
+            REQUIRE(data->m_targets[j] == expected.m_targets[j + 1]);
+          }
+          break;
+        }
+        default:
+          if (insn.ContainsBranch())
+            REQUIRE(insn.Index() == expected.m_targets[0]);
+          else if (expected.m_operand)
+            REQUIRE(insn.Index() == *expected.m_operand);
+      }
+    }
+  }
+}
+
+TEST_CASE("Malformed code is rejected when decoded") {
+  using namespace bjvm;
+  using namespace bjvm::classfile;
+
+  Arena arena;
+  for (int opc = 0xca; opc <= 0xff; ++opc)
+    REQUIRE_THROWS_AS(DecodeMethod({ static_cast<uint8_t>(opc) }, &arena), VerifyError);
+
+  REQUIRE_THROWS_AS(DecodeMethod({ 0x11, 0x00 }, &arena), VerifyError);  // sipush missing a byte
+  REQUIRE_THROWS_AS(DecodeMethod({ 0xc4, 0x60 }, &arena), VerifyError);  // wide iadd
+  REQUIRE_THROWS_AS(DecodeMethod({ 0xc4, 0x12, 0x00, 0x01 }, &arena), VerifyError);  // wide ldc
+  REQUIRE_THROWS_AS(DecodeMethod({ 0xbc, 0x03 }, &arena), VerifyError);  // newarray of no type
+  REQUIRE_THROWS_AS(DecodeMethod({ 0x11, 0x00, 0x00, 0xa7, 0xff, 0xfe }, &arena), VerifyError);  // into sipush
+  REQUIRE_THROWS_AS(DecodeMethod({ 0xa7, 0x00, 0x03 }, &arena), VerifyError);  // past the end
+  // tableswitch with low 2 and high 0
+  REQUIRE_THROWS_AS(DecodeMethod({ 0xaa, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0, 0 }, &arena), VerifyError);
+}
+
+/** An instruction and its operands, as text. */
+std::string DescribeInsn(const bjvm::classfile::Insn& insn) {
+  using namespace bjvm::classfile;
+  using IC = InsnCode;
+
+  std::ostringstream out;
+  IC code = insn.GetCode();
+  out << insn.GetPC() << ": " << CodeName(code);
+  switch (code) {
+    case IC::iconst: out << ' ' << insn.GetIntData(); break;
+    case IC::lconst: out << ' ' << insn.GetLongData(); break;
+    case IC::fconst: out << ' ' << insn.GetFloatData(); break;
+    case IC::dconst: out << ' ' << insn.GetDoubleData(); break;
+    case IC::iinc: out << ' ' << insn.GetIIncData().m_index << ' ' << insn.GetIIncData().m_const; break;
+    case IC::newarray: out << ' ' << static_cast<int>(insn.GetArrayType()); break;
+    case IC::invokeinterface:
+      out << ' ' << insn.GetInvokeInterfaceData()->m_index << ' ' << +insn.GetInvokeInterfaceData()->m_count;
+      break;
+    case IC::multianewarray:
+      out << ' ' << insn.GetMultianewarrayData().m_index << ' ' << +insn.GetMultianewarrayData().m_dims;
+      break;
+    case IC::tableswitch: {
+      const TableswitchData* data = insn.GetTableswitchData();
+      out << ' ' << data->m_low << ".." << data->m_high << " default " << data->m_default_target;
+      for (int target : data->m_targets)
+        out << ' ' << target;
+      break;
+    }
+    case IC::lookupswitch: {
+      const LookupswitchData* data = insn.GetLookupswitchData();
+      out << " default " << data->m_default_target;
+      for (size_t i = 0; i < data->m_keys.size(); ++i)
+        out << ' ' << data->m_keys[i] << ':' << data->m_targets[i];
+      break;
+    }
+    default:
+      if ((code >= IC::dload && code <= IC::ifnull) || code == IC::ldc || code == IC::ldc2_w || code == IC::ret)
+        out << ' ' << insn.Index();
+  }
+  return out.str();
+}
+
+/** Everything decoding a Code attribute produces, as text, to compare two decodings of the same code. */
+std::string DescribeCode(const bjvm::classfile::CodeAttribute& code) {
+  std::ostringstream out;
+  out << code.m_max_stack << ' ' << code.m_max_locals << '\n';
+  for (const auto& insn : code.m_code)
+    out << DescribeInsn(insn) << '\n';
+  for (const auto& entry : code.m_exception_table.m_exceptions)
+    out << "catch " << entry.m_start << ' ' << entry.m_end << ' ' << entry.m_handler << ' ' << entry.m_catch_type
+        << '\n';
+  if (code.m_line_number_table) {
+    for (const auto& entry : code.m_line_number_table->m_entries)
+      out << "line " << entry.m_start << ' ' << entry.m_line_number << '\n';
+  }
+  return out.str();
+}
+
+TEST_CASE("Code is only decoded when asked for, and decodes as if decoded eagerly") {
+  using namespace bjvm;
+  using namespace bjvm::classfile;
+
+  Arena arena;
+  std::vector<Classfile*> classes;
+
+  std::vector<uint8_t> main = ReadFile("Main.class");
+  ByteReader reader { main };
+  classes.push_back(arena.New<Classfile>(Classfile::parse(&reader, &arena)));
+
+  std::mt19937 rng { 99 };
+  for (int i = 0; i < 5; ++i) {
+    test::ClassBuilder builder { "Fuzzed" + std::to_string(i) };
+    for (int j = 0; j < 3; ++j) {
+      test::CodeBuilder body;
+      for (const auto& insn : FuzzMethod(rng, 100))
+        body.Bytes(insn.m_bytes);
+      builder.AddMethod("fuzzed" + std::to_string(j), "()V", 0, body);
+    }
+    std::vector<uint8_t> bytes = builder.Finish();
+    ByteReader fuzzed_reader { bytes };
+    classes.push_back(arena.New<Classfile>(Classfile::parse(&fuzzed_reader, &arena)));
+  }
+
+  for (Classfile* cf : classes) {
+    for (const auto& method : cf->m_methods) {
+      if (!method.HasCode())
+        continue;
+
+      REQUIRE(method.m_code->m_decoded.load() == nullptr);
+      const CodeAttribute* lazy = method.GetCode();
+      REQUIRE(lazy);
+      REQUIRE(method.GetCode() == lazy);  // decoded once, then published
+
+      Arena eager_arena;
+      CodeAttribute eager = CodeAttribute::parse(method.m_code->m_raw, &eager_arena);
+      REQUIRE(DescribeCode(*lazy) == DescribeCode(eager));
+    }
+  }
+}
+
+/** Every field of a parsed class, as text, to compare two parses of the same classfile. */
+std::string DescribeClassfile(const bjvm::classfile::Classfile& cf) {
+  std::ostringstream out;
+  out << cf.m_version.m_major << '.' << cf.m_version.m_minor << ' ' << static_cast<int>(cf.m_access_flags) << ' '
+      << cf.m_this_class << ' ' << cf.m_super_class << '\n';
+  for (int i = 1; i < cf.m_cp.Size(); ++i)
+    out << i << ": " << std::visit([&] (const auto& entry) { return entry.ToString(&cf.m_cp); }, cf.m_cp.GetAny(i))
+        << '\n';
+  for (uint16_t interface : cf.m_interfaces)
+    out << "implements " << interface << '\n';
+  for (const auto& field : cf.m_fields) {
+    out << "field " << static_cast<int>(field.m_access_flags) << ' ' << field.m_name_index << ' '
+        << field.m_descriptor_index << ' ' << (field.m_constant_value ? field.m_constant_value->m_index : -1) << '\n';
+  }
+  for (const auto& method : cf.m_methods) {
+    out << "method " << static_cast<int>(method.m_access_flags) << ' ' << method.m_name_index << ' '
+        << method.m_descriptor_index << '\n';
+    if (method.HasCode()) {
+      const auto& raw = method.m_code->m_raw;
+      out << "code " << std::string(raw.m_bytes.begin(), raw.m_bytes.end()) << ' ' << raw.m_line_number_table << ' '
+          << raw.m_stack_map_table << '\n';
+    }
+  }
+  if (cf.m_bootstrap_methods) {
+    for (const auto& method : cf.m_bootstrap_methods->m_methods) {
+      out << "bootstrap " << method.m_method_ref;
+      for (uint16_t argument : method.m_arguments)
+        out << ' ' << argument;
+      out << '\n';
+    }
+  }
+  return out.str();
+}
+
+/** Feed bytes to a stream parser in chunks of the sizes chunk_size returns, until it's done or they run out. */
+template <typename ChunkSize>
+bjvm::classfile::ClassfileStreamParser::Status FeedInChunks(bjvm::classfile::ClassfileStreamParser& parser,
+                                                            const std::vector<uint8_t>& bytes, ChunkSize chunk_size) {
+  auto status = bjvm::classfile::ClassfileStreamParser::Status::NeedMore;
+  for (size_t offset = 0; offset < bytes.size();) {
+    size_t size = std::min<size_t>(chunk_size(), bytes.size() - offset);
+    status = parser.Feed({ bytes.data() + offset, size });
+    offset += size;
+  }
+  return status;
+}
+
+TEST_CASE("Classfiles streamed in chunks parse as if read whole") {
+  using namespace bjvm;
+  using namespace bjvm::classfile;
+  using Status = ClassfileStreamParser::Status;
+
+  std::vector<std::vector<uint8_t>> classfiles { ReadFile("Main.class") };
+  std::mt19937 rng { 7 };
+  for (int i = 0; i < 3; ++i) {
+    test::ClassBuilder builder { "Streamed" + std::to_string(i) };
+    builder.Implement("java/lang/Runnable");
+    builder.Long(1234567890123);
+    builder.Double(0.25);
+    for (int j = 0; j < 20; ++j) {
+      builder.StaticField("f" + std::to_string(j), j % 2 ? "I" : "J");
+      test::CodeBuilder body;
+      for (const auto& insn : FuzzMethod(rng, 20))
+        body.Bytes(insn.m_bytes);
+      builder.AddMethod("m" + std::to_string(j), "()V", 0, body);
+    }
+    builder.AddAbstractMethod("run", "()V");
+    classfiles.push_back(builder.Finish());
+  }
+
+  for (const auto& bytes : classfiles) {
+    Arena arena;
+    ByteReader reader { bytes };
+    std::string expected = DescribeClassfile(Classfile::parse(&reader, &arena));
+
+    ClassfileStreamParser bytewise { &arena };
+    REQUIRE(FeedInChunks(bytewise, bytes, [] { return 1; }) == Status::Done);
+    REQUIRE(DescribeClassfile(bytewise.Take()) == expected);
+
+    for (int round = 0; round < 20; ++round) {
+      ClassfileStreamParser parser { &arena };
+      REQUIRE(FeedInChunks(parser, bytes, [&] { return 1 + rng() % (round < 10 ? 16 : 512); }) == Status::Done);
+      REQUIRE(DescribeClassfile(parser.Take()) == expected);
+    }
+
+    ClassfileStreamParser truncated { &arena };
+    REQUIRE(truncated.Feed({ bytes.data(), bytes.size() - 1 }) == Status::NeedMore);
+    REQUIRE_THROWS(truncated.Take());
+  }
+}
+
+TEST_CASE("Data after a streamed classfile is an error") {
+  using namespace bjvm;
+  using namespace bjvm::classfile;
+
+  std::vector<uint8_t> bytes = ReadFile("Main.class");
+  std::vector<uint8_t> padded = bytes;
+  padded.push_back(0);
+  Arena arena;
+
+  // In the same chunk as the end of the class
+  ClassfileStreamParser whole { &arena };
+  REQUIRE_THROWS(whole.Feed({ padded.data(), padded.size() }));
+
+  // Carried over from a unit which straddled chunks
+  ClassfileStreamParser straddling { &arena };
+  REQUIRE(straddling.Feed({ padded.data(), padded.size() - 3 }) == ClassfileStreamParser::Status::NeedMore);
+  REQUIRE_THROWS(straddling.Feed({ padded.data() + padded.size() - 3, 3 }));
+
+  // In a chunk of its own
+  ClassfileStreamParser later { &arena };
+  REQUIRE(later.Feed({ bytes.data(), bytes.size() }) == ClassfileStreamParser::Status::Done);
+  REQUIRE_THROWS(later.Feed({ padded.data() + bytes.size(), 1 }));
+  REQUIRE_NOTHROW(later.Feed({}));
+}
+
+/** The superclasses of the classes the verifier tests refer to, none of which is an interface. */
+class TestHierarchy : public bjvm::classfile::ClassHierarchy {
+  std::map<std::string, std::string> m_superclasses {
+    { "java/lang/Throwable", "java/lang/Object" }, { "java/lang/Exception", "java/lang/Throwable" },
+    { "java/lang/String", "java/lang/Object" }, { "Verified", "java/lang/Object" }
+  };
+
+public:
+  void SetSuperclass(const std::string& klass, const std::string& superclass) {
+    m_superclasses[klass] = superclass;
+  }
+
+  const bjvm::Symbol* GetSuperclassName(const bjvm::Symbol* klass) override {
+    if (klass->m_value == "java/lang/Object")
+      return nullptr;
+    return bjvm::Intern(m_superclasses.at(klass->m_value));
+  }
+
+  bool IsInterface(const bjvm::Symbol*) override {
+    return false;
+  }
+};
+
+/** Assemble a class Verified with the one given method and verify it. */
+const bjvm::classfile::TypeStates* VerifyAssembled(bjvm::test::ClassBuilder& builder, bjvm::Arena* arena) {
+  using namespace bjvm::classfile;
+  std::vector<uint8_t> bytes = builder.Finish();
+  bjvm::ByteReader reader { bytes };
+  auto* cf = arena->New<Classfile>(Classfile::parse(&reader, arena));
+  TestHierarchy hierarchy;
+  return VerifyMethod(*cf, cf->m_methods[0], &hierarchy, arena);
+}
+
+TEST_CASE("Methods are type checked against their stack maps") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+  using classfile::VerifyError;
+  Arena arena;
+
+  // The stack has to be as high as the frame says wherever control flow merges
+  auto merge = [] (uint8_t before_merge) {
+    ClassBuilder builder { "Verified" };
+    builder.SetVersion(51);
+    CodeBuilder code;
+    code.Op(ICONST_0).Branch(IFEQ, "merge").Op(before_merge).Label("merge").Op(ICONST_2).Op(IRETURN);
+    code.StackMapTable({ 0, 1, static_cast<uint8_t>(code.PC("merge")) });  // same_frame
+    builder.AddMethod("f", "()I", 0, code);
+    return builder;
+  };
+  auto same_height = merge(NOP), higher = merge(ICONST_1);
+  REQUIRE(VerifyAssembled(same_height, &arena)->GetStackDepth(3) == 0);
+  REQUIRE_THROWS_AS(VerifyAssembled(higher, &arena), VerifyError);
+
+  // Code after an unconditional branch starts with a frame, even if nothing branches to it
+  auto after_goto = [] (bool frame_after_goto) {
+    ClassBuilder builder { "Verified" };
+    builder.SetVersion(51);
+    CodeBuilder code;
+    code.Branch(GOTO, "target").Label("dead").Op(ICONST_0).Op(IRETURN).Label("target").Op(ICONST_1).Op(IRETURN);
+    auto dead = static_cast<uint8_t>(code.PC("dead")), target = static_cast<uint8_t>(code.PC("target"));
+    if (frame_after_goto)
+      code.StackMapTable({ 0, 2, dead, static_cast<uint8_t>(target - dead - 1) });
+    else
+      code.StackMapTable({ 0, 1, target });
+    builder.AddMethod("f", "()I", 0, code);
+    return builder;
+  };
+  auto with_frame = after_goto(true), without_frame = after_goto(false);
+  REQUIRE_NOTHROW(VerifyAssembled(with_frame, &arena));
+  REQUIRE_THROWS_AS(VerifyAssembled(without_frame, &arena), VerifyError);
+
+  // A constructor has to initialize this before it returns
+  auto constructor = [] (bool calls_super) {
+    ClassBuilder builder { "Verified" };
+    builder.SetVersion(51);
+    CodeBuilder code;
+    if (calls_super)
+      code.Op(ALOAD_0).U16(INVOKESPECIAL, builder.MethodRef("java/lang/Object", "<init>", "()V"));
+    code.Op(RETURN);
+    builder.AddMethod("<init>", "()V", 1, code, ACC_PUBLIC);
+    return builder;
+  };
+  auto initializes = constructor(true), returns_early = constructor(false);
+  REQUIRE_NOTHROW(VerifyAssembled(initializes, &arena));
+  REQUIRE_THROWS_AS(VerifyAssembled(returns_early, &arena), VerifyError);
+
+  // Handlers catch subclasses of Throwable, and the exception table may cover the code up to its very end
+  auto handler = [] (const std::string& catch_type) {
+    ClassBuilder builder { "Verified" };
+    builder.SetVersion(51);
+    uint16_t caught = builder.Class(catch_type);
+    CodeBuilder code;
+    code.Label("start").Op(ICONST_0).Op(IRETURN).Label("handler").Op(POP).Op(ICONST_1).Op(IRETURN).Label("end");
+    code.Catch("start", "end", "handler", caught);
+    // same_locals_1_stack_item_frame, holding the exception
+    code.StackMapTable({ 0, 1, static_cast<uint8_t>(64 + code.PC("handler")), 7, static_cast<uint8_t>(caught >> 8),
+                         static_cast<uint8_t>(caught) });
+    builder.AddMethod("f", "()I", 0, code);
+    return builder;
+  };
+  auto exception = handler("java/lang/Exception"), string = handler("java/lang/String");
+  const classfile::TypeStates* states = VerifyAssembled(exception, &arena);
+  REQUIRE(states->IsReachable(2));
+  REQUIRE(states->GetStackDepth(2) == 1);
+  REQUIRE(states->IsReference(2, 0));
+  REQUIRE_THROWS_AS(VerifyAssembled(string, &arena), VerifyError);
+}
+
+TEST_CASE("StackMapTable attributes are read to exactly their length") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+  using classfile::VerifyError;
+  Arena arena;
+
+  auto with_table = [] (std::vector<uint8_t> table, uint16_t version = 51) {
+    ClassBuilder builder { "Verified" };
+    builder.SetVersion(version);
+    CodeBuilder code;
+    code.Op(ICONST_0).Branch(IFEQ, "merge").Op(NOP).Label("merge").Op(ICONST_2).Op(IRETURN);
+    code.StackMapTable(std::move(table));
+    builder.AddMethod("f", "()I", 0, code);
+    return builder;
+  };
+
+  auto exact = with_table({ 0, 1, 5 }), trailing = with_table({ 0, 1, 5, 0 }), truncated = with_table({ 0, 2, 5 });
+  REQUIRE_NOTHROW(VerifyAssembled(exact, &arena));
+  REQUIRE_THROWS_AS(VerifyAssembled(trailing, &arena), VerifyError);
+  REQUIRE_THROWS_AS(VerifyAssembled(truncated, &arena), VerifyError);
+
+  // Version 50 falls back to inference on any malformed table, truncated ones included
+  auto old_trailing = with_table({ 0, 1, 5, 0 }, 50), old_truncated = with_table({ 0, 2, 5 }, 50);
+  REQUIRE(VerifyAssembled(old_trailing, &arena)->GetStackDepth(3) == 0);
+  REQUIRE(VerifyAssembled(old_truncated, &arena)->GetStackDepth(3) == 0);
+}
+
+TEST_CASE("Version 50 methods without stack maps are verified by inference") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+  using classfile::VerifyError;
+  Arena arena;
+
+  auto without_table = [] (uint16_t version, uint8_t before_merge) {
+    ClassBuilder builder { "Verified" };
+    builder.SetVersion(version, 3);
+    CodeBuilder code;
+    code.Op(ICONST_0).Branch(IFEQ, "merge").Op(before_merge).Label("merge").Op(ICONST_2).Op(IRETURN);
+    builder.AddMethod("f", "()I", 0, code);
+    return builder;
+  };
+
+  auto old_good = without_table(50, NOP), old_bad = without_table(50, ICONST_1), new_good = without_table(51, NOP);
+  REQUIRE(VerifyAssembled(old_good, &arena)->GetStackDepth(3) == 0);
+  REQUIRE_THROWS_AS(VerifyAssembled(old_bad, &arena), VerifyError);
+  REQUIRE_THROWS_AS(VerifyAssembled(new_good, &arena), VerifyError);
+
+  // The major version is the second of the two, which is what decides between type checking and inference
+  std::vector<uint8_t> bytes = new_good.Finish();
+  ByteReader reader { bytes };
+  auto cf = classfile::Classfile::parse(&reader, &arena);
+  REQUIRE(cf.m_version.m_major == 51);
+  REQUIRE(cf.m_version.m_minor == 3);
+}
+
+TEST_CASE("Verification results are cached until the hierarchy changes") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+  const std::string path = "test_verification_cache.bin";
+  std::remove(path.c_str());
+  Arena arena;
+
+  // Verifying the handler asks the hierarchy whether java/lang/Exception is a Throwable
+  ClassBuilder builder { "Verified" };
+  builder.SetVersion(51);
+  uint16_t exception = builder.Class("java/lang/Exception");
+  CodeBuilder code;
+  code.Label("start").Op(ICONST_0).Op(IRETURN).Label("handler").Op(POP).Op(ICONST_1).Op(IRETURN).Label("end");
+  code.Catch("start", "end", "handler", exception);
+  code.StackMapTable({ 0, 1, static_cast<uint8_t>(64 + code.PC("handler")), 7, 0, static_cast<uint8_t>(exception) });
+  builder.AddMethod("f", "()I", 0, code);
+  std::vector<uint8_t> bytes = builder.Finish();
+
+  auto parse = [&] {
+    ByteReader reader { bytes };
+    auto* cf = arena.New<classfile::Classfile>(classfile::Classfile::parse(&reader, &arena));
+    cf->m_digest = Sha256({ bytes.data(), bytes.size() });
+    return cf;
+  };
+
+  TestHierarchy hierarchy;
+  classfile::Classfile* verified = parse();
+  {
+    VerificationCache cache { path };
+    REQUIRE(cache.Size() == 0);
+    REQUIRE_FALSE(cache.Apply(verified, &hierarchy, &arena));
+
+    RecordingClassHierarchy recording { &hierarchy };
+    auto& lazy = *verified->m_methods[0].m_code;
+    lazy.m_type_states = classfile::VerifyMethod(*verified, verified->m_methods[0], &recording, &arena);
+    REQUIRE_FALSE(recording.Facts().empty());
+    cache.Add(*verified, recording.Facts());
+    cache.Save();
+  }
+
+  const classfile::TypeStates* expected = verified->m_methods[0].GetTypeStates();
+  auto same_states = [&] (const classfile::TypeStates* states) {
+    return states && states->m_words_per_insn == expected->m_words_per_insn
+           && std::equal(states->m_stack_depths.begin(), states->m_stack_depths.end(),
+                         expected->m_stack_depths.begin(), expected->m_stack_depths.end())
+           && std::equal(states->m_reference_maps.begin(), states->m_reference_maps.end(),
+                         expected->m_reference_maps.begin(), expected->m_reference_maps.end());
+  };
+
+  {
+    VerificationCache cache { path };
+    REQUIRE(cache.Size() == 1);
+    classfile::Classfile* loaded = parse();
+    REQUIRE(cache.Apply(loaded, &hierarchy, &arena));
+    REQUIRE(same_states(loaded->m_methods[0].GetTypeStates()));
+    REQUIRE(cache.Hits() == 1);
+
+    // Once a class the result relied on has another superclass, the class has to be verified again
+    TestHierarchy changed;
+    changed.SetSuperclass("java/lang/Exception", "java/lang/Object");
+    classfile::Classfile* stale = parse();
+    REQUIRE_FALSE(cache.Apply(stale, &changed, &arena));
+    REQUIRE_FALSE(stale->m_methods[0].GetTypeStates());
+
+    // As does a class with other bytes, whatever its name
+    classfile::Classfile* other = parse();
+    other->m_digest->m_bytes[0] ^= 1;
+    REQUIRE_FALSE(cache.Apply(other, &hierarchy, &arena));
+    REQUIRE(cache.Hits() == 1);
+  }
+
+  // A damaged result is ignored, rather than trusted
+  std::vector<uint8_t> file = ReadFile(path);
+  file.back() ^= 1;
+  std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(file.data()), file.size());
+  {
+    VerificationCache cache { path };
+    REQUIRE(cache.Size() == 1);
+    classfile::Classfile* loaded = parse();
+    REQUIRE_FALSE(cache.Apply(loaded, &hierarchy, &arena));
+    REQUIRE_FALSE(loaded->m_methods[0].GetTypeStates());
+  }
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("SHA-256 matches the FIPS 180-4 examples") {
+  using namespace bjvm;
+
+  auto digest = [] (const std::string& message) {
+    return Sha256({ reinterpret_cast<const uint8_t*>(message.data()), message.size() }).ToHex();
+  };
+  REQUIRE(digest("abc") == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  REQUIRE(digest("") == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  // Two blocks, since the padding doesn't fit after 56 bytes
+  REQUIRE(digest("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq")
+          == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+
+/** Run a static method to completion, returning what it returned. */
+bjvm::FrameEntry Interpret(const bjvm::classfile::MethodInfo* method, const std::vector<bjvm::FrameEntry>& args,
+                           bjvm::DispatchMode dispatch_mode,
+                           bjvm::StackCaching stack_caching = bjvm::StackCaching::None) {
+  bjvm::BytecodeInterpreter interpreter { nullptr, dispatch_mode, stack_caching };
+  interpreter.PushFrame(method, args.data());
+  while (interpreter.step()) {}
+  return interpreter.GetReturnValue();
+}
+
+/** Every dispatch mode this build supports. */
+std::vector<bjvm::DispatchMode> DispatchModes() {
+  if (BJVM_THREADED_DISPATCH)
+    return { bjvm::DispatchMode::Switch, bjvm::DispatchMode::Threaded };
+  return { bjvm::DispatchMode::Switch };
+}
+
+/** A value as it sits in a frame entry. */
+template <typename T>
+bjvm::FrameEntry Entry(T value) {
+  bjvm::FrameEntry entry = 0;
+  std::memcpy(&entry, &value, sizeof(T));
+  return entry;
+}
+
+/** The value in a frame entry. */
+template <typename T>
+T Value(bjvm::FrameEntry entry) {
+  T value;
+  std::memcpy(&value, &entry, sizeof(T));
+  return value;
+}
+
+/** Fold the top count small ints on the stack into one, three bits each, the top in the lowest bits. */
+void FoldInts(bjvm::test::CodeBuilder& code, int count) {
+  using namespace bjvm::test;
+  for (int i = 1; i < count; ++i)
+    code.Op(SWAP).Op(BIPUSH, { static_cast<uint8_t>(3 * i) }).Op(ISHL).Op(IOR);
+}
+
+TEST_CASE("Dispatch modes agree on the edge cases of arithmetic and control flow") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+  using Limits = std::numeric_limits<int32_t>;
+  using LongLimits = std::numeric_limits<int64_t>;
+  constexpr float NaN = std::numeric_limits<float>::quiet_NaN(), INF = std::numeric_limits<float>::infinity();
+
+  ClassBuilder builder { "Interpreted" };
+  auto binary = [&] (const std::string& name, const std::string& descriptor, uint8_t load_a, uint8_t load_b,
+                     uint8_t b_slot, uint8_t op, uint8_t ret) {
+    CodeBuilder code;
+    code.Op(load_a, { 0 }).Op(load_b, { b_slot }).Op(op).Op(ret);
+    builder.AddMethod(name, descriptor, 4, code);
+  };
+  binary("idiv", "(II)I", ILOAD, ILOAD, 1, IDIV, IRETURN);
+  binary("irem", "(II)I", ILOAD, ILOAD, 1, IREM, IRETURN);
+  binary("ldiv", "(JJ)J", LLOAD, LLOAD, 2, LDIV, LRETURN);
+  binary("lrem", "(JJ)J", LLOAD, LLOAD, 2, LREM, LRETURN);
+  binary("ishl", "(II)I", ILOAD, ILOAD, 1, ISHL, IRETURN);
+  binary("ishr", "(II)I", ILOAD, ILOAD, 1, ISHR, IRETURN);
+  binary("iushr", "(II)I", ILOAD, ILOAD, 1, IUSHR, IRETURN);
+  binary("lshl", "(JI)J", LLOAD, ILOAD, 2, LSHL, LRETURN);
+  binary("lushr", "(JI)J", LLOAD, ILOAD, 2, LUSHR, LRETURN);
+  binary("fcmpl", "(FF)I", FLOAD, FLOAD, 1, FCMPL, IRETURN);
+  binary("fcmpg", "(FF)I", FLOAD, FLOAD, 1, FCMPG, IRETURN);
+  auto convert = [&] (const std::string& name, const std::string& descriptor, uint8_t load, uint8_t op, uint8_t ret) {
+    CodeBuilder code;
+    code.Op(load, { 0 }).Op(op).Op(ret);
+    builder.AddMethod(name, descriptor, 2, code);
+  };
+  convert("f2i", "(F)I", FLOAD, F2I, IRETURN);
+  convert("f2l", "(F)J", FLOAD, F2L, LRETURN);
+  convert("d2i", "(D)I", DLOAD, D2I, IRETURN);
+  convert("d2l", "(D)J", DLOAD, D2L, LRETURN);
+
+  auto fold = FoldInts;
+  {
+    // Form 1: four ints, 1 2 3 4 -> 3 4 1 2 3 4
+    CodeBuilder code;
+    code.Op(ICONST_1).Op(ICONST_2).Op(ICONST_3).Op(ICONST_4).Op(DUP2_X2);
+    fold(code, 6);
+    code.Op(IRETURN);
+    builder.AddMethod("dup2_x2_ints", "()I", 0, code);
+  }
+  {
+    // Form 2: two ints under a long, 3 4 5L -> 5L 3 4 5L
+    CodeBuilder code;
+    code.Op(ICONST_3).Op(ICONST_4).U16(LDC2_W, builder.Long(5)).Op(DUP2_X2).Op(L2I);
+    fold(code, 3);
+    code.Op(I2L).Op(LADD).Op(L2I).Op(IRETURN);
+    builder.AddMethod("dup2_x2_int_long", "()I", 0, code);
+  }
+  {
+    // Form 4: two longs, 7L 2L -> 2L 7L 2L, then 2 * (7 - 2)
+    CodeBuilder code;
+    code.U16(LDC2_W, builder.Long(7)).U16(LDC2_W, builder.Long(2)).Op(DUP2_X2).Op(LSUB).Op(LMUL).Op(LRETURN);
+    builder.AddMethod("dup2_x2_longs", "()J", 0, code);
+  }
+  {
+    CodeBuilder code;
+    code.Op(ILOAD_0).Tableswitch(-1, { "minus_one", "zero", "one" }, "default");
+    code.Label("minus_one").Op(BIPUSH, { 10 }).Op(IRETURN);
+    code.Label("zero").Op(BIPUSH, { 11 }).Op(IRETURN);
+    code.Label("one").Op(BIPUSH, { 12 }).Op(IRETURN);
+    code.Label("default").Op(BIPUSH, { 99 }).Op(IRETURN);
+    builder.AddMethod("tableswitch", "(I)I", 1, code);
+  }
+
+  LoadedClasses classes;
+  classes.Add(builder);
+  REQUIRE(classes.Link());
+
+  // Check that every mode returns the expected value
+  auto check = [&] (const std::string& name, const std::string& descriptor, const std::vector<FrameEntry>& args,
+                    auto expected) {
+    const classfile::MethodInfo* method = classes.Method("Interpreted", name, descriptor);
+    for (DispatchMode mode : DispatchModes()) {
+      REQUIRE(Value<decltype(expected)>(Interpret(method, args, mode)) == expected);
+    }
+  };
+  auto i = [] (int32_t value) { return Entry(value); };
+  auto l = [] (int64_t value) { return Entry(value); };
+
+  check("idiv", "(II)I", { i(Limits::min()), i(-1) }, Limits::min());
+  check("irem", "(II)I", { i(Limits::min()), i(-1) }, 0);
+  check("idiv", "(II)I", { i(-7), i(2) }, -3);
+  check("irem", "(II)I", { i(-7), i(2) }, -1);
+  check("ldiv", "(JJ)J", { l(LongLimits::min()), 0, l(-1), 0 }, LongLimits::min());
+  check("lrem", "(JJ)J", { l(LongLimits::min()), 0, l(-1), 0 }, int64_t { 0 });
+  check("lrem", "(JJ)J", { l(7), 0, l(-2), 0 }, int64_t { 1 });
+  for (DispatchMode mode : DispatchModes()) {
+    REQUIRE_THROWS(Interpret(classes.Method("Interpreted", "idiv", "(II)I"), { i(1), i(0) }, mode));
+    REQUIRE_THROWS(Interpret(classes.Method("Interpreted", "lrem", "(JJ)J"), { l(1), 0, l(0), 0 }, mode));
+  }
+
+  check("ishl", "(II)I", { i(1), i(33) }, 2);
+  check("ishr", "(II)I", { i(-16), i(-30) }, -4);
+  check("iushr", "(II)I", { i(-1), i(60) }, 15);
+  check("lshl", "(JI)J", { l(1), 0, i(65) }, int64_t { 2 });
+  check("lushr", "(JI)J", { l(-1), 0, i(-4) }, int64_t { 15 });
+
+  check("f2i", "(F)I", { Entry(NaN) }, 0);
+  check("f2i", "(F)I", { Entry(INF) }, Limits::max());
+  check("f2i", "(F)I", { Entry(-INF) }, Limits::min());
+  check("f2i", "(F)I", { Entry(-2.9f) }, -2);
+  check("f2l", "(F)J", { Entry(NaN) }, int64_t { 0 });
+  check("f2l", "(F)J", { Entry(INF) }, LongLimits::max());
+  check("f2l", "(F)J", { Entry(-INF) }, LongLimits::min());
+  check("d2i", "(D)I", { Entry(double { NaN }), 0 }, 0);
+  check("d2i", "(D)I", { Entry(1e10), 0 }, Limits::max());
+  check("d2l", "(D)J", { Entry(-1e300), 0 }, LongLimits::min());
+
+  check("fcmpl", "(FF)I", { Entry(NaN), Entry(1.0f) }, -1);
+  check("fcmpg", "(FF)I", { Entry(NaN), Entry(1.0f) }, 1);
+  check("fcmpl", "(FF)I", { Entry(1.0f), Entry(NaN) }, -1);
+  check("fcmpg", "(FF)I", { Entry(NaN), Entry(NaN) }, 1);
+  check("fcmpl", "(FF)I", { Entry(2.0f), Entry(1.0f) }, 1);
+  check("fcmpg", "(FF)I", { Entry(1.0f), Entry(1.0f) }, 0);
+
+  check("dup2_x2_ints", "()I", {}, 0341234);
+  check("dup2_x2_int_long", "()I", {}, 5 + (5 | 4 << 3 | 3 << 6));
+  check("dup2_x2_longs", "()J", {}, int64_t { 10 });
+
+  for (int32_t key : { Limits::min(), -2, 2, Limits::max() })
+    check("tableswitch", "(I)I", { i(key) }, 99);
+  check("tableswitch", "(I)I", { i(-1) }, 10);
+  check("tableswitch", "(I)I", { i(0) }, 11);
+  check("tableswitch", "(I)I", { i(1) }, 12);
+}
+
+TEST_CASE("Static fields and methods work before and after being quickened") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+
+  // count += n, returning the new count, by way of a static call
+  ClassBuilder builder { "Statics" };
+  uint16_t count = builder.StaticField("count", "J");
+  CodeBuilder add;
+  add.U16(GETSTATIC, count).Op(ILOAD_0).Op(I2L).Op(LADD).Op(DUP2).U16(PUTSTATIC, count).Op(LRETURN);
+  builder.AddMethod("add", "(I)J", 1, add);
+  CodeBuilder twice;
+  twice.Op(ILOAD_0).U16(INVOKESTATIC, builder.MethodRef("add", "(I)J")).Op(POP2)
+       .Op(ILOAD_0).U16(INVOKESTATIC, builder.MethodRef("add", "(I)J")).Op(LRETURN);
+  builder.AddMethod("twice", "(I)J", 1, twice);
+
+  LoadedClasses classes;
+  classes.Add(builder);
+  REQUIRE(classes.Link());
+
+  int64_t expected = 0;
+  for (DispatchMode mode : DispatchModes()) {
+    for (int32_t n : { 3, 4 }) {
+      expected += 2 * n;
+      REQUIRE(Value<int64_t>(Interpret(classes.Method("Statics", "twice", "(I)J"), { Entry(n) }, mode)) == expected);
+    }
+  }
+}
+
+/** Number of superinstructions in decoded code. */
+int CountFused(const bjvm::classfile::CodeAttribute& code) {
+  using namespace bjvm::classfile;
+  return static_cast<int>(std::count_if(code.m_code.begin(), code.m_code.end(), [] (const Insn& insn) {
+    return std::any_of(SUPERINSTRUCTIONS, SUPERINSTRUCTIONS + SUPERINSTRUCTION_COUNT,
+                       [&] (const Superinstruction& superinstruction) {
+      return insn.GetCode() == superinstruction.m_fused;
+    });
+  }));
+}
+
+TEST_CASE("Superinstructions run like the instructions they fuse") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+
+  // Each method is assembled twice: as is, and with a nop after every instruction, so that nothing is fused
+  auto assemble = [] (bool separated) {
+    ClassBuilder builder { separated ? "Unfused" : "Fused" };
+    auto gap = [&] (CodeBuilder& code) {
+      if (separated)
+        code.Op(NOP);
+    };
+    auto op = [&] (CodeBuilder& code, uint8_t opcode, std::initializer_list<uint8_t> operands = {}) {
+      code.Op(opcode, operands);
+      gap(code);
+    };
+    auto branch = [&] (CodeBuilder& code, uint8_t opcode, const std::string& label) {
+      code.Branch(opcode, label);
+      gap(code);
+    };
+
+    // a + b, or 100 + b by a branch into the middle of iload_iload_iadd_istore
+    CodeBuilder into_middle;
+    op(into_middle, ILOAD, { 0 });
+    branch(into_middle, IFNE, "fused");
+    op(into_middle, BIPUSH, { 100 });
+    branch(into_middle, GOTO, "middle");
+    into_middle.Label("fused");
+    op(into_middle, ILOAD, { 0 });
+    into_middle.Label("middle");
+    op(into_middle, ILOAD, { 1 });
+    op(into_middle, IADD);
+    op(into_middle, ISTORE, { 2 });
+    op(into_middle, ILOAD, { 2 });
+    op(into_middle, IRETURN);
+    builder.AddMethod("into_middle", "(II)I", 3, into_middle);
+
+    // 0 + 1 + ... + (n - 1), with the loop condition at the bottom, as javac puts it
+    CodeBuilder bottom;
+    op(bottom, ICONST_0);
+    op(bottom, ISTORE, { 2 });
+    op(bottom, ICONST_0);
+    op(bottom, ISTORE, { 1 });
+    branch(bottom, GOTO, "cond");
+    bottom.Label("loop");
+    op(bottom, ILOAD, { 2 });
+    op(bottom, ILOAD, { 1 });
+    op(bottom, IADD);
+    op(bottom, ISTORE, { 2 });
+    op(bottom, IINC, { 1, 1 });
+    bottom.Label("cond");
+    op(bottom, ILOAD, { 1 });
+    op(bottom, ILOAD, { 0 });
+    branch(bottom, IF_ICMPLT, "loop");
+    op(bottom, ILOAD, { 2 });
+    op(bottom, IRETURN);
+    builder.AddMethod("sum_bottom", "(I)I", 3, bottom);
+
+    // The same, with the loop condition at the top
+    CodeBuilder top;
+    op(top, ICONST_0);
+    op(top, ISTORE, { 2 });
+    op(top, ICONST_0);
+    op(top, ISTORE, { 1 });
+    top.Label("loop");
+    op(top, ILOAD, { 1 });
+    op(top, ILOAD, { 0 });
+    branch(top, IF_ICMPGE, "end");
+    op(top, ILOAD, { 2 });
+    op(top, ILOAD, { 1 });
+    op(top, IADD);
+    op(top, ISTORE, { 2 });
+    op(top, IINC, { 1, 1 });
+    branch(top, GOTO, "loop");
+    top.Label("end");
+    op(top, ILOAD, { 2 });
+    op(top, IRETURN);
+    builder.AddMethod("sum_top", "(I)I", 3, top);
+    return builder;
+  };
+
+  LoadedClasses classes;
+  auto fused = assemble(false), unfused = assemble(true);
+  classes.Add(fused);
+  classes.Add(unfused);
+  REQUIRE(classes.Link());
+
+  const std::vector<std::pair<std::string, std::string>> methods {
+    { "into_middle", "(II)I" }, { "sum_bottom", "(I)I" }, { "sum_top", "(I)I" }
+  };
+  const std::vector<std::vector<FrameEntry>> arguments {
+    { Entry(0), Entry(5) }, { Entry(7), Entry(5) }, { Entry(-3), Entry(-4) }, { Entry(10), 0 }, { Entry(0), 0 }
+  };
+
+  for (const auto& [name, descriptor] : methods) {
+    const classfile::MethodInfo* with = classes.Method("Fused", name, descriptor);
+    const classfile::MethodInfo* without = classes.Method("Unfused", name, descriptor);
+    for (const auto& args : arguments) {
+      for (DispatchMode mode : DispatchModes())
+        REQUIRE(Interpret(with, args, mode) == Interpret(without, args, mode));
+    }
+
+    // Fusing happened in a copy of the code, leaving the decoded code as it was
+    REQUIRE(CountFused(*with->GetExecutableCode()) > 0);
+    REQUIRE(CountFused(*with->GetCode()) == 0);
+    REQUIRE(with->GetCode() != with->GetExecutableCode());
+    REQUIRE(CountFused(*without->GetExecutableCode()) == 0);
+  }
+
+  const classfile::MethodInfo* into_middle = classes.Method("Fused", "into_middle", "(II)I");
+  REQUIRE(Value<int32_t>(Interpret(into_middle, { Entry(0), Entry(5) }, DispatchMode::Switch)) == 105);
+  REQUIRE(Value<int32_t>(Interpret(into_middle, { Entry(7), Entry(5) }, DispatchMode::Switch)) == 12);
+  REQUIRE(Value<int32_t>(Interpret(classes.Method("Fused", "sum_top", "(I)I"), { Entry(10) }, DispatchMode::Switch))
+          == 45);
+}
+
+TEST_CASE("Caching the top of the stack doesn't change what code does") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+
+  ClassBuilder builder { "Cached" };
+  // Assemble a method ()I returning the int body leaves on top of the stack
+  auto method = [&] (const std::string& name, uint16_t max_locals, const std::function<void(CodeBuilder&)>& body) {
+    CodeBuilder code;
+    body(code);
+    code.Op(IRETURN);
+    builder.AddMethod(name, "()I", max_locals, code);
+  };
+  auto ints = [] (CodeBuilder& code, std::initializer_list<uint8_t> values) {
+    for (uint8_t value : values)
+      code.Op(BIPUSH, { value });
+  };
+
+  // The dup family, and the other instructions which shuffle the stack, with every form of each
+  const std::vector<std::tuple<std::string, int32_t>> expected {
+    { "dup", 01222 }, { "dup_x1", 01323 }, { "dup_x2", 014234 }, { "dup_x2_long", 01353 }, { "dup2", 012323 },
+    { "dup2_long", 12 }, { "dup2_x1", 023123 }, { "dup2_x1_long", 0515 }, { "dup2_x2", 0341234 }, { "swap", 0132 },
+    { "pop", 012 }, { "pop2", 01 }, { "pop2_long", 01 }
+  };
+  method("dup", 0, [&] (CodeBuilder& code) {
+    ints(code, { 1, 2 });
+    code.Op(DUP);
+    ints(code, { 2 });
+    FoldInts(code, 4);
+  });
+  method("dup_x1", 0, [&] (CodeBuilder& code) { ints(code, { 1, 2, 3 }); code.Op(DUP_X1); FoldInts(code, 4); });
+  method("dup_x2", 0, [&] (CodeBuilder& code) { ints(code, { 1, 2, 3, 4 }); code.Op(DUP_X2); FoldInts(code, 5); });
+  method("dup_x2_long", 1, [&] (CodeBuilder& code) {
+    // 1 5L 3 -> 1 3 5L 3
+    code.Op(ICONST_1).U16(LDC2_W, builder.Long(5)).Op(ICONST_3).Op(DUP_X2);
+    code.Op(ISTORE, { 0 }).Op(L2I).Op(ILOAD, { 0 });
+    FoldInts(code, 4);
+  });
+  method("dup2", 0, [&] (CodeBuilder& code) { ints(code, { 1, 2, 3 }); code.Op(DUP2); FoldInts(code, 5); });
+  method("dup2_long", 0, [&] (CodeBuilder& code) {
+    code.U16(LDC2_W, builder.Long(6)).Op(DUP2).Op(LADD).Op(L2I);
+  });
+  method("dup2_x1", 0, [&] (CodeBuilder& code) { ints(code, { 1, 2, 3 }); code.Op(DUP2_X1); FoldInts(code, 5); });
+  method("dup2_x1_long", 2, [&] (CodeBuilder& code) {
+    // 1 5L -> 5L 1 5L
+    code.Op(ICONST_1).U16(LDC2_W, builder.Long(5)).Op(DUP2_X1);
+    code.Op(L2I).Op(ISTORE, { 0 }).Op(ISTORE, { 1 }).Op(L2I).Op(ILOAD, { 1 }).Op(ILOAD, { 0 });
+    FoldInts(code, 3);
+  });
+  method("dup2_x2", 0, [&] (CodeBuilder& code) { ints(code, { 1, 2, 3, 4 }); code.Op(DUP2_X2); FoldInts(code, 6); });
+  method("swap", 0, [&] (CodeBuilder& code) { ints(code, { 1, 2, 3 }); code.Op(SWAP); FoldInts(code, 3); });
+  method("pop", 0, [&] (CodeBuilder& code) { ints(code, { 1, 2, 3 }); code.Op(POP); FoldInts(code, 2); });
+  method("pop2", 0, [&] (CodeBuilder& code) { ints(code, { 1, 2, 3 }); code.Op(POP2); });
+  method("pop2_long", 0, [&] (CodeBuilder& code) { code.Op(ICONST_1).U16(LDC2_W, builder.Long(5)).Op(POP2); });
+  // Calls, with values left on the caller's stack across them, and returns from deep stacks
+  CodeBuilder mix;
+  mix.Op(ILOAD, { 0 }).Op(I2L).Op(LLOAD, { 1 }).Op(LADD).Op(ILOAD, { 3 }).Op(I2L).Op(LSUB).Op(LRETURN);
+  builder.AddMethod("mix", "(IJI)J", 4, mix);
+  builder.AddEmptyMethod("nothing", ACC_PUBLIC | ACC_STATIC);
+  CodeBuilder deep;
+  deep.Op(ICONST_1).Op(ICONST_2).Op(ICONST_3).Op(ILOAD, { 0 }).Op(IRETURN);
+  builder.AddMethod("deep", "(I)I", 1, deep);
+  CodeBuilder fib;
+  fib.Op(ILOAD, { 0 }).Op(ICONST_2).Branch(IF_ICMPGE, "recurse").Op(ILOAD, { 0 }).Op(IRETURN).Label("recurse")
+     .Op(ILOAD, { 0 }).Op(ICONST_1).Op(ISUB).U16(INVOKESTATIC, builder.MethodRef("fib", "(I)I"))
+     .Op(ILOAD, { 0 }).Op(ICONST_2).Op(ISUB).U16(INVOKESTATIC, builder.MethodRef("fib", "(I)I")).Op(IADD).Op(IRETURN);
+  builder.AddMethod("fib", "(I)I", 1, fib);
+  method("calls", 0, [&] (CodeBuilder& code) {
+    code.Op(BIPUSH, { 7 }).U16(INVOKESTATIC, builder.MethodRef("nothing", "()V"));
+    code.Op(BIPUSH, { 40 }).U16(LDC2_W, builder.Long(1000)).Op(ICONST_2)
+        .U16(INVOKESTATIC, builder.MethodRef("mix", "(IJI)J")).Op(L2I).Op(IADD);
+    code.Op(BIPUSH, { 9 }).U16(INVOKESTATIC, builder.MethodRef("deep", "(I)I")).Op(IADD);
+    code.Op(BIPUSH, { 10 }).U16(INVOKESTATIC, builder.MethodRef("fib", "(I)I")).Op(IADD);
+  });
+  const std::vector<std::tuple<std::string, int32_t>> calls { { "calls", 7 + 1038 + 9 + 55 } };
+
+  LoadedClasses classes;
+  classes.Add(builder);
+  REQUIRE(classes.Link());
+
+  for (const auto& cases : { expected, calls }) {
+    for (const auto& [name, result] : cases) {
+      const classfile::MethodInfo* method = classes.Method("Cached", name, "()I");
+      for (DispatchMode mode : DispatchModes()) {
+        FrameEntry uncached = Interpret(method, {}, mode, StackCaching::None);
+        REQUIRE(Interpret(method, {}, mode, StackCaching::TopOfStack) == uncached);
+        REQUIRE(Value<int32_t>(uncached) == result);
+      }
+    }
+  }
+}
+
+TEST_CASE("Inline caches go from monomorphic to polymorphic to megamorphic") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+  using State = InlineCache::State;
+
+  // Base and Sub0 declare m, and Sub1 and on inherit Sub0's
+  LoadedClasses classes;
+  ClassBuilder base { "Base" };
+  base.AddEmptyMethod("m");
+  classes.Add(base);
+  ClassBuilder sub0 { "Sub0", "Base" };
+  sub0.AddEmptyMethod("m");
+  classes.Add(sub0);
+  constexpr int SUBCLASSES = InlineCache::POLYMORPHIC_ENTRIES + 2;
+  for (int i = 1; i < SUBCLASSES; ++i) {
+    ClassBuilder sub { "Sub" + std::to_string(i), "Sub0" };
+    classes.Add(sub);
+  }
+  ClassBuilder abstract { "Abstract", "Base", ACC_PUBLIC | ACC_SUPER | ACC_ABSTRACT };
+  abstract.AddAbstractMethod("m", "()V");
+  classes.Add(abstract);
+  // Not abstract, but doesn't implement m either, as if Abstract had been changed since it was compiled
+  ClassBuilder incomplete { "Incomplete", "Abstract" };
+  classes.Add(incomplete);
+  REQUIRE(classes.Link());
+
+  auto sub = [&] (int i) {
+    return classes.Get("Sub" + std::to_string(i));
+  };
+  const classfile::MethodInfo* base_m = classes.Method("Base", "m");
+  const classfile::MethodInfo* sub_m = classes.Method("Sub0", "m");
+
+  InlineCache cache { base_m };
+  REQUIRE(cache.GetState() == State::Empty);
+  REQUIRE(cache.Lookup(classes.Get("Base")) == base_m);
+  REQUIRE(cache.GetState() == State::Monomorphic);
+  REQUIRE(cache.Lookup(classes.Get("Base")) == base_m);
+  REQUIRE(cache.GetState() == State::Monomorphic);
+  REQUIRE((cache.GetHits() == 1 && cache.GetMisses() == 1));
+
+  // Each new class is a miss, until there's no room for it
+  for (int i = 0; i < InlineCache::POLYMORPHIC_ENTRIES - 1; ++i) {
+    REQUIRE(cache.Lookup(sub(i)) == sub_m);
+    REQUIRE(cache.GetState() == State::Polymorphic);
+  }
+  REQUIRE((cache.GetHits() == 1 && cache.GetMisses() == InlineCache::POLYMORPHIC_ENTRIES));
+  REQUIRE(cache.Lookup(sub(0)) == sub_m);
+  REQUIRE(cache.GetHits() == 2);
+
+  // Classes past that are looked up on every call, while the cached ones still hit
+  for (int call = 0; call < 2; ++call) {
+    for (int i = InlineCache::POLYMORPHIC_ENTRIES - 1; i < SUBCLASSES; ++i)
+      REQUIRE(cache.Lookup(sub(i)) == sub_m);
+  }
+  REQUIRE(cache.GetState() == State::Megamorphic);
+  REQUIRE((cache.GetHits() == 2 && cache.GetMisses() == InlineCache::POLYMORPHIC_ENTRIES + 6));
+  REQUIRE(cache.Lookup(classes.Get("Base")) == base_m);
+  REQUIRE(cache.GetHits() == 3);
+  REQUIRE(std::string(StateName(cache.GetState())) == "megamorphic");
+
+  // A class whose method is abstract can't be called, nor is it cached
+  InlineCache abstract_cache { classes.Method("Abstract", "m") };
+  std::string error;
+  try {
+    abstract_cache.Lookup(classes.Get("Incomplete"));
+  } catch (std::runtime_error& e) {
+    error = e.what();
+  }
+  REQUIRE(error == "AbstractMethodError: Incomplete.m()V");
+  REQUIRE(abstract_cache.GetState() == State::Empty);
+  REQUIRE(abstract_cache.GetMisses() == 1);
+}
+
+TEST_CASE("Package-private methods are only overridden from their own package") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+  constexpr uint16_t PACKAGE_PRIVATE = 0;
+
+  // p/A declares m package-private; q/B redeclares it, which doesn't override it; p/C overrides both, A's because it's
+  // in A's package and B's because B's is public
+  LoadedClasses classes;
+  ClassBuilder a { "p/A" };
+  a.AddEmptyMethod("m", PACKAGE_PRIVATE);
+  classes.Add(a);
+  ClassBuilder b { "q/B", "p/A" };
+  b.AddEmptyMethod("m");
+  classes.Add(b);
+  ClassBuilder c { "p/C", "q/B" };
+  c.AddEmptyMethod("m");
+  classes.Add(c);
+  // q/D inherits A's m without redeclaring it
+  ClassBuilder d { "q/D", "p/A" };
+  classes.Add(d);
+  ClassBuilder e { "p/E", "p/A" };
+  e.AddEmptyMethod("m", PACKAGE_PRIVATE);
+  classes.Add(e);
+  ClassBuilder f { "q/F", "p/E" };
+  f.AddEmptyMethod("m");
+  classes.Add(f);
+  REQUIRE(classes.Link());
+
+  const classfile::MethodInfo* a_m = classes.Method("p/A", "m");
+  const classfile::MethodInfo* b_m = classes.Method("q/B", "m");
+  const classfile::MethodInfo* c_m = classes.Method("p/C", "m");
+  const classfile::MethodInfo* e_m = classes.Method("p/E", "m");
+  const classfile::MethodInfo* f_m = classes.Method("q/F", "m");
+
+  REQUIRE(classes.Get("p/A")->SelectMethod(a_m) == a_m);
+  REQUIRE(classes.Get("q/B")->SelectMethod(a_m) == a_m);
+  REQUIRE(classes.Get("q/B")->SelectMethod(b_m) == b_m);
+  REQUIRE(classes.Get("p/C")->SelectMethod(a_m) == c_m);
+  REQUIRE(classes.Get("p/C")->SelectMethod(b_m) == c_m);
+  REQUIRE(classes.Get("q/D")->SelectMethod(a_m) == a_m);
+
+  // E's m is package-private too, so F overrides neither it nor A's
+  REQUIRE(classes.Get("p/E")->SelectMethod(a_m) == e_m);
+  REQUIRE(classes.Get("q/F")->SelectMethod(a_m) == e_m);
+  REQUIRE(classes.Get("q/F")->SelectMethod(e_m) == e_m);
+  REQUIRE(classes.Get("q/F")->SelectMethod(f_m) == f_m);
+
+  // B's m can't take A's slot, so gets one of its own, and C's takes over both
+  REQUIRE(b_m->m_table_index != a_m->m_table_index);
+  REQUIRE(c_m->m_table_index == a_m->m_table_index);
+  REQUIRE(e_m->m_table_index == a_m->m_table_index);
+  REQUIRE(f_m->m_table_index != a_m->m_table_index);
+
+  // The vtables agree with SelectMethod for every method each class inherits
+  const std::vector<std::pair<const char*, std::vector<const classfile::MethodInfo*>>> inherited {
+    { "p/A", { a_m } }, { "q/B", { a_m, b_m } }, { "p/C", { a_m, b_m, c_m } }, { "q/D", { a_m } },
+    { "p/E", { a_m, e_m } }, { "q/F", { a_m, e_m, f_m } }
+  };
+  for (const auto& [name, methods] : inherited) {
+    for (const auto* method : methods)
+      REQUIRE(classes.Get(name)->GetVirtualMethod(method) == classes.Get(name)->SelectMethod(method));
+  }
+}
+
+TEST_CASE("Virtual methods are found through vtables and itables") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+
+  LoadedClasses classes;
+  ClassBuilder i = ClassBuilder::Interface("I");
+  i.AddAbstractMethod("m", "()V");
+  i.AddAbstractMethod("n", "()V");
+  classes.Add(i);
+  ClassBuilder base { "Base" };
+  base.AddEmptyMethod("m");
+  base.AddEmptyMethod("n");
+  classes.Add(base);
+  // Sub overrides m, adds o and implements I with m from itself and n from Base
+  ClassBuilder sub { "Sub", "Base" };
+  sub.Implement("I");
+  sub.AddEmptyMethod("m");
+  sub.AddEmptyMethod("o");
+  classes.Add(sub);
+  REQUIRE(classes.Link());
+
+  const classfile::MethodInfo* base_m = classes.Method("Base", "m");
+  const classfile::MethodInfo* base_n = classes.Method("Base", "n");
+  const classfile::MethodInfo* sub_m = classes.Method("Sub", "m");
+  const classfile::MethodInfo* sub_o = classes.Method("Sub", "o");
+  const classfile::MethodInfo* i_m = classes.Method("I", "m");
+  const classfile::MethodInfo* i_n = classes.Method("I", "n");
+
+  // An override reuses the slot it overrides, and a new method is appended
+  REQUIRE(sub_m->m_table_index == base_m->m_table_index);
+  REQUIRE(sub_o->m_table_index != base_m->m_table_index);
+  REQUIRE(sub_o->m_table_index != base_n->m_table_index);
+
+  const ClassInstance* base_class = classes.Get("Base");
+  const ClassInstance* sub_class = classes.Get("Sub");
+  REQUIRE(base_class->GetVirtualMethod(base_m) == base_m);
+  REQUIRE(base_class->GetVirtualMethod(base_n) == base_n);
+  REQUIRE(sub_class->GetVirtualMethod(base_m) == sub_m);
+  REQUIRE(sub_class->GetVirtualMethod(base_n) == base_n);
+  REQUIRE(sub_class->GetVirtualMethod(sub_o) == sub_o);
+
+  REQUIRE(sub_class->GetVirtualMethod(i_m) == sub_m);
+  REQUIRE(sub_class->GetVirtualMethod(i_n) == base_n);
+
+  // Base doesn't implement I, so has no itable to look in
+  std::string message;
+  try {
+    base_class->GetVirtualMethod(i_m);
+  } catch (const std::runtime_error& e) {
+    message = e.what();
+  }
+  REQUIRE(message == "IncompatibleClassChangeError: Base does not implement I");
+}
+
+/** A parsed JSON value, enough of JSON to read back what WriteProfile writes. */
+struct Json {
+  enum class Kind { Null, Bool, Number, String, Array, Object } m_kind = Kind::Null;
+  bool m_bool = false;
+  double m_number = 0;
+  std::string m_string;
+  std::vector<Json> m_items;  // Array elements, or object member values
+  std::vector<std::string> m_keys;  // Object member names, in the same order
+
+  /** The member with the given name, which must exist. */
+  const Json& operator[](const std::string& key) const {
+    auto it = std::find(m_keys.begin(), m_keys.end(), key);
+    if (it == m_keys.end())
+      throw std::runtime_error("No member " + key);
+    return m_items[it - m_keys.begin()];
+  }
+
+  /** Parse a complete JSON document, throwing on anything malformed or trailing. */
+  static Json Parse(const std::string& text) {
+    size_t pos = 0;
+    Json value = ParseValue(text, pos);
+    SkipSpace(text, pos);
+    if (pos != text.size())
+      throw std::runtime_error("Trailing data in JSON");
+    return value;
+  }
+
+private:
+  static void SkipSpace(const std::string& text, size_t& pos) {
+    while (pos < text.size() && std::strchr(" \t\r\n", text[pos]))
+      ++pos;
+  }
+
+  static void Expect(const std::string& text, size_t& pos, char c) {
+    SkipSpace(text, pos);
+    if (pos >= text.size() || text[pos] != c)
+      throw std::runtime_error(std::string("Expected ") + c + " in JSON");
+    ++pos;
+  }
+
+  static std::string ParseString(const std::string& text, size_t& pos) {
+    Expect(text, pos, '"');
+    std::string result;
+    while (pos < text.size() && text[pos] != '"') {
+      char c = text[pos++];
+      if (static_cast<unsigned char>(c) < 0x20)
+        throw std::runtime_error("Unescaped control character in JSON");
+      if (c != '\\') {
+        result += c;
+        continue;
+      }
+      if (pos >= text.size())
+        break;
+      char escape = text[pos++];
+      if (escape == 'u') {
+        // Only the control characters are escaped this way, so every code point here is one byte of UTF-8
+        unsigned code_point = std::stoul(text.substr(pos, 4), nullptr, 16);
+        if (code_point >= 0x80)
+          throw std::runtime_error("Unexpected \\u escape in JSON");
+        result += static_cast<char>(code_point);
+        pos += 4;
+      } else if (escape == '"' || escape == '\\' || escape == '/') {
+        result += escape;
+      } else {
+        throw std::runtime_error("Unexpected escape in JSON");
+      }
+    }
+    Expect(text, pos, '"');
+    return result;
+  }
+
+  static Json ParseValue(const std::string& text, size_t& pos) {
+    SkipSpace(text, pos);
+    if (pos >= text.size())
+      throw std::runtime_error("Unexpected end of JSON");
+
+    Json value;
+    char c = text[pos];
+    if (c == '"') {
+      value.m_kind = Kind::String;
+      value.m_string = ParseString(text, pos);
+    } else if (c == '[' || c == '{') {
+      bool object = c == '{';
+      char close = object ? '}' : ']';
+      value.m_kind = object ? Kind::Object : Kind::Array;
+      ++pos;
+      SkipSpace(text, pos);
+      if (pos < text.size() && text[pos] == close) {
+        ++pos;
+        return value;
+      }
+      while (true) {
+        if (object) {
+          value.m_keys.push_back(ParseString(text, pos));
+          Expect(text, pos, ':');
+        }
+        value.m_items.push_back(ParseValue(text, pos));
+        SkipSpace(text, pos);
+        if (pos < text.size() && text[pos] == ',') {
+          ++pos;
+          continue;
+        }
+        Expect(text, pos, close);
+        break;
+      }
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+      value.m_kind = Kind::Number;
+      size_t length;
+      value.m_number = std::stod(text.substr(pos), &length);
+      pos += length;
+    } else if (text.compare(pos, 4, "true") == 0 || text.compare(pos, 5, "false") == 0) {
+      value.m_kind = Kind::Bool;
+      value.m_bool = c == 't';
+      pos += value.m_bool ? 4 : 5;
+    } else if (text.compare(pos, 4, "null") == 0) {
+      pos += 4;
+    } else {
+      throw std::runtime_error("Unexpected character in JSON");
+    }
+    return value;
+  }
+};
+
+TEST_CASE("Profiles are written as JSON") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+
+  // U+1F600 is a surrogate pair in modified UTF-8, but one four-byte sequence in the UTF-8 JSON needs
+  const std::string modified_name = "sum\xed\xa0\xbd\xed\xb8\x80";
+  const std::string name = "sum\xf0\x9f\x98\x80";
+
+  // 0 + 1 + ... + (n - 1), and run(n) calls it twice
+  ClassBuilder builder { "Profiled" };
+  CodeBuilder sum;
+  sum.Op(ICONST_0).Op(ISTORE_1).Op(ICONST_0).Op(ISTORE, { 2 }).Branch(GOTO, "cond")
+     .Label("loop").Op(ILOAD_1).Op(ILOAD, { 2 }).Op(IADD).Op(ISTORE_1).Op(IINC, { 2, 1 })
+     .Label("cond").Op(ILOAD, { 2 }).Op(ILOAD_0).Branch(IF_ICMPLT, "loop")
+     .Op(ILOAD_1).Op(IRETURN);
+  builder.AddMethod(modified_name, "(I)I", 3, sum);
+  CodeBuilder run;
+  run.Op(ILOAD_0).U16(INVOKESTATIC, builder.MethodRef(modified_name, "(I)I"))
+     .Op(ILOAD_0).U16(INVOKESTATIC, builder.MethodRef(modified_name, "(I)I")).Op(IADD).Op(IRETURN);
+  builder.AddMethod("run", "(I)I", 1, run);
+  builder.AddEmptyMethod("unused", ACC_PUBLIC | ACC_STATIC);
+
+  LoadedClasses classes;
+  classes.Add(builder);
+  REQUIRE(classes.Link());
+  REQUIRE(Value<int32_t>(Interpret(classes.Method("Profiled", "run", "(I)I"), { Entry<int32_t>(5) },
+                                   DispatchMode::Switch)) == 20);
+
+  std::ostringstream out;
+  WriteProfile(out, classes.All(), 10);
+  Json profile = Json::Parse(out.str());
+  REQUIRE(profile.m_kind == Json::Kind::Object);
+
+  // Hottest first: the summing method, by its invocations plus its loop's iterations, then run
+  const Json& methods = profile["methods"];
+  REQUIRE(methods.m_items.size() == 2);
+  REQUIRE(methods.m_items[0]["class"].m_string == "Profiled");
+  REQUIRE(methods.m_items[0]["name"].m_string == name);
+  REQUIRE(methods.m_items[0]["descriptor"].m_string == "(I)I");
+  REQUIRE(methods.m_items[0]["invocations"].m_number == 2);
+  REQUIRE(methods.m_items[0]["backedges"].m_number == 10);
+  REQUIRE(methods.m_items[1]["name"].m_string == "run");
+  REQUIRE(methods.m_items[1]["invocations"].m_number == 1);
+  REQUIRE(methods.m_items[1]["backedges"].m_number == 0);
+
+  const Json& loops = profile["loops"];
+  REQUIRE(loops.m_items.size() == 1);
+  REQUIRE(loops.m_items[0]["name"].m_string == name);
+  REQUIRE(loops.m_items[0]["pc"].m_number == sum.PC("loop"));
+  REQUIRE(loops.m_items[0]["iterations"].m_number == 10);
+
+  REQUIRE(profile["call_sites"].m_kind == Json::Kind::Array);
+  REQUIRE(profile["call_sites"].m_items.empty());
+
+  // Lists are cut to the limit
+  std::ostringstream limited;
+  WriteProfile(limited, classes.All(), 1);
+  REQUIRE(Json::Parse(limited.str())["methods"].m_items.size() == 1);
+}
+
+TEST_CASE("Misplaced classfiles can't be loaded, whether the class path is lazy or not") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+
+  // Right.class, saved as Wrong.class
+  const std::string directory = "test_wrong_name";
+  std::filesystem::create_directory(directory);
+  std::vector<uint8_t> bytes = ClassBuilder { "Right" }.Finish();
+  WriteFile(directory + "/Wrong.class", { bytes.data(), bytes.size() });
+
+  for (bool lazy : { true, false }) {
+    VMOptions options;
+    options.m_classpath = directory;
+    options.m_lazy_classpath = lazy;
+    VM vm { std::move(options) };
+
+    std::string error;
+    try {
+      vm.LoadClass("Wrong");
+    } catch (const std::runtime_error& e) {
+      error = e.what();
+    }
+    REQUIRE(error == "NoClassDefFoundError: Wrong (wrong name: Right)");
+  }
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Archiving the same class path writes the same archive") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+
+  const std::string directory = "test_archive_classpath";
+  std::filesystem::create_directory(directory);
+  for (const char* name : { "A", "B", "C", "D" }) {
+    // With code, whose decoded instructions are archived too
+    ClassBuilder builder { name };
+    CodeBuilder code;
+    code.Op(ILOAD_0).Tableswitch(0, { "zero" }, "other");
+    code.Label("zero").Op(ICONST_1).Op(IRETURN);
+    code.Label("other").Op(ILOAD_0).Op(IRETURN);
+    builder.AddMethod("f", "(I)I", 1, code);
+    std::vector<uint8_t> bytes = builder.Finish();
+    WriteFile(directory + "/" + name + ".class", { bytes.data(), bytes.size() });
+  }
+
+  std::vector<std::vector<uint8_t>> archives;
+  for (int i = 0; i < 2; ++i) {
+    const std::string path = "test_archive_" + std::to_string(i) + ".bin";
+    VMOptions options;
+    options.m_classpath = directory;
+    VM vm { std::move(options) };
+    REQUIRE(vm.WriteClassArchive(path) == 4);
+    archives.push_back(ReadFile(path));
+    std::remove(path.c_str());
+  }
+  REQUIRE(archives[0] == archives[1]);
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Archived classes run like the classfiles they were made from") {
+  using namespace bjvm;
+  using namespace bjvm::test;
+  const std::string path = "test_archived_code.bin";
+
+  ClassBuilder builder { "Archived" };
+  {
+    // Two tableswitches and a lookupswitch, so that each switch must find its own table again
+    CodeBuilder code;
+    code.Op(ILOAD_0).Tableswitch(0, { "zero", "one" }, "five");
+    code.Label("zero").Op(BIPUSH, { 20 }).Op(IRETURN);
+    code.Label("one").Op(BIPUSH, { 21 }).Op(IRETURN);
+    code.Label("five").Op(ILOAD_0).Tableswitch(5, { "is_five" }, "sparse");
+    code.Label("is_five").Op(BIPUSH, { 25 }).Op(IRETURN);
+    code.Label("sparse").Op(ILOAD_0).Lookupswitch({ { -1000, "minus" }, { 100, "hundred" } }, "none");
+    code.Label("minus").Op(BIPUSH, { 40 }).Op(IRETURN);
+    code.Label("hundred").Op(BIPUSH, { 50 }).Op(IRETURN);
+    code.Label("none").Op(ICONST_M1).Op(IRETURN);
+    builder.AddMethod("switches", "(I)I", 1, code);
+  }
+  {
+    // 1 + 2 + ... + n
+    CodeBuilder code;
+    code.Op(ICONST_0).Op(ISTORE_1);
+    code.Label("loop").Op(ILOAD_0).Branch(IFLE, "done");
+    code.Op(ILOAD_1).Op(ILOAD_0).Op(IADD).Op(ISTORE_1).Op(IINC, { 0, 0xff }).Branch(GOTO, "loop");
+    code.Label("done").Op(ILOAD_1).Op(IRETURN);
+    builder.AddMethod("sum", "(I)I", 2, code);
+  }
+  {
+    CodeBuilder code;
+    code.Label("start").Op(ILOAD_0).Op(ILOAD_1).Op(IDIV).Label("end").Op(IRETURN);
+    code.Label("handler").Op(POP).Op(ICONST_M1).Op(IRETURN);
+    code.Catch("start", "end", "handler");
+    builder.AddMethod("divide", "(II)I", 2, code);
+  }
+
+  Arena arena;
+  std::vector<uint8_t> bytes = builder.Finish();
+  ByteReader reader { bytes };
+  auto cf = classfile::Classfile::parse(&reader, &arena);
+  cf.m_digest = Sha256({ bytes.data(), bytes.size() });
+  uint32_t crc = Crc32({ bytes.data(), bytes.size() });
+  auto length = static_cast<uint32_t>(bytes.size());
+  ClassArchive::Write(path, { { "Archived", &cf, crc, length } });
+
+  auto archive = ClassArchive::Open(path);
+  REQUIRE(archive);
+  classfile::Classfile* loaded = archive->Load("Archived", crc, length, &arena);
+  REQUIRE(loaded);
+
+  // The archived code decodes to what the classfile does, switch tables and all
+  REQUIRE(loaded->m_methods.size() == cf.m_methods.size());
+  for (size_t i = 0; i < cf.m_methods.size(); ++i) {
+    if (!cf.m_methods[i].HasCode())
+      continue;
+    const classfile::CodeAttribute* expected = cf.m_methods[i].GetCode();
+    const classfile::CodeAttribute* actual = loaded->m_methods[i].m_code->m_decoded.load();
+    REQUIRE(actual);
+    REQUIRE(DescribeCode(*actual) == DescribeCode(*expected));
+  }
+
+  LoadedClasses classes;
+  classes.Add(loaded);
+  REQUIRE(classes.Link());
+
+  auto check = [&] (const std::string& name, const std::string& descriptor, const std::vector<FrameEntry>& args,
+                    int32_t expected) {
+    const classfile::MethodInfo* method = classes.Method("Archived", name, descriptor);
+    for (DispatchMode mode : DispatchModes())
+      REQUIRE(Value<int32_t>(Interpret(method, args, mode)) == expected);
+  };
+  check("switches", "(I)I", { Entry(0) }, 20);
+  check("switches", "(I)I", { Entry(1) }, 21);
+  check("switches", "(I)I", { Entry(5) }, 25);
+  check("switches", "(I)I", { Entry(-1000) }, 40);
+  check("switches", "(I)I", { Entry(100) }, 50);
+  check("switches", "(I)I", { Entry(2) }, -1);
+  check("sum", "(I)I", { Entry(10), 0 }, 55);
+  check("divide", "(II)I", { Entry(42), Entry(5) }, 8);
+
+  archive.reset();
+  std::remove(path.c_str());
+}